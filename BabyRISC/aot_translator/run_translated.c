@@ -0,0 +1,44 @@
+/* Loads a payload translated by 'translate_payload' (a shared object) and executes it.
+ * Usage: ./run_translated <payload.so>
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include "asm_aot.h"
+#include "common.h"
+#include "prompt.h"
+
+int main(int argc, char ** argv)
+{
+    int ret = E_SUCCESS;
+    asm_aot_module_t module = { 0 };
+    static vm_context_t vm;
+    int count = 0;
+
+    if (argc != 2)
+    {
+        printf("Usage: %s <payload.so>\n", argv[0]);
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    ret = aot_load(argv[1], &module);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to load '%s'.\n", argv[1]);
+        goto cleanup;
+    }
+
+    ret = vm_init(&vm, STDOUT_FILENO);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to initialize the processor.\n");
+        goto cleanup;
+    }
+    ret = aot_execute(&vm, &module, &count);
+    PROMPT_PRINTF("executed 0x%X instructions\n\n", count);
+
+cleanup:
+    vm_free(&vm);
+    aot_unload(&module);
+    return ret;
+}
@@ -0,0 +1,629 @@
+/* Translates a BabyRISC payload into a C translation unit with the same observable behavior
+ * (output, result and instructions count) as executing the payload with 'execute_asm_file'.
+ * The whole file is translated, just like 'execute_asm_file' would execute it.
+ * Usage: ./translate_payload <payload.bin> <output.c | output.so>
+ * When the output ends with ".so", the C code is compiled with $CC (a compiler program, default "cc") into a shared
+ * object, which can be executed with 'run_translated'.
+ * The translated code doesn't count instructions against a budget, so builds with an instruction budget
+ * (ASM_DEFAULT_INSTRUCTION_BUDGET) refuse to translate - and the loader refuses to execute with one (see asm_aot.h).
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "asm_program.h"
+#include "asm_processor_state.h"
+#include "asm_instructions.h"
+#include "common.h"
+
+#ifndef AOT_INCLUDE_DIR
+#define AOT_INCLUDE_DIR "../inc"
+#endif
+
+#define AOT_STACK_SIZE_DEFINE_MAX_SIZE (64)
+
+// Everything the translated code needs besides the instructions themselves.
+// All the arithmetic is done the way the interpreter's compiled code does it on x86-64 (wrapping arithmetic,
+// shift counts masked to 5 bits, trapping on INT32_MIN / -1), so constant operands can't change the results.
+static const char * translation_prelude =
+    "#include <signal.h>\n"
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "#include \"asm_aot.h\"\n"
+    "\n"
+    "const uint32_t babyrisc_aot_abi_version = ASM_AOT_ABI_VERSION;\n"
+    "\n"
+    "#define AOT_EXIT(count, error)                                                                            \\\n"
+    "    do                                                                                                    \\\n"
+    "    {                                                                                                     \\\n"
+    "        memcpy(runtime->registers, regs, sizeof(regs));                                                   \\\n"
+    "        *count_out = (int)(count_base + (count));                                                         \\\n"
+    "        return (error);                                                                                   \\\n"
+    "    } while (0)\n"
+    "\n"
+    "static inline reg_value_t aot_add(reg_value_t a, reg_value_t b) { return (reg_value_t)((uint32_t)a + (uint32_t)b); }\n"
+    "static inline reg_value_t aot_sub(reg_value_t a, reg_value_t b) { return (reg_value_t)((uint32_t)a - (uint32_t)b); }\n"
+    "static inline reg_value_t aot_mul(reg_value_t a, reg_value_t b) { return (reg_value_t)((uint32_t)a * (uint32_t)b); }\n"
+    "static inline reg_value_t aot_shl(reg_value_t a, uint32_t b) { return (reg_value_t)((uint32_t)a << (b & 31)); }\n"
+    "static inline reg_value_t aot_shr(reg_value_t a, uint32_t b) { return a >> (b & 31); }\n"
+    "static inline reg_value_t aot_rol(reg_value_t a, uint32_t b) { return aot_shl(a, b) | aot_shr(a, 32 - b); }\n"
+    "static inline reg_value_t aot_ror(reg_value_t a, uint32_t b) { return aot_shr(a, b) | aot_shl(a, 32 - b); }\n"
+    "static inline reg_value_t aot_div(reg_value_t a, reg_value_t b)\n"
+    "{\n"
+    "    if (a == INT32_MIN && b == -1)\n"
+    "    {\n"
+    "        raise(SIGFPE);\n"
+    "    }\n"
+    "    return a / b;\n"
+    "}\n"
+    "\n"
+    "int babyrisc_aot_entry(const asm_aot_runtime_t * runtime, int * count_out)\n"
+    "{\n"
+    "    reg_value_t regs[ASM_REGISTER_END - ASM_REGISTER_START];\n"
+    "    uint8_t * stack = runtime->stack;\n"
+    "    reg_value_t sp_val = 0;\n"
+    "    reg_value_t pop_val = 0;\n"
+    "    reg_value_t mem_offset = 0;\n"
+    "    int cmp_val = 0;\n"
+    "    uint32_t count_base = 0;\n"
+    "    memcpy(regs, runtime->registers, sizeof(regs));\n"
+    "    (void)stack;\n"
+    "    (void)sp_val;\n"
+    "    (void)pop_val;\n"
+    "    (void)mem_offset;\n"
+    "    (void)cmp_val;\n"
+    "\n";
+
+static void emit_exit(FILE * out, int count, const char * error)
+{
+    fprintf(out, "    AOT_EXIT(%d, %s);\n", count, error);
+}
+
+// Emits "reg = <value>". Returns whether the execution may continue after this instruction.
+static int emit_write_reg(FILE * out, uint8_t reg, const char * value)
+{
+    fprintf(out, "    regs[%u] = %s;\n", reg, value);
+    return 1;
+}
+
+static const char * binary_function(asm_opcode_t opcode)
+{
+    switch (opcode)
+    {
+    case ADD:
+    case ADDI:
+        return "aot_add";
+    case SUB:
+    case SUBI:
+        return "aot_sub";
+    case MUL:
+    case MULI:
+        return "aot_mul";
+    case SHL:
+        return "aot_shl";
+    case SHR:
+        return "aot_shr";
+    case ROL:
+        return "aot_rol";
+    case ROR:
+        return "aot_ror";
+    default:
+        return NULL;
+    }
+}
+
+static const char * binary_operator(asm_opcode_t opcode)
+{
+    switch (opcode)
+    {
+    case AND:
+    case ANDI:
+        return "&";
+    case OR:
+    case ORI:
+        return "|";
+    case XOR:
+    case XORI:
+        return "^";
+    default:
+        return NULL;
+    }
+}
+
+// Translates a single instruction. Returns whether the execution may continue to the next instruction,
+// or -1 if the instruction can't be translated.
+// (The registers are used as they are, see program_validate_instruction)
+static int translate_instruction(FILE * out, const asm_instruction_t * instruction, int count)
+{
+    asm_opcode_t opcode = (asm_opcode_t)instruction->opcode;
+    uint8_t reg0 = instruction->reg0;
+    uint8_t reg1 = instruction->reg1;
+    uint8_t reg2 = instruction->reg2;
+    int32_t imm32 = instruction->imm32;
+    char value[128];
+
+    switch (opcode)
+    {
+    case ADD:
+    case SUB:
+    case MUL:
+    case AND:
+    case OR:
+    case XOR:
+        if (binary_function(opcode) != NULL)
+        {
+            snprintf(value, sizeof(value), "%s(regs[%u], regs[%u])", binary_function(opcode), reg1, reg2);
+        }
+        else
+        {
+            snprintf(value, sizeof(value), "regs[%u] %s regs[%u]", reg1, binary_operator(opcode), reg2);
+        }
+        return emit_write_reg(out, reg0, value);
+
+    case ADDI:
+    case SUBI:
+    case MULI:
+    case ANDI:
+    case ORI:
+    case XORI:
+    case SHL:
+    case SHR:
+    case ROL:
+    case ROR:
+        if (binary_function(opcode) != NULL)
+        {
+            snprintf(value, sizeof(value), "%s(regs[%u], (int32_t)0x%xu)", binary_function(opcode), reg1,
+                     (uint32_t)imm32);
+        }
+        else
+        {
+            snprintf(value, sizeof(value), "regs[%u] %s (int32_t)0x%xu", reg1, binary_operator(opcode),
+                     (uint32_t)imm32);
+        }
+        return emit_write_reg(out, reg0, value);
+
+    case DIV:
+        fprintf(out, "    if (regs[%u] == 0)\n    {\n    ", reg2);
+        emit_exit(out, count, "E_DIV_ZERO");
+        fprintf(out, "    }\n");
+        snprintf(value, sizeof(value), "aot_div(regs[%u], regs[%u])", reg1, reg2);
+        return emit_write_reg(out, reg0, value);
+
+    case DIVI:
+        // (Division by a zero immediate was replaced with FAULT by the decoder)
+        snprintf(value, sizeof(value), "aot_div(regs[%u], (int32_t)0x%xu)", reg1, (uint32_t)imm32);
+        return emit_write_reg(out, reg0, value);
+
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+        fprintf(out, "    runtime->%s(runtime->context, regs[%u]);\n",
+                (opcode == PRINTC) ? "print_char" : (opcode == PRINTDD) ? "print_dd" : "print_dx", reg0);
+        return 1;
+
+    case PRINTNL:
+        fprintf(out, "    runtime->print_nl(runtime->context);\n");
+        return 1;
+
+    case RET:
+        emit_exit(out, count, "E_RETURN");
+        return 0;
+
+    case RETNZ:
+    case RETZ:
+        fprintf(out, "    if (regs[%u] %s 0)\n    {\n    ", reg0, (opcode == RETNZ) ? "!=" : "==");
+        emit_exit(out, count, "E_RETURN");
+        fprintf(out, "    }\n");
+        return 1;
+
+    case PUSH:
+        fprintf(out, "    sp_val = regs[ASM_REGISTER_SP];\n");
+        fprintf(out, "    if (sp_val < 0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(reg_value_t)))\n    {\n    ");
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        fprintf(out, "    memcpy(&stack[sp_val], &regs[%u], sizeof(reg_value_t));\n", reg0);
+        fprintf(out, "    regs[ASM_REGISTER_SP] = sp_val + sizeof(reg_value_t);\n");
+        return 1;
+
+    case POP:
+        fprintf(out, "    sp_val = regs[ASM_REGISTER_SP];\n");
+        fprintf(out, "    if (sp_val < (reg_value_t)sizeof(reg_value_t) || sp_val > (reg_value_t)ASM_STACK_SIZE)\n");
+        fprintf(out, "    {\n    ");
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        fprintf(out, "    sp_val -= sizeof(reg_value_t);\n");
+        fprintf(out, "    memcpy(&pop_val, &stack[sp_val], sizeof(reg_value_t));\n");
+        emit_write_reg(out, reg0, "pop_val");
+        fprintf(out, "    regs[ASM_REGISTER_SP] = sp_val;\n");
+        return 1;
+
+    case PUSHCTX:
+        fprintf(out, "    sp_val = regs[ASM_REGISTER_SP];\n");
+        fprintf(out, "    if (sp_val < 0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(regs)))\n    {\n    ");
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        fprintf(out, "    memcpy(&stack[sp_val], regs, sizeof(regs));\n");
+        fprintf(out, "    regs[ASM_REGISTER_SP] = sp_val + sizeof(regs);\n");
+        return 1;
+
+    case POPCTX:
+        fprintf(out, "    sp_val = regs[ASM_REGISTER_SP];\n");
+        fprintf(out, "    if (sp_val < (reg_value_t)sizeof(regs) || sp_val > (reg_value_t)ASM_STACK_SIZE)\n    {\n    ");
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        fprintf(out, "    memcpy(regs, &stack[sp_val - sizeof(regs)], sizeof(regs));\n");
+        return 1;
+
+    case LOAD:
+    case STORE:
+        fprintf(out, "    mem_offset = aot_add(regs[%u], %d);\n", reg1, imm32);
+        fprintf(out, "    if (!stack_range_valid(mem_offset, sizeof(reg_value_t)))\n    {\n    ");
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        if (opcode == LOAD)
+        {
+            fprintf(out, "    memcpy(&regs[%u], &stack[mem_offset], sizeof(reg_value_t));\n", reg0);
+        }
+        else
+        {
+            fprintf(out, "    memcpy(&stack[mem_offset], &regs[%u], sizeof(reg_value_t));\n", reg0);
+        }
+        return 1;
+
+    case MEMCPY:
+        fprintf(out, "    if (!stack_range_valid(regs[%u], regs[%u]) || !stack_range_valid(regs[%u], regs[%u]))\n",
+                reg0, reg2, reg1, reg2);
+        fprintf(out, "    {\n    ");
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        fprintf(out, "    memmove(&stack[regs[%u]], &stack[regs[%u]], (size_t)regs[%u]);\n", reg0, reg1, reg2);
+        return 1;
+
+    case MEMSET:
+        fprintf(out, "    if (!stack_range_valid(regs[%u], regs[%u]))\n    {\n    ", reg0, reg2);
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        fprintf(out, "    memset(&stack[regs[%u]], (uint8_t)regs[%u], (size_t)regs[%u]);\n", reg0, reg1, reg2);
+        return 1;
+
+    case MEMCMP:
+        fprintf(out, "    if (!stack_range_valid(regs[%u], regs[%u]) || !stack_range_valid(regs[%u], regs[%u]))\n",
+                reg1, reg0, reg2, reg0);
+        fprintf(out, "    {\n    ");
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        fprintf(out, "    cmp_val = memcmp(&stack[regs[%u]], &stack[regs[%u]], (size_t)regs[%u]);\n", reg1, reg2, reg0);
+        emit_write_reg(out, reg0, "(cmp_val > 0) - (cmp_val < 0)");
+        return 1;
+
+    case FAULT:
+        fprintf(out, "    AOT_EXIT(%d, %d);\n", count, imm32);
+        return 0;
+
+    case DIV_WFAULT:
+        fprintf(out, "    if (regs[%u] == 0)\n    {\n    ", reg2);
+        emit_exit(out, count, "E_DIV_ZERO");
+        fprintf(out, "    }\n");
+        fprintf(out, "    AOT_EXIT(%d, %d);\n", count, imm32);
+        return 0;
+
+    case POP_WFAULT:
+        fprintf(out, "    sp_val = regs[ASM_REGISTER_SP];\n");
+        fprintf(out, "    if (sp_val < (reg_value_t)sizeof(reg_value_t) || sp_val > (reg_value_t)ASM_STACK_SIZE)\n");
+        fprintf(out, "    {\n    ");
+        emit_exit(out, count, "E_STACK_VIOLATION");
+        fprintf(out, "    }\n");
+        fprintf(out, "    AOT_EXIT(%d, %d);\n", count, imm32);
+        return 0;
+
+    case HALT:
+        // If we couldn't even read the opcode of the last instruction, it wasn't executed
+        fprintf(out, "    AOT_EXIT(%d, %d);\n", reg0 ? count : count - 1, imm32);
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+// Emits the jump of a taken branch (at instruction 'index') - like in the JIT, 'count_base' keeps the difference
+// between the count known at the branch and the one known at its target, so the exits can use the static counts.
+static void emit_branch_taken(FILE * out, size_t index, const asm_instruction_t * instruction)
+{
+    fprintf(out, "        count_base += (uint32_t)%d;\n", (int32_t)(index + 1) - instruction->imm32);
+    fprintf(out, "        goto L%d;\n", instruction->imm32);
+}
+
+// Translates a branch instruction (at 'index'). Returns whether the execution may continue to the next instruction.
+static int translate_branch(FILE * out, size_t index, const asm_instruction_t * instruction)
+{
+    uint8_t reg0 = instruction->reg0;
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case JMP:
+        fprintf(out, "    {\n");
+        emit_branch_taken(out, index, instruction);
+        fprintf(out, "    }\n");
+        return 0;
+
+    case JZ:
+    case JNZ:
+        fprintf(out, "    if (regs[%u] %s 0)\n    {\n", reg0, (instruction->opcode == JZ) ? "==" : "!=");
+        emit_branch_taken(out, index, instruction);
+        fprintf(out, "    }\n");
+        return 1;
+
+    case LOOP:
+        fprintf(out, "    regs[%u] = aot_sub(regs[%u], 1);\n", reg0, reg0);
+        fprintf(out, "    if (regs[%u] != 0)\n    {\n", reg0);
+        emit_branch_taken(out, index, instruction);
+        fprintf(out, "    }\n");
+        return 1;
+
+    default:
+        return -1;
+    }
+}
+
+static int translate_program(const asm_program_t * program, const char * source_name, FILE * out)
+{
+    int ret = E_SUCCESS;
+    bool * is_target = NULL;
+    bool has_branches = false;
+
+    fprintf(out, "/* Translated from '%s' by BabyRISC's aot_translator. Do not edit. */\n", source_name);
+    fprintf(out, "%s", translation_prelude);
+
+    // Only the branches targets get labels
+    is_target = calloc(program->count + 1, sizeof(*is_target));
+    if (is_target == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        if (asm_is_branch((asm_opcode_t)program->instructions[i].opcode))
+        {
+            is_target[program->instructions[i].imm32] = true;
+            has_branches = true;
+        }
+    }
+
+    // The program always ends with HALT, which never continues
+    // (nothing after an instruction that doesn't continue can be reached, unless there are branches)
+    for (size_t i = 0; i <= program->count; ++i)
+    {
+        const asm_instruction_t * instruction = &program->instructions[i];
+        int result = 0;
+        if (is_target[i])
+        {
+            fprintf(out, "L%zu:\n", i);
+        }
+        fprintf(out, "    /* %zu: %s %u, %u, %u, 0x%x */\n", i, asm_opcode_names[instruction->opcode], instruction->reg0,
+                instruction->reg1, instruction->reg2, (uint32_t)instruction->imm32);
+
+        if (asm_is_branch((asm_opcode_t)instruction->opcode))
+        {
+            result = translate_branch(out, i, instruction);
+        }
+        else
+        {
+            result = translate_instruction(out, instruction, (int)(i + 1));
+        }
+
+        if (result < 0)
+        {
+            ret = E_NOT_IMPL_INSTR;
+            goto cleanup;
+        }
+        else if (result == 0 && !has_branches)
+        {
+            break;
+        }
+    }
+    fprintf(out, "}\n");
+
+    if (ferror(out))
+    {
+        ret = E_FWRITE;
+    }
+
+cleanup:
+    free(is_target);
+    return ret;
+}
+
+static int read_payload(const char * path, uint8_t ** bytes_out, size_t * size_out)
+{
+    int ret = E_SUCCESS;
+    FILE * fp = NULL;
+    uint8_t * bytes = NULL;
+    long size = 0;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) == -1 || fseek(fp, 0, SEEK_SET) != 0)
+    {
+        ret = E_FTELL;
+        goto cleanup;
+    }
+
+    bytes = malloc((size > 0) ? (size_t)size : 1);
+    if (bytes == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    if (fread(bytes, 1, (size_t)size, fp) != (size_t)size)
+    {
+        ret = E_FREAD;
+        goto cleanup;
+    }
+
+    *bytes_out = bytes;
+    *size_out = (size_t)size;
+    bytes = NULL;
+
+cleanup:
+    free(bytes);
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+    return ret;
+}
+
+static int ends_with(const char * string, const char * suffix)
+{
+    size_t string_len = strlen(string);
+    size_t suffix_len = strlen(suffix);
+    return (string_len >= suffix_len) && (strcmp(&string[string_len - suffix_len], suffix) == 0);
+}
+
+// Compiles the translated C file into a shared object (the compiler is executed directly - the paths are passed to it
+// as they are, never through a shell)
+static int compile_shared_object(const char * c_path, const char * so_path)
+{
+    char stack_size_define[AOT_STACK_SIZE_DEFINE_MAX_SIZE];
+    int status = 0;
+    pid_t pid = -1;
+    const char * cc = getenv("CC");
+    if (cc == NULL || cc[0] == '\0')
+    {
+        cc = "cc";
+    }
+
+    // (The translated code checks the stack accesses against the stack size the loader was built with)
+    snprintf(stack_size_define, sizeof(stack_size_define), "-DASM_STACK_SIZE=%d", ASM_STACK_SIZE);
+    char * const argv[] = {
+        (char *)cc, "-O2", "-shared", "-fPIC", stack_size_define, "-I", AOT_INCLUDE_DIR, "-o", (char *)so_path,
+        (char *)c_path, NULL,
+    };
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1)
+    {
+        return E_FWRITE;
+    }
+    if (pid == 0)
+    {
+        execvp(cc, argv);
+        _exit(127);
+    }
+
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            return E_FWRITE;
+        }
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? E_SUCCESS : E_FWRITE;
+}
+
+int main(int argc, char ** argv)
+{
+    int ret = E_SUCCESS;
+    uint8_t * payload = NULL;
+    size_t payload_size = 0;
+    asm_program_t program;
+    FILE * out = NULL;
+    char c_path[] = "/tmp/babyrisc_aot_XXXXXX.c";
+    int compile = 0;
+
+    program_init(&program);
+    if (argc != 3)
+    {
+        printf("Usage: %s <payload.bin> <output.c | output.so>\n", argv[0]);
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    if (ASM_DEFAULT_INSTRUCTION_BUDGET != 0)
+    {
+        printf("Payloads can't be translated with an instruction budget.\n");
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    ret = read_payload(argv[1], &payload, &payload_size);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to read '%s'.\n", argv[1]);
+        goto cleanup;
+    }
+
+    ret = program_decode_span(payload, payload_size, &program);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to decode '%s'.\n", argv[1]);
+        goto cleanup;
+    }
+
+    // Shared objects are compiled from a temporary C file
+    compile = ends_with(argv[2], ".so");
+    if (compile)
+    {
+        int fd = mkstemps(c_path, 2);
+        out = (fd == -1) ? NULL : fdopen(fd, "w");
+    }
+    else
+    {
+        out = fopen(argv[2], "w");
+    }
+    if (out == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    ret = translate_program(&program, argv[1], out);
+    if (fclose(out) != 0 && ret == E_SUCCESS)
+    {
+        ret = E_FWRITE;
+    }
+    out = NULL;
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to translate '%s'.\n", argv[1]);
+        goto cleanup;
+    }
+
+    if (compile)
+    {
+        ret = compile_shared_object(c_path, argv[2]);
+        if (ret != E_SUCCESS)
+        {
+            printf("Failed to compile '%s'.\n", argv[2]);
+            goto cleanup;
+        }
+    }
+
+    // Success
+    printf("Translated %zu instructions into '%s'.\n", program.count, argv[2]);
+
+cleanup:
+    if (compile)
+    {
+        unlink(c_path);
+    }
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+    program_free(&program);
+    free(payload);
+    return ret;
+}
@@ -0,0 +1,680 @@
+/* Executes a corpus of BabyRISC payloads in a single process, on a pool of threads (each with its own VM).
+ * The payloads are either every file in a directory, or the files listed in a manifest (a path per line).
+ * Every payload is executed the way BabyRISC executes the user's payload: it ends at the terminator (0xffffffff), if
+ * it has one, and the admin code (generated once, for the flag file given with '-f') is appended to it.
+ * For every payload the result, the instructions count and a hash of the output are reported, in the input's order.
+ * Untrusted payloads can be limited to a budget of instructions with '-b' (they end with E_OUT_OF_GAS), of at most
+ * ASM_MAX_INSTRUCTION_BUDGET.
+ * Payloads that share a prelude can be given it with '-p': it's executed once (it must succeed, e.g. end with RET),
+ * and every payload starts from the registers & stack it ended with (its output is discarded).
+ * Payloads that repeat in the corpus are decoded (and compiled) only once, see asm_program_cache.h.
+ * Usage: ./batch_runner [-j threads] [-f flag] [-b budget] [-p prelude] <directory | manifest>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "admin_code.h"
+#include "asm_execution.h"
+#include "asm_program.h"
+#include "asm_program_cache.h"
+#include "asm_output.h"
+#include "asm_profile.h"
+#include "asm_snapshot.h"
+#include "payload_input.h"
+#include "common.h"
+
+#define BATCH_MAX_THREADS (256)
+
+typedef struct batch_result_s
+{
+    int ret;
+    // The signal that killed the payload (INT32_MIN / -1 traps, just like in BabyRISC), 0 if it wasn't killed
+    int signal_number;
+    int count;
+    uint64_t output_digest;
+    uint64_t output_size;
+} batch_result_t;
+
+// The payloads are split between the workers' queues up front. Every worker takes payloads from the head of its own
+// queue, and when it runs out it steals from the tail of the others' (so slow payloads don't leave workers idle).
+typedef struct batch_queue_s
+{
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} batch_queue_t;
+
+typedef struct batch_s
+{
+    char ** paths;
+    size_t count;
+    size_t capacity;
+    batch_result_t * results;
+    const uint8_t * admin_payload;
+    size_t admin_payload_size;
+    batch_queue_t * queues;
+    size_t workers_count;
+    // NULL if payloads aren't cached
+    asm_program_cache_t * cache;
+} batch_t;
+
+typedef struct batch_worker_s
+{
+    batch_t * batch;
+    size_t index;
+    pthread_t thread;
+    vm_context_t vm;
+#if ASM_ENABLE_PROFILING
+    asm_profile_t profile;
+#endif
+} batch_worker_t;
+
+// Where the executing payload of each thread continues from when it traps
+static __thread sigjmp_buf * batch_trap = NULL;
+
+static void batch_on_trap(int signal_number)
+{
+    if (batch_trap == NULL)
+    {
+        // Not while executing a payload - die like without the handler
+        signal(signal_number, SIG_DFL);
+        raise(signal_number);
+        return;
+    }
+    siglongjmp(*batch_trap, signal_number);
+}
+
+static int batch_add_path(batch_t * batch, const char * path)
+{
+    int ret = E_SUCCESS;
+
+    if (batch->count == batch->capacity)
+    {
+        size_t new_capacity = (batch->capacity == 0) ? 256 : batch->capacity * 2;
+        char ** new_paths = realloc(batch->paths, new_capacity * sizeof(*new_paths));
+        if (new_paths == NULL)
+        {
+            ret = E_NOMEM;
+            goto cleanup;
+        }
+        batch->paths = new_paths;
+        batch->capacity = new_capacity;
+    }
+
+    batch->paths[batch->count] = strdup(path);
+    if (batch->paths[batch->count] == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    batch->count++;
+
+cleanup:
+    return ret;
+}
+
+static int compare_paths(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Adds every regular file in 'directory' (sorted by name, so the report is always in the same order).
+static int batch_add_directory(batch_t * batch, const char * directory)
+{
+    int ret = E_SUCCESS;
+    DIR * dir = NULL;
+    struct dirent * entry = NULL;
+    struct stat st;
+    char path[4096];
+
+    dir = opendir(directory);
+    if (dir == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        ret = batch_add_path(batch, path);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+
+    qsort(batch->paths, batch->count, sizeof(*batch->paths), compare_paths);
+
+cleanup:
+    if (dir != NULL)
+    {
+        closedir(dir);
+    }
+    return ret;
+}
+
+// Adds every path listed in 'manifest' (empty lines and lines starting with '#' are skipped).
+static int batch_add_manifest(batch_t * batch, const char * manifest)
+{
+    int ret = E_SUCCESS;
+    FILE * manifest_fp = NULL;
+    char * line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_size = 0;
+
+    manifest_fp = fopen(manifest, "r");
+    if (manifest_fp == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    while ((line_size = getline(&line, &line_capacity, manifest_fp)) != -1)
+    {
+        while (line_size > 0 && (line[line_size - 1] == '\n' || line[line_size - 1] == '\r'))
+        {
+            line[--line_size] = '\0';
+        }
+        if (line_size == 0 || line[0] == '#')
+        {
+            continue;
+        }
+
+        ret = batch_add_path(batch, line);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    free(line);
+    if (manifest_fp != NULL)
+    {
+        fclose(manifest_fp);
+    }
+    return ret;
+}
+
+// Reads the payload in 'path' (up to its terminator) followed by 'suffix' (the admin code), into a newly allocated
+// buffer.
+static int batch_read_payload(const char * path, const uint8_t * suffix, size_t suffix_size, uint8_t ** payload_out,
+                              size_t * size_out)
+{
+    int ret = E_SUCCESS;
+    FILE * payload_fp = NULL;
+    uint8_t * payload = NULL;
+    struct stat st;
+    size_t size = 0;
+
+    payload_fp = fopen(path, "rb");
+    if (payload_fp == NULL || fstat(fileno(payload_fp), &st) != 0)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    payload = malloc((size_t)st.st_size + suffix_size + 1);
+    if (payload == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    size = fread(payload, 1, (size_t)st.st_size, payload_fp);
+    if (ferror(payload_fp))
+    {
+        ret = E_FREAD;
+        goto cleanup;
+    }
+
+    size = payload_find_terminator(payload, 0, size);
+
+    if (suffix_size > 0)
+    {
+        memcpy(&payload[size], suffix, suffix_size);
+    }
+    *payload_out = payload;
+    *size_out = size + suffix_size;
+    payload = NULL;
+
+cleanup:
+    free(payload);
+    if (payload_fp != NULL)
+    {
+        fclose(payload_fp);
+    }
+    return ret;
+}
+
+// Executes 'program' on the worker's VM. If it traps, the signal is reported in 'result' instead of killing us.
+static int batch_execute(batch_worker_t * worker, const asm_program_t * program, batch_result_t * result)
+{
+    sigjmp_buf trap;
+
+    output_init(&worker->vm.output, ASM_OUTPUT_DISCARD, ASM_OUTPUT_BUFFERED);
+    int signal_number = sigsetjmp(trap, 1);
+    if (signal_number != 0)
+    {
+        // (Like BabyRISC's own handler, the output printed before the trap still counts)
+        batch_trap = NULL;
+        output_flush(&worker->vm.output);
+        result->signal_number = signal_number;
+        return E_SUCCESS;
+    }
+
+    batch_trap = &trap;
+    int ret = execute_asm_program(&worker->vm, program, ASM_DEFAULT_ENGINE, &result->count);
+    batch_trap = NULL;
+    return ret;
+}
+
+static void batch_run_payload(batch_worker_t * worker, size_t index)
+{
+    int ret = E_SUCCESS;
+    batch_t * batch = worker->batch;
+    batch_result_t * result = &batch->results[index];
+    uint8_t * payload = NULL;
+    size_t payload_size = 0;
+    asm_cached_program_t * cached = NULL;
+    asm_program_t decoded;
+    const asm_program_t * program = &decoded;
+    program_init(&decoded);
+    memset(result, 0, sizeof(*result));
+
+    ret = batch_read_payload(batch->paths[index], batch->admin_payload, batch->admin_payload_size, &payload,
+                             &payload_size);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    if (batch->cache != NULL)
+    {
+        ret = program_cache_get(batch->cache, payload, payload_size, worker->vm.instruction_budget, ASM_CACHE_DEFAULT_FLAGS,
+                                &cached);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+        program = &cached->program;
+    }
+    else
+    {
+        ret = program_prepare(&decoded, payload, payload_size, worker->vm.instruction_budget, ASM_PREPARE_ALL);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+
+    ret = batch_execute(worker, program, result);
+    result->output_digest = worker->vm.output.digest;
+    result->output_size = worker->vm.output.total_size;
+
+cleanup:
+    result->ret = ret;
+    if (cached != NULL)
+    {
+        program_cache_release(batch->cache, cached);
+    }
+    program_free(&decoded);
+    free(payload);
+}
+
+// Takes the next payload to execute - from the worker's own queue, or stolen from another worker's queue.
+// Returns false when no payloads are left.
+static bool batch_take(batch_worker_t * worker, size_t * index_out)
+{
+    batch_t * batch = worker->batch;
+
+    for (size_t i = 0; i < batch->workers_count; ++i)
+    {
+        bool own = (i == 0);
+        batch_queue_t * queue = &batch->queues[(worker->index + i) % batch->workers_count];
+        bool taken = false;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail)
+        {
+            *index_out = own ? queue->head++ : --queue->tail;
+            taken = true;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (taken)
+        {
+            return true;
+        }
+    }
+
+    // (Payloads are never added to the queues, so once they're all empty - we're done)
+    return false;
+}
+
+// Executes the prelude in 'path' on a context of its own, and captures the state it ends with
+static int batch_run_prelude(const char * path, uint64_t budget, asm_snapshot_t * snapshot)
+{
+    int ret = E_SUCCESS;
+    static vm_context_t vm;
+    uint8_t * payload = NULL;
+    size_t payload_size = 0;
+    asm_program_t program;
+    program_init(&program);
+
+    ret = vm_init(&vm, ASM_OUTPUT_DISCARD);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    ret = batch_read_payload(path, NULL, 0, &payload, &payload_size);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    ret = program_prepare(&program, payload, payload_size, budget, ASM_PREPARE_ALL);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    ret = execute_asm_program(&vm, &program, ASM_DEFAULT_ENGINE, NULL);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    ret = snapshot_capture(snapshot, &vm);
+
+cleanup:
+    vm_free(&vm);
+    program_free(&program);
+    free(payload);
+    return ret;
+}
+
+static void * batch_worker_main(void * arg)
+{
+    batch_worker_t * worker = arg;
+    size_t index = 0;
+
+    while (batch_take(worker, &index))
+    {
+        batch_run_payload(worker, index);
+    }
+    return NULL;
+}
+
+static double elapsed_seconds(const struct timespec * start, const struct timespec * end)
+{
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void batch_report(const batch_t * batch, size_t threads, double seconds)
+{
+    uint64_t total_count = 0;
+    size_t failed = 0;
+
+    for (size_t i = 0; i < batch->count; ++i)
+    {
+        const batch_result_t * result = &batch->results[i];
+        if (result->signal_number != 0)
+        {
+            printf("%s: signal %d, output %016llx (%llu bytes)\n", batch->paths[i], result->signal_number,
+                   (unsigned long long)result->output_digest, (unsigned long long)result->output_size);
+            failed++;
+            continue;
+        }
+
+        printf("%s: result %d, executed 0x%X instructions, output %016llx (%llu bytes)\n", batch->paths[i],
+               result->ret, result->count, (unsigned long long)result->output_digest,
+               (unsigned long long)result->output_size);
+        total_count += (uint64_t)result->count;
+    }
+
+    printf("\n%zu payloads (%zu killed by a signal) on %zu threads in %.3f s\n", batch->count, failed, threads,
+           seconds);
+    printf("%.2f payloads/s, %.2f M instructions/s\n", (double)batch->count / seconds,
+           (double)total_count / seconds / 1e6);
+
+    if (batch->cache != NULL)
+    {
+        asm_program_cache_stats_t stats;
+        program_cache_get_stats(batch->cache, &stats);
+        printf("Program cache: %llu hits, %llu misses, %llu evictions (%zu programs, %zu bytes)\n",
+               (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.evictions,
+               stats.entries, stats.memory_size);
+    }
+}
+
+#if ASM_ENABLE_PROFILING
+// Dumps the profile of all the payloads (the table to stderr, the JSON to ASM_PROFILE_JSON_PATH)
+static void batch_report_profile(const batch_worker_t * workers, size_t workers_count)
+{
+    asm_profile_t profile;
+    FILE * profile_fp = NULL;
+    profile_init(&profile);
+
+    for (size_t i = 0; i < workers_count; ++i)
+    {
+        if (profile_merge(&profile, &workers[i].profile) != E_SUCCESS)
+        {
+            printf("Failed to merge the profiles\n");
+            goto cleanup;
+        }
+    }
+
+    profile_print_table(stderr, &profile);
+    profile_fp = fopen(ASM_PROFILE_JSON_PATH, "w");
+    if (profile_fp != NULL)
+    {
+        profile_print_json(profile_fp, &profile);
+        fclose(profile_fp);
+    }
+
+cleanup:
+    profile_free(&profile);
+}
+#endif
+
+static void usage(const char * name)
+{
+    printf("Usage: %s [-j threads] [-f flag] [-b budget] [-p prelude] <directory | manifest>\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+    int ret = E_SUCCESS;
+    batch_t batch = { 0 };
+    batch_worker_t * workers = NULL;
+    size_t workers_started = 0;
+    static uint8_t admin_payload[MAX_ADMIN_PAYLOAD_SIZE];
+    const char * flag_path = NULL;
+    const char * prelude_path = NULL;
+    asm_snapshot_t prelude;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t budget = ASM_DEFAULT_INSTRUCTION_BUDGET;
+    struct stat st;
+    struct timespec start;
+    struct timespec end;
+    int option = 0;
+    snapshot_init(&prelude);
+
+    while ((option = getopt(argc, argv, "j:f:b:p:")) != -1)
+    {
+        switch (option)
+        {
+        case 'j':
+            threads = strtol(optarg, NULL, 0);
+            break;
+        case 'f':
+            flag_path = optarg;
+            break;
+        case 'b':
+            budget = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            prelude_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            ret = E_IVLD_ARGS;
+            goto cleanup;
+        }
+    }
+    if (optind != argc - 1 || threads <= 0 || threads > BATCH_MAX_THREADS || budget > ASM_MAX_INSTRUCTION_BUDGET)
+    {
+        usage(argv[0]);
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    // The admin code is the same for all the payloads, so it's generated only once
+    if (flag_path != NULL)
+    {
+        ret = generate_admin_code(flag_path, admin_payload, sizeof(admin_payload), &batch.admin_payload_size);
+        if (ret != E_SUCCESS)
+        {
+            printf("Failed to generate admin code\n");
+            goto cleanup;
+        }
+        batch.admin_payload = admin_payload;
+    }
+
+    batch.cache = program_cache_default();
+
+    // The prelude is executed only once, all the payloads start from where it ended
+    if (prelude_path != NULL)
+    {
+        ret = batch_run_prelude(prelude_path, budget, &prelude);
+        if (ret != E_SUCCESS)
+        {
+            printf("Failed to execute the prelude '%s' (result %d).\n", prelude_path, ret);
+            goto cleanup;
+        }
+    }
+
+    ret = (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)) ? batch_add_directory(&batch, argv[optind])
+                                                                 : batch_add_manifest(&batch, argv[optind]);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to list the payloads in '%s'.\n", argv[optind]);
+        goto cleanup;
+    }
+    if (batch.count == 0)
+    {
+        printf("No payloads in '%s'.\n", argv[optind]);
+        goto cleanup;
+    }
+    if ((size_t)threads > batch.count)
+    {
+        threads = (long)batch.count;
+    }
+
+    batch.workers_count = (size_t)threads;
+    batch.results = calloc(batch.count, sizeof(*batch.results));
+    batch.queues = calloc(batch.workers_count, sizeof(*batch.queues));
+    workers = calloc(batch.workers_count, sizeof(*workers));
+    if (batch.results == NULL || batch.queues == NULL || workers == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < batch.workers_count; ++i)
+    {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].head = batch.count * i / batch.workers_count;
+        batch.queues[i].tail = batch.count * (i + 1) / batch.workers_count;
+        workers[i].batch = &batch;
+        workers[i].index = i;
+        ret = vm_init(&workers[i].vm, ASM_OUTPUT_DISCARD);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+        workers[i].vm.instruction_budget = budget;
+        if (prelude_path != NULL)
+        {
+            vm_set_snapshot(&workers[i].vm, &prelude);
+        }
+#if ASM_ENABLE_PROFILING
+        profile_init(&workers[i].profile);
+        workers[i].vm.profile = &workers[i].profile;
+#endif
+    }
+
+    signal(SIGFPE, batch_on_trap);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; workers_started < batch.workers_count; ++workers_started)
+    {
+        if (pthread_create(&workers[workers_started].thread, NULL, batch_worker_main, &workers[workers_started]) != 0)
+        {
+            // The workers that did start will steal the rest of the payloads
+            break;
+        }
+    }
+    if (workers_started == 0)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    for (size_t i = 0; i < workers_started; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    batch_report(&batch, workers_started, elapsed_seconds(&start, &end));
+#if ASM_ENABLE_PROFILING
+    batch_report_profile(workers, batch.workers_count);
+#endif
+
+cleanup:
+    if (batch.queues != NULL)
+    {
+        for (size_t i = 0; i < batch.workers_count; ++i)
+        {
+            pthread_mutex_destroy(&batch.queues[i].lock);
+        }
+    }
+    for (size_t i = 0; i < batch.count; ++i)
+    {
+        free(batch.paths[i]);
+    }
+    free(batch.paths);
+    free(batch.results);
+    free(batch.queues);
+    for (size_t i = 0; workers != NULL && i < batch.workers_count; ++i)
+    {
+        vm_free(&workers[i].vm);
+#if ASM_ENABLE_PROFILING
+        profile_free(&workers[i].profile);
+#endif
+    }
+    free(workers);
+    snapshot_free(&prelude);
+    return ret;
+}
@@ -0,0 +1,301 @@
+/* Benchmarks the BabyRISC execution engines against each other.
+ * A synthetic ALU / stack heavy payload is generated, decoded once, and then executed many times by every engine.
+ * Usage: ./bench_engines [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "asm_emitter.h"
+#include "asm_execution.h"
+#include "asm_program.h"
+#include "asm_jit.h"
+#include "asm_fusion.h"
+#include "asm_lockstep.h"
+#include "asm_optimizer.h"
+#include "asm_verifier.h"
+#include "common.h"
+
+#define BENCH_PAYLOAD_MAX_SIZE (64 * 1024)
+#define BENCH_BLOCKS (256)
+#define BENCH_DEFAULT_ITERATIONS (20000)
+
+static const char * engine_names[MAX_ASM_ENGINE_VAL] = {
+    [ASM_ENGINE_INTERPRETER] = "interpreter",
+    [ASM_ENGINE_THREADED] = "threaded",
+    [ASM_ENGINE_JIT] = "jit",
+};
+
+static int generate_bench_code(uint8_t * payload, size_t max_size, size_t * payload_size_out)
+{
+    int ret = E_SUCCESS;
+    asm_emitter_t emitter;
+    emitter_init_buffer(&emitter, payload, max_size);
+
+    // (The emitter keeps the first error, so it's only checked once we finish).
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R0, ASM_REGISTER_ZERO, 1);
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R1, ASM_REGISTER_ZERO, 0x1234);
+    for (size_t i = 0; i < BENCH_BLOCKS; ++i)
+    {
+        emit_opcode3(&emitter, ADD, ASM_REGISTER_R2, ASM_REGISTER_R0, ASM_REGISTER_R1);
+        emit_opcode_imm32(&emitter, MULI, ASM_REGISTER_R3, ASM_REGISTER_R2, 7);
+        emit_opcode3(&emitter, XOR, ASM_REGISTER_R1, ASM_REGISTER_R3, ASM_REGISTER_R0);
+        emit_opcode_imm32(&emitter, ROR, ASM_REGISTER_R4, ASM_REGISTER_R1, 3);
+        emit_opcode_imm32(&emitter, ANDI, ASM_REGISTER_R5, ASM_REGISTER_R4, 0xffff);
+        emit_opcode1(&emitter, PUSH, ASM_REGISTER_R5);
+        emit_opcode1(&emitter, POP, ASM_REGISTER_R6);
+        emit_opcode_imm32(&emitter, DIVI, ASM_REGISTER_R0, ASM_REGISTER_R6, 3);
+    }
+    emit_opcode(&emitter, RET);
+
+    ret = emitter_error(&emitter);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    *payload_size_out = emitter.size;
+
+cleanup:
+    emitter_free(&emitter);
+    return ret;
+}
+
+static double elapsed_seconds(const struct timespec * start, const struct timespec * end)
+{
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int bench_compiled_jit(vm_context_t * vm, const asm_program_t * program, long iterations)
+{
+    int ret = E_SUCCESS;
+    asm_jit_code_t code = { 0 };
+    struct timespec start;
+    struct timespec end;
+    int count = 0;
+    long long total_count = 0;
+
+    ret = jit_compile(program, &code);
+    if (ret != E_SUCCESS)
+    {
+        printf("jit: can't compile on this host (%d)\n", ret);
+        ret = E_SUCCESS;
+        goto cleanup;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; ++i)
+    {
+        ret = jit_execute(vm, &code, &count);
+        if (ret != E_SUCCESS)
+        {
+            printf("jit-compiled: execution failed (%d)\n", ret);
+            goto cleanup;
+        }
+        total_count += count;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsed_seconds(&start, &end);
+    printf("%-12s %8.3f s  %8.2f M instructions/s  %6.2f ns/instruction\n", "jit-compiled", seconds,
+           (double)total_count / seconds / 1e6, seconds * 1e9 / (double)total_count);
+
+cleanup:
+    jit_free(&code);
+    return ret;
+}
+
+// Executes the program 'iterations' times in lockstep (each execution is a lane, with its own R0)
+static int bench_lockstep(const asm_program_t * program, long iterations)
+{
+    int ret = E_SUCCESS;
+    asm_register_file_t * initial_registers = NULL;
+    asm_lane_result_t * results = NULL;
+    struct timespec start;
+    struct timespec end;
+    long long total_count = 0;
+
+    initial_registers = calloc((size_t)iterations, sizeof(*initial_registers));
+    results = calloc((size_t)iterations, sizeof(*results));
+    if (initial_registers == NULL || results == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    for (long i = 0; i < iterations; ++i)
+    {
+        initial_registers[i].registers[ASM_REGISTER_R0] = (reg_value_t)i;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = execute_asm_program_lockstep(program, initial_registers, (size_t)iterations, results);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (ret != E_SUCCESS)
+    {
+        printf("lockstep: execution failed (%d)\n", ret);
+        goto cleanup;
+    }
+    for (long i = 0; i < iterations; ++i)
+    {
+        total_count += results[i].count;
+    }
+
+    double seconds = elapsed_seconds(&start, &end);
+    printf("%-12s %8.3f s  %8.2f M instructions/s  %6.2f ns/instruction\n", "lockstep", seconds,
+           (double)total_count / seconds / 1e6, seconds * 1e9 / (double)total_count);
+
+cleanup:
+    free(initial_registers);
+    free(results);
+    return ret;
+}
+
+static int bench_engine(vm_context_t * vm, const asm_program_t * program, asm_engine_t engine, const char * name,
+                        long iterations)
+{
+    int ret = E_SUCCESS;
+    struct timespec start;
+    struct timespec end;
+    int count = 0;
+    long long total_count = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; ++i)
+    {
+        ret = execute_asm_program(vm, program, engine, &count);
+        if (ret != E_SUCCESS)
+        {
+            printf("%s: execution failed (%d)\n", name, ret);
+            goto cleanup;
+        }
+        total_count += count;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsed_seconds(&start, &end);
+    printf("%-12s %8.3f s  %8.2f M instructions/s  %6.2f ns/instruction\n", name, seconds,
+           (double)total_count / seconds / 1e6, seconds * 1e9 / (double)total_count);
+
+cleanup:
+    return ret;
+}
+
+int main(int argc, char ** argv)
+{
+    int ret = E_SUCCESS;
+    static uint8_t payload[BENCH_PAYLOAD_MAX_SIZE];
+    size_t payload_size = 0;
+    static vm_context_t vm;
+    asm_program_t program;
+    asm_fusion_stats_t fusion_stats;
+    asm_optimizer_stats_t optimizer_stats;
+    asm_verify_report_t verify_report;
+    long iterations = (argc > 1) ? strtol(argv[1], NULL, 0) : BENCH_DEFAULT_ITERATIONS;
+
+    program_init(&program);
+    ret = vm_init(&vm, STDOUT_FILENO);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to initialize the processor\n");
+        goto cleanup;
+    }
+    ret = generate_bench_code(payload, sizeof(payload), &payload_size);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to generate benchmark code\n");
+        goto cleanup;
+    }
+
+    ret = program_decode_span(payload, payload_size, &program);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to decode benchmark code\n");
+        goto cleanup;
+    }
+
+    printf("payload: %zu bytes, %zu instructions, %ld iterations\n", payload_size, program.count, iterations);
+    for (int engine = 0; engine < MAX_ASM_ENGINE_VAL; ++engine)
+    {
+        if (engine_names[engine] == NULL)
+        {
+            continue;
+        }
+
+        ret = bench_engine(&vm, &program, (asm_engine_t)engine, engine_names[engine], iterations);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+
+    // The JIT engine above compiles the program on every execution, this is the cost of running it once compiled
+    ret = bench_compiled_jit(&vm, &program, iterations);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    // All the executions at once, a vector of lanes at a time
+    ret = bench_lockstep(&program, iterations);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    // The interpreter engines again, this time executing the fused instructions
+    ret = program_fuse(&program, &fusion_stats);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to fuse benchmark code\n");
+        goto cleanup;
+    }
+    fusion_stats_print(stdout, &fusion_stats);
+    ret = bench_engine(&vm, &program, ASM_ENGINE_INTERPRETER, "interp+fuse", iterations);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    ret = bench_engine(&vm, &program, ASM_ENGINE_THREADED, "thread+fuse", iterations);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    // Then optimized as well
+    ret = program_optimize(&program, &optimizer_stats);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to optimize benchmark code\n");
+        goto cleanup;
+    }
+    optimizer_stats_print(stdout, &optimizer_stats);
+    ret = bench_engine(&vm, &program, ASM_ENGINE_INTERPRETER, "interp+opt", iterations);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    ret = bench_engine(&vm, &program, ASM_ENGINE_THREADED, "thread+opt", iterations);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    // And once more, with the stack checks the verifier proved unneeded dropped
+    ret = program_verify(&program, &verify_report);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to verify benchmark code\n");
+        goto cleanup;
+    }
+    verify_report_print(stdout, &verify_report);
+    ret = bench_engine(&vm, &program, ASM_ENGINE_INTERPRETER, "interp+ver", iterations);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    ret = bench_engine(&vm, &program, ASM_ENGINE_THREADED, "thread+ver", iterations);
+
+cleanup:
+    program_free(&program);
+    vm_free(&vm);
+    return ret;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#ifndef __ADMIN_CODE_H
+#define __ADMIN_CODE_H
+
+#include "asm_types.h"
+#include "common.h"
+
+// The admin code is executed right after the user's payload (it prints the flag, if R0 is just right)
+#define MAX_ADMIN_PAYLOAD_SIZE (1024)
+
+// Writes the admin shellcode (for the flag in 'flag_path') to the 'payload' buffer.
+// Writes the actual size of the payload to 'payload_size_out'.
+// Return 0 on success, otherwise - error.
+int generate_admin_code(const char * flag_path, uint8_t * payload, size_t max_size, size_t * payload_size_out);
+
+#endif /* __ADMIN_CODE_H */
@@ -0,0 +1,48 @@
+#pragma once
+#ifndef __ASM_AOT_H
+#define __ASM_AOT_H
+
+#include "asm_types.h"
+#include "asm_processor_state.h"
+#include "common.h"
+
+// The interface between ahead-of-time translated payloads (see 'aot_translator') and the loader.
+// A translated payload is a shared object exporting ASM_AOT_ENTRY_SYMBOL (of type 'asm_aot_entry_t')
+// and ASM_AOT_ABI_SYMBOL (a uint32_t holding the ASM_AOT_ABI_VERSION it was translated with).
+
+#define ASM_AOT_ABI_VERSION (2)
+#define ASM_AOT_ENTRY_SYMBOL "babyrisc_aot_entry"
+#define ASM_AOT_ABI_SYMBOL "babyrisc_aot_abi_version"
+
+// What the translated code gets from the loader: the processor state, and the output functions
+// (which should be called with 'context').
+typedef struct asm_aot_runtime_s
+{
+    reg_value_t * registers;
+    uint8_t * stack;
+    void * context;
+    void (*print_char)(void * context, reg_value_t value);
+    void (*print_dd)(void * context, reg_value_t value);
+    void (*print_dx)(void * context, reg_value_t value);
+    void (*print_nl)(void * context);
+} asm_aot_runtime_t;
+
+// Executes the translated payload on the runtime's processor state.
+// Returns exactly what the interpreter returns (E_RETURN for RET*), and writes the executed instructions count.
+typedef int (*asm_aot_entry_t)(const asm_aot_runtime_t * runtime, int * count_out);
+
+typedef struct asm_aot_module_s
+{
+    void * handle;
+    asm_aot_entry_t entry;
+} asm_aot_module_t;
+
+int aot_load(const char * path, asm_aot_module_t * module_out);
+void aot_unload(asm_aot_module_t * module);
+
+// Executes a loaded payload from a fresh context (in 'vm'). Behaves exactly like the interpreter.
+// The translated code doesn't count instructions against a budget, so contexts with an instruction budget are
+// refused (E_IVLD_ARGS).
+int aot_execute(vm_context_t * vm, const asm_aot_module_t * module, int * count_out);
+
+#endif /* __ASM_AOT_H */
@@ -0,0 +1,91 @@
+#pragma once
+#ifndef __ASM_CONTAINER_H
+#define __ASM_CONTAINER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "asm_program.h"
+#include "common.h"
+
+// The BRX container - a payload packed with its decoded instructions, so it's executed without decoding it.
+// execute_asm_file recognizes containers by their magic (anything else is executed as a raw payload, like before),
+// maps them, and executes the instructions right from the mapping (they're only copied if the instruction budget has
+// to cut them, see program_limit). payload_builder writes a container next to every payload it builds.
+// Layout (all the offsets are from the start of the container, in the byte order of the machine that wrote it):
+//  - The header (asm_brx_header_t).
+//  - The code section: the raw payload, exactly as it would be executed without the container.
+//  - The instructions section (ASM_BRX_DECODED): 'instructions_count' + 1 decoded instructions (the last is the
+//    HALT), aligned to ASM_BRX_ALIGNMENT.
+//  - The optimized section (ASM_BRX_FUSED / ASM_BRX_OPTIMIZED): the same, after the passes the flags name.
+// The decoded sections are tied to the exact instruction set & layout they were written with (so the version
+// changes with them), and containers of another version are decoded from their code section instead.
+// The decoded sections aren't trusted: every entry of the instructions section is checked to be one the decoder could
+// have made (opcodes, registers, lengths, branch targets, see program_validate_instruction) when it's loaded, but not
+// to match the code section. The optimized section is never executed - the build's passes are applied to the
+// instructions section, and a container whose optimized section disagrees with them is decoded from its code section.
+
+#define ASM_BRX_MAGIC (0x1a585242) // "BRX\x1a"
+#define ASM_BRX_VERSION (1)
+#define ASM_BRX_ALIGNMENT (64)
+
+// Flags
+// Has the instructions section
+#define ASM_BRX_DECODED (1 << 0)
+// The fusion pass was applied (see asm_fusion.h)
+#define ASM_BRX_FUSED (1 << 1)
+// The optimizer was applied (see asm_optimizer.h). The optimized section is only checked by builds that apply the
+// same passes.
+#define ASM_BRX_OPTIMIZED (1 << 2)
+
+// 'max_stack_depth' of programs whose stack depth isn't known statically
+#define ASM_BRX_UNKNOWN_STACK_DEPTH (UINT32_MAX)
+
+typedef struct asm_brx_header_s
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t header_size;
+    // Where the execution starts (an offset in the code section, the code before it is never executed)
+    uint32_t entry;
+    uint64_t code_offset;
+    uint64_t code_size;
+    // XXH64 of the code section (e.g. for keying caches)
+    uint64_t hash;
+    // 0 - no such section
+    uint64_t instructions_offset;
+    uint64_t optimized_offset;
+    // (Not including the HALT)
+    uint64_t instructions_count;
+    uint32_t instruction_size;
+    // How deep the program's own pushes can take the stack (in bytes, from where it started), if the program can't
+    // loop and doesn't set SP other than by pushing & popping - otherwise ASM_BRX_UNKNOWN_STACK_DEPTH
+    uint32_t max_stack_depth;
+} asm_brx_header_t;
+
+// A mapped container
+typedef struct asm_container_s
+{
+    uint8_t * mapping;
+    size_t mapping_size;
+    // (In the mapping)
+    const asm_brx_header_t * header;
+    const uint8_t * code;
+} asm_container_t;
+
+// Maps the container that starts at 'offset' in the file 'fd'. Returns 0 on success, otherwise - error
+// (E_IVLD_ARGS if it's not a valid container).
+int container_open(asm_container_t * container, int fd, off_t offset);
+void container_close(asm_container_t * container);
+
+// Sets up 'program_out' to execute the container (limited to 'budget' instructions, see program_limit), using the
+// instructions section in the mapping if it can be used. The program must be freed with program_free (before the
+// container is closed). Returns 0 on success, otherwise - error.
+int container_load_program(const asm_container_t * container, uint64_t budget, asm_program_t * program_out);
+
+// Writes a container of the 'code_size' bytes payload in 'code' (executed from 'entry') to 'fp', with the sections
+// 'flags' asks for. Returns 0 on success, otherwise - error.
+int container_write(FILE * fp, const uint8_t * code, size_t code_size, uint32_t entry, int flags);
+
+#endif /* __ASM_CONTAINER_H */
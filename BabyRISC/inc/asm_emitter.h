@@ -0,0 +1,60 @@
+#pragma once
+#ifndef __ASM_EMITTER_H
+#define __ASM_EMITTER_H
+
+#include "asm_types.h"
+#include "asm_processor_state.h"
+#include "asm_instructions.h"
+#include "common.h"
+
+// The emitter - encodes instructions into a buffer in memory, a whole instruction at a time (asm_file_generation.h
+// writes through it). The buffer is either the emitter's own, which grows as needed, or the caller's, which doesn't.
+// Errors are latched: once something can't be emitted, nothing more is, and the first error is kept - so a whole
+// payload can be emitted, and checked once at the end (see emitter_error).
+
+// The longest encoded instruction (an opcode, 3 registers and an imm32)
+#define ASM_EMITTER_MAX_INSTRUCTION_SIZE (sizeof(opcode_t) + 3 * sizeof(reg_t) + sizeof(int32_t))
+
+typedef struct asm_emitter_s
+{
+    uint8_t * buffer;
+    size_t size;
+    size_t capacity;
+    // Whether 'buffer' is the caller's (it's never grown or freed)
+    int borrowed;
+    // The first error (E_SUCCESS if there wasn't one)
+    int error;
+} asm_emitter_t;
+
+// Initializes an emitter with its own buffer (freed by emitter_free)
+void emitter_init(asm_emitter_t * emitter);
+// Initializes an emitter that writes to 'buffer' (emitting more than 'capacity' bytes fails with E_NOMEM)
+void emitter_init_buffer(asm_emitter_t * emitter, uint8_t * buffer, size_t capacity);
+void emitter_free(asm_emitter_t * emitter);
+// Empties the emitter and clears its error, keeping the buffer (for emitting many payloads one after the other)
+void emitter_reset(asm_emitter_t * emitter);
+
+// Returns the first error of the emitter, or 0 if everything was emitted.
+int emitter_error(const asm_emitter_t * emitter);
+
+void emit_raw(asm_emitter_t * emitter, const void * bytes, size_t size);
+void emit_opcode(asm_emitter_t * emitter, asm_opcode_t opcode);
+void emit_opcode1(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0);
+void emit_opcode2(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1);
+void emit_opcode3(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1,
+                  asm_register_t reg2);
+void emit_opcode_imm32(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1,
+                       int32_t imm32);
+
+// Branches (JMP / JZ, JNZ, LOOP). 'rel32' is relative to the end of the branch (see asm_instructions.h).
+void emit_opcode_rel32(asm_emitter_t * emitter, asm_opcode_t opcode, int32_t rel32);
+void emit_opcode1_rel32(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0, int32_t rel32);
+
+// The rel32 of a branch emitted next, which targets the offset 'target' (e.g. an earlier 'size', for a loop).
+// Forward branches can be emitted with a placeholder, and patched with emitter_patch_branch once their target is
+// known.
+int32_t emitter_branch_rel32(const asm_emitter_t * emitter, asm_opcode_t opcode, size_t target);
+// Points the branch that was emitted at offset 'branch' to the offset 'target'
+void emitter_patch_branch(asm_emitter_t * emitter, size_t branch, size_t target);
+
+#endif /* __ASM_EMITTER_H */
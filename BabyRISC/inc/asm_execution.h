@@ -3,8 +3,39 @@
 #define __ASM_EXECUTION_H
 
 #include "asm_types.h"
+#include "asm_program.h"
+#include "asm_processor_state.h"
 
-int execute_asm_file(FILE * fp);
-int execute_asm_memory(void * asm_bytes, size_t len);
+// The engines that can execute decoded programs. They all behave exactly the same.
+typedef enum asm_engine_e
+{
+    // Calls the instruction implementations through the 'asm_instruction_definitions' table
+    ASM_ENGINE_INTERPRETER,
+    // Direct-threaded dispatch (computed goto), with the registers kept in locals
+    ASM_ENGINE_THREADED,
+    // Translates the program into native code (falls back to the interpreter for what it can't translate)
+    ASM_ENGINE_JIT,
+    // Runs both the interpreter and the JIT and compares them (for testing the JIT)
+    ASM_ENGINE_JIT_DIFFERENTIAL,
+
+    MAX_ASM_ENGINE_VAL
+} asm_engine_t;
+
+// The engine used by execute_asm_file / execute_asm_memory (can be chosen at build time)
+#ifndef ASM_DEFAULT_ENGINE
+#define ASM_DEFAULT_ENGINE ASM_ENGINE_INTERPRETER
+#endif
+
+// Whether execute_asm_file / execute_asm_memory fuse common instruction sequences before executing them
+#ifndef ASM_ENABLE_FUSION
+#define ASM_ENABLE_FUSION 1
+#endif
+
+// All the executions start from a fresh context (registers & stack) in 'vm', and write their output to its sink.
+// (execute_asm_file / execute_asm_memory apply the context's instruction budget to the programs they decode, callers
+// of execute_asm_program should use program_limit).
+int execute_asm_program(vm_context_t * vm, const asm_program_t * program, asm_engine_t engine, int * count_out);
+int execute_asm_file(vm_context_t * vm, FILE * fp);
+int execute_asm_memory(vm_context_t * vm, void * asm_bytes, size_t len);
 
 #endif /* __ASM_EXECUTION_H */
@@ -7,10 +7,20 @@
 #include "asm_instructions.h"
 #include "common.h"
 
+// Writes instructions to a file, each with a single fwrite (they're encoded by the emitter, see asm_emitter.h - which
+// is the faster way to build a whole payload in memory).
 int file_write_opcode(FILE * fp, asm_opcode_t opcode);
 int file_write_opcode1(FILE * fp, asm_opcode_t opcode, asm_register_t reg0);
 int file_write_opcode2(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1);
 int file_write_opcode3(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1, asm_register_t reg2);
 int file_write_opcode_imm32(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1, int32_t imm2);
 
+// Branches (JMP / JZ, JNZ, LOOP). 'rel32' is relative to the end of the branch (see asm_instructions.h).
+int file_write_opcode_rel32(FILE * fp, asm_opcode_t opcode, int32_t rel32);
+int file_write_opcode1_rel32(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, int32_t rel32);
+
+// The rel32 of a branch written next to 'fp', which targets the file offset 'target' (e.g. an earlier ftell, for a
+// loop). Forward branches can be written with a placeholder, and rewritten once their target is known.
+int32_t file_branch_rel32(FILE * fp, asm_opcode_t opcode, long target);
+
 #endif /* __ASM_FILE_GENERATION_H */
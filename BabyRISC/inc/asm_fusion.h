@@ -0,0 +1,34 @@
+#pragma once
+#ifndef __ASM_FUSION_H
+#define __ASM_FUSION_H
+
+#include "asm_program.h"
+
+// The instruction sequences the fusion pass replaces with a single (fused) instruction
+typedef enum asm_fusion_e
+{
+    ASM_FUSION_LOADI,        // ADDI rX, ZERO, imm32
+    ASM_FUSION_PRINTC4,      // (PRINTC rX; ROR rX, rX, 8) x 4
+    ASM_FUSION_MULSUBIRETNZ, // MUL rX, rY, rZ; SUBI rX, rX, imm32; RETNZ rX
+    MAX_ASM_FUSION_VAL
+} asm_fusion_t;
+
+typedef struct asm_fusion_stats_s
+{
+    size_t fused[MAX_ASM_FUSION_VAL];
+    // How many instructions dispatches are saved each time the whole program is executed
+    size_t dispatches_saved;
+} asm_fusion_stats_t;
+
+// Builds 'program->optimized' - a copy of the decoded instructions in which the known sequences are replaced with
+// fused instructions. Only sequences that can't fail are fused, so the results, output and instruction count of
+// the program stay exactly the same. 'stats_out' (optional) receives how often each fusion fired.
+// The fused instructions are only executed from a fresh context - LOADI relies on ZERO being 0, which a snapshot
+// whose prelude ended with a POPCTX doesn't keep (executions from a snapshot get the decoded instructions, see
+// execute_asm_program).
+// Returns 0 on success, otherwise - error.
+int program_fuse(asm_program_t * program, asm_fusion_stats_t * stats_out);
+
+void fusion_stats_print(FILE * fp, const asm_fusion_stats_t * stats);
+
+#endif /* __ASM_FUSION_H */
@@ -0,0 +1,32 @@
+#pragma once
+#ifndef __ASM_GUARDED_STACK_H
+#define __ASM_GUARDED_STACK_H
+
+#include "asm_program.h"
+#include "asm_processor_state.h"
+
+// The guarded stack backend (compiled in with ASM_GUARDED_STACK, e.g. "make GUARDED_STACK=1").
+// The stack is mapped in the middle of a reserved (inaccessible) region that covers every offset a 32-bit register
+// can hold, so any access outside of the stack faults instead of touching other memory. The threaded engine relies
+// on that instead of checking the offsets of PUSH / POP / PUSHCTX / POPCTX / LOAD / STORE.
+// A fault in the guard region aborts the execution, which is then replayed from the start by the interpreter (which
+// checks every access): a stack violation ends the execution, so paying for it twice is cheap, and the replay
+// reports exactly what the checked engines report (the registers, count and output at the failing instruction).
+
+// Maps a new guarded stack of ASM_STACK_SIZE bytes (zeroed). Returns 0 on success, otherwise - error.
+int guarded_stack_map(uint8_t ** stack_out);
+void guarded_stack_unmap(uint8_t * stack);
+
+// Zeroes the bytes [start, end) of the stack (the pages of large ranges are given back to the kernel instead, which
+// zeroes them on their next use)
+void guarded_stack_reset(uint8_t * stack, size_t start, size_t end);
+
+typedef int (*guarded_engine_t)(vm_context_t * vm, const asm_program_t * program, int * count_out);
+
+// Executes 'program' with 'engine', and returns what it returns. If the execution touched the guard region of the
+// context's stack, it's aborted and E_STACK_GUARD_HIT is returned instead (the context is left as it was at the
+// fault, and its output may have been partly written - see output_rewind).
+int guarded_stack_execute(vm_context_t * vm, const asm_program_t * program, guarded_engine_t engine,
+                          int * count_out);
+
+#endif /* __ASM_GUARDED_STACK_H */
@@ -0,0 +1,11 @@
+#pragma once
+#ifndef __ASM_HASH_H
+#define __ASM_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64 (xxHash, 64-bit) of 'size' bytes - a fast non-cryptographic hash, for keying caches by content
+uint64_t hash_xxh64(const void * data, size_t size, uint64_t seed);
+
+#endif /* __ASM_HASH_H */
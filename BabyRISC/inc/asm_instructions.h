@@ -4,6 +4,11 @@
 
 #include <stdio.h>
 #include "asm_types.h"
+#include "asm_processor_state.h"
+
+// Bumped whenever what an instruction does changes (results that outlive the process are stamped with it, see
+// asm_memo.h)
+#define ASM_INSTRUCTION_SET_VERSION (1)
 
 typedef enum asm_opcode_e
 {
@@ -36,11 +41,107 @@ typedef enum asm_opcode_e
     POP,
     PUSHCTX,
     POPCTX,
+    JMP,
+    JZ,
+    JNZ,
+    LOOP,
+    LOAD,
+    STORE,
+    MEMCPY,
+    MEMSET,
+    MEMCMP,
+
+    MAX_ASM_OPCODE_VAL,
+
+    // Internal opcodes - these are never encoded in payloads, they are only produced by the decoder.
+    // HALT terminates every decoded program, and returns the decoding error stored in its 'imm32'.
+    HALT = MAX_ASM_OPCODE_VAL,
+
+    // Instructions that are known (at decode time) to fail because of their registers operands.
+    // FAULT returns the error stored in its 'imm32'. DIV_WFAULT / POP_WFAULT first make the dynamic checks
+    // DIV / POP would have made (division-by-zero / stack bounds), and only then fail writing their destination.
+    FAULT,
+    DIV_WFAULT,
+    POP_WFAULT,
+
+    // Fused instructions (superinstructions), produced by the fusion pass (see asm_fusion.h)
+    LOADI,
+    PRINTC4,
+    MULSUBIRETNZ,
 
-    MAX_ASM_OPCODE_VAL
+    // PUSH / POP without the stack bounds checks, for the instructions the verifier proved can't violate the stack
+    // (see asm_verifier.h)
+    PUSH_NOCHECK,
+    POP_NOCHECK,
+
+    MAX_ASM_INTERNAL_OPCODE_VAL
 } asm_opcode_t;
 
-typedef int (*instruction_definition_t)(FILE * fp);
-extern instruction_definition_t asm_instruction_definitions[MAX_ASM_OPCODE_VAL];
+// The operands that follow the opcode in the binary-encoding of each instruction
+typedef enum asm_operands_format_e
+{
+    ASM_OPERANDS_NONE,
+    ASM_OPERANDS_REG1,
+    ASM_OPERANDS_REG2,
+    ASM_OPERANDS_REG3,
+    ASM_OPERANDS_REG2_IMM32,
+    ASM_OPERANDS_REG3_IMM32,
+    ASM_OPERANDS_REL32,
+    ASM_OPERANDS_REG1_REL32,
+} asm_operands_format_t;
+
+// The branch instructions:
+//  JMP rel32         - continues at the target
+//  JZ / JNZ r, rel32 - continues at the target if r is zero / not zero
+//  LOOP r, rel32     - decrements r (wrapping around), and continues at the target if it's not zero
+// 'rel32' is the target's payload offset, relative to the end of the branch instruction. The decoder resolves it to
+// the index of the target instruction (stored in 'imm32' instead), so the engines never see payload offsets.
+// A target must be the start of an instruction (or the end of the decoded instructions, where the payload ends) -
+// a branch to anywhere else fails with E_INVLD_BRANCH_TARGET when it's executed.
+
+// The memory instructions (all the offsets are in bytes, from the start of the stack):
+//  LOAD r0, r1, imm32  - loads the 32-bit value at offset r1 + imm32 into r0
+//  STORE r0, r1, imm32 - stores r0 at offset r1 + imm32
+//  MEMCPY r0, r1, r2   - copies r2 bytes from offset r1 to offset r0 (the ranges may overlap)
+//  MEMSET r0, r1, r2   - sets r2 bytes at offset r0 to the low byte of r1
+//  MEMCMP r0, r1, r2   - compares r0 bytes at offsets r1 and r2, and sets r0 to -1 / 0 / 1 (like memcmp's sign)
+// (Use SP as the base register to access the stack relative to SP, or ZERO for absolute offsets).
+// Every range is checked once, before anything is accessed: if it's not entirely inside the stack, the instruction
+// fails with E_STACK_VIOLATION without changing anything.
+
+// A decoded instruction. Operands which are not used by the instruction's format are zero.
+// 'length' is the number of payload instructions this instruction stands for (more than one for fused
+// instructions), which is how far the engines advance after executing it, and how much it adds to the count.
+typedef struct asm_instruction_s
+{
+    opcode_t opcode;
+    reg_t reg0;
+    reg_t reg1;
+    reg_t reg2;
+    int32_t imm32;
+    uint8_t length;
+} asm_instruction_t;
+
+// Whether 'opcode' is one of the branch instructions (see above)
+static inline int asm_is_branch(asm_opcode_t opcode)
+{
+    return opcode == JMP || opcode == JZ || opcode == JNZ || opcode == LOOP;
+}
+
+// Whether 'opcode' is one of the memory instructions (see above)
+static inline int asm_is_memory_access(asm_opcode_t opcode)
+{
+    return opcode == LOAD || opcode == STORE || opcode == MEMCPY || opcode == MEMSET || opcode == MEMCMP;
+}
+
+// Rotations, as implemented by the ROL / ROR instructions (shared by all the execution engines)
+#define _rotl(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+#define _rotr(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+typedef int (*instruction_definition_t)(vm_context_t * vm, const asm_instruction_t * instruction);
+extern instruction_definition_t asm_instruction_definitions[MAX_ASM_INTERNAL_OPCODE_VAL];
+extern asm_operands_format_t asm_instruction_operands[MAX_ASM_OPCODE_VAL];
+// The name of every opcode (for reports and dumps)
+extern const char * asm_opcode_names[MAX_ASM_INTERNAL_OPCODE_VAL];
 
 #endif /* __ASM_INSTRUCTIONS_H */
@@ -0,0 +1,31 @@
+#pragma once
+#ifndef __ASM_JIT_H
+#define __ASM_JIT_H
+
+#include "asm_program.h"
+
+// A decoded program translated into native (x86-64) machine code.
+typedef struct asm_jit_code_s
+{
+    uint8_t * code;
+    size_t size;
+    size_t capacity;
+    size_t entry_offset;
+} asm_jit_code_t;
+
+// Translates 'program' into machine code. Returns E_NOT_IMPL_INSTR if the program can't be translated
+// (e.g. on a non x86-64 host), in which case it should be executed by the interpreter instead.
+int jit_compile(const asm_program_t * program, asm_jit_code_t * code_out);
+void jit_free(asm_jit_code_t * code);
+
+// Executes compiled code from a fresh context (in 'vm'). Behaves exactly like the interpreter.
+int jit_execute(vm_context_t * vm, const asm_jit_code_t * code, int * count_out);
+
+// Compiles and executes 'program', falling back to the interpreter if it can't be compiled.
+int execute_asm_program_jit(vm_context_t * vm, const asm_program_t * program, int * count_out);
+
+// Executes 'program' both with the interpreter and with the JIT, and compares the results, instruction counts,
+// final registers & stack and output of both. Returns E_JIT_MISMATCH if they differ (details go to stderr).
+int execute_asm_program_jit_differential(vm_context_t * vm, const asm_program_t * program, int * count_out);
+
+#endif /* __ASM_JIT_H */
@@ -0,0 +1,46 @@
+#pragma once
+#ifndef __ASM_LOCKSTEP_H
+#define __ASM_LOCKSTEP_H
+
+#include "asm_types.h"
+#include "asm_program.h"
+#include "asm_processor_state.h"
+#include "common.h"
+
+// Lockstep execution - a single decoded program is executed over many independent register files ("lanes") at
+// once. The lanes' registers are kept as structure-of-arrays (a row of lanes per register), so every ALU instruction
+// is executed over all the lanes with vector instructions. Lanes that finish (RET/RETNZ/RETZ, errors) are masked
+// out, while the others keep going. Lanes that branch to different instructions are executed separately until they
+// reach the same instruction again.
+// Each lane behaves exactly like executing the program from a fresh context (with its initial registers) - same
+// result, instruction count and output, except for INT32_MIN / -1, which ends the lane with E_DIV_OVERFLOW
+// (instead of killing the whole process with SIGFPE).
+
+// The number of lanes executed together. More lanes are executed a block of lanes at a time.
+#define ASM_LOCKSTEP_LANES (64)
+
+// The initial registers of a lane
+typedef struct asm_register_file_s
+{
+    reg_value_t registers[ASM_REGISTER_END - ASM_REGISTER_START];
+} asm_register_file_t;
+
+typedef struct asm_lane_result_s
+{
+    int ret;
+    int count;
+    // The registers when the lane finished
+    reg_value_t registers[ASM_REGISTER_END - ASM_REGISTER_START];
+    // The lane's output is not written anywhere, only its digest & size are kept (see asm_output.h)
+    uint64_t output_digest;
+    uint64_t output_size;
+} asm_lane_result_t;
+
+// Executes 'program' once for every one of the 'lanes' register files in 'initial_registers' (the rest of the
+// context - the stack - starts zeroed, as usual). The result of lane i is written to 'results[i]'.
+// (The decoded instructions are executed, not the optimized ones - fusion saves nothing when dispatching is shared
+// by all the lanes anyway). Returns 0 on success, otherwise - error.
+int execute_asm_program_lockstep(const asm_program_t * program, const asm_register_file_t * initial_registers,
+                                 size_t lanes, asm_lane_result_t * results);
+
+#endif /* __ASM_LOCKSTEP_H */
@@ -0,0 +1,98 @@
+#pragma once
+#ifndef __ASM_MEMO_H
+#define __ASM_MEMO_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "asm_types.h"
+#include "common.h"
+
+// Memoization of whole executions. A payload's execution depends on nothing but its bytes (and the instruction
+// budget, and the build - the stack size and the instruction set), so executing the same payload again always ends
+// with the same result, instructions count and output.
+// With memoization, execute_asm_file / execute_asm_memory look the payload up first, and a payload that was already
+// executed just has its output written again, instead of being executed.
+// The results are kept in memory (the least recently used are dropped past ASM_MEMO_SIZE bytes), and optionally in
+// a directory (a file per payload), so they survive the process.
+// Notes:
+//  - Only executions that start from a fresh context are memoized (not on contexts with a snapshot, or profiled).
+//  - A replayed execution doesn't leave its registers & stack behind in the context.
+//  - The payload includes the admin code, so the files of the on-disk store contain the flag (and so may the output).
+//  - Executions killed by a signal (e.g. dividing INT32_MIN by -1) are never memoized.
+
+// Whether execute_asm_file / execute_asm_memory memoize executions (can be chosen at build time, e.g. "make MEMO=1")
+#ifndef ASM_MEMOIZE
+#define ASM_MEMOIZE (0)
+#endif
+
+// The size limit of the in-memory store (in bytes). An execution whose output doesn't fit is never memoized.
+#ifndef ASM_MEMO_SIZE
+#define ASM_MEMO_SIZE (16 * 1024 * 1024)
+#endif
+
+// The directory of the on-disk store ("" - results are only kept in memory). It must exist.
+#ifndef ASM_MEMO_DIRECTORY
+#define ASM_MEMO_DIRECTORY ""
+#endif
+
+// The result of an execution
+typedef struct asm_memo_result_s
+{
+    int ret;
+    int count;
+    uint8_t * output;
+    size_t output_size;
+} asm_memo_result_t;
+
+typedef struct asm_memo_entry_s
+{
+    // The key - the payload, and the budget it was executed with
+    uint64_t hash;
+    uint8_t * bytes;
+    size_t size;
+    uint64_t budget;
+
+    asm_memo_result_t result;
+
+    size_t memory_size;
+    struct asm_memo_entry_s * bucket_next;
+    struct asm_memo_entry_s * lru_prev;
+    struct asm_memo_entry_s * lru_next;
+} asm_memo_entry_t;
+
+typedef struct asm_memo_s
+{
+    pthread_mutex_t lock;
+    size_t max_memory_size;
+    size_t memory_size;
+    // NULL - no on-disk store
+    const char * directory;
+    asm_memo_entry_t ** buckets;
+    size_t buckets_count;
+    size_t entries;
+    // Most recently used first
+    asm_memo_entry_t * lru_head;
+    asm_memo_entry_t * lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+} asm_memo_t;
+
+// 'directory' - the on-disk store (NULL - none). Returns 0 on success, otherwise - error.
+int memo_init(asm_memo_t * memo, size_t max_memory_size, const char * directory);
+void memo_free(asm_memo_t * memo);
+
+// The process-wide store (ASM_MEMO_SIZE bytes & ASM_MEMO_DIRECTORY, created on first use). Returns NULL if it
+// couldn't be created.
+asm_memo_t * memo_default(void);
+
+// Looks up the result of executing the 'size' bytes payload with 'budget'. If it's found, it's copied to
+// 'result_out' (which must be freed with memo_result_free).
+bool memo_lookup(asm_memo_t * memo, const uint8_t * bytes, size_t size, uint64_t budget,
+                 asm_memo_result_t * result_out);
+// Keeps the result of executing the payload (failing to keep it isn't an error - it's just executed again)
+void memo_store(asm_memo_t * memo, const uint8_t * bytes, size_t size, uint64_t budget,
+                const asm_memo_result_t * result);
+void memo_result_free(asm_memo_result_t * result);
+
+#endif /* __ASM_MEMO_H */
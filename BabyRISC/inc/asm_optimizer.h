@@ -0,0 +1,49 @@
+#pragma once
+#ifndef __ASM_OPTIMIZER_H
+#define __ASM_OPTIMIZER_H
+
+#include <stdio.h>
+#include "asm_program.h"
+
+// The optimizer - rewrites 'program->optimized' (after the fusion pass, see asm_fusion.h) so it does less work:
+//  - Constant propagation: the values of the registers are followed along every straight-line path (they're
+//    forgotten wherever paths join), and instructions whose result is known become LOADI.
+//  - Algebraic simplification: operands with known values become immediates, MULI by a power of two becomes SHL,
+//    MULI / ANDI by 0 become LOADI, consecutive shifts of a register by immediates are merged into one.
+//  - Dead-write elimination: writes that are overwritten before they're read (with nothing in between that can end
+//    the execution, which would leave them in the registers), and instructions that don't change anything, are
+//    removed.
+// Like the fused instructions, the instructions the optimizer removes or merges are folded into the 'length' of
+// the instruction that's executed instead, and stay in place for the branches into them - so the results, output,
+// faults and instruction count of the program stay exactly the same. Nothing that prints, touches the stack or can
+// fail is removed or moved.
+// ROL / ROR are only folded on known values - on negative values they don't rotate (the right shift copies the
+// sign bit), so consecutive rotations can't be merged.
+// The optimized instructions are only correct for executions that start from a fresh context: ZERO is known to be
+// 0 (unless the program itself has a POPCTX). Executions from a snapshot, whose ZERO may have been restored by a
+// POPCTX in the prelude, execute 'program->instructions' instead (see execute_asm_program).
+
+// Whether the programs are optimized before they're executed (can be chosen at build time)
+#ifndef ASM_ENABLE_OPTIMIZER
+#define ASM_ENABLE_OPTIMIZER 1
+#endif
+
+typedef struct asm_optimizer_stats_s
+{
+    // Instructions that became LOADI of their known result
+    size_t folded;
+    // Instructions replaced with a cheaper equivalent
+    size_t simplified;
+    // Shifts merged into the shift before them
+    size_t merged;
+    // Dead writes & instructions without effect that were removed
+    size_t removed;
+} asm_optimizer_stats_t;
+
+// Optimizes 'program' (after it's fused, and before it's verified - see asm_verifier.h). 'stats_out' (optional)
+// receives what was done. Returns 0 on success, otherwise - error.
+int program_optimize(asm_program_t * program, asm_optimizer_stats_t * stats_out);
+
+void optimizer_stats_print(FILE * fp, const asm_optimizer_stats_t * stats);
+
+#endif /* __ASM_OPTIMIZER_H */
@@ -0,0 +1,94 @@
+#pragma once
+#ifndef __ASM_OUTPUT_H
+#define __ASM_OUTPUT_H
+
+#include "asm_types.h"
+#include "common.h"
+
+// The output sink of the PRINT* instructions.
+// The output is collected in a buffer and written to 'fd' in big chunks, instead of a write per instruction.
+// The buffer is flushed when it's full, at the end of every execution (RET, errors, end of payload), at process exit,
+// and whenever the policy asks for it.
+
+#define ASM_OUTPUT_BUFFER_SIZE (4096)
+
+typedef enum asm_output_policy_e
+{
+    // Flush only when the buffer is full / at the end of the execution
+    ASM_OUTPUT_BUFFERED,
+    // Also flush at every PRINTNL (for interactive use - the output shows up a line at a time)
+    ASM_OUTPUT_LINE_BUFFERED,
+    // Flush after every PRINT* instruction (the behavior before the output was buffered)
+    ASM_OUTPUT_UNBUFFERED,
+
+    MAX_ASM_OUTPUT_POLICY_VAL
+} asm_output_policy_t;
+
+// The policy of the processor's output (can be chosen at build time)
+#ifndef ASM_OUTPUT_DEFAULT_POLICY
+#define ASM_OUTPUT_DEFAULT_POLICY ASM_OUTPUT_BUFFERED
+#endif
+
+// Output written to this fd is dropped (only its digest is kept)
+#define ASM_OUTPUT_DISCARD (-1)
+
+// A copy of everything an output writes out (see output_capture)
+typedef struct asm_output_capture_s
+{
+    uint8_t * bytes;
+    size_t size;
+    size_t capacity;
+    // Output beyond 'max_size' isn't kept ('overflowed' is set instead)
+    size_t max_size;
+    int overflowed;
+} asm_output_capture_t;
+
+typedef struct asm_output_s
+{
+    int fd;
+    asm_output_policy_t policy;
+    size_t size;
+    uint8_t buffer[ASM_OUTPUT_BUFFER_SIZE];
+    // FNV-1a hash & size of everything flushed since output_init (so outputs can be compared without keeping them)
+    uint64_t digest;
+    uint64_t total_size;
+    // How much of the next output to drop, because it was already written (see output_rewind)
+    uint64_t skip;
+    // Where the output is copied to as it's flushed (NULL - it isn't)
+    asm_output_capture_t * capture;
+} asm_output_t;
+
+void output_init(asm_output_t * output, int fd, asm_output_policy_t policy);
+
+// The PRINT* instructions: a single character, signed decimal ("%d"), hexadecimal ("%x") and a newline
+void output_char(asm_output_t * output, reg_value_t value);
+void output_dd(asm_output_t * output, reg_value_t value);
+void output_dx(asm_output_t * output, reg_value_t value);
+void output_nl(asm_output_t * output);
+
+// Writes raw bytes (output that was already produced somewhere else, e.g. captured from another context)
+void output_write(asm_output_t * output, const uint8_t * data, size_t size);
+
+// Writes everything buffered so far. Returns 0 on success, otherwise - error.
+int output_flush(asm_output_t * output);
+
+// How much was written to 'output' so far (flushed or not)
+static inline uint64_t output_position(const asm_output_t * output)
+{
+    return output->total_size + output->size;
+}
+
+// Drops everything written to 'output' since it was at 'position', for replaying what wrote it: the part that is
+// still buffered is discarded, and the part that was already flushed is dropped when it's written again.
+void output_rewind(asm_output_t * output, uint64_t position);
+
+// Copies everything written to 'output' from now on (once it's flushed) to 'capture', until output_capture is called
+// again with NULL. The capture must be freed with output_capture_free.
+void output_capture(asm_output_t * output, asm_output_capture_t * capture, size_t max_size);
+void output_capture_free(asm_output_capture_t * capture);
+
+// Makes sure 'output' is flushed when the process exits (or crashes on a signal, e.g. the SIGFPE of dividing
+// INT32_MIN by -1), so output buffered before that is not lost. Should be called once, for the main VM's output.
+void output_flush_at_exit(asm_output_t * output);
+
+#endif /* __ASM_OUTPUT_H */
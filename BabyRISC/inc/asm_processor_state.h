@@ -4,6 +4,7 @@
 #define __ASM_PROCESSOR_STATE_H
 
 #include "asm_types.h"
+#include "asm_output.h"
 #include "common.h"
 
 // Registers indices
@@ -22,12 +23,89 @@ typedef enum asm_register_e
     ASM_REGISTER_END
 } asm_register_t;
 
+// The size of the stack (in bytes), can be chosen at build time
+#ifndef ASM_STACK_SIZE
 #define ASM_STACK_SIZE (4096)
-extern uint8_t asm_stack[ASM_STACK_SIZE];
-extern reg_value_t registers[ASM_REGISTER_END - ASM_REGISTER_START];
+#endif
 
-void initialize_context(void);
-int read_reg(asm_register_t reg, reg_value_t * reg_out);
-int write_reg(asm_register_t reg, reg_value_t value);
+// Whether the stack is mapped between guard regions, which catch the accesses outside of it (see
+// asm_guarded_stack.h). Requires ASM_STACK_SIZE to be a whole number of pages.
+#ifndef ASM_GUARDED_STACK
+#define ASM_GUARDED_STACK 0
+#endif
+
+// The largest budget of instructions (the engines count the executed instructions in an int)
+#define ASM_MAX_INSTRUCTION_BUDGET INT32_MAX
+
+// How many instructions every execution may execute (0 - unlimited), can be chosen at build time
+#ifndef ASM_DEFAULT_INSTRUCTION_BUDGET
+#define ASM_DEFAULT_INSTRUCTION_BUDGET 0
+#endif
+#if ASM_DEFAULT_INSTRUCTION_BUDGET > ASM_MAX_INSTRUCTION_BUDGET
+#error "ASM_DEFAULT_INSTRUCTION_BUDGET is larger than ASM_MAX_INSTRUCTION_BUDGET"
+#endif
+
+// The state of a single processor (VM). Nothing is shared between contexts, so different programs can be executed
+// on different contexts at the same time (e.g. from different threads).
+// ('registers' must stay the first field - the JIT addresses the registers through the context pointer).
+typedef struct vm_context_s
+{
+    reg_value_t registers[ASM_REGISTER_END - ASM_REGISTER_START];
+#if ASM_GUARDED_STACK
+    // ASM_STACK_SIZE bytes, mapped by vm_init
+    uint8_t * stack;
+#else
+    uint8_t stack[ASM_STACK_SIZE];
+#endif
+    // The stack bytes the executions may have written since the context was last reset ([start, end), empty if
+    // start >= end). Everything outside of it is still as the executions start with it, so only it is reset.
+    uint32_t stack_dirty_start;
+    uint32_t stack_dirty_end;
+    // The state executions on this context start from (NULL - a fresh context, see asm_snapshot.h)
+    const struct asm_snapshot_s * snapshot;
+    // Where the PRINT* instructions write to (flushed at the end of every execution)
+    asm_output_t output;
+    // An execution that would go past this many instructions ends with E_OUT_OF_GAS instead (0 - unlimited).
+    // It's applied to the programs when they are decoded (see program_limit).
+    uint64_t instruction_budget;
+    // Statistics over all the executions on this context
+    uint64_t executions;
+    uint64_t instructions_executed;
+    // Where the executions on this context are profiled (NULL - not profiled, see asm_profile.h)
+    struct asm_profile_s * profile;
+} vm_context_t;
+
+// Initializes a new context, whose output is written to 'output_fd'. Returns 0 on success, otherwise - error.
+// Contexts are released with vm_free.
+int vm_init(vm_context_t * vm, int output_fd);
+void vm_free(vm_context_t * vm);
+
+// Resets the registers & stack (every execution starts from a fresh context, or from the context's snapshot).
+void initialize_context(vm_context_t * vm);
+
+// Registers are validated once, when the instructions are decoded (the instructions index the registers directly).
+// These return the error reading / writing 'reg' would cause (E_SUCCESS if it is allowed).
+int validate_read_reg(asm_register_t reg);
+int validate_write_reg(asm_register_t reg);
+
+// Whether the 'size' bytes at stack offset 'offset' are all inside the stack (used by the memory instructions,
+// which check their whole range once)
+static inline int stack_range_valid(reg_value_t offset, reg_value_t size)
+{
+    return offset >= 0 && size >= 0 && offset <= (reg_value_t)ASM_STACK_SIZE - size;
+}
+
+// Records that the 'size' bytes at stack offset 'offset' (inside the stack) were written
+static inline void stack_mark_dirty(vm_context_t * vm, reg_value_t offset, reg_value_t size)
+{
+    if ((uint32_t)offset < vm->stack_dirty_start)
+    {
+        vm->stack_dirty_start = (uint32_t)offset;
+    }
+    if ((uint32_t)(offset + size) > vm->stack_dirty_end)
+    {
+        vm->stack_dirty_end = (uint32_t)(offset + size);
+    }
+}
 
 #endif /* __ASM_PROCESSOR_STATE_H */
@@ -0,0 +1,91 @@
+#pragma once
+#ifndef __ASM_PROFILE_H
+#define __ASM_PROFILE_H
+
+#include <stdio.h>
+#include <time.h>
+#include "asm_types.h"
+#include "asm_instructions.h"
+#include "asm_program.h"
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// The execution profiler - counts how many times every opcode was executed and how many cycles its handler took,
+// and how many times the instruction at every payload offset was executed.
+// It is compiled in only with ASM_ENABLE_PROFILING (e.g. "make PROFILE=1"), and then a context profiles the
+// executions of the interpreter engine (the one that dispatches through the handlers table) if its 'profile' is set.
+// Without it, nothing is recorded and the hooks compile to nothing.
+#ifndef ASM_ENABLE_PROFILING
+#define ASM_ENABLE_PROFILING 0
+#endif
+
+// Where BabyRISC writes the profile of its run (as JSON)
+#ifndef ASM_PROFILE_JSON_PATH
+#define ASM_PROFILE_JSON_PATH "babyrisc_profile.json"
+#endif
+
+typedef struct asm_profile_s
+{
+    uint64_t executions;
+    uint64_t opcode_count[MAX_ASM_INTERNAL_OPCODE_VAL];
+    uint64_t opcode_cycles[MAX_ASM_INTERNAL_OPCODE_VAL];
+    // Indexed by payload offset (only offsets where instructions start are ever hit)
+    uint64_t * offset_hits;
+    size_t offset_hits_size;
+} asm_profile_t;
+
+void profile_init(asm_profile_t * profile);
+void profile_free(asm_profile_t * profile);
+
+// Makes room for the offsets of 'program' (called before every execution). Returns 0 on success, otherwise - error.
+int profile_prepare(asm_profile_t * profile, const asm_program_t * program);
+
+// Adds the counters of 'other' to 'profile'. Returns 0 on success, otherwise - error.
+int profile_merge(asm_profile_t * profile, const asm_profile_t * other);
+
+// Dumps the profile as a human-readable table / as JSON.
+void profile_print_table(FILE * fp, const asm_profile_t * profile);
+void profile_print_json(FILE * fp, const asm_profile_t * profile);
+
+// Cycles counter (the time stamp counter on x86, nanoseconds elsewhere)
+static inline uint64_t profile_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Records an execution of instruction 'index' of 'program' (which took 'cycles')
+static inline void profile_record(asm_profile_t * profile, const asm_program_t * program, size_t index,
+                                  asm_opcode_t opcode, uint64_t cycles)
+{
+    profile->opcode_count[opcode]++;
+    profile->opcode_cycles[opcode] += cycles;
+    profile->offset_hits[program->offsets[index]]++;
+}
+
+// The hooks around the dispatch of every instruction
+#if ASM_ENABLE_PROFILING
+#define PROFILE_DISPATCH_BEGIN(start) uint64_t start = profile_cycles()
+#define PROFILE_DISPATCH_END(profile, program, code, instruction, start)                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if ((profile) != NULL)                                                                                         \
+        {                                                                                                              \
+            profile_record((profile), (program), (size_t)((instruction) - (code)),                                     \
+                           (asm_opcode_t)(instruction)->opcode, profile_cycles() - (start));                           \
+        }                                                                                                              \
+    } while (0)
+#else
+#define PROFILE_DISPATCH_BEGIN(start)
+#define PROFILE_DISPATCH_END(profile, program, code, instruction, start)
+#endif
+
+#endif /* __ASM_PROFILE_H */
@@ -0,0 +1,112 @@
+#pragma once
+#ifndef __ASM_PROGRAM_H
+#define __ASM_PROGRAM_H
+
+#include "asm_types.h"
+#include "asm_instructions.h"
+#include "asm_span_parsing.h"
+#include "common.h"
+
+// A payload decoded into an array of fixed-size instructions.
+// The array always ends with a HALT instruction (which is not included in 'count'), so the execution
+// loop never has to check whether it ran out of instructions.
+// 'optimized' (if not NULL) is an equivalent version of 'instructions' produced by the optimization passes.
+// It has the same layout (instruction i of the payload is in index i), but an instruction there may stand for
+// several payload instructions - the ones it covers are skipped (they are still in place, for branches into them).
+// 'offsets' (only kept when profiling, see asm_profile.h) is the payload offset every instruction was decoded from.
+// 'runs' and 'budget' are set by program_limit (see below).
+// 'jit' (if not NULL) is the program's machine code, compiled ahead of time (not owned by the program - see
+// asm_program_cache.h). The JIT engine executes it instead of compiling the program again.
+// 'borrowed' tells whether 'instructions' points into memory the program doesn't own (e.g. a mapped container, see
+// asm_container.h) - it isn't freed with the program then.
+// 'stack_verified' tells that 'optimized' has stack instructions without bounds checks, which are only safe for
+// executions that start with SP at 0 (see asm_verifier.h). 'unchecked' (if not NULL) marks the PUSH / POP instructions
+// in 'instructions' the verifier proved safe the same way, for the engines that compile 'instructions' (the JIT).
+struct asm_jit_code_s;
+typedef struct asm_program_s
+{
+    asm_instruction_t * instructions;
+    asm_instruction_t * optimized;
+    uint32_t * offsets;
+    uint32_t * runs;
+    uint64_t budget;
+    const struct asm_jit_code_s * jit;
+    int borrowed;
+    int stack_verified;
+    uint8_t * unchecked;
+    size_t count;
+    size_t capacity;
+} asm_program_t;
+
+// Flags of 'borrowed'
+#define ASM_PROGRAM_BORROWED_INSTRUCTIONS (1 << 0)
+
+void program_init(asm_program_t * program);
+void program_free(asm_program_t * program);
+
+// The instructions the interpreter engines should execute (the optimized ones, if there are any)
+const asm_instruction_t * program_code(const asm_program_t * program);
+
+// Decodes all the instructions in 'bytes' (until the first decoding error / end of the buffer) into 'program'.
+// Decoding errors are not returned - they are reported by the HALT instruction when it is executed,
+// exactly where the original instruction would have failed. Returns 0 on success, otherwise - error.
+int program_decode_span(const uint8_t * bytes, size_t size, asm_program_t * program);
+
+// Decoding a payload an instruction at a time (for payloads that are still being received, see asm_stream.h):
+//  - program_decode_begin makes room for a payload of up to 'size' bytes. Returns 0 on success, otherwise - error.
+//  - program_decode_next decodes the instruction at the span's offset, and returns whether it was the HALT (decoding
+//    is over). The span must hold the whole instruction from there (program_instruction_size bytes, by its opcode),
+//    or end where the payload ends.
+//    The offsets of the instructions are kept ('offsets[count]' is where the next instruction starts).
+//  - The branches are left with their relative offsets, until program_resolve_branch replaces them with the index
+//    of their target (or with FAULT, like program_decode_span does). It needs the instructions up to the target
+//    (program_branch_target) decoded.
+int program_decode_begin(asm_program_t * program, size_t size);
+int program_decode_next(asm_program_t * program, asm_span_t * span);
+// The size of the encoded instruction that starts with 'opcode' (just the opcode, if it isn't a valid one)
+size_t program_instruction_size(opcode_t opcode);
+
+// Validates the registers of a decoded instruction (and the divisor of DIVI): an instruction that would fail because
+// of them is replaced with a FAULT / DIV_WFAULT / POP_WFAULT that fails with the same error.
+// Every instruction a program holds was validated (program_decode_next validates every instruction it decodes, and
+// containers are checked against it, see asm_container.h) - so all the engines access the registers operands
+// directly, and never divide by an immediate 0 (invalid registers only appear in the *FAULT instructions, which
+// don't use them).
+void program_validate_instruction(asm_instruction_t * instruction);
+int64_t program_branch_target(const asm_program_t * program, size_t index);
+void program_resolve_branch(asm_program_t * program, size_t index);
+
+// Limits every execution of 'program' to 'budget' instructions (0 - unlimited, at most ASM_MAX_INSTRUCTION_BUDGET -
+// larger budgets fail with E_IVLD_ARGS). The budget is charged a
+// straight-line run of instructions at a time (a run ends with a branch instruction, or with the HALT), so the
+// engines only check it at branches:
+//  - The first run is charged by ending the program (in all its versions) at the instruction that would exceed the
+//    budget - an execution that doesn't get past it ends with E_OUT_OF_GAS after exactly 'budget' instructions.
+//  - If the program has branches, 'runs[i]' is set to the length of the run that starts at instruction i, and every
+//    executed branch checks that the run it continues to fits in the budget. If it doesn't, the execution ends with
+//    E_OUT_OF_GAS right after the branch (so it never executes more than 'budget' instructions).
+// Returns 0 on success, otherwise - error.
+int program_limit(asm_program_t * program, uint64_t budget);
+
+// The steps of program_prepare
+// Decode 'bytes' into the program (otherwise it already holds its instructions, e.g. mapped from a container)
+#define ASM_PREPARE_DECODE (1 << 0)
+// Fuse & optimize it (the passes the build enables)
+#define ASM_PREPARE_PASSES (1 << 1)
+// Verify it (if the build enables the verifier), and limit it to 'budget' instructions
+#define ASM_PREPARE_FINISH (1 << 2)
+#define ASM_PREPARE_ALL (ASM_PREPARE_DECODE | ASM_PREPARE_PASSES | ASM_PREPARE_FINISH)
+
+// Prepares 'program' to be executed, like execute_asm_file prepares the payloads it executes: the steps 'flags'
+// asks for, in the order decode, fuse, optimize, verify, limit. Returns 0 on success, otherwise - error (the program
+// must still be freed).
+int program_prepare(asm_program_t * program, const uint8_t * bytes, size_t size, uint64_t budget, int flags);
+
+// Whether the run that starts at instruction 'index' fits in the budget, after 'count' instructions were executed
+// (checked by the engines after every branch)
+static inline int program_run_fits(const asm_program_t * program, uint64_t count, size_t index)
+{
+    return program->runs == NULL || count + program->runs[index] <= program->budget;
+}
+
+#endif /* __ASM_PROGRAM_H */
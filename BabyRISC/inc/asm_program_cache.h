@@ -0,0 +1,92 @@
+#pragma once
+#ifndef __ASM_PROGRAM_CACHE_H
+#define __ASM_PROGRAM_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "asm_program.h"
+#include "asm_execution.h"
+#include "asm_jit.h"
+#include "common.h"
+
+// A cache of prepared programs (decoded, fused, limited to a budget and optionally JIT-compiled), keyed by the
+// payload bytes (XXH64, and then compared in full), so a payload that's executed again skips all of that.
+// The least recently used programs are evicted once the cache holds more than its size limit (pinned programs are
+// never evicted). Programs are handed out with a reference, so they can be executed (by any number of threads)
+// while they're evicted - they're freed only once they're released.
+
+// The size limit of the process-wide cache (in bytes, see program_cache_default), can be chosen at build time
+// (0 - payloads aren't cached)
+#ifndef ASM_PROGRAM_CACHE_SIZE
+#define ASM_PROGRAM_CACHE_SIZE (64 * 1024 * 1024)
+#endif
+
+typedef struct asm_cached_program_s
+{
+    // The key - the payload, and the budget its program is limited to
+    uint64_t hash;
+    uint8_t * bytes;
+    size_t size;
+    uint64_t budget;
+
+    asm_program_t program;
+    // The program's machine code (if it was asked for, and it could be compiled - see program->jit)
+    asm_jit_code_t jit;
+
+    size_t memory_size;
+    size_t references;
+    int pinned;
+    int evicted;
+    struct asm_cached_program_s * bucket_next;
+    struct asm_cached_program_s * lru_prev;
+    struct asm_cached_program_s * lru_next;
+} asm_cached_program_t;
+
+typedef struct asm_program_cache_stats_s
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t memory_size;
+} asm_program_cache_stats_t;
+
+typedef struct asm_program_cache_s
+{
+    pthread_mutex_t lock;
+    size_t max_memory_size;
+    asm_cached_program_t ** buckets;
+    size_t buckets_count;
+    // Most recently used first
+    asm_cached_program_t * lru_head;
+    asm_cached_program_t * lru_tail;
+    asm_program_cache_stats_t stats;
+} asm_program_cache_t;
+
+// Flags of program_cache_get
+// Also compile the program with the JIT (when it's prepared)
+#define ASM_CACHE_COMPILE (1 << 0)
+// Never evict the program
+#define ASM_CACHE_PIN (1 << 1)
+// The flags execute_asm_file / execute_asm_memory (and the batch runner) cache payloads with (the JIT engine gets
+// their machine code cached too)
+#define ASM_CACHE_DEFAULT_FLAGS ((ASM_DEFAULT_ENGINE == ASM_ENGINE_JIT) ? ASM_CACHE_COMPILE : 0)
+
+// Returns 0 on success, otherwise - error
+int program_cache_init(asm_program_cache_t * cache, size_t max_memory_size);
+// (All the programs must have been released)
+void program_cache_free(asm_program_cache_t * cache);
+
+// The process-wide cache (ASM_PROGRAM_CACHE_SIZE bytes, created on first use). Returns NULL if there isn't one.
+asm_program_cache_t * program_cache_default(void);
+
+// Returns the program of the 'size' bytes payload limited to 'budget' instructions (see program_limit), preparing it
+// (and caching it) if it isn't cached. The program must be released with program_cache_release.
+// Returns 0 on success, otherwise - error.
+int program_cache_get(asm_program_cache_t * cache, const uint8_t * bytes, size_t size, uint64_t budget, int flags,
+                      asm_cached_program_t ** entry_out);
+void program_cache_release(asm_program_cache_t * cache, asm_cached_program_t * entry);
+
+void program_cache_get_stats(asm_program_cache_t * cache, asm_program_cache_stats_t * stats_out);
+
+#endif /* __ASM_PROGRAM_CACHE_H */
@@ -0,0 +1,38 @@
+#pragma once
+#ifndef __ASM_SNAPSHOT_H
+#define __ASM_SNAPSHOT_H
+
+#include "asm_types.h"
+#include "asm_processor_state.h"
+
+// Snapshots of a context's state (the registers, including SP, and the stack), so many payloads can start from the
+// state a shared prelude left behind instead of executing the prelude again:
+//     execute_asm_program(&vm, &prelude, ...);
+//     snapshot_capture(&snapshot, &vm);
+//     vm_set_snapshot(&vm, &snapshot);
+//     execute_asm_program(&vm, &variant, ...); // Starts from the registers & stack the prelude ended with
+// Only the part of the stack that isn't zeroes is kept. Restoring a snapshot (at the start of every execution) only
+// touches the stack bytes the previous execution wrote - the engines that dispatch through handlers (the interpreter
+// and the threaded engine) track them, the native ones (the JIT and AOT code) mark the whole stack.
+typedef struct asm_snapshot_s
+{
+    reg_value_t registers[ASM_REGISTER_END - ASM_REGISTER_START];
+    // The stack bytes [stack_start, stack_end) (the rest of the stack is zeroes)
+    uint32_t stack_start;
+    uint32_t stack_end;
+    uint8_t * stack;
+} asm_snapshot_t;
+
+void snapshot_init(asm_snapshot_t * snapshot);
+void snapshot_free(asm_snapshot_t * snapshot);
+
+// Captures the state the last execution on 'vm' ended with (replacing what 'snapshot' held).
+// Returns 0 on success, otherwise - error. A snapshot that is already set on a context is set again after it's
+// recaptured (see vm_set_snapshot).
+int snapshot_capture(asm_snapshot_t * snapshot, const vm_context_t * vm);
+
+// Executions on 'vm' start from 'snapshot' from now on (NULL - from a fresh context). The snapshot isn't copied,
+// so it must outlive its use (it's never modified, so many contexts can share it).
+void vm_set_snapshot(vm_context_t * vm, const asm_snapshot_t * snapshot);
+
+#endif /* __ASM_SNAPSHOT_H */
@@ -0,0 +1,25 @@
+#pragma once
+#ifndef __ASM_SPAN_PARSING_H
+#define __ASM_SPAN_PARSING_H
+
+#include <stddef.h>
+#include "asm_processor_state.h"
+#include "asm_types.h"
+#include "asm_instructions.h"
+#include "common.h"
+
+// A read cursor over an in-memory encoded payload.
+// Parsing from a span never allocates and never copies more than the parsed value itself.
+typedef struct asm_span_s
+{
+    const uint8_t * data;
+    size_t size;
+    size_t offset;
+} asm_span_t;
+
+void span_init(asm_span_t * span, const uint8_t * data, size_t size);
+int span_parse_imm32(asm_span_t * span, int32_t * imm32_out);
+int span_parse_reg(asm_span_t * span, asm_register_t * reg_out);
+int span_parse_opcode(asm_span_t * span, asm_opcode_t * opcode_out);
+
+#endif /* __ASM_SPAN_PARSING_H */
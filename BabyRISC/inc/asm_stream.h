@@ -0,0 +1,60 @@
+#pragma once
+#ifndef __ASM_STREAM_H
+#define __ASM_STREAM_H
+
+#include <stddef.h>
+#include "asm_types.h"
+#include "asm_processor_state.h"
+#include "common.h"
+
+// Streaming execution - executing a payload while it's still being received (e.g. over a slow connection), instead
+// of receiving all of it first (compiled into BabyRISC with ASM_STREAM_INPUT, e.g. "make STREAM=1").
+// The payload is read from the fd only when the execution catches up with what was received so far, a block at a
+// time (so the transfer of the rest of the payload overlaps the execution of what already arrived). Once the
+// terminator is received, the suffix (the admin code) is appended to the payload, just like to a payload that was
+// read whole.
+// Streamed payloads are always interpreted, and execute exactly like the same payload decoded whole (the
+// instructions are decoded as they're reached, the branches are resolved once the code up to their target arrived).
+// The only difference is when the failure to receive a payload is found out: a payload whose terminator never
+// arrives is executed (up to what was received) before that's known.
+
+typedef enum asm_stream_state_e
+{
+    // The terminator wasn't received yet
+    ASM_STREAM_RECEIVING,
+    // The terminator was received, and the suffix appended (the payload is complete)
+    ASM_STREAM_COMPLETE,
+    // The input ended (or the payload got too long) before the terminator
+    ASM_STREAM_FAILED,
+} asm_stream_state_t;
+
+typedef struct asm_stream_s
+{
+    int fd;
+    // Room for 'max_size' bytes of the payload (with its terminator), and then the suffix
+    uint8_t * bytes;
+    size_t max_size;
+    const uint8_t * suffix;
+    size_t suffix_size;
+    // How much was read from the fd, and how much of it is known to be the payload (a terminator may be starting at
+    // the end of what was read)
+    size_t received;
+    size_t available;
+    // The size of the payload (without its terminator), once it's complete
+    size_t payload_size;
+    asm_stream_state_t state;
+} asm_stream_t;
+
+// 'buffer' must have room for 'max_size' + 'suffix_size' bytes
+void stream_init(asm_stream_t * stream, int fd, uint8_t * buffer, size_t max_size, const uint8_t * suffix,
+                 size_t suffix_size);
+
+// Receives the rest of the payload (if the execution didn't need all of it). Returns 0 once the payload is complete,
+// otherwise - error (E_FREAD if the input ended, or the payload got too long, before the terminator).
+int stream_finish(asm_stream_t * stream);
+
+// Executes the payload (user payload + suffix) from a fresh context, receiving it as the execution needs it.
+// Returns the execution's result, or E_FREAD if the payload failed to arrive before the execution ended.
+int execute_asm_stream(vm_context_t * vm, asm_stream_t * stream, int * count_out);
+
+#endif /* __ASM_STREAM_H */
@@ -0,0 +1,11 @@
+#pragma once
+#ifndef __ASM_THREADED_EXECUTION_H
+#define __ASM_THREADED_EXECUTION_H
+
+#include "asm_program.h"
+
+// Executes a decoded program (from a fresh context) using direct-threaded dispatch.
+// Behaves exactly like the table-driven interpreter - same results, output and instruction count.
+int execute_asm_program_threaded(vm_context_t * vm, const asm_program_t * program, int * count_out);
+
+#endif /* __ASM_THREADED_EXECUTION_H */
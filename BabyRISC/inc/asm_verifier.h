@@ -0,0 +1,45 @@
+#pragma once
+#ifndef __ASM_VERIFIER_H
+#define __ASM_VERIFIER_H
+
+#include <stdio.h>
+#include "asm_program.h"
+#include "asm_processor_state.h"
+
+// The verifier - a static analysis of a decoded program, which computes the range SP may be in at every instruction
+// (for executions that start with SP at 0, like on a fresh context):
+//  - PUSH / POP instructions that are proven to stay inside the stack are replaced (in 'program->optimized') with
+//    PUSH_NOCHECK / POP_NOCHECK, which skip the bounds checks. Executions that start with another SP (e.g. from a
+//    snapshot) execute the checked instructions instead (see 'stack_verified'). The original instructions are analyzed
+//    on their own for the JIT, which compiles them - its proofs are in 'program->unchecked'.
+//  - Stack instructions that always violate the stack (whenever they're reached) are reported.
+//  - Registers that may be read before the program writes them (so they still hold their initial value) are
+//    reported as well.
+// The analysis follows the branches, so loops that push / pop (or anything else that changes SP other than by a
+// constant) leave SP's range unknown from there on - and those instructions keep their checks.
+// Nothing about the program's results, output or instruction count changes.
+
+// Whether the programs are verified before they're executed (can be chosen at build time)
+#ifndef ASM_ENABLE_VERIFIER
+#define ASM_ENABLE_VERIFIER 1
+#endif
+
+typedef struct asm_verify_report_s
+{
+    // Stack instructions executed without checks
+    size_t unchecked;
+    // Stack instructions that always violate the stack, and the first of them
+    size_t violations;
+    size_t first_violation;
+    // The registers that may be read before they're written (a bit per register), and the first such read of each
+    uint32_t uninitialized_reads;
+    size_t first_uninitialized_read[ASM_REGISTER_END - ASM_REGISTER_START];
+} asm_verify_report_t;
+
+// Verifies 'program' (after it's fused, see program_fuse). 'report_out' (optional) receives the findings.
+// Returns 0 on success, otherwise - error.
+int program_verify(asm_program_t * program, asm_verify_report_t * report_out);
+
+void verify_report_print(FILE * fp, const asm_verify_report_t * report);
+
+#endif /* __ASM_VERIFIER_H */
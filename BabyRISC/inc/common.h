@@ -30,6 +30,16 @@ typedef enum error_code_e
     E_EOF,
     E_RETURN,
     E_ADMIN_CODE_ERR,
+    E_JIT_MISMATCH,
+    E_DIV_OVERFLOW,
+    E_OUT_OF_GAS,
+    E_INVLD_BRANCH_TARGET,
+    E_ENGINE_MISMATCH,
+    // Not errors - returned by the branch instructions to the interpreter loop (like E_RETURN, never reported)
+    E_BRANCH_TAKEN,
+    E_BRANCH_NOT_TAKEN,
+    // Not an error - a guarded execution touched the guard region of its stack, and is replayed (asm_guarded_stack.h)
+    E_STACK_GUARD_HIT,
 } error_code_t;
 
 #endif /* __COMMON_H */
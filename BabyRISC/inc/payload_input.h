@@ -0,0 +1,22 @@
+#pragma once
+#ifndef __PAYLOAD_INPUT_H
+#define __PAYLOAD_INPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// User payloads end with 4 0xff bytes (0xffffffff), which aren't part of the payload
+#define TERMINATE_MARKER_UINT32 (0xfffffffful)
+
+// Returns the offset of the first terminator in 'bytes' that starts at or after 'start' (and ends before 'size'),
+// or 'size' if there isn't one. Uses SSE2 (when available) to check 16 offsets at a time.
+size_t payload_find_terminator(const uint8_t * bytes, size_t start, size_t size);
+
+// Reads a payload from 'fd' into 'payload', up to its terminator. The payload (with its terminator) must fit in
+// 'max_size' bytes. Returns 0 on success, otherwise - error (E_FREAD if the input ended, or didn't fit, before the
+// terminator).
+// The input is read in blocks (as much as is available, up to 'max_size'), so what follows the terminator in the
+// same block is consumed too.
+int payload_read_fd(int fd, uint8_t * payload, size_t max_size, size_t * payload_size_out);
+
+#endif /* __PAYLOAD_INPUT_H */
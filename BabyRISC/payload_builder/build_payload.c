@@ -1,9 +1,15 @@
 /* This project is an example project that can be used in order to generate payloads for BabyRISC.
  * Just edit the opcode insertion and run the output binary.
  * The payload will be written to a file named "payload.bin".
+ * It's also packed into a container (see asm_container.h), "payload.brx", which BabyRISC's execute_asm_file executes
+ * without decoding it.
+ * The verifier's findings about the payload (see asm_verifier.h) are printed before it's written.
  */
 #include <stdio.h>
-#include "asm_file_generation.h"
+#include <stdlib.h>
+#include "asm_container.h"
+#include "asm_emitter.h"
+#include "asm_verifier.h"
 #include "common.h"
 
 #define TERMINATE_MARKER_UINT32 (0xfffffffful)
@@ -11,39 +17,79 @@
 int main(void)
 {
     int ret = E_SUCCESS;
-    FILE * payload_fp = NULL;
+    FILE * output_fp = NULL;
+    asm_emitter_t emitter;
+    asm_program_t program;
+    asm_verify_report_t report;
+    program_init(&program);
 
-    payload_fp = fopen("payload.bin", "w");
-    if (payload_fp == NULL)
+    // The payload is built in memory, and then written both raw and as a container
+    emitter_init(&emitter);
+
+    // Fill some registers and return
+    // (The emitter keeps the first error, so it's only checked once we finish).
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R0, ASM_REGISTER_ZERO, 0x0);
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R1, ASM_REGISTER_ZERO, 0x11);
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R2, ASM_REGISTER_ZERO, 0x22);
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R3, ASM_REGISTER_ZERO, 0x33);
+    emit_opcode(&emitter, RET);
+
+    // Terminate the payload so BabyRISC will know where to stop reading
+    uint32_t terminate_marker = TERMINATE_MARKER_UINT32;
+    emit_raw(&emitter, &terminate_marker, sizeof(terminate_marker));
+
+    ret = emitter_error(&emitter);
+    if (ret != E_SUCCESS)
     {
-        ret = E_FOPEN;
         goto cleanup;
     }
+    const uint8_t * payload = emitter.buffer;
+    size_t payload_size = emitter.size;
 
-    // Fill some registers and return
-    // (Because E_SUCCESS == 0, we just OR all the return values, to check for error when we finish).
-    ret |= file_write_opcode_imm32(payload_fp, ADDI, ASM_REGISTER_R0, ASM_REGISTER_ZERO, 0x0);
-    ret |= file_write_opcode_imm32(payload_fp, ADDI, ASM_REGISTER_R1, ASM_REGISTER_ZERO, 0x11);
-    ret |= file_write_opcode_imm32(payload_fp, ADDI, ASM_REGISTER_R2, ASM_REGISTER_ZERO, 0x22);
-    ret |= file_write_opcode_imm32(payload_fp, ADDI, ASM_REGISTER_R3, ASM_REGISTER_ZERO, 0x33);
-    ret |= file_write_opcode(payload_fp, RET);
-
+    // Stack instructions that always fail, or registers that are used before they're set, are most likely mistakes
+    ret = program_decode_span(payload, payload_size, &program);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    ret = program_verify(&program, &report);
     if (ret != E_SUCCESS)
     {
-        ret = E_FWRITE;
         goto cleanup;
     }
+    verify_report_print(stdout, &report);
 
-    // Terminate the payload so BabyRISC will know where to stop reading
-    uint32_t terminate_marker = TERMINATE_MARKER_UINT32;
-    if (fwrite(&terminate_marker, sizeof(terminate_marker), 1, payload_fp) != 1)
+    output_fp = fopen("payload.bin", "w");
+    if (output_fp == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+    if (fwrite(payload, 1, payload_size, output_fp) != payload_size)
     {
         ret = E_FWRITE;
         goto cleanup;
     }
+    fclose(output_fp);
+    output_fp = NULL;
+    printf("Written %zu bytes to 'payload.bin'.\n", payload_size);
+
+    // The container holds the same payload (the terminator included, just like execute_asm_file would execute it)
+    output_fp = fopen("payload.brx", "w");
+    if (output_fp == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+    ret = container_write(output_fp, payload, payload_size, 0,
+                          ASM_BRX_DECODED | ASM_BRX_FUSED | ASM_BRX_OPTIMIZED);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
 
     // Calculate amount of bytes written
-    long offset = ftell(payload_fp);
+    long offset = ftell(output_fp);
     if (offset == -1)
     {
         ret = E_FTELL;
@@ -51,12 +97,14 @@ int main(void)
     }
 
     // Success
-    printf("Written %ld bytes to 'payload.bin'.\n", offset);
+    printf("Written %ld bytes to 'payload.brx'.\n", offset);
 
 cleanup:
-    if (payload_fp != NULL)
+    if (output_fp != NULL)
     {
-        fclose(payload_fp);
+        fclose(output_fp);
     }
+    emitter_free(&emitter);
+    program_free(&program);
     return ret;
 }
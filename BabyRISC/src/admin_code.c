@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include "admin_code.h"
+#include "asm_emitter.h"
+#include "common.h"
+
+#define MAX_FLAG_SIZE (256)
+
+// Reads the flag from 'flag_path' into the buffer.
+// The flag is written null-terminated (and the rest of the buffer is padded with nulls).
+// Return 0 on success, otherwise - error.
+static int read_flag(const char * flag_path, char * buffer, size_t buffer_len)
+{
+    int ret = E_SUCCESS;
+    FILE * flag_fp = NULL;
+
+    memset(buffer, 0, buffer_len);
+
+    flag_fp = fopen(flag_path, "r");
+    if (flag_fp == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    // Read entire flag from file
+    size_t bytes_read = fread(buffer, 1, buffer_len - 1, flag_fp);
+    if ((bytes_read == 0) || !feof(flag_fp))
+    {
+        // Read error
+        ret = E_FREAD;
+        goto cleanup;
+    }
+
+    // Success
+    ret = E_SUCCESS;
+
+cleanup:
+    if (flag_fp != NULL)
+    {
+        fclose(flag_fp);
+    }
+    return ret;
+}
+
+int generate_admin_code(const char * flag_path, uint8_t * payload, size_t max_size, size_t * payload_size_out)
+{
+    int ret = E_SUCCESS;
+    char flag_string[MAX_FLAG_SIZE] = { 0 };
+    asm_emitter_t emitter;
+
+    // Write admin shellcode to payload buffer
+    // (The emitter keeps the first error, so it's only checked once we finish).
+    emitter_init_buffer(&emitter, payload, max_size);
+
+    ret = read_flag(flag_path, flag_string, sizeof(flag_string));
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to read flag.\n");
+        goto cleanup;
+    }
+
+    // Pad out with newlines
+    for (size_t i = 0; i < 8; ++i)
+    {
+        emit_opcode(&emitter, PRINTNL);
+    }
+
+    // If the user sets R0 so (R0 * 42) == 1 (impossible!), she deserves to read the flag
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R1, ASM_REGISTER_ZERO, 42);
+    emit_opcode3(&emitter, MUL, ASM_REGISTER_R2, ASM_REGISTER_R0, ASM_REGISTER_R1);
+    emit_opcode_imm32(&emitter, SUBI, ASM_REGISTER_R2, ASM_REGISTER_R2, 1);
+    emit_opcode1(&emitter, RETNZ, ASM_REGISTER_R2);
+
+    // Print each 4-bytes of the flag as 4-characters
+    // (We might print some trailing null-characters if the flag length is not divisible by 4)
+    int32_t * flag_start = (int32_t *)flag_string;
+    int32_t * flag_end = (int32_t *)((char *)flag_string + strlen(flag_string));
+    for (int32_t * p = flag_start; p <= flag_end; ++p)
+    {
+        int32_t dword = *p;
+
+        emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R1, ASM_REGISTER_ZERO, dword);
+        for (size_t j = 0; j < 4; j++)
+        {
+            emit_opcode1(&emitter, PRINTC, ASM_REGISTER_R1);
+            emit_opcode_imm32(&emitter, ROR, ASM_REGISTER_R1, ASM_REGISTER_R1, 8);
+        }
+    }
+
+    emit_opcode(&emitter, PRINTNL);
+    emit_opcode(&emitter, RET);
+
+    // Check if some error (other than E_SUCCESS) was recieved during the admin code generation
+    if (emitter_error(&emitter) != E_SUCCESS)
+    {
+        ret = E_ADMIN_CODE_ERR;
+        goto cleanup;
+    }
+
+    // Success
+    *payload_size_out = emitter.size;
+
+cleanup:
+    emitter_free(&emitter);
+    return ret;
+}
@@ -0,0 +1,111 @@
+#include <dlfcn.h>
+#include <string.h>
+#include "asm_aot.h"
+#include "asm_processor_state.h"
+#include "common.h"
+
+static void aot_print_char(void * context, reg_value_t value)
+{
+    output_char(&((vm_context_t *)context)->output, value);
+}
+
+static void aot_print_dd(void * context, reg_value_t value)
+{
+    output_dd(&((vm_context_t *)context)->output, value);
+}
+
+static void aot_print_dx(void * context, reg_value_t value)
+{
+    output_dx(&((vm_context_t *)context)->output, value);
+}
+
+static void aot_print_nl(void * context)
+{
+    output_nl(&((vm_context_t *)context)->output);
+}
+
+int aot_load(const char * path, asm_aot_module_t * module_out)
+{
+    int ret = E_SUCCESS;
+    asm_aot_module_t module = { 0 };
+    const uint32_t * abi_version = NULL;
+
+    module.handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (module.handle == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    // Refuse payloads that were translated for another version of the runtime interface
+    abi_version = dlsym(module.handle, ASM_AOT_ABI_SYMBOL);
+    if (abi_version == NULL || *abi_version != ASM_AOT_ABI_VERSION)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    *(void **)&module.entry = dlsym(module.handle, ASM_AOT_ENTRY_SYMBOL);
+    if (module.entry == NULL)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    *module_out = module;
+    module.handle = NULL;
+
+cleanup:
+    aot_unload(&module);
+    return ret;
+}
+
+void aot_unload(asm_aot_module_t * module)
+{
+    if (module->handle != NULL)
+    {
+        dlclose(module->handle);
+    }
+    memset(module, 0, sizeof(*module));
+}
+
+int aot_execute(vm_context_t * vm, const asm_aot_module_t * module, int * count_out)
+{
+    int ret = E_SUCCESS;
+    int count = 0;
+    asm_aot_runtime_t runtime = {
+        .registers = vm->registers,
+        .stack = vm->stack,
+        .context = vm,
+        .print_char = aot_print_char,
+        .print_dd = aot_print_dd,
+        .print_dx = aot_print_dx,
+        .print_nl = aot_print_nl,
+    };
+
+    if (vm->instruction_budget != 0)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    // Init context (the translated code doesn't record which stack bytes it writes, so they all may be)
+    initialize_context(vm);
+    stack_mark_dirty(vm, 0, ASM_STACK_SIZE);
+
+    ret = module->entry(&runtime, &count);
+    output_flush(&vm->output);
+
+    // If we exited because of a RET/RETNZ instruction, we want to report success
+    if (ret == E_RETURN)
+    {
+        ret = E_SUCCESS;
+    }
+
+cleanup:
+    if (count_out)
+    {
+        *count_out = count;
+    }
+    return ret;
+}
@@ -0,0 +1,444 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "asm_container.h"
+#include "asm_execution.h"
+#include "asm_fusion.h"
+#include "asm_hash.h"
+#include "asm_instructions.h"
+#include "asm_optimizer.h"
+#include "asm_profile.h"
+
+// The passes the programs go through in this build (see ASM_BRX_OPTIMIZED)
+#define CONTAINER_BUILD_PASSES                                                                                         \
+    ((ASM_ENABLE_FUSION ? ASM_BRX_FUSED : 0) | (ASM_ENABLE_OPTIMIZER ? ASM_BRX_OPTIMIZED : 0))
+
+int container_open(asm_container_t * container, int fd, off_t offset)
+{
+    int ret = E_SUCCESS;
+    asm_brx_header_t header;
+    struct stat st;
+    size_t size = 0;
+
+    memset(container, 0, sizeof(*container));
+
+    // (Most files aren't containers, so the header is checked before anything is mapped)
+    if (pread(fd, &header, sizeof(header), offset) != (ssize_t)sizeof(header) || header.magic != ASM_BRX_MAGIC ||
+        fstat(fd, &st) != 0)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+    size = (size_t)(st.st_size - offset);
+    if (header.header_size < sizeof(header) || header.code_offset < header.header_size ||
+        header.code_offset > size || header.code_size > size - header.code_offset || header.entry > header.code_size)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    // The mapping is private & writable, so the instructions can be changed in place (see container_load_program)
+    // without copying the pages that aren't changed
+    container->mapping_size = (size_t)st.st_size;
+    container->mapping = mmap(NULL, container->mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (container->mapping == MAP_FAILED)
+    {
+        container->mapping = NULL;
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    container->header = (const asm_brx_header_t *)&container->mapping[offset];
+    container->code = &container->mapping[offset + (off_t)header.code_offset];
+
+cleanup:
+    if (ret != E_SUCCESS)
+    {
+        container_close(container);
+    }
+    return ret;
+}
+
+void container_close(asm_container_t * container)
+{
+    if (container->mapping != NULL)
+    {
+        munmap(container->mapping, container->mapping_size);
+    }
+    memset(container, 0, sizeof(*container));
+}
+
+// Returns the decoded section at 'offset' (with 'count' + 1 instructions), or NULL if it doesn't fit in the container
+static asm_instruction_t * container_section(const asm_container_t * container, uint64_t offset, uint64_t count)
+{
+    const uint8_t * start = (const uint8_t *)container->header;
+    size_t size = container->mapping_size - (size_t)(start - container->mapping);
+
+    if (offset == 0 || offset > size || ((uintptr_t)start + offset) % ASM_BRX_ALIGNMENT != 0 ||
+        count >= (size - offset) / sizeof(asm_instruction_t))
+    {
+        return NULL;
+    }
+    return (asm_instruction_t *)&start[offset];
+}
+
+// Whether 'instruction' (HALT / FAULT / DIV_WFAULT / POP_WFAULT) fails with an actual error - the engines' loops
+// treat the codes that aren't errors as the instruction succeeding or branching, and would continue past it.
+static bool container_check_error(const asm_instruction_t * instruction)
+{
+    switch (instruction->imm32)
+    {
+    case E_SUCCESS:
+    case E_BRANCH_TAKEN:
+    case E_BRANCH_NOT_TAKEN:
+    case E_STACK_GUARD_HIT:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Whether the decoded 'instructions' are well-formed - valid opcodes & registers, lengths and branch targets inside
+// the program, the errors the failing instructions return, and the terminating HALT.
+// The unchecked stack instructions are never written (they're only safe where the verifier proved so).
+static bool container_check_instructions(const asm_instruction_t * instructions, size_t count)
+{
+    for (size_t i = 0; i <= count; ++i)
+    {
+        const asm_instruction_t * instruction = &instructions[i];
+        if (instruction->opcode >= MAX_ASM_INTERNAL_OPCODE_VAL || instruction->opcode == PUSH_NOCHECK ||
+            instruction->opcode == POP_NOCHECK || instruction->reg0 >= ASM_REGISTER_END ||
+            instruction->reg1 >= ASM_REGISTER_END || instruction->reg2 >= ASM_REGISTER_END ||
+            instruction->length == 0 || (i < count && instruction->length > count - i))
+        {
+            return false;
+        }
+        if (asm_is_branch((asm_opcode_t)instruction->opcode) &&
+            (instruction->imm32 < 0 || (size_t)instruction->imm32 > count))
+        {
+            return false;
+        }
+        if ((instruction->opcode == HALT || instruction->opcode == FAULT || instruction->opcode == DIV_WFAULT ||
+             instruction->opcode == POP_WFAULT) &&
+            !container_check_error(instruction))
+        {
+            return false;
+        }
+    }
+    return instructions[count].opcode == HALT && instructions[count].length == 1;
+}
+
+// Whether 'instruction' is one the decoder could have made (see program_decode_next) - an instruction of the payload
+// that program_validate_instruction leaves as it is, or what it replaces one with (the engines rely on that).
+static bool container_check_decoded(const asm_instruction_t * instruction)
+{
+    asm_instruction_t validated = *instruction;
+
+    if (instruction->length != 1)
+    {
+        return false;
+    }
+    switch (instruction->opcode)
+    {
+    case FAULT:
+    case DIV_WFAULT:
+    case POP_WFAULT:
+        return true;
+    default:
+        if (instruction->opcode >= MAX_ASM_OPCODE_VAL)
+        {
+            return false;
+        }
+        program_validate_instruction(&validated);
+        return validated.opcode == instruction->opcode;
+    }
+}
+
+static bool container_same_instruction(const asm_instruction_t * instruction, const asm_instruction_t * other)
+{
+    return instruction->opcode == other->opcode && instruction->reg0 == other->reg0 &&
+           instruction->reg1 == other->reg1 && instruction->reg2 == other->reg2 &&
+           instruction->imm32 == other->imm32 && instruction->length == other->length;
+}
+
+// Sets up the program's instructions right from the instructions section in the mapping. Returns false if it can't be
+// used.
+static bool container_map_program(const asm_container_t * container, asm_program_t * program)
+{
+    const asm_brx_header_t * header = container->header;
+    asm_instruction_t * instructions = NULL;
+
+    // (The profiler needs the payload offsets of the instructions, which only decoding keeps)
+    if (ASM_ENABLE_PROFILING || header->version != ASM_BRX_VERSION || !(header->flags & ASM_BRX_DECODED) ||
+        header->instruction_size != sizeof(asm_instruction_t) || header->instructions_count >= UINT32_MAX)
+    {
+        return false;
+    }
+
+    size_t count = (size_t)header->instructions_count;
+    instructions = container_section(container, header->instructions_offset, count);
+    if (instructions == NULL || !container_check_instructions(instructions, count))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!container_check_decoded(&instructions[i]))
+        {
+            return false;
+        }
+    }
+
+    program->instructions = instructions;
+    program->borrowed = ASM_PROGRAM_BORROWED_INSTRUCTIONS;
+    program->count = count;
+    program->capacity = count + 1;
+    return true;
+}
+
+// Whether the container's optimized section (if it has one of the passes this build applies) is exactly what the
+// passes made of its instructions section, in 'program'
+static bool container_check_optimized(const asm_container_t * container, const asm_program_t * program)
+{
+    const asm_brx_header_t * header = container->header;
+    uint16_t passes = header->flags & (ASM_BRX_FUSED | ASM_BRX_OPTIMIZED);
+    const asm_instruction_t * optimized = NULL;
+
+    if (CONTAINER_BUILD_PASSES == 0 || passes != CONTAINER_BUILD_PASSES || header->optimized_offset == 0)
+    {
+        return true;
+    }
+    optimized = container_section(container, header->optimized_offset, program->count);
+    if (optimized == NULL || program->optimized == NULL)
+    {
+        return false;
+    }
+    for (size_t i = 0; i <= program->count; ++i)
+    {
+        if (!container_same_instruction(&optimized[i], &program->optimized[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int container_load_program(const asm_container_t * container, uint64_t budget, asm_program_t * program_out)
+{
+    int ret = E_SUCCESS;
+    const asm_brx_header_t * header = container->header;
+    const uint8_t * code = &container->code[header->entry];
+    size_t code_size = (size_t)(header->code_size - header->entry);
+    bool mapped = false;
+
+    program_init(program_out);
+    mapped = container_map_program(container, program_out);
+
+    // The optimized section is never executed as it is - the passes are applied to the instructions section here,
+    // and a container whose optimized section says otherwise isn't trusted at all (the code section is decoded, like
+    // it is when the decoded sections can't be used)
+    ret = program_prepare(program_out, code, code_size, budget, mapped ? ASM_PREPARE_PASSES : ASM_PREPARE_ALL);
+    if (ret == E_SUCCESS && mapped)
+    {
+        if (!container_check_optimized(container, program_out))
+        {
+            program_free(program_out);
+            ret = program_prepare(program_out, code, code_size, budget, ASM_PREPARE_ALL);
+        }
+        else
+        {
+            ret = program_prepare(program_out, code, code_size, budget, ASM_PREPARE_FINISH);
+        }
+    }
+
+    if (ret != E_SUCCESS)
+    {
+        program_free(program_out);
+    }
+    return ret;
+}
+
+// Whether 'instruction' sets SP other than by pushing / popping (reg0 is the only register that's written)
+static bool container_sets_sp(const asm_instruction_t * instruction)
+{
+    switch (instruction->opcode)
+    {
+    case PUSH:
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+    case RETNZ:
+    case RETZ:
+    case JZ:
+    case JNZ:
+    case STORE:
+    case MEMCPY:
+    case MEMSET:
+        // (reg0 is only read)
+        return false;
+    case POPCTX:
+        return true;
+    default:
+        return instruction->reg0 == ASM_REGISTER_SP;
+    }
+}
+
+// See 'max_stack_depth'. Without backward branches every instruction is executed at most once, so all the pushes
+// together are a bound.
+static uint32_t container_max_stack_depth(const asm_program_t * program)
+{
+    uint64_t depth = 0;
+
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        const asm_instruction_t * instruction = &program->instructions[i];
+        if (container_sets_sp(instruction) ||
+            (asm_is_branch((asm_opcode_t)instruction->opcode) && (size_t)instruction->imm32 <= i))
+        {
+            return ASM_BRX_UNKNOWN_STACK_DEPTH;
+        }
+        if (instruction->opcode == PUSH)
+        {
+            depth += sizeof(reg_value_t);
+        }
+        else if (instruction->opcode == PUSHCTX)
+        {
+            depth += (ASM_REGISTER_END - ASM_REGISTER_START) * sizeof(reg_value_t);
+        }
+    }
+    return (depth < ASM_BRX_UNKNOWN_STACK_DEPTH) ? (uint32_t)depth : ASM_BRX_UNKNOWN_STACK_DEPTH;
+}
+
+// Writes zeros until 'fp' is at 'offset'
+static int container_pad(FILE * fp, uint64_t position, uint64_t offset)
+{
+    for (; position < offset; ++position)
+    {
+        if (fputc(0, fp) == EOF)
+        {
+            return E_FWRITE;
+        }
+    }
+    return E_SUCCESS;
+}
+
+// Writes a decoded section (field by field, so the padding inside the instructions is always zero)
+static int container_write_section(FILE * fp, const asm_instruction_t * instructions, size_t count)
+{
+    for (size_t i = 0; i <= count; ++i)
+    {
+        asm_instruction_t instruction;
+        memset(&instruction, 0, sizeof(instruction));
+        instruction.opcode = instructions[i].opcode;
+        instruction.reg0 = instructions[i].reg0;
+        instruction.reg1 = instructions[i].reg1;
+        instruction.reg2 = instructions[i].reg2;
+        instruction.imm32 = instructions[i].imm32;
+        instruction.length = instructions[i].length;
+        if (fwrite(&instruction, sizeof(instruction), 1, fp) != 1)
+        {
+            return E_FWRITE;
+        }
+    }
+    return E_SUCCESS;
+}
+
+static uint64_t container_align(uint64_t offset)
+{
+    return (offset + ASM_BRX_ALIGNMENT - 1) / ASM_BRX_ALIGNMENT * ASM_BRX_ALIGNMENT;
+}
+
+int container_write(FILE * fp, const uint8_t * code, size_t code_size, uint32_t entry, int flags)
+{
+    int ret = E_SUCCESS;
+    asm_brx_header_t header;
+    asm_program_t program;
+    uint64_t section_size = 0;
+    program_init(&program);
+    memset(&header, 0, sizeof(header));
+
+    if (entry > code_size)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    header.magic = ASM_BRX_MAGIC;
+    header.version = ASM_BRX_VERSION;
+    header.flags = (uint16_t)flags;
+    header.header_size = sizeof(header);
+    header.entry = entry;
+    header.code_offset = sizeof(header);
+    header.code_size = code_size;
+    header.hash = hash_xxh64(code, code_size, 0);
+    header.instruction_size = sizeof(asm_instruction_t);
+
+    // (The metadata needs the decoded instructions even when they're not written)
+    ret = program_decode_span(&code[entry], code_size - entry, &program);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    if (flags & ASM_BRX_FUSED)
+    {
+        ret = program_fuse(&program, NULL);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+    if (flags & ASM_BRX_OPTIMIZED)
+    {
+        ret = program_optimize(&program, NULL);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+    header.instructions_count = program.count;
+    header.max_stack_depth = container_max_stack_depth(&program);
+
+    section_size = (program.count + 1) * sizeof(asm_instruction_t);
+    if (flags & ASM_BRX_DECODED)
+    {
+        header.instructions_offset = container_align(header.code_offset + code_size);
+        if (program.optimized != NULL)
+        {
+            header.optimized_offset = container_align(header.instructions_offset + section_size);
+        }
+    }
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(code, 1, code_size, fp) != code_size)
+    {
+        ret = E_FWRITE;
+        goto cleanup;
+    }
+    if (header.instructions_offset != 0)
+    {
+        ret = container_pad(fp, header.code_offset + code_size, header.instructions_offset);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+        ret = container_write_section(fp, program.instructions, program.count);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+    if (header.optimized_offset != 0)
+    {
+        ret = container_pad(fp, header.instructions_offset + section_size, header.optimized_offset);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+        ret = container_write_section(fp, program.optimized, program.count);
+    }
+
+cleanup:
+    program_free(&program);
+    return ret;
+}
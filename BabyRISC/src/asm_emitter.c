@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include "asm_emitter.h"
+
+#define EMITTER_INITIAL_CAPACITY (4096)
+
+void emitter_init(asm_emitter_t * emitter)
+{
+    memset(emitter, 0, sizeof(*emitter));
+}
+
+void emitter_init_buffer(asm_emitter_t * emitter, uint8_t * buffer, size_t capacity)
+{
+    memset(emitter, 0, sizeof(*emitter));
+    emitter->buffer = buffer;
+    emitter->capacity = capacity;
+    emitter->borrowed = 1;
+}
+
+void emitter_free(asm_emitter_t * emitter)
+{
+    if (!emitter->borrowed)
+    {
+        free(emitter->buffer);
+    }
+    memset(emitter, 0, sizeof(*emitter));
+}
+
+void emitter_reset(asm_emitter_t * emitter)
+{
+    emitter->size = 0;
+    emitter->error = E_SUCCESS;
+}
+
+int emitter_error(const asm_emitter_t * emitter)
+{
+    return emitter->error;
+}
+
+// Makes room for 'size' more bytes. Returns where they go, or NULL if they can't be emitted (the error is latched).
+static uint8_t * emitter_reserve(asm_emitter_t * emitter, size_t size)
+{
+    if (emitter->error != E_SUCCESS)
+    {
+        return NULL;
+    }
+
+    if (size > emitter->capacity - emitter->size)
+    {
+        size_t capacity = (emitter->capacity != 0) ? emitter->capacity : EMITTER_INITIAL_CAPACITY;
+        while (size > capacity - emitter->size)
+        {
+            capacity *= 2;
+        }
+
+        uint8_t * buffer = emitter->borrowed ? NULL : realloc(emitter->buffer, capacity);
+        if (buffer == NULL)
+        {
+            emitter->error = E_NOMEM;
+            return NULL;
+        }
+        emitter->buffer = buffer;
+        emitter->capacity = capacity;
+    }
+
+    uint8_t * position = &emitter->buffer[emitter->size];
+    emitter->size += size;
+    return position;
+}
+
+void emit_raw(asm_emitter_t * emitter, const void * bytes, size_t size)
+{
+    uint8_t * position = emitter_reserve(emitter, size);
+    if (position != NULL)
+    {
+        memcpy(position, bytes, size);
+    }
+}
+
+// Emits an instruction: the opcode, the first 'regs_count' registers of 'regs', and 'imm32' (if 'has_imm32')
+static void emit_instruction(asm_emitter_t * emitter, asm_opcode_t opcode, const asm_register_t * regs,
+                             size_t regs_count, int has_imm32, int32_t imm32)
+{
+    uint8_t instruction[ASM_EMITTER_MAX_INSTRUCTION_SIZE];
+    size_t size = 0;
+
+    instruction[size] = (opcode_t)opcode;
+    size += sizeof(opcode_t);
+    for (size_t i = 0; i < regs_count; ++i)
+    {
+        instruction[size] = (reg_t)regs[i];
+        size += sizeof(reg_t);
+    }
+    if (has_imm32)
+    {
+        memcpy(&instruction[size], &imm32, sizeof(imm32));
+        size += sizeof(imm32);
+    }
+
+    emit_raw(emitter, instruction, size);
+}
+
+void emit_opcode(asm_emitter_t * emitter, asm_opcode_t opcode)
+{
+    emit_instruction(emitter, opcode, NULL, 0, 0, 0);
+}
+
+void emit_opcode1(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0)
+{
+    emit_instruction(emitter, opcode, (const asm_register_t[]){ reg0 }, 1, 0, 0);
+}
+
+void emit_opcode2(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1)
+{
+    emit_instruction(emitter, opcode, (const asm_register_t[]){ reg0, reg1 }, 2, 0, 0);
+}
+
+void emit_opcode3(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1,
+                  asm_register_t reg2)
+{
+    emit_instruction(emitter, opcode, (const asm_register_t[]){ reg0, reg1, reg2 }, 3, 0, 0);
+}
+
+void emit_opcode_imm32(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1,
+                       int32_t imm32)
+{
+    emit_instruction(emitter, opcode, (const asm_register_t[]){ reg0, reg1 }, 2, 1, imm32);
+}
+
+void emit_opcode_rel32(asm_emitter_t * emitter, asm_opcode_t opcode, int32_t rel32)
+{
+    emit_instruction(emitter, opcode, NULL, 0, 1, rel32);
+}
+
+void emit_opcode1_rel32(asm_emitter_t * emitter, asm_opcode_t opcode, asm_register_t reg0, int32_t rel32)
+{
+    emit_instruction(emitter, opcode, (const asm_register_t[]){ reg0 }, 1, 1, rel32);
+}
+
+// The size of a branch (the opcode, its register if it has one, and the rel32)
+static size_t emitter_branch_size(asm_opcode_t opcode)
+{
+    size_t size = sizeof(opcode_t) + sizeof(int32_t);
+    if (asm_instruction_operands[opcode] == ASM_OPERANDS_REG1_REL32)
+    {
+        size += sizeof(reg_t);
+    }
+    return size;
+}
+
+int32_t emitter_branch_rel32(const asm_emitter_t * emitter, asm_opcode_t opcode, size_t target)
+{
+    return (int32_t)((int64_t)target - (int64_t)(emitter->size + emitter_branch_size(opcode)));
+}
+
+void emitter_patch_branch(asm_emitter_t * emitter, size_t branch, size_t target)
+{
+    if (emitter->error != E_SUCCESS)
+    {
+        return;
+    }
+    if (branch >= emitter->size || emitter->buffer[branch] >= MAX_ASM_OPCODE_VAL ||
+        !asm_is_branch((asm_opcode_t)emitter->buffer[branch]) ||
+        emitter_branch_size((asm_opcode_t)emitter->buffer[branch]) > emitter->size - branch)
+    {
+        emitter->error = E_IVLD_ARGS;
+        return;
+    }
+
+    size_t size = emitter_branch_size((asm_opcode_t)emitter->buffer[branch]);
+    int32_t rel32 = (int32_t)((int64_t)target - (int64_t)(branch + size));
+    memcpy(&emitter->buffer[branch + size - sizeof(rel32)], &rel32, sizeof(rel32));
+}
@@ -2,49 +2,76 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "asm_types.h"
 #include "asm_execution.h"
 #include "asm_processor_state.h"
-#include "asm_file_parsing.h"
+#include "asm_program.h"
+#include "asm_program_cache.h"
+#include "asm_memo.h"
+#include "asm_container.h"
+#include "asm_snapshot.h"
+#include "asm_threaded_execution.h"
+#include "asm_jit.h"
+#include "asm_guarded_stack.h"
 #include "asm_instructions.h"
+#include "asm_profile.h"
 #include "common.h"
 #include "prompt.h"
 
-static int parse_exec_asm_file(FILE * fp, int * count_out)
+// Executes an already decoded program (from a fresh context) through the instructions table.
+static int interpret_asm_program(vm_context_t * vm, const asm_program_t * program, int * count_out)
 {
     int ret = E_SUCCESS;
-    if (fp == NULL)
-    {
-        ret = E_FOPEN;
-        goto cleanup;
-    }
 
     // Init context
-    initialize_context();
+    initialize_context(vm);
 
-    // Fetch-decode-execute instructions loop
-    asm_opcode_t opcode;
-    int inst_count = 0;
-    while (!feof(fp))
+    // Execute instructions loop (the program always ends with HALT, so no bounds checks are needed)
+    // (fused instructions stand for several payload instructions, and skip the ones they cover)
+    const asm_instruction_t * code = program_code(program);
+    const asm_instruction_t * instruction = code;
+    // (Unsigned, so loops that run for long just wrap it around, like the count reported by the other engines)
+    unsigned int inst_count = 0;
+#if ASM_ENABLE_PROFILING
+    // (An execution that can't be profiled is still executed)
+    asm_profile_t * profile = vm->profile;
+    if (profile != NULL && profile_prepare(profile, program) != E_SUCCESS)
     {
-        ret = file_parse_opcode(fp, &opcode);
-        if (ret != E_SUCCESS)
+        profile = NULL;
+    }
+#endif
+    while (1)
+    {
+        inst_count += instruction->length;
+        PROFILE_DISPATCH_BEGIN(start);
+        ret = asm_instruction_definitions[instruction->opcode](vm, instruction);
+        PROFILE_DISPATCH_END(profile, program, code, instruction, start);
+        if (ret == E_SUCCESS)
         {
-            break;
+            instruction += instruction->length;
+            continue;
         }
-        inst_count++;
 
-        if (opcode >= MAX_ASM_OPCODE_VAL || opcode < 0)
+        // Branches continue at their target (or at the next instruction), if the run there fits in the budget
+        if (ret != E_BRANCH_TAKEN && ret != E_BRANCH_NOT_TAKEN)
         {
-            ret = E_INVLD_OPCODE;
             break;
         }
-
-        ret = asm_instruction_definitions[opcode](fp);
-        if (ret != E_SUCCESS)
+        const asm_instruction_t * next = (ret == E_BRANCH_TAKEN) ? &code[instruction->imm32] : instruction + 1;
+        if (!program_run_fits(program, (uint64_t)inst_count, (size_t)(next - code)))
         {
+            ret = E_OUT_OF_GAS;
             break;
         }
+        instruction = next;
+    }
+
+    // If we couldn't even read the opcode of the last instruction, it wasn't executed
+    if (instruction->opcode == HALT && !instruction->reg0)
+    {
+        inst_count--;
     }
 
     // If we exited the loop because RET/RETNZ instruction, we want to report success
@@ -53,41 +80,314 @@ static int parse_exec_asm_file(FILE * fp, int * count_out)
         ret = E_SUCCESS;
     }
 
-cleanup:
     if (count_out)
     {
-        *count_out = inst_count;
+        *count_out = (int)inst_count;
+    }
+    return ret;
+}
+
+#if ASM_GUARDED_STACK
+// The threaded engine doesn't check its stack accesses on a guarded stack. An execution that hits the guard region
+// is replayed by the interpreter, from the start (see asm_guarded_stack.h).
+static int execute_asm_program_guarded(vm_context_t * vm, const asm_program_t * program, int * count_out)
+{
+    int ret = E_SUCCESS;
+    uint64_t output_start = output_position(&vm->output);
+
+    ret = guarded_stack_execute(vm, program, execute_asm_program_threaded, count_out);
+    if (ret == E_STACK_GUARD_HIT)
+    {
+        output_rewind(&vm->output, output_start);
+        // (The aborted execution didn't get to record which stack bytes it wrote)
+        stack_mark_dirty(vm, 0, ASM_STACK_SIZE);
+        ret = interpret_asm_program(vm, program, count_out);
     }
     return ret;
 }
+#endif
 
-int execute_asm_file(FILE * fp)
+int execute_asm_program(vm_context_t * vm, const asm_program_t * program, asm_engine_t engine, int * count_out)
 {
     int ret = E_SUCCESS;
     int count = 0;
+    asm_program_t checked;
+
+    // The fused & optimized code (and the verifier's proofs) assume a fresh context - ZERO and SP are 0 (a snapshot's
+    // ZERO isn't, after a POPCTX in its prelude). Executions from a snapshot get the instructions with all their checks.
+    if (vm->snapshot != NULL)
+    {
+        checked = *program;
+        checked.optimized = NULL;
+        checked.jit = NULL;
+        checked.stack_verified = 0;
+        checked.unchecked = NULL;
+        program = &checked;
+    }
+
+    switch (engine)
+    {
+    case ASM_ENGINE_INTERPRETER:
+        ret = interpret_asm_program(vm, program, &count);
+        break;
+    case ASM_ENGINE_THREADED:
+#if ASM_GUARDED_STACK
+        ret = execute_asm_program_guarded(vm, program, &count);
+#else
+        ret = execute_asm_program_threaded(vm, program, &count);
+#endif
+        break;
+    case ASM_ENGINE_JIT:
+        ret = execute_asm_program_jit(vm, program, &count);
+        break;
+    case ASM_ENGINE_JIT_DIFFERENTIAL:
+        ret = execute_asm_program_jit_differential(vm, program, &count);
+        break;
+    default:
+        ret = E_IVLD_ARGS;
+        break;
+    }
+
+    // Whatever the program printed is written out by the time it's done (whether it returned or failed)
+    output_flush(&vm->output);
+
+    vm->executions++;
+    vm->instructions_executed += (uint64_t)(unsigned int)count;
+    if (count_out)
+    {
+        *count_out = count;
+    }
+    return ret;
+}
+
+static int parse_exec_asm_span(vm_context_t * vm, const uint8_t * asm_bytes, size_t len, int * count_out)
+{
+    int ret = E_SUCCESS;
+    asm_program_t program;
+    asm_program_cache_t * cache = program_cache_default();
+    asm_cached_program_t * cached = NULL;
+    program_init(&program);
+    if (count_out)
+    {
+        *count_out = 0;
+    }
+
+    if (cache != NULL)
+    {
+        // A payload that was already executed isn't decoded again
+        ret = program_cache_get(cache, asm_bytes, len, vm->instruction_budget, ASM_CACHE_DEFAULT_FLAGS, &cached);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+        ret = execute_asm_program(vm, &cached->program, ASM_DEFAULT_ENGINE, count_out);
+        goto cleanup;
+    }
+
+    // Decode the whole payload once, then execute the decoded instructions
+    ret = program_prepare(&program, asm_bytes, len, vm->instruction_budget, ASM_PREPARE_ALL);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    ret = execute_asm_program(vm, &program, ASM_DEFAULT_ENGINE, count_out);
+
+cleanup:
+    if (cached != NULL)
+    {
+        program_cache_release(cache, cached);
+    }
+    program_free(&program);
+    return ret;
+}
+
+#if ASM_MEMOIZE
+// Replays the payload's memoized execution (if it was already executed), or executes it and memoizes it
+static int memo_exec_asm_span(vm_context_t * vm, const uint8_t * asm_bytes, size_t len, int * count_out)
+{
+    int ret = E_SUCCESS;
+    asm_memo_t * memo = memo_default();
+    asm_memo_result_t result = { 0 };
+    asm_output_capture_t capture;
+
+    // (A context with a snapshot doesn't start fresh, and a profiled one should really execute)
+    if (memo == NULL || vm->snapshot != NULL || vm->profile != NULL)
+    {
+        return parse_exec_asm_span(vm, asm_bytes, len, count_out);
+    }
 
-    ret = parse_exec_asm_file(fp, &count);
+    if (memo_lookup(memo, asm_bytes, len, vm->instruction_budget, &result))
+    {
+        output_write(&vm->output, result.output, result.output_size);
+        output_flush(&vm->output);
+        vm->executions++;
+        vm->instructions_executed += (uint64_t)(unsigned int)result.count;
+        *count_out = result.count;
+        ret = result.ret;
+        goto cleanup;
+    }
+
+    // Whatever is still buffered was written before this execution
+    output_flush(&vm->output);
+    output_capture(&vm->output, &capture, memo->max_memory_size);
+    ret = parse_exec_asm_span(vm, asm_bytes, len, count_out);
+    output_capture(&vm->output, NULL, 0);
+
+    // (Running out of memory has nothing to do with the payload)
+    if (!capture.overflowed && ret != E_NOMEM)
+    {
+        result.ret = ret;
+        result.count = *count_out;
+        result.output = capture.bytes;
+        result.output_size = capture.size;
+        memo_store(memo, asm_bytes, len, vm->instruction_budget, &result);
+        result.output = NULL;
+    }
+    output_capture_free(&capture);
+
+cleanup:
+    memo_result_free(&result);
+    return ret;
+}
+#endif
+
+static int execute_asm_span(vm_context_t * vm, const uint8_t * asm_bytes, size_t len)
+{
+    int ret = E_SUCCESS;
+    int count = 0;
+
+#if ASM_MEMOIZE
+    ret = memo_exec_asm_span(vm, asm_bytes, len, &count);
+#else
+    ret = parse_exec_asm_span(vm, asm_bytes, len, &count);
+#endif
     PROMPT_PRINTF("executed 0x%X instructions\n\n", count);
     return ret;
 }
 
-int execute_asm_memory(void * asm_bytes, size_t len)
+// Executes a container (see asm_container.h) from its decoded instructions
+static int execute_asm_container(vm_context_t * vm, const asm_container_t * container)
+{
+    int ret = E_SUCCESS;
+    int count = 0;
+    asm_program_t program;
+    program_init(&program);
+
+    ret = container_load_program(container, vm->instruction_budget, &program);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    ret = execute_asm_program(vm, &program, ASM_DEFAULT_ENGINE, &count);
+
+cleanup:
+    PROMPT_PRINTF("executed 0x%X instructions\n\n", count);
+    program_free(&program);
+    return ret;
+}
+
+// Reads the rest of a (non-mappable) file into a newly allocated buffer.
+static int read_file_bytes(FILE * fp, uint8_t ** bytes_out, size_t * len_out)
+{
+    int ret = E_SUCCESS;
+    uint8_t * bytes = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+
+    while (!feof(fp))
+    {
+        if (len == capacity)
+        {
+            size_t new_capacity = (capacity == 0) ? 4096 : capacity * 2;
+            uint8_t * new_bytes = realloc(bytes, new_capacity);
+            if (new_bytes == NULL)
+            {
+                ret = E_NOMEM;
+                goto cleanup;
+            }
+            bytes = new_bytes;
+            capacity = new_capacity;
+        }
+
+        len += fread(&bytes[len], 1, capacity - len, fp);
+        if (ferror(fp))
+        {
+            ret = E_FREAD;
+            goto cleanup;
+        }
+    }
+
+    *bytes_out = bytes;
+    *len_out = len;
+    bytes = NULL;
+
+cleanup:
+    free(bytes);
+    return ret;
+}
+
+int execute_asm_file(vm_context_t * vm, FILE * fp)
 {
     int ret = E_SUCCESS;
-    FILE * fp = NULL;
-    fp = fmemopen(asm_bytes, len, "r");
+    struct stat st;
+    off_t offset = 0;
+    uint8_t * mapping = NULL;
+    size_t mapping_size = 0;
+    uint8_t * bytes = NULL;
+    size_t len = 0;
+    asm_container_t container;
+
     if (fp == NULL)
     {
-        ret = -1;
+        ret = E_FOPEN;
+        PROMPT_PRINTF("executed 0x%X instructions\n\n", 0);
         goto cleanup;
     }
 
-    ret = execute_asm_file(fp);
+    // Regular files are mapped (from the current position), everything else is read into memory
+    offset = ftello(fp);
+    if (offset != -1 && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset)
+    {
+        mapping_size = (size_t)st.st_size;
+        mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = NULL;
+        }
+    }
+
+    // Containers are executed without decoding them (anything that isn't a valid container is a raw payload)
+    if (mapping != NULL && container_open(&container, fileno(fp), offset) == E_SUCCESS)
+    {
+        ret = execute_asm_container(vm, &container);
+        container_close(&container);
+    }
+    else if (mapping != NULL)
+    {
+        ret = execute_asm_span(vm, &mapping[offset], mapping_size - (size_t)offset);
+    }
+    else
+    {
+        ret = read_file_bytes(fp, &bytes, &len);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+        ret = execute_asm_span(vm, bytes, len);
+    }
 
 cleanup:
-    if (fp != NULL)
+    if (mapping != NULL)
     {
-        fclose(fp);
+        munmap(mapping, mapping_size);
     }
+    free(bytes);
     return ret;
 }
+
+int execute_asm_memory(vm_context_t * vm, void * asm_bytes, size_t len)
+{
+    return execute_asm_span(vm, asm_bytes, len);
+}
@@ -1,25 +1,21 @@
 #include <stdio.h>
 #include "asm_file_generation.h"
+#include "asm_emitter.h"
 #include "asm_types.h"
 #include "common.h"
 
-static int file_write_reg(FILE * fp, asm_register_t reg)
+// Writes the instruction 'emitter' encoded, with a single fwrite
+static int file_write_emitted(FILE * fp, const asm_emitter_t * emitter)
 {
     int ret = E_SUCCESS;
-    if (fwrite(&reg, sizeof(reg_t), 1, fp) != 1)
+
+    ret = emitter_error(emitter);
+    if (ret != E_SUCCESS)
     {
-        ret = E_FWRITE;
         goto cleanup;
     }
 
-cleanup:
-    return ret;
-}
-
-int file_write_opcode(FILE * fp, asm_opcode_t opcode)
-{
-    int ret = E_SUCCESS;
-    if (fwrite(&opcode, sizeof(opcode_t), 1, fp) != 1)
+    if (fwrite(emitter->buffer, 1, emitter->size, fp) != emitter->size)
     {
         ret = E_FWRITE;
         goto cleanup;
@@ -29,82 +25,83 @@ cleanup:
     return ret;
 }
 
-int file_write_opcode1(FILE * fp, asm_opcode_t opcode, asm_register_t reg0)
+int file_write_opcode(FILE * fp, asm_opcode_t opcode)
 {
-    int ret = E_SUCCESS;
+    uint8_t buffer[ASM_EMITTER_MAX_INSTRUCTION_SIZE];
+    asm_emitter_t emitter;
+    emitter_init_buffer(&emitter, buffer, sizeof(buffer));
 
-    ret = file_write_opcode(fp, opcode);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+    emit_opcode(&emitter, opcode);
+    return file_write_emitted(fp, &emitter);
+}
 
-    ret = file_write_reg(fp, reg0);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+int file_write_opcode1(FILE * fp, asm_opcode_t opcode, asm_register_t reg0)
+{
+    uint8_t buffer[ASM_EMITTER_MAX_INSTRUCTION_SIZE];
+    asm_emitter_t emitter;
+    emitter_init_buffer(&emitter, buffer, sizeof(buffer));
 
-cleanup:
-    return ret;
+    emit_opcode1(&emitter, opcode, reg0);
+    return file_write_emitted(fp, &emitter);
 }
 
 int file_write_opcode2(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1)
 {
-    int ret = E_SUCCESS;
+    uint8_t buffer[ASM_EMITTER_MAX_INSTRUCTION_SIZE];
+    asm_emitter_t emitter;
+    emitter_init_buffer(&emitter, buffer, sizeof(buffer));
 
-    ret = file_write_opcode1(fp, opcode, reg0);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+    emit_opcode2(&emitter, opcode, reg0, reg1);
+    return file_write_emitted(fp, &emitter);
+}
 
-    ret = file_write_reg(fp, reg1);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+int file_write_opcode3(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1, asm_register_t reg2)
+{
+    uint8_t buffer[ASM_EMITTER_MAX_INSTRUCTION_SIZE];
+    asm_emitter_t emitter;
+    emitter_init_buffer(&emitter, buffer, sizeof(buffer));
 
-cleanup:
-    return ret;
+    emit_opcode3(&emitter, opcode, reg0, reg1, reg2);
+    return file_write_emitted(fp, &emitter);
 }
 
-int file_write_opcode3(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1, asm_register_t reg2)
+int file_write_opcode_imm32(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1, int32_t imm2)
 {
-    int ret = E_SUCCESS;
+    uint8_t buffer[ASM_EMITTER_MAX_INSTRUCTION_SIZE];
+    asm_emitter_t emitter;
+    emitter_init_buffer(&emitter, buffer, sizeof(buffer));
 
-    ret = file_write_opcode2(fp, opcode, reg0, reg1);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+    emit_opcode_imm32(&emitter, opcode, reg0, reg1, imm2);
+    return file_write_emitted(fp, &emitter);
+}
 
-    ret = file_write_reg(fp, reg2);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+int file_write_opcode_rel32(FILE * fp, asm_opcode_t opcode, int32_t rel32)
+{
+    uint8_t buffer[ASM_EMITTER_MAX_INSTRUCTION_SIZE];
+    asm_emitter_t emitter;
+    emitter_init_buffer(&emitter, buffer, sizeof(buffer));
 
-cleanup:
-    return ret;
+    emit_opcode_rel32(&emitter, opcode, rel32);
+    return file_write_emitted(fp, &emitter);
 }
 
-int file_write_opcode_imm32(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, asm_register_t reg1, int32_t imm2)
+int file_write_opcode1_rel32(FILE * fp, asm_opcode_t opcode, asm_register_t reg0, int32_t rel32)
 {
-    int ret = E_SUCCESS;
+    uint8_t buffer[ASM_EMITTER_MAX_INSTRUCTION_SIZE];
+    asm_emitter_t emitter;
+    emitter_init_buffer(&emitter, buffer, sizeof(buffer));
 
-    ret = file_write_opcode2(fp, opcode, reg0, reg1);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+    emit_opcode1_rel32(&emitter, opcode, reg0, rel32);
+    return file_write_emitted(fp, &emitter);
+}
 
-    if (fwrite(&imm2, sizeof(int32_t), 1, fp) != 1)
+int32_t file_branch_rel32(FILE * fp, asm_opcode_t opcode, long target)
+{
+    // The branch ends after the opcode, its register (if it has one) and the rel32 itself
+    long size = (long)(sizeof(opcode_t) + sizeof(int32_t));
+    if (asm_instruction_operands[opcode] == ASM_OPERANDS_REG1_REL32)
     {
-        ret = E_FWRITE;
-        goto cleanup;
+        size += (long)sizeof(reg_t);
     }
-
-cleanup:
-    return ret;
+    return (int32_t)(target - (ftell(fp) + size));
 }
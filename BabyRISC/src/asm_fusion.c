@@ -0,0 +1,161 @@
+#include <string.h>
+#include "asm_fusion.h"
+#include "asm_processor_state.h"
+
+static const char * fusion_names[MAX_ASM_FUSION_VAL] = {
+    [ASM_FUSION_LOADI] = "LOADI",
+    [ASM_FUSION_PRINTC4] = "PRINTC4",
+    [ASM_FUSION_MULSUBIRETNZ] = "MULSUBIRETNZ",
+};
+
+// The fused instructions access their registers directly. That's fine, because the decoder replaces every
+// instruction with an invalid register (or a write to ZERO) with a FAULT instruction, which is never fused.
+
+// ADDI rX, ZERO, imm32 => LOADI rX, imm32
+// ZERO is only guaranteed to be 0 if nothing can restore it from the stack (POPCTX restores all the registers) - a
+// POPCTX in the program itself is checked here, one in a snapshot's prelude by execute_asm_program.
+static size_t fusion_try_loadi(const asm_instruction_t * instructions, size_t left, int has_popctx,
+                               asm_instruction_t * fused)
+{
+    const asm_instruction_t * addi = &instructions[0];
+    if (has_popctx || left < 1 || addi->opcode != ADDI || addi->reg1 != ASM_REGISTER_ZERO)
+    {
+        return 0;
+    }
+
+    fused->opcode = LOADI;
+    fused->reg0 = addi->reg0;
+    fused->imm32 = addi->imm32;
+    return 1;
+}
+
+// (PRINTC rX; ROR rX, rX, 8) x 4 => PRINTC4 rX
+static size_t fusion_try_printc4(const asm_instruction_t * instructions, size_t left, asm_instruction_t * fused)
+{
+    const size_t length = 8;
+    reg_t reg = instructions[0].reg0;
+    if (left < length)
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; i < length; i += 2)
+    {
+        const asm_instruction_t * printc = &instructions[i];
+        const asm_instruction_t * ror = &instructions[i + 1];
+        if (printc->opcode != PRINTC || printc->reg0 != reg || ror->opcode != ROR || ror->reg0 != reg ||
+            ror->reg1 != reg || ror->imm32 != 8)
+        {
+            return 0;
+        }
+    }
+
+    fused->opcode = PRINTC4;
+    fused->reg0 = reg;
+    return length;
+}
+
+// MUL rX, rY, rZ; SUBI rX, rX, imm32; RETNZ rX => MULSUBIRETNZ rX, rY, rZ, imm32
+static size_t fusion_try_mulsubiretnz(const asm_instruction_t * instructions, size_t left,
+                                      asm_instruction_t * fused)
+{
+    const asm_instruction_t * mul = &instructions[0];
+    const asm_instruction_t * subi = &instructions[1];
+    const asm_instruction_t * retnz = &instructions[2];
+    if (left < 3 || mul->opcode != MUL || subi->opcode != SUBI || subi->reg0 != mul->reg0 ||
+        subi->reg1 != mul->reg0 || retnz->opcode != RETNZ || retnz->reg0 != mul->reg0)
+    {
+        return 0;
+    }
+
+    fused->opcode = MULSUBIRETNZ;
+    fused->reg0 = mul->reg0;
+    fused->reg1 = mul->reg1;
+    fused->reg2 = mul->reg2;
+    fused->imm32 = subi->imm32;
+    return 3;
+}
+
+int program_fuse(asm_program_t * program, asm_fusion_stats_t * stats_out)
+{
+    int ret = E_SUCCESS;
+    asm_fusion_stats_t stats;
+    asm_instruction_t * optimized = NULL;
+    int has_popctx = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    // The terminating HALT is copied as well (it is never fused)
+    optimized = malloc((program->count + 1) * sizeof(*optimized));
+    if (optimized == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    memcpy(optimized, program->instructions, (program->count + 1) * sizeof(*optimized));
+
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        if (program->instructions[i].opcode == POPCTX)
+        {
+            has_popctx = 1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < program->count;)
+    {
+        const asm_instruction_t * instructions = &program->instructions[i];
+        size_t left = program->count - i;
+        asm_instruction_t fused;
+        size_t length = 0;
+        asm_fusion_t fusion = ASM_FUSION_LOADI;
+        memset(&fused, 0, sizeof(fused));
+
+        if ((length = fusion_try_printc4(instructions, left, &fused)) != 0)
+        {
+            fusion = ASM_FUSION_PRINTC4;
+        }
+        else if ((length = fusion_try_mulsubiretnz(instructions, left, &fused)) != 0)
+        {
+            fusion = ASM_FUSION_MULSUBIRETNZ;
+        }
+        else if ((length = fusion_try_loadi(instructions, left, has_popctx, &fused)) != 0)
+        {
+            fusion = ASM_FUSION_LOADI;
+        }
+        else
+        {
+            ++i;
+            continue;
+        }
+
+        // The instructions covered by the fused one stay in place (they are just skipped)
+        fused.length = (uint8_t)length;
+        optimized[i] = fused;
+        stats.fused[fusion]++;
+        stats.dispatches_saved += length - 1;
+        i += length;
+    }
+
+    free(program->optimized);
+    program->optimized = optimized;
+    optimized = NULL;
+
+    if (stats_out)
+    {
+        *stats_out = stats;
+    }
+
+cleanup:
+    free(optimized);
+    return ret;
+}
+
+void fusion_stats_print(FILE * fp, const asm_fusion_stats_t * stats)
+{
+    for (size_t i = 0; i < MAX_ASM_FUSION_VAL; ++i)
+    {
+        fprintf(fp, "%-14s fused %zu times\n", fusion_names[i], stats->fused[i]);
+    }
+    fprintf(fp, "%-14s %zu dispatches per run\n", "saved", stats->dispatches_saved);
+}
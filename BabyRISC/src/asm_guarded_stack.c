@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "asm_guarded_stack.h"
+#include "common.h"
+
+#if ASM_GUARDED_STACK
+
+// The offsets of the stack accesses are 32-bit registers (with up to a context's size added / subtracted), so the
+// guard region on each side of the stack covers 2GB, and some slack (a whole number of pages on every platform).
+#define GUARDED_STACK_SLACK ((size_t)1 << 16)
+#define GUARDED_STACK_GUARD_SIZE (((size_t)1 << 31) + GUARDED_STACK_SLACK)
+#define GUARDED_STACK_RESERVATION_SIZE (GUARDED_STACK_GUARD_SIZE + ASM_STACK_SIZE + GUARDED_STACK_GUARD_SIZE)
+
+// Ranges at least this large are reset by dropping their pages instead of clearing them (only the pages that were
+// used cost anything, but every reset is a system call)
+#define GUARDED_STACK_DROP_PAGES_SIZE (64 * 1024)
+
+_Static_assert(ASM_STACK_SIZE % 4096 == 0, "The guarded stack must end at a page boundary");
+
+// The execution that runs on the current thread (if any), and where to go back to if it hits its guard region
+typedef struct guarded_execution_s
+{
+    sigjmp_buf recovery;
+    const uint8_t * start;
+    const uint8_t * end;
+} guarded_execution_t;
+
+static _Thread_local guarded_execution_t * current_execution = NULL;
+static struct sigaction previous_action;
+static pthread_once_t install_once = PTHREAD_ONCE_INIT;
+static int install_result = E_SUCCESS;
+
+int guarded_stack_map(uint8_t ** stack_out)
+{
+    int ret = E_SUCCESS;
+    uint8_t * reservation = NULL;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (page_size <= 0 || ASM_STACK_SIZE % page_size != 0)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    reservation = mmap(NULL, GUARDED_STACK_RESERVATION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1, 0);
+    if (reservation == MAP_FAILED)
+    {
+        reservation = NULL;
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    if (mprotect(&reservation[GUARDED_STACK_GUARD_SIZE], ASM_STACK_SIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    *stack_out = &reservation[GUARDED_STACK_GUARD_SIZE];
+    reservation = NULL;
+
+cleanup:
+    if (reservation != NULL)
+    {
+        munmap(reservation, GUARDED_STACK_RESERVATION_SIZE);
+    }
+    return ret;
+}
+
+void guarded_stack_unmap(uint8_t * stack)
+{
+    if (stack != NULL)
+    {
+        munmap(stack - GUARDED_STACK_GUARD_SIZE, GUARDED_STACK_RESERVATION_SIZE);
+    }
+}
+
+void guarded_stack_reset(uint8_t * stack, size_t start, size_t end)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    // The whole pages in the range (the stack itself starts at a page boundary)
+    size_t pages_start = (start + page_size - 1) / page_size * page_size;
+    size_t pages_end = end / page_size * page_size;
+
+    if (end - start < GUARDED_STACK_DROP_PAGES_SIZE || pages_start >= pages_end ||
+        madvise(&stack[pages_start], pages_end - pages_start, MADV_DONTNEED) != 0)
+    {
+        memset(&stack[start], 0, end - start);
+        return;
+    }
+    memset(&stack[start], 0, pages_start - start);
+    memset(&stack[pages_end], 0, end - pages_end);
+}
+
+static void guarded_stack_on_fault(int signal_number, siginfo_t * info, void * ucontext)
+{
+    guarded_execution_t * execution = current_execution;
+    const uint8_t * address = info->si_addr;
+
+    if (execution != NULL && address >= execution->start && address < execution->end)
+    {
+        current_execution = NULL;
+        siglongjmp(execution->recovery, 1);
+    }
+
+    // Not a stack access - let the handler that was installed before take it (returning re-executes the faulting
+    // instruction, so with the default action the process dies just like without this handler)
+    if (previous_action.sa_flags & SA_SIGINFO)
+    {
+        previous_action.sa_sigaction(signal_number, info, ucontext);
+    }
+    else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN)
+    {
+        previous_action.sa_handler(signal_number);
+    }
+    else
+    {
+        signal(signal_number, SIG_DFL);
+    }
+}
+
+// Installs the SIGSEGV handler (once per process, on top of the one that was installed before - e.g. by
+// output_flush_at_exit). SA_NODEFER keeps SIGSEGV unblocked after jumping out of the handler, so the executions
+// don't have to save & restore the signal mask.
+static void guarded_stack_install(void)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guarded_stack_on_fault;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &previous_action) != 0)
+    {
+        install_result = E_IVLD_ARGS;
+    }
+}
+
+int guarded_stack_execute(vm_context_t * vm, const asm_program_t * program, guarded_engine_t engine,
+                          int * count_out)
+{
+    int ret = E_SUCCESS;
+    guarded_execution_t execution;
+
+    pthread_once(&install_once, guarded_stack_install);
+    ret = install_result;
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    execution.start = vm->stack - GUARDED_STACK_GUARD_SIZE;
+    execution.end = vm->stack + ASM_STACK_SIZE + GUARDED_STACK_GUARD_SIZE;
+    if (sigsetjmp(execution.recovery, 0) != 0)
+    {
+        // (The handler already cleared 'current_execution')
+        ret = E_STACK_GUARD_HIT;
+        goto cleanup;
+    }
+
+    current_execution = &execution;
+    ret = engine(vm, program, count_out);
+    current_execution = NULL;
+
+cleanup:
+    return ret;
+}
+
+#endif /* ASM_GUARDED_STACK */
@@ -0,0 +1,101 @@
+#include <string.h>
+#include "asm_hash.h"
+
+#define XXH_PRIME64_1 (0x9e3779b185ebca87ull)
+#define XXH_PRIME64_2 (0xc2b2ae3d27d4eb4full)
+#define XXH_PRIME64_3 (0x165667b19e3779f9ull)
+#define XXH_PRIME64_4 (0x85ebca77c2b2ae63ull)
+#define XXH_PRIME64_5 (0x27d4eb2f165667c5ull)
+
+static inline uint64_t xxh_rotl64(uint64_t value, unsigned int count)
+{
+    return (value << count) | (value >> (64 - count));
+}
+
+static inline uint64_t xxh_read64(const uint8_t * bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint32_t xxh_read32(const uint8_t * bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxh_round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * XXH_PRIME64_2;
+    accumulator = xxh_rotl64(accumulator, 31);
+    return accumulator * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t accumulator, uint64_t value)
+{
+    accumulator ^= xxh_round(0, value);
+    return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// (The reads are little-endian, like the payloads - BabyRISC only runs on little-endian hosts)
+uint64_t hash_xxh64(const void * data, size_t size, uint64_t seed)
+{
+    const uint8_t * bytes = data;
+    const uint8_t * end = bytes + size;
+    uint64_t hash = 0;
+
+    if (size >= 32)
+    {
+        // Four lanes, 8 bytes each per 32-byte stripe
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do
+        {
+            v1 = xxh_round(v1, xxh_read64(bytes));
+            v2 = xxh_round(v2, xxh_read64(bytes + 8));
+            v3 = xxh_round(v3, xxh_read64(bytes + 16));
+            v4 = xxh_round(v4, xxh_read64(bytes + 24));
+            bytes += 32;
+        } while (end - bytes >= 32);
+
+        hash = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        hash = xxh_merge_round(hash, v1);
+        hash = xxh_merge_round(hash, v2);
+        hash = xxh_merge_round(hash, v3);
+        hash = xxh_merge_round(hash, v4);
+    }
+    else
+    {
+        hash = seed + XXH_PRIME64_5;
+    }
+    hash += (uint64_t)size;
+
+    for (; end - bytes >= 8; bytes += 8)
+    {
+        hash ^= xxh_round(0, xxh_read64(bytes));
+        hash = xxh_rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - bytes >= 4)
+    {
+        hash ^= (uint64_t)xxh_read32(bytes) * XXH_PRIME64_1;
+        hash = xxh_rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        bytes += 4;
+    }
+    for (; bytes < end; ++bytes)
+    {
+        hash ^= (uint64_t)*bytes * XXH_PRIME64_5;
+        hash = xxh_rotl64(hash, 11) * XXH_PRIME64_1;
+    }
+
+    // Avalanche
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
@@ -1,44 +1,18 @@
 #include "asm_instructions.h"
 #include "asm_processor_state.h"
-#include "asm_file_parsing.h"
 #include "string.h"
 
-#define _rotl(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
-#define _rotr(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
-
 // The INSTRUCTION_DEFINE_BINARY_* macros below allow you to quickly define binary operations without
 // implementing any code yourself. Just pass the "operator" to be applied.
+// (The registers are accessed directly, see program_validate_instruction)
 
 // Define binary operation (which is: "reg0 = reg1 (op) reg2")
 // Here just pass the 'operator' as the (op) being made
 #define INSTRUCTION_DEFINE_BINARY_OP(opcode, operator)                                                                 \
     INSTRUCTION_DEFINE_OP3(opcode)                                                                                     \
     {                                                                                                                  \
-        int ret = E_SUCCESS;                                                                                           \
-        reg_value_t value1 = 0;                                                                                        \
-        reg_value_t value2 = 0;                                                                                        \
-        ret = read_reg(reg1, &value1);                                                                                 \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-                                                                                                                       \
-        ret = read_reg(reg2, &value2);                                                                                 \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-                                                                                                                       \
-        value1 = (value1) operator(value2);                                                                            \
-                                                                                                                       \
-        ret = write_reg(reg0, value1);                                                                                 \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-                                                                                                                       \
-    cleanup:                                                                                                           \
-        return ret;                                                                                                    \
+        vm->registers[reg0] = (vm->registers[reg1]) operator(vm->registers[reg2]);                                     \
+        return E_SUCCESS;                                                                                              \
     }
 
 // Define binary 32-bit immediate operation (which is: "reg0 = reg1 (op) imm32")
@@ -46,144 +20,134 @@
 #define INSTRUCTION_DEFINE_BINARY_IMM32_OP(opcode, operator)                                                           \
     INSTRUCTION_DEFINE_OP_IMM32(opcode)                                                                                \
     {                                                                                                                  \
-        int ret = E_SUCCESS;                                                                                           \
-        reg_value_t value = 0;                                                                                         \
-        ret = read_reg(reg1, &value);                                                                                  \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-                                                                                                                       \
-        value = (value) operator(imm32);                                                                               \
-                                                                                                                       \
-        ret = write_reg(reg0, value);                                                                                  \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-                                                                                                                       \
-    cleanup:                                                                                                           \
-        return ret;                                                                                                    \
+        vm->registers[reg0] = (vm->registers[reg1]) operator(imm32);                                                   \
+        return E_SUCCESS;                                                                                              \
     }
 
 // Each of the INSTRUCTION_DEFINE_OP* macros below allow you to define new instructions.
 // The effect of using these macros is generating a new symbol "__INSTRUCTION_DEFINE_(opcode)", which contains
 // the implementation for the opcode itself. The code you will write after the invocation will be the
-// "__INSTRUCTION_IMPL_(opcode)" symbol, which gets as parameters the registers / immediate of the instruction.
+// "__INSTRUCTION_IMPL_(opcode)" symbol, which gets as parameters the context it executes on ('vm'), and the
+// registers / immediate of the instruction.
+// The macros also record the operands format of the opcode as "__INSTRUCTION_OPERANDS_(opcode)", which is what
+// the decoder uses in order to know which operands follow the opcode.
 
 // Define instruction with no operands
 #define INSTRUCTION_DEFINE_OP0(opcode)                                                                                 \
-    static int __INSTRUCTION_IMPL_##opcode(void);                                                                      \
-    static int __INSTRUCTION_DEFINE_##opcode(FILE * fp)                                                                \
+    enum                                                                                                               \
+    {                                                                                                                  \
+        __INSTRUCTION_OPERANDS_##opcode = ASM_OPERANDS_NONE                                                            \
+    };                                                                                                                 \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm);                                                         \
+    static int __INSTRUCTION_DEFINE_##opcode(vm_context_t * vm, const asm_instruction_t * instruction)                 \
     {                                                                                                                  \
-        (void)fp;                                                                                                      \
-        int ret = E_SUCCESS;                                                                                           \
-        ret = __INSTRUCTION_IMPL_##opcode();                                                                           \
-        return ret;                                                                                                    \
+        (void)instruction;                                                                                             \
+        return __INSTRUCTION_IMPL_##opcode(vm);                                                                        \
     }                                                                                                                  \
-    static int __INSTRUCTION_IMPL_##opcode(void)
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm)
 
 // Define instruction with a single register operand
 #define INSTRUCTION_DEFINE_OP1(opcode)                                                                                 \
-    static int __INSTRUCTION_IMPL_##opcode(asm_register_t reg0);                                                       \
-    static int __INSTRUCTION_DEFINE_##opcode(FILE * fp)                                                                \
+    enum                                                                                                               \
+    {                                                                                                                  \
+        __INSTRUCTION_OPERANDS_##opcode = ASM_OPERANDS_REG1                                                            \
+    };                                                                                                                 \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0);                                    \
+    static int __INSTRUCTION_DEFINE_##opcode(vm_context_t * vm, const asm_instruction_t * instruction)                 \
     {                                                                                                                  \
-        int ret = E_SUCCESS;                                                                                           \
-        asm_register_t reg0;                                                                                           \
-        ret = file_parse_reg(fp, &reg0);                                                                               \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = __INSTRUCTION_IMPL_##opcode(reg0);                                                                       \
-    cleanup:                                                                                                           \
-        return ret;                                                                                                    \
+        return __INSTRUCTION_IMPL_##opcode(vm, (asm_register_t)instruction->reg0);                                     \
     }                                                                                                                  \
-    static int __INSTRUCTION_IMPL_##opcode(asm_register_t reg0)
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0)
 
 // Define instruction with two registers operand
 #define INSTRUCTION_DEFINE_OP2(opcode)                                                                                 \
-    static int __INSTRUCTION_IMPL_##opcode(asm_register_t reg0, asm_register_t reg1);                                  \
-    static int __INSTRUCTION_DEFINE_##opcode(FILE * fp)                                                                \
+    enum                                                                                                               \
     {                                                                                                                  \
-        int ret = E_SUCCESS;                                                                                           \
-        asm_register_t reg0;                                                                                           \
-        asm_register_t reg1;                                                                                           \
-        ret = file_parse_reg(fp, &reg0);                                                                               \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = file_parse_reg(fp, &reg1);                                                                               \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = __INSTRUCTION_IMPL_##opcode(reg0, reg1);                                                                 \
-    cleanup:                                                                                                           \
-        return ret;                                                                                                    \
+        __INSTRUCTION_OPERANDS_##opcode = ASM_OPERANDS_REG2                                                            \
+    };                                                                                                                 \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0, asm_register_t reg1);               \
+    static int __INSTRUCTION_DEFINE_##opcode(vm_context_t * vm, const asm_instruction_t * instruction)                 \
+    {                                                                                                                  \
+        return __INSTRUCTION_IMPL_##opcode(vm, (asm_register_t)instruction->reg0,                                      \
+                                           (asm_register_t)instruction->reg1);                                         \
     }                                                                                                                  \
-    static int __INSTRUCTION_IMPL_##opcode(asm_register_t reg0, asm_register_t reg1)
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0, asm_register_t reg1)
 
 // Define instruction with three registers operand
 #define INSTRUCTION_DEFINE_OP3(opcode)                                                                                 \
-    static int __INSTRUCTION_IMPL_##opcode(asm_register_t reg0, asm_register_t reg1, asm_register_t reg2);             \
-    static int __INSTRUCTION_DEFINE_##opcode(FILE * fp)                                                                \
+    enum                                                                                                               \
+    {                                                                                                                  \
+        __INSTRUCTION_OPERANDS_##opcode = ASM_OPERANDS_REG3                                                            \
+    };                                                                                                                 \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0, asm_register_t reg1,                \
+                                           asm_register_t reg2);                                                       \
+    static int __INSTRUCTION_DEFINE_##opcode(vm_context_t * vm, const asm_instruction_t * instruction)                 \
     {                                                                                                                  \
-        int ret = E_SUCCESS;                                                                                           \
-        asm_register_t reg0;                                                                                           \
-        asm_register_t reg1;                                                                                           \
-        asm_register_t reg2;                                                                                           \
-        ret = file_parse_reg(fp, &reg0);                                                                               \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = file_parse_reg(fp, &reg1);                                                                               \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = file_parse_reg(fp, &reg2);                                                                               \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = __INSTRUCTION_IMPL_##opcode(reg0, reg1, reg2);                                                           \
-    cleanup:                                                                                                           \
-        return ret;                                                                                                    \
+        return __INSTRUCTION_IMPL_##opcode(vm, (asm_register_t)instruction->reg0, (asm_register_t)instruction->reg1,   \
+                                           (asm_register_t)instruction->reg2);                                         \
     }                                                                                                                  \
-    static int __INSTRUCTION_IMPL_##opcode(asm_register_t reg0, asm_register_t reg1, asm_register_t reg2)
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0, asm_register_t reg1,                \
+                                           asm_register_t reg2)
 
 // Define instruction with two registers operands and a single 32-bit immediate
 #define INSTRUCTION_DEFINE_OP_IMM32(opcode)                                                                            \
-    static int __INSTRUCTION_IMPL_##opcode(asm_register_t reg0, asm_register_t reg1, int32_t imm32);                   \
-    static int __INSTRUCTION_DEFINE_##opcode(FILE * fp)                                                                \
+    enum                                                                                                               \
+    {                                                                                                                  \
+        __INSTRUCTION_OPERANDS_##opcode = ASM_OPERANDS_REG2_IMM32                                                      \
+    };                                                                                                                 \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0, asm_register_t reg1,                \
+                                           int32_t imm32);                                                             \
+    static int __INSTRUCTION_DEFINE_##opcode(vm_context_t * vm, const asm_instruction_t * instruction)                 \
+    {                                                                                                                  \
+        return __INSTRUCTION_IMPL_##opcode(vm, (asm_register_t)instruction->reg0, (asm_register_t)instruction->reg1,   \
+                                           instruction->imm32);                                                        \
+    }                                                                                                                  \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0, asm_register_t reg1,                \
+                                           int32_t imm32)
+
+// Define instruction with three registers operands and a single 32-bit immediate (only used by internal instructions)
+#define INSTRUCTION_DEFINE_OP3_IMM32(opcode)                                                                           \
+    enum                                                                                                               \
+    {                                                                                                                  \
+        __INSTRUCTION_OPERANDS_##opcode = ASM_OPERANDS_REG3_IMM32                                                      \
+    };                                                                                                                 \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0, asm_register_t reg1,                \
+                                           asm_register_t reg2, int32_t imm32);                                        \
+    static int __INSTRUCTION_DEFINE_##opcode(vm_context_t * vm, const asm_instruction_t * instruction)                 \
     {                                                                                                                  \
-        int ret = E_SUCCESS;                                                                                           \
-        asm_register_t reg0;                                                                                           \
-        asm_register_t reg1;                                                                                           \
-        int32_t imm32;                                                                                                 \
-        ret = file_parse_reg(fp, &reg0);                                                                               \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = file_parse_reg(fp, &reg1);                                                                               \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = file_parse_imm32(fp, &imm32);                                                                            \
-        if (ret != E_SUCCESS)                                                                                          \
-        {                                                                                                              \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ret = __INSTRUCTION_IMPL_##opcode(reg0, reg1, imm32);                                                          \
-    cleanup:                                                                                                           \
-        return ret;                                                                                                    \
+        return __INSTRUCTION_IMPL_##opcode(vm, (asm_register_t)instruction->reg0, (asm_register_t)instruction->reg1,   \
+                                           (asm_register_t)instruction->reg2, instruction->imm32);                     \
     }                                                                                                                  \
-    static int __INSTRUCTION_IMPL_##opcode(asm_register_t reg0, asm_register_t reg1, int32_t imm32)
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0, asm_register_t reg1,                \
+                                           asm_register_t reg2, int32_t imm32)
+
+// Define branch instruction with no register operand (only the target, which is resolved by the decoder).
+// The implementation returns E_BRANCH_TAKEN for the execution loop to continue at the target, or E_BRANCH_NOT_TAKEN.
+#define INSTRUCTION_DEFINE_OP_REL32(opcode)                                                                            \
+    enum                                                                                                               \
+    {                                                                                                                  \
+        __INSTRUCTION_OPERANDS_##opcode = ASM_OPERANDS_REL32                                                           \
+    };                                                                                                                 \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm);                                                         \
+    static int __INSTRUCTION_DEFINE_##opcode(vm_context_t * vm, const asm_instruction_t * instruction)                 \
+    {                                                                                                                  \
+        (void)instruction;                                                                                             \
+        return __INSTRUCTION_IMPL_##opcode(vm);                                                                        \
+    }                                                                                                                  \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm)
+
+// Define branch instruction with a single register operand (and the target, like above)
+#define INSTRUCTION_DEFINE_OP1_REL32(opcode)                                                                           \
+    enum                                                                                                               \
+    {                                                                                                                  \
+        __INSTRUCTION_OPERANDS_##opcode = ASM_OPERANDS_REG1_REL32                                                      \
+    };                                                                                                                 \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0);                                    \
+    static int __INSTRUCTION_DEFINE_##opcode(vm_context_t * vm, const asm_instruction_t * instruction)                 \
+    {                                                                                                                  \
+        return __INSTRUCTION_IMPL_##opcode(vm, (asm_register_t)instruction->reg0);                                     \
+    }                                                                                                                  \
+    static int __INSTRUCTION_IMPL_##opcode(vm_context_t * vm, asm_register_t reg0)
 
 // Actually define all the binary operations
 INSTRUCTION_DEFINE_BINARY_OP(AND, &)
@@ -205,330 +169,383 @@ INSTRUCTION_DEFINE_BINARY_IMM32_OP(SHL, <<)
 
 INSTRUCTION_DEFINE_OP0(PRINTNL)
 {
-    printf("\n");
+    output_nl(&vm->output);
     return E_SUCCESS;
 }
 
 INSTRUCTION_DEFINE_OP1(PRINTDX)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value = 0;
-    ret = read_reg(reg0, &value);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
-
-    printf("%x", value);
-
-cleanup:
-    return ret;
+    output_dx(&vm->output, vm->registers[reg0]);
+    return E_SUCCESS;
 }
 
 INSTRUCTION_DEFINE_OP1(PRINTDD)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value = 0;
-    ret = read_reg(reg0, &value);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
-
-    printf("%d", value);
-
-cleanup:
-    return ret;
+    output_dd(&vm->output, vm->registers[reg0]);
+    return E_SUCCESS;
 }
 
 INSTRUCTION_DEFINE_OP1(PRINTC)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value = 0;
-    ret = read_reg(reg0, &value);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
-
-    printf("%c", value & 0xff);
-
-cleanup:
-    return ret;
+    output_char(&vm->output, vm->registers[reg0]);
+    return E_SUCCESS;
 }
 
 INSTRUCTION_DEFINE_OP0(RET)
 {
+    (void)vm;
     return E_RETURN;
 }
 
 INSTRUCTION_DEFINE_OP1(RETNZ)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value = 0;
-    ret = read_reg(reg0, &value);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
-
-    if (value != 0)
-    {
-        ret = E_RETURN;
-    }
-
-cleanup:
-    return ret;
+    return (vm->registers[reg0] != 0) ? E_RETURN : E_SUCCESS;
 }
 
 INSTRUCTION_DEFINE_OP1(RETZ)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value = 0;
-    ret = read_reg(reg0, &value);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
-
-    if (value == 0)
-    {
-        ret = E_RETURN;
-    }
-
-cleanup:
-    return ret;
+    return (vm->registers[reg0] == 0) ? E_RETURN : E_SUCCESS;
 }
 
 INSTRUCTION_DEFINE_OP1(PUSH)
 {
-    int ret = E_SUCCESS;
-    reg_value_t reg_val = 0;
-    reg_value_t sp_val = 0;
-    ret = read_reg(reg0, &reg_val);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
-
-    ret = read_reg(ASM_REGISTER_SP, &sp_val);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+    reg_value_t reg_val = vm->registers[reg0];
+    reg_value_t sp_val = vm->registers[ASM_REGISTER_SP];
 
     if (sp_val < (reg_value_t)0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(reg_val)))
     {
-        ret = E_STACK_VIOLATION;
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
-    memcpy(&asm_stack[sp_val], &reg_val, sizeof(reg_val));
-    ret = write_reg(ASM_REGISTER_SP, sp_val + sizeof(reg_val));
-
-cleanup:
-    return ret;
+    memcpy(&vm->stack[sp_val], &reg_val, sizeof(reg_val));
+    stack_mark_dirty(vm, sp_val, sizeof(reg_val));
+    vm->registers[ASM_REGISTER_SP] = sp_val + sizeof(reg_val);
+    return E_SUCCESS;
 }
 
 INSTRUCTION_DEFINE_OP1(POP)
 {
-    int ret = E_SUCCESS;
     reg_value_t reg_val = 0;
-    reg_value_t sp_val = 0;
-
-    ret = read_reg(ASM_REGISTER_SP, &sp_val);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+    reg_value_t sp_val = vm->registers[ASM_REGISTER_SP];
 
     if (sp_val < (reg_value_t)sizeof(reg_val) || sp_val > (reg_value_t)ASM_STACK_SIZE)
     {
-        ret = E_STACK_VIOLATION;
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
 
     sp_val -= sizeof(reg_val);
-    memcpy(&reg_val, &asm_stack[sp_val], sizeof(reg_val));
+    memcpy(&reg_val, &vm->stack[sp_val], sizeof(reg_val));
+    vm->registers[reg0] = reg_val;
+    vm->registers[ASM_REGISTER_SP] = sp_val;
+    return E_SUCCESS;
+}
 
-    ret = write_reg(reg0, reg_val);
-    if (ret != E_SUCCESS)
+INSTRUCTION_DEFINE_OP0(PUSHCTX)
+{
+    reg_value_t sp_val = vm->registers[ASM_REGISTER_SP];
+
+    if (sp_val < (reg_value_t)0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(vm->registers)))
     {
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
-
-    ret = write_reg(ASM_REGISTER_SP, sp_val);
-
-cleanup:
-    return ret;
+    memcpy(&vm->stack[sp_val], vm->registers, sizeof(vm->registers));
+    stack_mark_dirty(vm, sp_val, sizeof(vm->registers));
+    vm->registers[ASM_REGISTER_SP] = sp_val + sizeof(vm->registers);
+    return E_SUCCESS;
 }
 
-INSTRUCTION_DEFINE_OP0(PUSHCTX)
+INSTRUCTION_DEFINE_OP0(POPCTX)
 {
-    int ret = E_SUCCESS;
-    reg_value_t sp_val = 0;
+    reg_value_t sp_val = vm->registers[ASM_REGISTER_SP];
 
-    ret = read_reg(ASM_REGISTER_SP, &sp_val);
-    if (ret != E_SUCCESS)
+    if (sp_val < (reg_value_t)sizeof(vm->registers) || sp_val > (reg_value_t)ASM_STACK_SIZE)
     {
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
 
-    if (sp_val < (reg_value_t)0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(registers)))
+    sp_val -= sizeof(vm->registers);
+    memcpy(vm->registers, &vm->stack[sp_val], sizeof(vm->registers));
+    return E_SUCCESS;
+}
+
+// We must implement division fully in-order to handle division-by-zero.
+INSTRUCTION_DEFINE_OP3(DIV)
+{
+    if (vm->registers[reg2] == 0)
     {
-        ret = E_STACK_VIOLATION;
-        goto cleanup;
+        return E_DIV_ZERO;
     }
-    memcpy(&asm_stack[sp_val], registers, sizeof(registers));
-    ret = write_reg(ASM_REGISTER_SP, sp_val + sizeof(registers));
 
-cleanup:
-    return ret;
+    vm->registers[reg0] = vm->registers[reg1] / vm->registers[reg2];
+    return E_SUCCESS;
 }
 
-INSTRUCTION_DEFINE_OP0(POPCTX)
+// Division by a zero immediate is detected by the decoder.
+INSTRUCTION_DEFINE_OP_IMM32(DIVI)
 {
-    int ret = E_SUCCESS;
-    reg_value_t sp_val = 0;
+    vm->registers[reg0] = vm->registers[reg1] / imm32;
+    return E_SUCCESS;
+}
 
-    ret = read_reg(ASM_REGISTER_SP, &sp_val);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+INSTRUCTION_DEFINE_OP_IMM32(ROL)
+{
+    vm->registers[reg0] = _rotl(vm->registers[reg1], imm32);
+    return E_SUCCESS;
+}
 
-    if (sp_val < (reg_value_t)sizeof(registers) || sp_val > (reg_value_t)ASM_STACK_SIZE)
-    {
-        ret = E_STACK_VIOLATION;
-        goto cleanup;
-    }
+INSTRUCTION_DEFINE_OP_IMM32(ROR)
+{
+    vm->registers[reg0] = _rotr(vm->registers[reg1], imm32);
+    return E_SUCCESS;
+}
 
-    sp_val -= sizeof(registers);
-    memcpy(registers, &asm_stack[sp_val], sizeof(registers));
+INSTRUCTION_DEFINE_OP_REL32(JMP)
+{
+    (void)vm;
+    return E_BRANCH_TAKEN;
+}
 
-cleanup:
-    return ret;
+INSTRUCTION_DEFINE_OP1_REL32(JZ)
+{
+    return (vm->registers[reg0] == 0) ? E_BRANCH_TAKEN : E_BRANCH_NOT_TAKEN;
 }
 
-// We must implement division fully in-order to handle division-by-zero.
-INSTRUCTION_DEFINE_OP3(DIV)
+INSTRUCTION_DEFINE_OP1_REL32(JNZ)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value1 = 0;
-    reg_value_t value2 = 0;
-    ret = read_reg(reg1, &value1);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+    return (vm->registers[reg0] != 0) ? E_BRANCH_TAKEN : E_BRANCH_NOT_TAKEN;
+}
 
-    ret = read_reg(reg2, &value2);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+INSTRUCTION_DEFINE_OP1_REL32(LOOP)
+{
+    reg_value_t counter = (reg_value_t)((uint32_t)vm->registers[reg0] - 1);
+    vm->registers[reg0] = counter;
+    return (counter != 0) ? E_BRANCH_TAKEN : E_BRANCH_NOT_TAKEN;
+}
+
+INSTRUCTION_DEFINE_OP_IMM32(LOAD)
+{
+    reg_value_t offset = (reg_value_t)((uint32_t)vm->registers[reg1] + (uint32_t)imm32);
+    reg_value_t reg_val = 0;
 
-    if (value2 == 0)
+    if (!stack_range_valid(offset, sizeof(reg_val)))
     {
-        ret = E_DIV_ZERO;
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
+    memcpy(&reg_val, &vm->stack[offset], sizeof(reg_val));
+    vm->registers[reg0] = reg_val;
+    return E_SUCCESS;
+}
 
-    value1 = value1 / value2;
+INSTRUCTION_DEFINE_OP_IMM32(STORE)
+{
+    reg_value_t offset = (reg_value_t)((uint32_t)vm->registers[reg1] + (uint32_t)imm32);
+    reg_value_t reg_val = vm->registers[reg0];
 
-    ret = write_reg(reg0, value1);
-    if (ret != E_SUCCESS)
+    if (!stack_range_valid(offset, sizeof(reg_val)))
     {
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
-
-cleanup:
-    return ret;
+    memcpy(&vm->stack[offset], &reg_val, sizeof(reg_val));
+    stack_mark_dirty(vm, offset, sizeof(reg_val));
+    return E_SUCCESS;
 }
 
-// We must implement division fully in-order to handle division-by-zero.
-INSTRUCTION_DEFINE_OP_IMM32(DIVI)
+INSTRUCTION_DEFINE_OP3(MEMCPY)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value = 0;
-    ret = read_reg(reg1, &value);
-    if (ret != E_SUCCESS)
+    reg_value_t size = vm->registers[reg2];
+
+    if (!stack_range_valid(vm->registers[reg0], size) || !stack_range_valid(vm->registers[reg1], size))
     {
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
+    memmove(&vm->stack[vm->registers[reg0]], &vm->stack[vm->registers[reg1]], (size_t)size);
+    stack_mark_dirty(vm, vm->registers[reg0], size);
+    return E_SUCCESS;
+}
+
+INSTRUCTION_DEFINE_OP3(MEMSET)
+{
+    reg_value_t size = vm->registers[reg2];
 
-    if (imm32 == 0)
+    if (!stack_range_valid(vm->registers[reg0], size))
     {
-        ret = E_DIV_ZERO;
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
+    memset(&vm->stack[vm->registers[reg0]], (uint8_t)vm->registers[reg1], (size_t)size);
+    stack_mark_dirty(vm, vm->registers[reg0], size);
+    return E_SUCCESS;
+}
 
-    value = value / imm32;
+INSTRUCTION_DEFINE_OP3(MEMCMP)
+{
+    reg_value_t size = vm->registers[reg0];
+    int result = 0;
 
-    ret = write_reg(reg0, value);
-    if (ret != E_SUCCESS)
+    if (!stack_range_valid(vm->registers[reg1], size) || !stack_range_valid(vm->registers[reg2], size))
     {
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
+    result = memcmp(&vm->stack[vm->registers[reg1]], &vm->stack[vm->registers[reg2]], (size_t)size);
+    vm->registers[reg0] = (result > 0) - (result < 0);
+    return E_SUCCESS;
+}
 
-cleanup:
-    return ret;
+// HALT is never encoded in payloads - the decoder places it right after the last instruction it managed to decode.
+// It reports the decoding error that stopped the decoder (stored in 'imm32').
+INSTRUCTION_DEFINE_OP_IMM32(HALT)
+{
+    (void)vm;
+    (void)reg0;
+    (void)reg1;
+    return imm32;
 }
 
-INSTRUCTION_DEFINE_OP_IMM32(ROL)
+// The instructions below are never encoded in payloads - the decoder replaces the instructions that would fail
+// because of their registers operands with them. The error is stored in 'imm32'.
+
+INSTRUCTION_DEFINE_OP_IMM32(FAULT)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value = 0;
-    ret = read_reg(reg1, &value);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+    (void)vm;
+    (void)reg0;
+    (void)reg1;
+    return imm32;
+}
 
-    value = _rotl(value, imm32);
+// DIV with an invalid destination register
+INSTRUCTION_DEFINE_OP3_IMM32(DIV_WFAULT)
+{
+    (void)reg0;
+    (void)reg1;
+    return (vm->registers[reg2] == 0) ? E_DIV_ZERO : imm32;
+}
 
-    ret = write_reg(reg0, value);
-    if (ret != E_SUCCESS)
+// POP with an invalid destination register
+INSTRUCTION_DEFINE_OP_IMM32(POP_WFAULT)
+{
+    reg_value_t sp_val = vm->registers[ASM_REGISTER_SP];
+    (void)reg0;
+    (void)reg1;
+
+    if (sp_val < (reg_value_t)sizeof(reg_value_t) || sp_val > (reg_value_t)ASM_STACK_SIZE)
     {
-        goto cleanup;
+        return E_STACK_VIOLATION;
     }
+    return imm32;
+}
 
-cleanup:
-    return ret;
+// The fused instructions below are never encoded in payloads either - the fusion pass (asm_fusion.c) creates them
+// from common instruction sequences that can't fail.
+
+// LOADI reg0, imm32 - "ADDI reg0, ZERO, imm32"
+INSTRUCTION_DEFINE_OP_IMM32(LOADI)
+{
+    (void)reg1;
+    vm->registers[reg0] = imm32;
+    return E_SUCCESS;
 }
 
-INSTRUCTION_DEFINE_OP_IMM32(ROR)
+// PRINTC4 reg0 - "PRINTC reg0; ROR reg0, reg0, 8" (4 times)
+INSTRUCTION_DEFINE_OP1(PRINTC4)
 {
-    int ret = E_SUCCESS;
-    reg_value_t value = 0;
-    ret = read_reg(reg1, &value);
-    if (ret != E_SUCCESS)
+    reg_value_t value = vm->registers[reg0];
+    for (size_t i = 0; i < sizeof(value); ++i)
     {
-        goto cleanup;
+        output_char(&vm->output, value);
+        value = _rotr(value, 8);
     }
 
-    value = _rotr(value, imm32);
+    vm->registers[reg0] = value;
+    return E_SUCCESS;
+}
 
-    ret = write_reg(reg0, value);
-    if (ret != E_SUCCESS)
-    {
-        goto cleanup;
-    }
+// MULSUBIRETNZ reg0, reg1, reg2, imm32 - "MUL reg0, reg1, reg2; SUBI reg0, reg0, imm32; RETNZ reg0"
+INSTRUCTION_DEFINE_OP3_IMM32(MULSUBIRETNZ)
+{
+    reg_value_t value = vm->registers[reg1] * vm->registers[reg2];
+    value = value - imm32;
+    vm->registers[reg0] = value;
+    return (value != 0) ? E_RETURN : E_SUCCESS;
+}
 
-cleanup:
-    return ret;
+// The unchecked stack instructions below are only produced by the verifier (asm_verifier.c), for instructions whose
+// SP is known to be inside the stack.
+
+// PUSH_NOCHECK reg0 - PUSH reg0
+INSTRUCTION_DEFINE_OP1(PUSH_NOCHECK)
+{
+    reg_value_t reg_val = vm->registers[reg0];
+    reg_value_t sp_val = vm->registers[ASM_REGISTER_SP];
+
+    memcpy(&vm->stack[sp_val], &reg_val, sizeof(reg_val));
+    stack_mark_dirty(vm, sp_val, sizeof(reg_val));
+    vm->registers[ASM_REGISTER_SP] = sp_val + sizeof(reg_val);
+    return E_SUCCESS;
+}
+
+// POP_NOCHECK reg0 - POP reg0
+INSTRUCTION_DEFINE_OP1(POP_NOCHECK)
+{
+    reg_value_t reg_val = 0;
+    reg_value_t sp_val = vm->registers[ASM_REGISTER_SP] - sizeof(reg_val);
+
+    memcpy(&reg_val, &vm->stack[sp_val], sizeof(reg_val));
+    vm->registers[reg0] = reg_val;
+    vm->registers[ASM_REGISTER_SP] = sp_val;
+    return E_SUCCESS;
 }
 
 // This is the table containing the function pointers for the instructions implementations.
-// If you add an instruction, add the INSTRUCTION_SYMBOL entry to this table with the opcode value.
+// If you add an instruction, add the INSTRUCTION_SYMBOL entry to this table with the opcode value,
+// and the INSTRUCTION_OPERANDS entry to the operands table below it.
 
 #define INSTRUCTION_SYMBOL(opcode) [opcode] = __INSTRUCTION_DEFINE_##opcode
-instruction_definition_t asm_instruction_definitions[MAX_ASM_OPCODE_VAL] = {
-    INSTRUCTION_SYMBOL(ADD),     INSTRUCTION_SYMBOL(ADDI),    INSTRUCTION_SYMBOL(AND),    INSTRUCTION_SYMBOL(ANDI),
-    INSTRUCTION_SYMBOL(DIV),     INSTRUCTION_SYMBOL(DIVI),    INSTRUCTION_SYMBOL(MUL),    INSTRUCTION_SYMBOL(MULI),
-    INSTRUCTION_SYMBOL(OR),      INSTRUCTION_SYMBOL(ORI),     INSTRUCTION_SYMBOL(PRINTC), INSTRUCTION_SYMBOL(PRINTDD),
-    INSTRUCTION_SYMBOL(PRINTDX), INSTRUCTION_SYMBOL(PRINTNL), INSTRUCTION_SYMBOL(RET),    INSTRUCTION_SYMBOL(RETNZ),
-    INSTRUCTION_SYMBOL(RETZ),    INSTRUCTION_SYMBOL(ROL),     INSTRUCTION_SYMBOL(ROR),    INSTRUCTION_SYMBOL(SHL),
-    INSTRUCTION_SYMBOL(SHR),     INSTRUCTION_SYMBOL(SUB),     INSTRUCTION_SYMBOL(SUBI),   INSTRUCTION_SYMBOL(XOR),
-    INSTRUCTION_SYMBOL(XORI),    INSTRUCTION_SYMBOL(PUSH),    INSTRUCTION_SYMBOL(POP),    INSTRUCTION_SYMBOL(PUSHCTX),
-    INSTRUCTION_SYMBOL(POPCTX),
+instruction_definition_t asm_instruction_definitions[MAX_ASM_INTERNAL_OPCODE_VAL] = {
+    INSTRUCTION_SYMBOL(ADD),        INSTRUCTION_SYMBOL(ADDI),       INSTRUCTION_SYMBOL(AND),
+    INSTRUCTION_SYMBOL(ANDI),       INSTRUCTION_SYMBOL(DIV),        INSTRUCTION_SYMBOL(DIVI),
+    INSTRUCTION_SYMBOL(MUL),        INSTRUCTION_SYMBOL(MULI),       INSTRUCTION_SYMBOL(OR),
+    INSTRUCTION_SYMBOL(ORI),        INSTRUCTION_SYMBOL(PRINTC),     INSTRUCTION_SYMBOL(PRINTDD),
+    INSTRUCTION_SYMBOL(PRINTDX),    INSTRUCTION_SYMBOL(PRINTNL),    INSTRUCTION_SYMBOL(RET),
+    INSTRUCTION_SYMBOL(RETNZ),      INSTRUCTION_SYMBOL(RETZ),       INSTRUCTION_SYMBOL(ROL),
+    INSTRUCTION_SYMBOL(ROR),        INSTRUCTION_SYMBOL(SHL),        INSTRUCTION_SYMBOL(SHR),
+    INSTRUCTION_SYMBOL(SUB),        INSTRUCTION_SYMBOL(SUBI),       INSTRUCTION_SYMBOL(XOR),
+    INSTRUCTION_SYMBOL(XORI),       INSTRUCTION_SYMBOL(PUSH),       INSTRUCTION_SYMBOL(POP),
+    INSTRUCTION_SYMBOL(PUSHCTX),    INSTRUCTION_SYMBOL(POPCTX),     INSTRUCTION_SYMBOL(JMP),
+    INSTRUCTION_SYMBOL(JZ),         INSTRUCTION_SYMBOL(JNZ),        INSTRUCTION_SYMBOL(LOOP),
+    INSTRUCTION_SYMBOL(LOAD),       INSTRUCTION_SYMBOL(STORE),      INSTRUCTION_SYMBOL(MEMCPY),
+    INSTRUCTION_SYMBOL(MEMSET),     INSTRUCTION_SYMBOL(MEMCMP),     INSTRUCTION_SYMBOL(HALT),
+    INSTRUCTION_SYMBOL(FAULT),      INSTRUCTION_SYMBOL(DIV_WFAULT), INSTRUCTION_SYMBOL(POP_WFAULT),
+    INSTRUCTION_SYMBOL(LOADI),      INSTRUCTION_SYMBOL(PRINTC4),    INSTRUCTION_SYMBOL(MULSUBIRETNZ),
+    INSTRUCTION_SYMBOL(PUSH_NOCHECK), INSTRUCTION_SYMBOL(POP_NOCHECK),
+};
+
+#define INSTRUCTION_OPERANDS(opcode) [opcode] = (asm_operands_format_t)__INSTRUCTION_OPERANDS_##opcode
+asm_operands_format_t asm_instruction_operands[MAX_ASM_OPCODE_VAL] = {
+    INSTRUCTION_OPERANDS(ADD),     INSTRUCTION_OPERANDS(ADDI),    INSTRUCTION_OPERANDS(AND),
+    INSTRUCTION_OPERANDS(ANDI),    INSTRUCTION_OPERANDS(DIV),     INSTRUCTION_OPERANDS(DIVI),
+    INSTRUCTION_OPERANDS(MUL),     INSTRUCTION_OPERANDS(MULI),    INSTRUCTION_OPERANDS(OR),
+    INSTRUCTION_OPERANDS(ORI),     INSTRUCTION_OPERANDS(PRINTC),  INSTRUCTION_OPERANDS(PRINTDD),
+    INSTRUCTION_OPERANDS(PRINTDX), INSTRUCTION_OPERANDS(PRINTNL), INSTRUCTION_OPERANDS(RET),
+    INSTRUCTION_OPERANDS(RETNZ),   INSTRUCTION_OPERANDS(RETZ),    INSTRUCTION_OPERANDS(ROL),
+    INSTRUCTION_OPERANDS(ROR),     INSTRUCTION_OPERANDS(SHL),     INSTRUCTION_OPERANDS(SHR),
+    INSTRUCTION_OPERANDS(SUB),     INSTRUCTION_OPERANDS(SUBI),    INSTRUCTION_OPERANDS(XOR),
+    INSTRUCTION_OPERANDS(XORI),    INSTRUCTION_OPERANDS(PUSH),    INSTRUCTION_OPERANDS(POP),
+    INSTRUCTION_OPERANDS(PUSHCTX), INSTRUCTION_OPERANDS(POPCTX),  INSTRUCTION_OPERANDS(JMP),
+    INSTRUCTION_OPERANDS(JZ),      INSTRUCTION_OPERANDS(JNZ),     INSTRUCTION_OPERANDS(LOOP),
+    INSTRUCTION_OPERANDS(LOAD),    INSTRUCTION_OPERANDS(STORE),   INSTRUCTION_OPERANDS(MEMCPY),
+    INSTRUCTION_OPERANDS(MEMSET),  INSTRUCTION_OPERANDS(MEMCMP),
+};
+
+#define OPCODE_NAME(opcode) [opcode] = #opcode
+const char * asm_opcode_names[MAX_ASM_INTERNAL_OPCODE_VAL] = {
+    OPCODE_NAME(ADD),          OPCODE_NAME(ADDI),         OPCODE_NAME(AND),          OPCODE_NAME(ANDI),
+    OPCODE_NAME(DIV),          OPCODE_NAME(DIVI),         OPCODE_NAME(MUL),          OPCODE_NAME(MULI),
+    OPCODE_NAME(OR),           OPCODE_NAME(ORI),          OPCODE_NAME(PRINTC),       OPCODE_NAME(PRINTDD),
+    OPCODE_NAME(PRINTDX),      OPCODE_NAME(PRINTNL),      OPCODE_NAME(RET),          OPCODE_NAME(RETNZ),
+    OPCODE_NAME(RETZ),         OPCODE_NAME(ROL),          OPCODE_NAME(ROR),          OPCODE_NAME(SHL),
+    OPCODE_NAME(SHR),          OPCODE_NAME(SUB),          OPCODE_NAME(SUBI),         OPCODE_NAME(XOR),
+    OPCODE_NAME(XORI),         OPCODE_NAME(PUSH),         OPCODE_NAME(POP),          OPCODE_NAME(PUSHCTX),
+    OPCODE_NAME(POPCTX),       OPCODE_NAME(JMP),          OPCODE_NAME(JZ),           OPCODE_NAME(JNZ),
+    OPCODE_NAME(LOOP),         OPCODE_NAME(LOAD),         OPCODE_NAME(STORE),        OPCODE_NAME(MEMCPY),
+    OPCODE_NAME(MEMSET),       OPCODE_NAME(MEMCMP),       OPCODE_NAME(HALT),         OPCODE_NAME(FAULT),
+    OPCODE_NAME(DIV_WFAULT),   OPCODE_NAME(POP_WFAULT),   OPCODE_NAME(LOADI),        OPCODE_NAME(PRINTC4),
+    OPCODE_NAME(MULSUBIRETNZ), OPCODE_NAME(PUSH_NOCHECK), OPCODE_NAME(POP_NOCHECK),
 };
@@ -0,0 +1,923 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "asm_jit.h"
+#include "asm_execution.h"
+#include "asm_processor_state.h"
+#include "asm_instructions.h"
+#include "asm_snapshot.h"
+#include "common.h"
+
+// The JIT translates every decoded instruction into a fixed machine-code template.
+// The generated function has the signature of 'jit_function_t' and works directly on the processor state:
+//  rbx - pinned pointer to the context (which starts with the registers array)
+//  r12 - pointer to the stack
+//  r13 - where to write the executed instructions count when exiting
+// Every instruction that may stop the execution (RET*, faults) gets an inline exit stub that adds the
+// instruction count (known at translation time) to [r13] and returns the error code through a shared epilogue.
+// [r13] starts at 0, and every taken branch adds the difference between the count known at the branch and the one
+// known at its target to it, so the stubs can keep using the count of a straight-line execution.
+// Instructions with invalid registers / writes to ZERO were replaced by the decoder with FAULT instructions,
+// which become unconditional exits.
+
+typedef int (*jit_function_t)(vm_context_t * vm, uint8_t * stack, int * count_out);
+
+_Static_assert(offsetof(vm_context_t, registers) == 0, "The JIT addresses the registers through the context pointer");
+
+// Worst case size of a single instruction template (PUSHCTX / POPCTX), including its exit stubs
+#define JIT_MAX_INSTRUCTION_SIZE (160)
+#define JIT_PROLOGUE_EPILOGUE_SIZE (64)
+
+#define JIT_REG_DISP(reg) ((uint8_t)((reg) * sizeof(reg_value_t)))
+#define JIT_REGISTERS_SIZE (sizeof(reg_value_t) * (ASM_REGISTER_END - ASM_REGISTER_START))
+
+#if defined(__x86_64__)
+
+static void jit_print_char(vm_context_t * vm, reg_value_t value)
+{
+    output_char(&vm->output, value);
+}
+
+static void jit_print_dd(vm_context_t * vm, reg_value_t value)
+{
+    output_dd(&vm->output, value);
+}
+
+static void jit_print_dx(vm_context_t * vm, reg_value_t value)
+{
+    output_dx(&vm->output, value);
+}
+
+static void jit_print_nl(vm_context_t * vm)
+{
+    output_nl(&vm->output);
+}
+
+// MEMCPY / MEMSET / MEMCMP are executed by the interpreter's handlers (which are mostly the libc routines anyway).
+// 'operands' packs the opcode and the registers of the instruction (see jit_emit_instruction).
+static int jit_memory_access(vm_context_t * vm, uint32_t operands)
+{
+    asm_instruction_t instruction = { 0 };
+
+    instruction.opcode = (opcode_t)(operands >> 24);
+    instruction.reg0 = (reg_t)operands;
+    instruction.reg1 = (reg_t)(operands >> 8);
+    instruction.reg2 = (reg_t)(operands >> 16);
+    return asm_instruction_definitions[instruction.opcode](vm, &instruction);
+}
+
+static void emit_u8(asm_jit_code_t * code, uint8_t byte)
+{
+    code->code[code->size++] = byte;
+}
+
+static void emit_bytes(asm_jit_code_t * code, const uint8_t * bytes, size_t len)
+{
+    memcpy(&code->code[code->size], bytes, len);
+    code->size += len;
+}
+
+static void emit_u32(asm_jit_code_t * code, uint32_t value)
+{
+    emit_bytes(code, (const uint8_t *)&value, sizeof(value));
+}
+
+static void emit_u64(asm_jit_code_t * code, uint64_t value)
+{
+    emit_bytes(code, (const uint8_t *)&value, sizeof(value));
+}
+
+// mov eax/ecx/edx/esi, dword [rbx + reg * 4]
+#define JIT_EAX (0)
+#define JIT_ECX (1)
+#define JIT_EDX (2)
+#define JIT_ESI (6)
+static void emit_load_reg(asm_jit_code_t * code, int host_reg, uint8_t reg)
+{
+    emit_u8(code, 0x8b);
+    emit_u8(code, 0x43 | (host_reg << 3));
+    emit_u8(code, JIT_REG_DISP(reg));
+}
+
+// mov dword [rbx + reg * 4], eax/ecx
+static void emit_store_reg(asm_jit_code_t * code, int host_reg, uint8_t reg)
+{
+    emit_u8(code, 0x89);
+    emit_u8(code, 0x43 | (host_reg << 3));
+    emit_u8(code, JIT_REG_DISP(reg));
+}
+
+// <op> eax, dword [rbx + reg * 4]
+static void emit_alu_reg(asm_jit_code_t * code, asm_opcode_t opcode, uint8_t reg)
+{
+    switch (opcode)
+    {
+    case ADD:
+        emit_u8(code, 0x03);
+        break;
+    case SUB:
+        emit_u8(code, 0x2b);
+        break;
+    case AND:
+        emit_u8(code, 0x23);
+        break;
+    case OR:
+        emit_u8(code, 0x0b);
+        break;
+    case XOR:
+        emit_u8(code, 0x33);
+        break;
+    case MUL:
+        emit_u8(code, 0x0f);
+        emit_u8(code, 0xaf);
+        break;
+    default:
+        break;
+    }
+    emit_u8(code, 0x43);
+    emit_u8(code, JIT_REG_DISP(reg));
+}
+
+// <op> eax, imm32
+static void emit_alu_imm32(asm_jit_code_t * code, asm_opcode_t opcode, int32_t imm32)
+{
+    switch (opcode)
+    {
+    case ADDI:
+        emit_u8(code, 0x05);
+        break;
+    case SUBI:
+        emit_u8(code, 0x2d);
+        break;
+    case ANDI:
+        emit_u8(code, 0x25);
+        break;
+    case ORI:
+        emit_u8(code, 0x0d);
+        break;
+    case XORI:
+        emit_u8(code, 0x35);
+        break;
+    case MULI:
+        // imul eax, eax, imm32
+        emit_u8(code, 0x69);
+        emit_u8(code, 0xc0);
+        break;
+    default:
+        break;
+    }
+    emit_u32(code, (uint32_t)imm32);
+}
+
+// mov eax/ecx, imm32
+static void emit_mov_imm32(asm_jit_code_t * code, int host_reg, uint32_t imm32)
+{
+    emit_u8(code, 0xb8 + host_reg);
+    emit_u32(code, imm32);
+}
+
+// Adds the instruction count to [r13] and returns eax through the epilogue at the start of the code
+#define JIT_RETURN_STUB_SIZE (13)
+static void emit_return(asm_jit_code_t * code, int count)
+{
+    // add dword [r13 + 0], count
+    emit_bytes(code, (const uint8_t[]){ 0x41, 0x81, 0x45, 0x00 }, 4);
+    emit_u32(code, (uint32_t)count);
+    // jmp epilogue
+    emit_u8(code, 0xe9);
+    emit_u32(code, (uint32_t)(0 - (int32_t)(code->size + sizeof(uint32_t))));
+}
+
+// Returns 'error' (like above)
+#define JIT_EXIT_STUB_SIZE (18)
+static void emit_exit(asm_jit_code_t * code, int count, int error)
+{
+    emit_mov_imm32(code, JIT_EAX, (uint32_t)error);
+    emit_return(code, count);
+}
+
+// Exits with 'error' if the flags match the condition of the short jump 'jcc_skip' NOT taken.
+// (The stub is jumped over when 'jcc_skip' is taken).
+#define JIT_JZ_SHORT (0x74)
+#define JIT_JNZ_SHORT (0x75)
+#define JIT_JBE_SHORT (0x76)
+#define JIT_JLE_SHORT (0x7e)
+static void emit_exit_unless(asm_jit_code_t * code, uint8_t jcc_skip, int count, int error)
+{
+    emit_u8(code, jcc_skip);
+    emit_u8(code, JIT_EXIT_STUB_SIZE);
+    emit_exit(code, count, error);
+}
+
+// Checks that ecx (the stack offset being accessed) is in [0, ASM_STACK_SIZE - size], or exits.
+static void emit_stack_check(asm_jit_code_t * code, int count, size_t size)
+{
+    // cmp ecx, imm32 (unsigned, so negative offsets fail as well)
+    emit_u8(code, 0x81);
+    emit_u8(code, 0xf9);
+    emit_u32(code, (uint32_t)(ASM_STACK_SIZE - size));
+    emit_exit_unless(code, JIT_JBE_SHORT, count, E_STACK_VIOLATION);
+}
+
+// Computes the stack offset of LOAD / STORE (reg1 + imm32) into ecx, and checks it
+static void emit_stack_offset(asm_jit_code_t * code, const asm_instruction_t * instruction, int count)
+{
+    emit_load_reg(code, JIT_ECX, instruction->reg1);
+    // add ecx, imm32
+    emit_bytes(code, (const uint8_t[]){ 0x81, 0xc1 }, 2);
+    emit_u32(code, (uint32_t)instruction->imm32);
+    emit_stack_check(code, count, sizeof(reg_value_t));
+}
+
+// call <function>(vm, esi) (the stack is kept 16-bytes aligned by the prologue)
+static void emit_call(asm_jit_code_t * code, void * function)
+{
+    // mov rdi, rbx
+    emit_bytes(code, (const uint8_t[]){ 0x48, 0x89, 0xdf }, 3);
+    // mov rax, imm64 ; call rax
+    emit_u8(code, 0x48);
+    emit_u8(code, 0xb8);
+    emit_u64(code, (uint64_t)(uintptr_t)function);
+    emit_u8(code, 0xff);
+    emit_u8(code, 0xd0);
+}
+
+// Emits a single instruction. Returns whether the execution may continue to the next instruction.
+// (The registers are used as they are, see program_validate_instruction)
+static int jit_emit_instruction(asm_jit_code_t * code, const asm_instruction_t * instruction, int count)
+{
+    uint8_t reg0 = instruction->reg0;
+    uint8_t reg1 = instruction->reg1;
+    uint8_t reg2 = instruction->reg2;
+    int32_t imm32 = instruction->imm32;
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case ADD:
+    case SUB:
+    case AND:
+    case OR:
+    case XOR:
+    case MUL:
+        emit_load_reg(code, JIT_EAX, reg1);
+        emit_alu_reg(code, (asm_opcode_t)instruction->opcode, reg2);
+        emit_store_reg(code, JIT_EAX, reg0);
+        return 1;
+
+    case ADDI:
+    case SUBI:
+    case ANDI:
+    case ORI:
+    case XORI:
+    case MULI:
+        emit_load_reg(code, JIT_EAX, reg1);
+        emit_alu_imm32(code, (asm_opcode_t)instruction->opcode, imm32);
+        emit_store_reg(code, JIT_EAX, reg0);
+        return 1;
+
+    case SHL:
+    case SHR:
+        emit_load_reg(code, JIT_EAX, reg1);
+        emit_mov_imm32(code, JIT_ECX, (uint32_t)imm32);
+        // shl eax, cl / sar eax, cl
+        emit_u8(code, 0xd3);
+        emit_u8(code, (instruction->opcode == SHL) ? 0xe0 : 0xf8);
+        emit_store_reg(code, JIT_EAX, reg0);
+        return 1;
+
+    case ROL:
+    case ROR:
+        // Same as the _rotl / _rotr macros: both shifts are done on the signed value
+        emit_load_reg(code, JIT_EAX, reg1);
+        // mov edx, eax
+        emit_u8(code, 0x89);
+        emit_u8(code, 0xc2);
+        emit_mov_imm32(code, JIT_ECX, (uint32_t)imm32);
+        // shl eax, cl / sar eax, cl
+        emit_u8(code, 0xd3);
+        emit_u8(code, (instruction->opcode == ROL) ? 0xe0 : 0xf8);
+        emit_mov_imm32(code, JIT_ECX, (uint32_t)32 - (uint32_t)imm32);
+        // sar edx, cl / shl edx, cl
+        emit_u8(code, 0xd3);
+        emit_u8(code, (instruction->opcode == ROL) ? 0xfa : 0xe2);
+        // or eax, edx
+        emit_u8(code, 0x09);
+        emit_u8(code, 0xd0);
+        emit_store_reg(code, JIT_EAX, reg0);
+        return 1;
+
+    case DIV:
+        emit_load_reg(code, JIT_EAX, reg1);
+        emit_load_reg(code, JIT_ECX, reg2);
+        // test ecx, ecx
+        emit_u8(code, 0x85);
+        emit_u8(code, 0xc9);
+        emit_exit_unless(code, JIT_JNZ_SHORT, count, E_DIV_ZERO);
+        // cdq ; idiv ecx
+        emit_u8(code, 0x99);
+        emit_u8(code, 0xf7);
+        emit_u8(code, 0xf9);
+        emit_store_reg(code, JIT_EAX, reg0);
+        return 1;
+
+    case DIVI:
+        // (Division by a zero immediate was replaced with FAULT by the decoder)
+        emit_load_reg(code, JIT_EAX, reg1);
+        emit_mov_imm32(code, JIT_ECX, (uint32_t)imm32);
+        // cdq ; idiv ecx
+        emit_u8(code, 0x99);
+        emit_u8(code, 0xf7);
+        emit_u8(code, 0xf9);
+        emit_store_reg(code, JIT_EAX, reg0);
+        return 1;
+
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+        emit_load_reg(code, JIT_ESI, reg0);
+        emit_call(code, (instruction->opcode == PRINTC)    ? (void *)jit_print_char
+                        : (instruction->opcode == PRINTDD) ? (void *)jit_print_dd
+                                                           : (void *)jit_print_dx);
+        return 1;
+
+    case PRINTNL:
+        emit_call(code, (void *)jit_print_nl);
+        return 1;
+
+    case RET:
+        emit_exit(code, count, E_RETURN);
+        return 0;
+
+    case RETNZ:
+    case RETZ:
+        emit_load_reg(code, JIT_EAX, reg0);
+        // test eax, eax
+        emit_u8(code, 0x85);
+        emit_u8(code, 0xc0);
+        emit_exit_unless(code, (instruction->opcode == RETNZ) ? JIT_JZ_SHORT : JIT_JNZ_SHORT, count, E_RETURN);
+        return 1;
+
+    case PUSH:
+    case PUSH_NOCHECK:
+        emit_load_reg(code, JIT_EAX, reg0);
+        emit_load_reg(code, JIT_ECX, ASM_REGISTER_SP);
+        if (instruction->opcode == PUSH)
+        {
+            emit_stack_check(code, count, sizeof(reg_value_t));
+        }
+        // mov dword [r12 + rcx], eax
+        emit_bytes(code, (const uint8_t[]){ 0x41, 0x89, 0x44, 0x0c, 0x00 }, 5);
+        // add ecx, 4
+        emit_bytes(code, (const uint8_t[]){ 0x81, 0xc1 }, 2);
+        emit_u32(code, sizeof(reg_value_t));
+        emit_store_reg(code, JIT_ECX, ASM_REGISTER_SP);
+        return 1;
+
+    case POP:
+    case POP_NOCHECK:
+        emit_load_reg(code, JIT_ECX, ASM_REGISTER_SP);
+        // sub ecx, 4
+        emit_bytes(code, (const uint8_t[]){ 0x81, 0xe9 }, 2);
+        emit_u32(code, sizeof(reg_value_t));
+        if (instruction->opcode == POP)
+        {
+            emit_stack_check(code, count, sizeof(reg_value_t));
+        }
+        // mov eax, dword [r12 + rcx]
+        emit_bytes(code, (const uint8_t[]){ 0x41, 0x8b, 0x44, 0x0c, 0x00 }, 5);
+        emit_store_reg(code, JIT_EAX, reg0);
+        emit_store_reg(code, JIT_ECX, ASM_REGISTER_SP);
+        return 1;
+
+    case PUSHCTX:
+        emit_load_reg(code, JIT_ECX, ASM_REGISTER_SP);
+        emit_stack_check(code, count, JIT_REGISTERS_SIZE);
+        for (uint8_t reg = ASM_REGISTER_START; reg < ASM_REGISTER_END; ++reg)
+        {
+            emit_load_reg(code, JIT_EAX, reg);
+            // mov dword [r12 + rcx + disp8], eax
+            emit_bytes(code, (const uint8_t[]){ 0x41, 0x89, 0x44, 0x0c, JIT_REG_DISP(reg) }, 5);
+        }
+        // add ecx, JIT_REGISTERS_SIZE
+        emit_bytes(code, (const uint8_t[]){ 0x81, 0xc1 }, 2);
+        emit_u32(code, JIT_REGISTERS_SIZE);
+        emit_store_reg(code, JIT_ECX, ASM_REGISTER_SP);
+        return 1;
+
+    case POPCTX:
+        emit_load_reg(code, JIT_ECX, ASM_REGISTER_SP);
+        // sub ecx, JIT_REGISTERS_SIZE
+        emit_bytes(code, (const uint8_t[]){ 0x81, 0xe9 }, 2);
+        emit_u32(code, JIT_REGISTERS_SIZE);
+        emit_stack_check(code, count, JIT_REGISTERS_SIZE);
+        for (uint8_t reg = ASM_REGISTER_START; reg < ASM_REGISTER_END; ++reg)
+        {
+            // mov eax, dword [r12 + rcx + disp8]
+            emit_bytes(code, (const uint8_t[]){ 0x41, 0x8b, 0x44, 0x0c, JIT_REG_DISP(reg) }, 5);
+            emit_store_reg(code, JIT_EAX, reg);
+        }
+        return 1;
+
+    case LOAD:
+        emit_stack_offset(code, instruction, count);
+        // mov eax, dword [r12 + rcx]
+        emit_bytes(code, (const uint8_t[]){ 0x41, 0x8b, 0x44, 0x0c, 0x00 }, 5);
+        emit_store_reg(code, JIT_EAX, reg0);
+        return 1;
+
+    case STORE:
+        emit_stack_offset(code, instruction, count);
+        emit_load_reg(code, JIT_EAX, reg0);
+        // mov dword [r12 + rcx], eax
+        emit_bytes(code, (const uint8_t[]){ 0x41, 0x89, 0x44, 0x0c, 0x00 }, 5);
+        return 1;
+
+    case MEMCPY:
+    case MEMSET:
+    case MEMCMP:
+        emit_mov_imm32(code, JIT_ESI, (uint32_t)instruction->opcode << 24 | (uint32_t)reg2 << 16 |
+                                          (uint32_t)reg1 << 8 | reg0);
+        emit_call(code, (void *)jit_memory_access);
+        // test eax, eax
+        emit_u8(code, 0x85);
+        emit_u8(code, 0xc0);
+        emit_u8(code, JIT_JZ_SHORT);
+        emit_u8(code, JIT_RETURN_STUB_SIZE);
+        emit_return(code, count);
+        return 1;
+
+    case FAULT:
+        emit_exit(code, count, imm32);
+        return 0;
+
+    case DIV_WFAULT:
+        emit_load_reg(code, JIT_ECX, reg2);
+        // test ecx, ecx
+        emit_u8(code, 0x85);
+        emit_u8(code, 0xc9);
+        emit_exit_unless(code, JIT_JNZ_SHORT, count, E_DIV_ZERO);
+        emit_exit(code, count, imm32);
+        return 0;
+
+    case POP_WFAULT:
+        emit_load_reg(code, JIT_ECX, ASM_REGISTER_SP);
+        // sub ecx, 4
+        emit_bytes(code, (const uint8_t[]){ 0x81, 0xe9 }, 2);
+        emit_u32(code, sizeof(reg_value_t));
+        emit_stack_check(code, count, sizeof(reg_value_t));
+        emit_exit(code, count, imm32);
+        return 0;
+
+    case HALT:
+        // If we couldn't even read the opcode of the last instruction, it wasn't executed
+        emit_exit(code, instruction->reg0 ? count : count - 1, imm32);
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+// The targets of the branches, which are only known once all the instructions were emitted
+typedef struct jit_fixup_s
+{
+    // Where the rel32 of the jump is, and the index of the instruction it jumps to
+    size_t offset;
+    size_t target;
+} jit_fixup_t;
+
+typedef struct jit_labels_s
+{
+    // The code offset of every instruction
+    size_t * offsets;
+    jit_fixup_t * fixups;
+    size_t fixups_count;
+} jit_labels_t;
+
+// The value [r13] may not exceed when the execution continues to instruction 'next', with the count known there
+// being 'count' (see program_limit - the budget fits in an int32). Returns false if the budget doesn't have to be
+// checked.
+static bool jit_gas_threshold(const asm_program_t * program, size_t next, int count, int32_t * threshold_out)
+{
+    if (program->runs == NULL)
+    {
+        return false;
+    }
+
+    *threshold_out = (int32_t)((int64_t)program->budget - count - program->runs[next]);
+    return true;
+}
+
+// Exits with E_OUT_OF_GAS unless the run at instruction 'next' fits in the budget
+static void emit_gas_check(asm_jit_code_t * code, const asm_program_t * program, size_t next, int count)
+{
+    int32_t threshold = 0;
+    if (jit_gas_threshold(program, next, count, &threshold))
+    {
+        // cmp dword [r13 + 0], threshold
+        emit_bytes(code, (const uint8_t[]){ 0x41, 0x81, 0x7d, 0x00 }, 4);
+        emit_u32(code, (uint32_t)threshold);
+        emit_exit_unless(code, JIT_JLE_SHORT, count, E_OUT_OF_GAS);
+    }
+}
+
+// Emits the jump of a taken branch (at instruction 'index') to its target
+static void emit_branch_taken(asm_jit_code_t * code, const asm_program_t * program, size_t index,
+                              jit_labels_t * labels)
+{
+    size_t target = (size_t)program->instructions[index].imm32;
+    int32_t threshold = 0;
+
+    // add dword [r13 + 0], count difference
+    emit_bytes(code, (const uint8_t[]){ 0x41, 0x81, 0x45, 0x00 }, 4);
+    emit_u32(code, (uint32_t)((int32_t)(index + 1) - (int32_t)target));
+
+    if (jit_gas_threshold(program, target, (int)target, &threshold))
+    {
+        // cmp dword [r13 + 0], threshold ; jle target (or exit)
+        emit_bytes(code, (const uint8_t[]){ 0x41, 0x81, 0x7d, 0x00 }, 4);
+        emit_u32(code, (uint32_t)threshold);
+        emit_bytes(code, (const uint8_t[]){ 0x0f, 0x8e }, 2);
+        labels->fixups[labels->fixups_count++] = (jit_fixup_t){ code->size, target };
+        emit_u32(code, 0);
+        emit_exit(code, (int)target, E_OUT_OF_GAS);
+    }
+    else
+    {
+        // jmp target
+        emit_u8(code, 0xe9);
+        labels->fixups[labels->fixups_count++] = (jit_fixup_t){ code->size, target };
+        emit_u32(code, 0);
+    }
+}
+
+// Emits the branch instruction at 'index'. Returns whether the execution may continue to the next instruction.
+static int jit_emit_branch(asm_jit_code_t * code, const asm_program_t * program, size_t index, jit_labels_t * labels)
+{
+    const asm_instruction_t * instruction = &program->instructions[index];
+    uint8_t jcc_not_taken = 0;
+    size_t jcc_offset = 0;
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case JMP:
+        emit_branch_taken(code, program, index, labels);
+        return 0;
+
+    case JZ:
+    case JNZ:
+        emit_load_reg(code, JIT_EAX, instruction->reg0);
+        // test eax, eax
+        emit_u8(code, 0x85);
+        emit_u8(code, 0xc0);
+        jcc_not_taken = (instruction->opcode == JZ) ? JIT_JNZ_SHORT : JIT_JZ_SHORT;
+        break;
+
+    case LOOP:
+        emit_load_reg(code, JIT_EAX, instruction->reg0);
+        emit_alu_imm32(code, SUBI, 1);
+        emit_store_reg(code, JIT_EAX, instruction->reg0);
+        jcc_not_taken = JIT_JZ_SHORT;
+        break;
+
+    default:
+        return -1;
+    }
+
+    // jcc not_taken ; <taken> ; not_taken:
+    emit_u8(code, jcc_not_taken);
+    jcc_offset = code->size;
+    emit_u8(code, 0);
+    emit_branch_taken(code, program, index, labels);
+    code->code[jcc_offset] = (uint8_t)(code->size - (jcc_offset + 1));
+
+    emit_gas_check(code, program, index + 1, (int)(index + 1));
+    return 1;
+}
+
+int jit_compile(const asm_program_t * program, asm_jit_code_t * code_out)
+{
+    int ret = E_SUCCESS;
+    asm_jit_code_t code = { 0 };
+    jit_labels_t labels = { 0 };
+    bool has_branches = false;
+
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        has_branches = has_branches || asm_is_branch((asm_opcode_t)program->instructions[i].opcode);
+    }
+    if (has_branches)
+    {
+        labels.offsets = malloc((program->count + 1) * sizeof(*labels.offsets));
+        labels.fixups = malloc((program->count + 1) * sizeof(*labels.fixups));
+        if (labels.offsets == NULL || labels.fixups == NULL)
+        {
+            ret = E_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    code.capacity = JIT_PROLOGUE_EPILOGUE_SIZE + (program->count + 1) * JIT_MAX_INSTRUCTION_SIZE;
+    code.code = mmap(NULL, code.capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code.code == MAP_FAILED)
+    {
+        code.code = NULL;
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    // The shared epilogue is at the start of the code, so all the exit stubs can jump back to offset 0:
+    // pop r13 ; pop r12 ; pop rbx ; ret
+    emit_bytes(&code, (const uint8_t[]){ 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3 }, 6);
+
+    // Prologue: push rbx ; push r12 ; push r13 ; mov rbx, rdi ; mov r12, rsi ; mov r13, rdx
+    code.entry_offset = code.size;
+    emit_bytes(&code, (const uint8_t[]){ 0x53, 0x41, 0x54, 0x41, 0x55 }, 5);
+    emit_bytes(&code, (const uint8_t[]){ 0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4, 0x49, 0x89, 0xd5 }, 9);
+
+    // The program always ends with HALT, which never continues
+    // (nothing after an instruction that doesn't continue can be reached, unless there are branches)
+    for (size_t i = 0; i <= program->count; ++i)
+    {
+        const asm_instruction_t * instruction = &program->instructions[i];
+        asm_instruction_t unchecked;
+        int result = 0;
+        // (The fused & optimized instructions aren't compiled - the verifier proved the stack instructions of these
+        // ones safe on their own, see 'unchecked')
+        if (program->unchecked != NULL && program->unchecked[i] &&
+            (instruction->opcode == PUSH || instruction->opcode == POP))
+        {
+            unchecked = *instruction;
+            unchecked.opcode = (instruction->opcode == PUSH) ? PUSH_NOCHECK : POP_NOCHECK;
+            instruction = &unchecked;
+        }
+        if (has_branches)
+        {
+            labels.offsets[i] = code.size;
+        }
+
+        if (asm_is_branch((asm_opcode_t)instruction->opcode))
+        {
+            result = jit_emit_branch(&code, program, i, &labels);
+        }
+        else
+        {
+            result = jit_emit_instruction(&code, instruction, (int)(i + 1));
+        }
+
+        if (result < 0)
+        {
+            ret = E_NOT_IMPL_INSTR;
+            goto cleanup;
+        }
+        else if (result == 0 && !has_branches)
+        {
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < labels.fixups_count; ++i)
+    {
+        const jit_fixup_t * fixup = &labels.fixups[i];
+        int32_t rel32 = (int32_t)(labels.offsets[fixup->target] - (fixup->offset + sizeof(rel32)));
+        memcpy(&code.code[fixup->offset], &rel32, sizeof(rel32));
+    }
+
+    if (mprotect(code.code, code.capacity, PROT_READ | PROT_EXEC) != 0)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    *code_out = code;
+    code.code = NULL;
+
+cleanup:
+    free(labels.offsets);
+    free(labels.fixups);
+    jit_free(&code);
+    return ret;
+}
+
+void jit_free(asm_jit_code_t * code)
+{
+    if (code->code != NULL)
+    {
+        munmap(code->code, code->capacity);
+    }
+    memset(code, 0, sizeof(*code));
+}
+
+int jit_execute(vm_context_t * vm, const asm_jit_code_t * code, int * count_out)
+{
+    int ret = E_SUCCESS;
+    int count = 0;
+    jit_function_t function = (jit_function_t)(void *)&code->code[code->entry_offset];
+
+    // Init context (the native code doesn't record which stack bytes it writes, so they all may be)
+    initialize_context(vm);
+    stack_mark_dirty(vm, 0, ASM_STACK_SIZE);
+
+    ret = function(vm, vm->stack, &count);
+    output_flush(&vm->output);
+
+    // If we exited because of a RET/RETNZ instruction, we want to report success
+    if (ret == E_RETURN)
+    {
+        ret = E_SUCCESS;
+    }
+
+    if (count_out)
+    {
+        *count_out = count;
+    }
+    return ret;
+}
+
+#else /* !defined(__x86_64__) */
+
+int jit_compile(const asm_program_t * program, asm_jit_code_t * code_out)
+{
+    (void)program;
+    (void)code_out;
+    return E_NOT_IMPL_INSTR;
+}
+
+void jit_free(asm_jit_code_t * code)
+{
+    memset(code, 0, sizeof(*code));
+}
+
+int jit_execute(vm_context_t * vm, const asm_jit_code_t * code, int * count_out)
+{
+    (void)vm;
+    (void)code;
+    (void)count_out;
+    return E_NOT_IMPL_INSTR;
+}
+
+#endif /* defined(__x86_64__) */
+
+int execute_asm_program_jit(vm_context_t * vm, const asm_program_t * program, int * count_out)
+{
+    int ret = E_SUCCESS;
+    asm_jit_code_t code = { 0 };
+
+    if (program->jit != NULL)
+    {
+        // (Already compiled)
+        ret = jit_execute(vm, program->jit, count_out);
+        goto cleanup;
+    }
+
+    ret = jit_compile(program, &code);
+    if (ret != E_SUCCESS)
+    {
+        // Anything we can't compile is executed by the interpreter
+        ret = execute_asm_program(vm, program, ASM_ENGINE_INTERPRETER, count_out);
+        goto cleanup;
+    }
+
+    ret = jit_execute(vm, &code, count_out);
+
+cleanup:
+    jit_free(&code);
+    return ret;
+}
+
+// The results of a single run, for comparing engines
+typedef struct jit_run_result_s
+{
+    int ret;
+    int count;
+    vm_context_t * vm;
+    char * output;
+    size_t output_size;
+} jit_run_result_t;
+
+// Executes the program on a new context that starts from 'snapshot' (with the interpreter, or 'code' if it's not
+// NULL), capturing its output.
+static int jit_run_captured(const asm_program_t * program, const asm_jit_code_t * code,
+                            const asm_snapshot_t * snapshot, jit_run_result_t * result)
+{
+    int ret = E_SUCCESS;
+    FILE * capture_fp = NULL;
+
+    memset(result, 0, sizeof(*result));
+    capture_fp = tmpfile();
+    result->vm = malloc(sizeof(*result->vm));
+    if (capture_fp == NULL || result->vm == NULL)
+    {
+        ret = (capture_fp == NULL) ? E_FOPEN : E_NOMEM;
+        goto cleanup;
+    }
+    ret = vm_init(result->vm, fileno(capture_fp));
+    if (ret != E_SUCCESS)
+    {
+        free(result->vm);
+        result->vm = NULL;
+        goto cleanup;
+    }
+    vm_set_snapshot(result->vm, snapshot);
+
+    result->ret = (code != NULL) ? jit_execute(result->vm, code, &result->count)
+                                 : execute_asm_program(result->vm, program, ASM_ENGINE_INTERPRETER, &result->count);
+
+    long size = ftell(capture_fp);
+    result->output = malloc((size > 0) ? (size_t)size : 1);
+    if (size == -1 || result->output == NULL)
+    {
+        ret = E_FREAD;
+        goto cleanup;
+    }
+    rewind(capture_fp);
+    result->output_size = fread(result->output, 1, (size_t)size, capture_fp);
+
+cleanup:
+    if (capture_fp != NULL)
+    {
+        fclose(capture_fp);
+    }
+    return ret;
+}
+
+static void jit_free_run_result(jit_run_result_t * result)
+{
+    if (result->vm != NULL)
+    {
+        vm_free(result->vm);
+    }
+    free(result->vm);
+    free(result->output);
+}
+
+int execute_asm_program_jit_differential(vm_context_t * vm, const asm_program_t * program, int * count_out)
+{
+    int ret = E_SUCCESS;
+    asm_jit_code_t code = { 0 };
+    jit_run_result_t expected = { 0 };
+    jit_run_result_t actual = { 0 };
+
+    if (jit_compile(program, &code) != E_SUCCESS)
+    {
+        // Nothing to compare against
+        ret = execute_asm_program(vm, program, ASM_ENGINE_INTERPRETER, count_out);
+        goto cleanup;
+    }
+
+    ret = jit_run_captured(program, NULL, vm->snapshot, &expected);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    ret = jit_run_captured(program, &code, vm->snapshot, &actual);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    // Only the JIT's results reach the caller's context
+    memcpy(vm->registers, actual.vm->registers, sizeof(vm->registers));
+    memcpy(vm->stack, actual.vm->stack, ASM_STACK_SIZE);
+    stack_mark_dirty(vm, 0, ASM_STACK_SIZE);
+    output_write(&vm->output, (const uint8_t *)actual.output, actual.output_size);
+    if (count_out)
+    {
+        *count_out = actual.count;
+    }
+
+    ret = actual.ret;
+    if (expected.ret != actual.ret || expected.count != actual.count)
+    {
+        fprintf(stderr, "JIT mismatch: interpreter returned %d after 0x%X instructions, JIT returned %d after 0x%X\n",
+                expected.ret, expected.count, actual.ret, actual.count);
+        ret = E_JIT_MISMATCH;
+    }
+    for (size_t i = 0; i < ASM_REGISTER_END - ASM_REGISTER_START; ++i)
+    {
+        if (expected.vm->registers[i] != actual.vm->registers[i])
+        {
+            fprintf(stderr, "JIT mismatch: register %zu is 0x%x in the interpreter, 0x%x in the JIT\n", i,
+                    expected.vm->registers[i], actual.vm->registers[i]);
+            ret = E_JIT_MISMATCH;
+        }
+    }
+    if (memcmp(expected.vm->stack, actual.vm->stack, ASM_STACK_SIZE) != 0)
+    {
+        fprintf(stderr, "JIT mismatch: stack contents differ\n");
+        ret = E_JIT_MISMATCH;
+    }
+    if (expected.output_size != actual.output_size || memcmp(expected.output, actual.output, actual.output_size) != 0)
+    {
+        fprintf(stderr, "JIT mismatch: output differs (%zu bytes in the interpreter, %zu bytes in the JIT)\n",
+                expected.output_size, actual.output_size);
+        ret = E_JIT_MISMATCH;
+    }
+
+cleanup:
+    jit_free_run_result(&expected);
+    jit_free_run_result(&actual);
+    jit_free(&code);
+    return ret;
+}
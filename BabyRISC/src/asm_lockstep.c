@@ -0,0 +1,642 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "asm_lockstep.h"
+#include "asm_instructions.h"
+#include "asm_output.h"
+
+// The ALU instructions are written as plain loops over all the lanes, which the compiler turns into vector
+// instructions (SSE2 by default, AVX2 with "-mavx2"). Finished lanes are masked out with blending instead of
+// branches: 'active' is all ones for the lanes that are still executing, 0 for the others.
+// The instructions that depend on per-lane values in a way that can't be vectorized (the stack and memory
+// instructions, division, printing and returning) loop over the active lanes one at a time.
+// Branches may send the lanes to different instructions, so every lane has its own program counter: each step
+// executes the lowest instruction any active lane is at, over the lanes that are at it ('executing' - a subset of
+// 'active', with the same format), so lanes that diverged meet again as soon as they reach the same instruction.
+// (The registers are accessed directly, see program_validate_instruction)
+
+#define LOCKSTEP_REGISTERS_COUNT (ASM_REGISTER_END - ASM_REGISTER_START)
+
+typedef struct lockstep_block_s
+{
+    reg_value_t registers[LOCKSTEP_REGISTERS_COUNT][ASM_LOCKSTEP_LANES];
+    int32_t active[ASM_LOCKSTEP_LANES];
+    int32_t executing[ASM_LOCKSTEP_LANES];
+    uint32_t pc[ASM_LOCKSTEP_LANES];
+    int32_t count[ASM_LOCKSTEP_LANES];
+    int ret[ASM_LOCKSTEP_LANES];
+    size_t active_lanes;
+    // The values computed by the current instruction (before they are blended into the registers)
+    reg_value_t values[ASM_LOCKSTEP_LANES];
+    uint8_t stacks[ASM_LOCKSTEP_LANES][ASM_STACK_SIZE];
+    asm_output_t outputs[ASM_LOCKSTEP_LANES];
+} lockstep_block_t;
+
+// The ALU operations, with the same results the other engines get from the hardware (wrap-around arithmetic, shift
+// counts modulo 32 - see also the AOT translator)
+static inline reg_value_t lockstep_add(reg_value_t a, reg_value_t b)
+{
+    return (reg_value_t)((uint32_t)a + (uint32_t)b);
+}
+
+static inline reg_value_t lockstep_sub(reg_value_t a, reg_value_t b)
+{
+    return (reg_value_t)((uint32_t)a - (uint32_t)b);
+}
+
+static inline reg_value_t lockstep_mul(reg_value_t a, reg_value_t b)
+{
+    return (reg_value_t)((uint32_t)a * (uint32_t)b);
+}
+
+static inline reg_value_t lockstep_and(reg_value_t a, reg_value_t b)
+{
+    return a & b;
+}
+
+static inline reg_value_t lockstep_or(reg_value_t a, reg_value_t b)
+{
+    return a | b;
+}
+
+static inline reg_value_t lockstep_xor(reg_value_t a, reg_value_t b)
+{
+    return a ^ b;
+}
+
+static inline reg_value_t lockstep_shl(reg_value_t a, reg_value_t b)
+{
+    return (reg_value_t)((uint32_t)a << ((uint32_t)b & 31));
+}
+
+static inline reg_value_t lockstep_shr(reg_value_t a, reg_value_t b)
+{
+    return a >> ((uint32_t)b & 31);
+}
+
+static inline reg_value_t lockstep_rol(reg_value_t a, reg_value_t b)
+{
+    return lockstep_shl(a, b) | lockstep_shr(a, 32 - b);
+}
+
+static inline reg_value_t lockstep_ror(reg_value_t a, reg_value_t b)
+{
+    return lockstep_shr(a, b) | lockstep_shl(a, 32 - b);
+}
+
+// Writes the computed values into 'reg' of the executing lanes
+static inline void lockstep_commit(lockstep_block_t * block, asm_register_t reg)
+{
+    reg_value_t * row = block->registers[reg];
+    for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)
+    {
+        row[lane] = (block->values[lane] & block->executing[lane]) | (row[lane] & ~block->executing[lane]);
+    }
+}
+
+// Masks out a lane that finished executing
+static void lockstep_finish(lockstep_block_t * block, size_t lane, int ret)
+{
+    if (block->active[lane])
+    {
+        block->active[lane] = 0;
+        block->executing[lane] = 0;
+        block->ret[lane] = ret;
+        block->active_lanes--;
+    }
+}
+
+// Finishes all the lanes that execute the current instruction
+static void lockstep_finish_all(lockstep_block_t * block, int ret)
+{
+    for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)
+    {
+        if (block->executing[lane])
+        {
+            lockstep_finish(block, lane, ret);
+        }
+    }
+}
+
+// Continues a lane at instruction 'next' (if the run there fits in the budget, see program_limit)
+static void lockstep_branch(lockstep_block_t * block, const asm_program_t * program, size_t lane, size_t next)
+{
+    if (!program_run_fits(program, (uint64_t)(uint32_t)block->count[lane], next))
+    {
+        lockstep_finish(block, lane, E_OUT_OF_GAS);
+        return;
+    }
+    block->pc[lane] = (uint32_t)next;
+}
+
+// Define binary operation (which is: "reg0 = reg1 (op) reg2")
+#define LOCKSTEP_BINARY_OP(opcode, function)                                                                           \
+    case opcode:                                                                                                       \
+        for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)                                                       \
+        {                                                                                                              \
+            block->values[lane] =                                                                                      \
+                function(block->registers[instruction->reg1][lane], block->registers[instruction->reg2][lane]);       \
+        }                                                                                                              \
+        lockstep_commit(block, instruction->reg0);                                                                     \
+        break;
+
+// Define binary 32-bit immediate operation (which is: "reg0 = reg1 (op) imm32")
+#define LOCKSTEP_BINARY_IMM32_OP(opcode, function)                                                                     \
+    case opcode:                                                                                                       \
+        for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)                                                       \
+        {                                                                                                              \
+            block->values[lane] = function(block->registers[instruction->reg1][lane], instruction->imm32);             \
+        }                                                                                                              \
+        lockstep_commit(block, instruction->reg0);                                                                     \
+        break;
+
+// Loops over the lanes that execute the current instruction
+#define LOCKSTEP_FOR_ACTIVE_LANES(lane)                                                                                \
+    for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)                                                           \
+        if (block->executing[lane])
+
+// The division of a single lane (returns false if the lane finished instead)
+static bool lockstep_divide(lockstep_block_t * block, size_t lane, reg_value_t dividend, reg_value_t divisor,
+                            reg_value_t * quotient_out)
+{
+    if (divisor == 0)
+    {
+        lockstep_finish(block, lane, E_DIV_ZERO);
+        return false;
+    }
+    if (dividend == INT32_MIN && divisor == -1)
+    {
+        lockstep_finish(block, lane, E_DIV_OVERFLOW);
+        return false;
+    }
+
+    *quotient_out = dividend / divisor;
+    return true;
+}
+
+static void lockstep_push(lockstep_block_t * block, size_t lane, reg_value_t value)
+{
+    reg_value_t sp_val = block->registers[ASM_REGISTER_SP][lane];
+
+    if (sp_val < (reg_value_t)0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(value)))
+    {
+        lockstep_finish(block, lane, E_STACK_VIOLATION);
+        return;
+    }
+    memcpy(&block->stacks[lane][sp_val], &value, sizeof(value));
+    block->registers[ASM_REGISTER_SP][lane] = sp_val + sizeof(value);
+}
+
+// Pops into 'reg' (if it's valid - POP_WFAULT only checks the stack)
+static void lockstep_pop(lockstep_block_t * block, size_t lane, asm_register_t reg, bool valid, int error)
+{
+    reg_value_t value = 0;
+    reg_value_t sp_val = block->registers[ASM_REGISTER_SP][lane];
+
+    if (sp_val < (reg_value_t)sizeof(value) || sp_val > (reg_value_t)ASM_STACK_SIZE)
+    {
+        lockstep_finish(block, lane, E_STACK_VIOLATION);
+        return;
+    }
+    if (!valid)
+    {
+        lockstep_finish(block, lane, error);
+        return;
+    }
+
+    sp_val -= sizeof(value);
+    memcpy(&value, &block->stacks[lane][sp_val], sizeof(value));
+    block->registers[reg][lane] = value;
+    block->registers[ASM_REGISTER_SP][lane] = sp_val;
+}
+
+static void lockstep_push_context(lockstep_block_t * block, size_t lane)
+{
+    reg_value_t context[LOCKSTEP_REGISTERS_COUNT];
+    reg_value_t sp_val = block->registers[ASM_REGISTER_SP][lane];
+
+    if (sp_val < (reg_value_t)0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(context)))
+    {
+        lockstep_finish(block, lane, E_STACK_VIOLATION);
+        return;
+    }
+    for (size_t reg = 0; reg < LOCKSTEP_REGISTERS_COUNT; ++reg)
+    {
+        context[reg] = block->registers[reg][lane];
+    }
+    memcpy(&block->stacks[lane][sp_val], context, sizeof(context));
+    block->registers[ASM_REGISTER_SP][lane] = sp_val + sizeof(context);
+}
+
+static void lockstep_pop_context(lockstep_block_t * block, size_t lane)
+{
+    reg_value_t context[LOCKSTEP_REGISTERS_COUNT];
+    reg_value_t sp_val = block->registers[ASM_REGISTER_SP][lane];
+
+    if (sp_val < (reg_value_t)sizeof(context) || sp_val > (reg_value_t)ASM_STACK_SIZE)
+    {
+        lockstep_finish(block, lane, E_STACK_VIOLATION);
+        return;
+    }
+
+    // (All the registers are restored, including SP and ZERO - just like the other engines)
+    sp_val -= sizeof(context);
+    memcpy(context, &block->stacks[lane][sp_val], sizeof(context));
+    for (size_t reg = 0; reg < LOCKSTEP_REGISTERS_COUNT; ++reg)
+    {
+        block->registers[reg][lane] = context[reg];
+    }
+}
+
+// Executes one of the memory instructions (see asm_instructions.h) in a single lane
+static void lockstep_memory_access(lockstep_block_t * block, size_t lane, const asm_instruction_t * instruction)
+{
+    uint8_t * stack = block->stacks[lane];
+    reg_value_t value0 = block->registers[instruction->reg0][lane];
+    reg_value_t value1 = block->registers[instruction->reg1][lane];
+    reg_value_t value2 = block->registers[instruction->reg2][lane];
+    reg_value_t offset = lockstep_add(value1, instruction->imm32);
+    int result = 0;
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case LOAD:
+    case STORE:
+        if (!stack_range_valid(offset, sizeof(reg_value_t)))
+        {
+            lockstep_finish(block, lane, E_STACK_VIOLATION);
+            return;
+        }
+        if (instruction->opcode == LOAD)
+        {
+            memcpy(&block->registers[instruction->reg0][lane], &stack[offset], sizeof(reg_value_t));
+        }
+        else
+        {
+            memcpy(&stack[offset], &value0, sizeof(value0));
+        }
+        break;
+
+    case MEMCPY:
+        if (!stack_range_valid(value0, value2) || !stack_range_valid(value1, value2))
+        {
+            lockstep_finish(block, lane, E_STACK_VIOLATION);
+            return;
+        }
+        memmove(&stack[value0], &stack[value1], (size_t)value2);
+        break;
+
+    case MEMSET:
+        if (!stack_range_valid(value0, value2))
+        {
+            lockstep_finish(block, lane, E_STACK_VIOLATION);
+            return;
+        }
+        memset(&stack[value0], (uint8_t)value1, (size_t)value2);
+        break;
+
+    case MEMCMP:
+        if (!stack_range_valid(value1, value0) || !stack_range_valid(value2, value0))
+        {
+            lockstep_finish(block, lane, E_STACK_VIOLATION);
+            return;
+        }
+        result = memcmp(&stack[value1], &stack[value2], (size_t)value0);
+        block->registers[instruction->reg0][lane] = (result > 0) - (result < 0);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Executes instruction 'index' over all the executing lanes
+static void lockstep_execute_instruction(lockstep_block_t * block, const asm_program_t * program, size_t index)
+{
+    const asm_instruction_t * instruction = &program->instructions[index];
+    reg_value_t quotient = 0;
+
+    for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)
+    {
+        block->count[lane] += block->executing[lane] & 1;
+        block->pc[lane] += block->executing[lane] & 1;
+    }
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+        LOCKSTEP_BINARY_OP(AND, lockstep_and)
+        LOCKSTEP_BINARY_OP(ADD, lockstep_add)
+        LOCKSTEP_BINARY_OP(XOR, lockstep_xor)
+        LOCKSTEP_BINARY_OP(SUB, lockstep_sub)
+        LOCKSTEP_BINARY_OP(MUL, lockstep_mul)
+        LOCKSTEP_BINARY_OP(OR, lockstep_or)
+        LOCKSTEP_BINARY_IMM32_OP(ANDI, lockstep_and)
+        LOCKSTEP_BINARY_IMM32_OP(ADDI, lockstep_add)
+        LOCKSTEP_BINARY_IMM32_OP(XORI, lockstep_xor)
+        LOCKSTEP_BINARY_IMM32_OP(SUBI, lockstep_sub)
+        LOCKSTEP_BINARY_IMM32_OP(MULI, lockstep_mul)
+        LOCKSTEP_BINARY_IMM32_OP(ORI, lockstep_or)
+        LOCKSTEP_BINARY_IMM32_OP(SHR, lockstep_shr)
+        LOCKSTEP_BINARY_IMM32_OP(SHL, lockstep_shl)
+        LOCKSTEP_BINARY_IMM32_OP(ROL, lockstep_rol)
+        LOCKSTEP_BINARY_IMM32_OP(ROR, lockstep_ror)
+
+    case DIV:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            if (lockstep_divide(block, lane, block->registers[instruction->reg1][lane],
+                                block->registers[instruction->reg2][lane], &quotient))
+            {
+                block->registers[instruction->reg0][lane] = quotient;
+            }
+        }
+        break;
+
+    case DIVI:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            if (lockstep_divide(block, lane, block->registers[instruction->reg1][lane], instruction->imm32, &quotient))
+            {
+                block->registers[instruction->reg0][lane] = quotient;
+            }
+        }
+        break;
+
+    case PRINTNL:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            output_nl(&block->outputs[lane]);
+        }
+        break;
+
+    case PRINTDX:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            output_dx(&block->outputs[lane], block->registers[instruction->reg0][lane]);
+        }
+        break;
+
+    case PRINTDD:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            output_dd(&block->outputs[lane], block->registers[instruction->reg0][lane]);
+        }
+        break;
+
+    case PRINTC:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            output_char(&block->outputs[lane], block->registers[instruction->reg0][lane]);
+        }
+        break;
+
+    case RET:
+        lockstep_finish_all(block, E_SUCCESS);
+        break;
+
+    case RETNZ:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            if (block->registers[instruction->reg0][lane] != 0)
+            {
+                lockstep_finish(block, lane, E_SUCCESS);
+            }
+        }
+        break;
+
+    case RETZ:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            if (block->registers[instruction->reg0][lane] == 0)
+            {
+                lockstep_finish(block, lane, E_SUCCESS);
+            }
+        }
+        break;
+
+    case PUSH:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            lockstep_push(block, lane, block->registers[instruction->reg0][lane]);
+        }
+        break;
+
+    case POP:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            lockstep_pop(block, lane, (asm_register_t)instruction->reg0, true, E_SUCCESS);
+        }
+        break;
+
+    case PUSHCTX:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            lockstep_push_context(block, lane);
+        }
+        break;
+
+    case POPCTX:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            lockstep_pop_context(block, lane);
+        }
+        break;
+
+    case LOAD:
+    case STORE:
+    case MEMCPY:
+    case MEMSET:
+    case MEMCMP:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            lockstep_memory_access(block, lane, instruction);
+        }
+        break;
+
+    case JMP:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            lockstep_branch(block, program, lane, (size_t)instruction->imm32);
+        }
+        break;
+
+    case JZ:
+    case JNZ:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            bool taken = (block->registers[instruction->reg0][lane] == 0) == (instruction->opcode == JZ);
+            lockstep_branch(block, program, lane, taken ? (size_t)instruction->imm32 : index + 1);
+        }
+        break;
+
+    case LOOP:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            reg_value_t counter = lockstep_sub(block->registers[instruction->reg0][lane], 1);
+            block->registers[instruction->reg0][lane] = counter;
+            lockstep_branch(block, program, lane, (counter != 0) ? (size_t)instruction->imm32 : index + 1);
+        }
+        break;
+
+    case HALT:
+        // If we couldn't even read the opcode of the last instruction, it wasn't executed
+        if (!instruction->reg0)
+        {
+            for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)
+            {
+                block->count[lane] -= block->executing[lane] & 1;
+            }
+        }
+        lockstep_finish_all(block, instruction->imm32);
+        break;
+
+    case FAULT:
+        lockstep_finish_all(block, instruction->imm32);
+        break;
+
+    case DIV_WFAULT:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            lockstep_finish(block, lane,
+                            (block->registers[instruction->reg2][lane] == 0) ? E_DIV_ZERO : instruction->imm32);
+        }
+        break;
+
+    case POP_WFAULT:
+        LOCKSTEP_FOR_ACTIVE_LANES(lane)
+        {
+            lockstep_pop(block, lane, (asm_register_t)instruction->reg0, false, instruction->imm32);
+        }
+        break;
+
+    default:
+        // (The fused instructions are never executed here)
+        lockstep_finish_all(block, E_NOT_IMPL_INSTR);
+        break;
+    }
+}
+
+// Whether any instruction of the program uses the stack (otherwise, the stacks don't need to be cleared)
+static bool lockstep_uses_stack(const asm_program_t * program)
+{
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        switch ((asm_opcode_t)program->instructions[i].opcode)
+        {
+        case PUSH:
+        case POP:
+        case PUSHCTX:
+        case POPCTX:
+        case POP_WFAULT:
+        case LOAD:
+        case STORE:
+        case MEMCPY:
+        case MEMSET:
+        case MEMCMP:
+            return true;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+// Chooses the next instruction to execute - the lowest one any active lane is at, and marks the lanes that are at it
+// as executing. (Without branches, all the active lanes are always at the same instruction).
+static size_t lockstep_converge(lockstep_block_t * block)
+{
+    uint32_t pc = UINT32_MAX;
+
+    for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)
+    {
+        if (block->active[lane] && block->pc[lane] < pc)
+        {
+            pc = block->pc[lane];
+        }
+    }
+    for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)
+    {
+        block->executing[lane] = (block->active[lane] && block->pc[lane] == pc) ? -1 : 0;
+    }
+    return pc;
+}
+
+int execute_asm_program_lockstep(const asm_program_t * program, const asm_register_file_t * initial_registers,
+                                 size_t lanes, asm_lane_result_t * results)
+{
+    int ret = E_SUCCESS;
+    lockstep_block_t * block = NULL;
+    bool uses_stack = false;
+    bool has_branches = false;
+
+    if (program == NULL || initial_registers == NULL || results == NULL)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+    uses_stack = lockstep_uses_stack(program);
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        has_branches = has_branches || asm_is_branch((asm_opcode_t)program->instructions[i].opcode);
+    }
+
+    block = calloc(1, sizeof(*block));
+    if (block == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    for (size_t first = 0; first < lanes; first += ASM_LOCKSTEP_LANES)
+    {
+        size_t block_lanes = (lanes - first < ASM_LOCKSTEP_LANES) ? lanes - first : ASM_LOCKSTEP_LANES;
+
+        // Init the context of every lane (the lanes past the last one start inactive)
+        block->active_lanes = block_lanes;
+        for (size_t lane = 0; lane < ASM_LOCKSTEP_LANES; ++lane)
+        {
+            block->active[lane] = (lane < block_lanes) ? -1 : 0;
+            block->executing[lane] = block->active[lane];
+            block->pc[lane] = 0;
+            block->count[lane] = 0;
+            block->ret[lane] = E_SUCCESS;
+            for (size_t reg = 0; reg < LOCKSTEP_REGISTERS_COUNT; ++reg)
+            {
+                block->registers[reg][lane] = (lane < block_lanes) ? initial_registers[first + lane].registers[reg] : 0;
+            }
+            output_init(&block->outputs[lane], ASM_OUTPUT_DISCARD, ASM_OUTPUT_BUFFERED);
+        }
+        if (uses_stack)
+        {
+            memset(block->stacks, 0, sizeof(block->stacks));
+        }
+
+        // The program always ends with HALT, which finishes all the lanes
+        for (size_t pc = 0; block->active_lanes > 0; ++pc)
+        {
+            if (has_branches)
+            {
+                pc = lockstep_converge(block);
+            }
+            lockstep_execute_instruction(block, program, pc);
+        }
+
+        for (size_t lane = 0; lane < block_lanes; ++lane)
+        {
+            asm_lane_result_t * result = &results[first + lane];
+            output_flush(&block->outputs[lane]);
+            result->ret = block->ret[lane];
+            result->count = block->count[lane];
+            for (size_t reg = 0; reg < LOCKSTEP_REGISTERS_COUNT; ++reg)
+            {
+                result->registers[reg] = block->registers[reg][lane];
+            }
+            result->output_digest = block->outputs[lane].digest;
+            result->output_size = block->outputs[lane].total_size;
+        }
+    }
+
+cleanup:
+    free(block);
+    return ret;
+}
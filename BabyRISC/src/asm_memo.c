@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "asm_memo.h"
+#include "asm_hash.h"
+#include "asm_instructions.h"
+
+#define MEMO_INITIAL_BUCKETS (256)
+#define MEMO_FILE_MAGIC (0x4f4d5242) // "BRMO"
+#define MEMO_MAX_PATH (4096)
+
+// The on-disk store: a file per payload, named after its hash - the header, the payload and then the output.
+// The results also depend on the build, so a file written by a build with another stack size or instruction set is
+// a miss too.
+typedef struct memo_file_header_s
+{
+    uint32_t magic;
+    int32_t ret;
+    int32_t count;
+    uint32_t instruction_set_version;
+    uint64_t budget;
+    uint64_t payload_size;
+    uint64_t output_size;
+    uint64_t stack_size;
+} memo_file_header_t;
+
+static pthread_once_t default_memo_once = PTHREAD_ONCE_INIT;
+static asm_memo_t default_memo;
+static int default_memo_ready = 0;
+
+int memo_init(asm_memo_t * memo, size_t max_memory_size, const char * directory)
+{
+    int ret = E_SUCCESS;
+
+    memset(memo, 0, sizeof(*memo));
+    memo->max_memory_size = max_memory_size;
+    memo->directory = directory;
+    memo->buckets_count = MEMO_INITIAL_BUCKETS;
+    memo->buckets = calloc(memo->buckets_count, sizeof(*memo->buckets));
+    if (memo->buckets == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    pthread_mutex_init(&memo->lock, NULL);
+
+cleanup:
+    return ret;
+}
+
+static void memo_free_entry(asm_memo_entry_t * entry)
+{
+    memo_result_free(&entry->result);
+    free(entry->bytes);
+    free(entry);
+}
+
+void memo_free(asm_memo_t * memo)
+{
+    asm_memo_entry_t * entry = memo->lru_head;
+    while (entry != NULL)
+    {
+        asm_memo_entry_t * next = entry->lru_next;
+        memo_free_entry(entry);
+        entry = next;
+    }
+    if (memo->buckets != NULL)
+    {
+        pthread_mutex_destroy(&memo->lock);
+    }
+    free(memo->buckets);
+    memset(memo, 0, sizeof(*memo));
+}
+
+static void memo_init_default(void)
+{
+    const char * directory = (ASM_MEMO_DIRECTORY[0] != '\0') ? ASM_MEMO_DIRECTORY : NULL;
+    if (memo_init(&default_memo, ASM_MEMO_SIZE, directory) == E_SUCCESS)
+    {
+        default_memo_ready = 1;
+    }
+}
+
+asm_memo_t * memo_default(void)
+{
+    pthread_once(&default_memo_once, memo_init_default);
+    return default_memo_ready ? &default_memo : NULL;
+}
+
+void memo_result_free(asm_memo_result_t * result)
+{
+    free(result->output);
+    memset(result, 0, sizeof(*result));
+}
+
+static int memo_result_copy(asm_memo_result_t * destination, const asm_memo_result_t * source)
+{
+    *destination = *source;
+    destination->output = malloc((source->output_size > 0) ? source->output_size : 1);
+    if (destination->output == NULL)
+    {
+        return E_NOMEM;
+    }
+    memcpy(destination->output, source->output, source->output_size);
+    return E_SUCCESS;
+}
+
+static asm_memo_entry_t * memo_find(asm_memo_t * memo, uint64_t hash, const uint8_t * bytes, size_t size,
+                                    uint64_t budget)
+{
+    asm_memo_entry_t * entry = memo->buckets[hash & (memo->buckets_count - 1)];
+    for (; entry != NULL; entry = entry->bucket_next)
+    {
+        if (entry->hash == hash && entry->size == size && entry->budget == budget &&
+            memcmp(entry->bytes, bytes, size) == 0)
+        {
+            break;
+        }
+    }
+    return entry;
+}
+
+static void memo_lru_unlink(asm_memo_t * memo, asm_memo_entry_t * entry)
+{
+    if (entry->lru_prev != NULL)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else
+    {
+        memo->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        memo->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void memo_lru_push(asm_memo_t * memo, asm_memo_entry_t * entry)
+{
+    entry->lru_next = memo->lru_head;
+    if (memo->lru_head != NULL)
+    {
+        memo->lru_head->lru_prev = entry;
+    }
+    else
+    {
+        memo->lru_tail = entry;
+    }
+    memo->lru_head = entry;
+}
+
+// Doubles the buckets once there are more entries than buckets (if that fails, the chains just get longer)
+static void memo_grow(asm_memo_t * memo)
+{
+    size_t buckets_count = memo->buckets_count * 2;
+    asm_memo_entry_t ** buckets = calloc(buckets_count, sizeof(*buckets));
+    if (buckets == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < memo->buckets_count; ++i)
+    {
+        asm_memo_entry_t * entry = memo->buckets[i];
+        while (entry != NULL)
+        {
+            asm_memo_entry_t * next = entry->bucket_next;
+            size_t bucket = entry->hash & (buckets_count - 1);
+            entry->bucket_next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(memo->buckets);
+    memo->buckets = buckets;
+    memo->buckets_count = buckets_count;
+}
+
+static void memo_remove(asm_memo_t * memo, asm_memo_entry_t * entry)
+{
+    asm_memo_entry_t ** link = &memo->buckets[entry->hash & (memo->buckets_count - 1)];
+    while (*link != entry)
+    {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    memo_lru_unlink(memo, entry);
+    memo->entries--;
+    memo->memory_size -= entry->memory_size;
+}
+
+// Adds the result to the in-memory store (must be called with the lock held)
+static void memo_insert(asm_memo_t * memo, uint64_t hash, const uint8_t * bytes, size_t size, uint64_t budget,
+                        const asm_memo_result_t * result)
+{
+    asm_memo_entry_t * entry = NULL;
+    size_t memory_size = sizeof(*entry) + size + result->output_size;
+
+    if (memory_size > memo->max_memory_size || memo_find(memo, hash, bytes, size, budget) != NULL)
+    {
+        return;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->bytes = malloc((size > 0) ? size : 1);
+    if (entry->bytes == NULL || memo_result_copy(&entry->result, result) != E_SUCCESS)
+    {
+        memo_free_entry(entry);
+        return;
+    }
+    memcpy(entry->bytes, bytes, size);
+    entry->size = size;
+    entry->hash = hash;
+    entry->budget = budget;
+    entry->memory_size = memory_size;
+
+    // Drop the least recently used results, until this one fits
+    while (memo->memory_size + memory_size > memo->max_memory_size)
+    {
+        asm_memo_entry_t * evicted = memo->lru_tail;
+        memo_remove(memo, evicted);
+        memo_free_entry(evicted);
+    }
+
+    if (memo->entries >= memo->buckets_count)
+    {
+        memo_grow(memo);
+    }
+    size_t bucket = hash & (memo->buckets_count - 1);
+    entry->bucket_next = memo->buckets[bucket];
+    memo->buckets[bucket] = entry;
+    memo_lru_push(memo, entry);
+    memo->entries++;
+    memo->memory_size += memory_size;
+}
+
+static int memo_file_path(const asm_memo_t * memo, uint64_t hash, char * path, size_t path_size)
+{
+    int length = snprintf(path, path_size, "%s/%016llx.memo", memo->directory, (unsigned long long)hash);
+    return (length > 0 && (size_t)length < path_size) ? E_SUCCESS : E_IVLD_ARGS;
+}
+
+// Reads the result of the payload from the on-disk store
+static int memo_load_file(const asm_memo_t * memo, uint64_t hash, const uint8_t * bytes, size_t size,
+                          uint64_t budget, asm_memo_result_t * result_out)
+{
+    int ret = E_SUCCESS;
+    char path[MEMO_MAX_PATH];
+    FILE * memo_fp = NULL;
+    memo_file_header_t header;
+    uint8_t * payload = NULL;
+    asm_memo_result_t result = { 0 };
+
+    ret = memo_file_path(memo, hash, path, sizeof(path));
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    memo_fp = fopen(path, "rb");
+    if (memo_fp == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    // (A file of another payload with the same hash is just a miss)
+    if (fread(&header, sizeof(header), 1, memo_fp) != 1 || header.magic != MEMO_FILE_MAGIC ||
+        header.instruction_set_version != ASM_INSTRUCTION_SET_VERSION || header.stack_size != ASM_STACK_SIZE ||
+        header.budget != budget || header.payload_size != size || header.output_size > SIZE_MAX - 1)
+    {
+        ret = E_FREAD;
+        goto cleanup;
+    }
+    payload = malloc((size > 0) ? size : 1);
+    result.output = malloc((size_t)header.output_size + 1);
+    if (payload == NULL || result.output == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    if (fread(payload, 1, size, memo_fp) != size || memcmp(payload, bytes, size) != 0 ||
+        fread(result.output, 1, (size_t)header.output_size, memo_fp) != header.output_size)
+    {
+        ret = E_FREAD;
+        goto cleanup;
+    }
+    result.ret = header.ret;
+    result.count = header.count;
+    result.output_size = (size_t)header.output_size;
+
+    *result_out = result;
+    result.output = NULL;
+
+cleanup:
+    free(result.output);
+    free(payload);
+    if (memo_fp != NULL)
+    {
+        fclose(memo_fp);
+    }
+    return ret;
+}
+
+// Writes the result of the payload to the on-disk store (to a temporary file that's then renamed, so a file that's
+// found is always whole)
+static int memo_save_file(const asm_memo_t * memo, uint64_t hash, const uint8_t * bytes, size_t size,
+                          uint64_t budget, const asm_memo_result_t * result)
+{
+    int ret = E_SUCCESS;
+    char path[MEMO_MAX_PATH];
+    char temporary_path[MEMO_MAX_PATH];
+    int memo_fd = -1;
+    FILE * memo_fp = NULL;
+    memo_file_header_t header = { 0 };
+
+    ret = memo_file_path(memo, hash, path, sizeof(path));
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    if (snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", path) >= (int)sizeof(temporary_path))
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+    memo_fd = mkstemp(temporary_path);
+    if (memo_fd == -1)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+    memo_fp = fdopen(memo_fd, "wb");
+    if (memo_fp == NULL)
+    {
+        close(memo_fd);
+        unlink(temporary_path);
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+
+    header.magic = MEMO_FILE_MAGIC;
+    header.ret = result->ret;
+    header.count = result->count;
+    header.instruction_set_version = ASM_INSTRUCTION_SET_VERSION;
+    header.budget = budget;
+    header.payload_size = size;
+    header.output_size = result->output_size;
+    header.stack_size = ASM_STACK_SIZE;
+    if (fwrite(&header, sizeof(header), 1, memo_fp) != 1 || fwrite(bytes, 1, size, memo_fp) != size ||
+        fwrite(result->output, 1, result->output_size, memo_fp) != result->output_size)
+    {
+        ret = E_FWRITE;
+    }
+    if (fclose(memo_fp) != 0)
+    {
+        ret = E_FWRITE;
+    }
+    if (ret != E_SUCCESS || rename(temporary_path, path) != 0)
+    {
+        unlink(temporary_path);
+        ret = E_FWRITE;
+    }
+
+cleanup:
+    return ret;
+}
+
+bool memo_lookup(asm_memo_t * memo, const uint8_t * bytes, size_t size, uint64_t budget,
+                 asm_memo_result_t * result_out)
+{
+    uint64_t hash = hash_xxh64(bytes, size, budget);
+    bool found = false;
+
+    pthread_mutex_lock(&memo->lock);
+    asm_memo_entry_t * entry = memo_find(memo, hash, bytes, size, budget);
+    if (entry != NULL && memo_result_copy(result_out, &entry->result) == E_SUCCESS)
+    {
+        memo_lru_unlink(memo, entry);
+        memo_lru_push(memo, entry);
+        memo->hits++;
+        found = true;
+    }
+    pthread_mutex_unlock(&memo->lock);
+    if (found)
+    {
+        return true;
+    }
+
+    // Results that aren't in memory may still be on disk (from a previous process)
+    found = memo->directory != NULL && memo_load_file(memo, hash, bytes, size, budget, result_out) == E_SUCCESS;
+
+    pthread_mutex_lock(&memo->lock);
+    if (found)
+    {
+        memo_insert(memo, hash, bytes, size, budget, result_out);
+        memo->hits++;
+    }
+    else
+    {
+        memo->misses++;
+    }
+    pthread_mutex_unlock(&memo->lock);
+    return found;
+}
+
+void memo_store(asm_memo_t * memo, const uint8_t * bytes, size_t size, uint64_t budget,
+                const asm_memo_result_t * result)
+{
+    uint64_t hash = hash_xxh64(bytes, size, budget);
+
+    pthread_mutex_lock(&memo->lock);
+    memo_insert(memo, hash, bytes, size, budget, result);
+    pthread_mutex_unlock(&memo->lock);
+
+    if (memo->directory != NULL)
+    {
+        memo_save_file(memo, hash, bytes, size, budget, result);
+    }
+}
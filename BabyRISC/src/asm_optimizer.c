@@ -0,0 +1,657 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "asm_optimizer.h"
+#include "asm_instructions.h"
+#include "asm_processor_state.h"
+
+#define OPTIMIZER_REGISTER_BIT(reg) (1u << (reg))
+#define OPTIMIZER_ALL_REGISTERS ((1u << ASM_REGISTER_END) - 1)
+
+// Shifts & rotations are only folded or merged by counts up to this one (the engines don't agree on larger ones)
+#define OPTIMIZER_MAX_SHIFT (31)
+
+// What's known about the values of the registers at some point of the program
+typedef struct optimizer_values_s
+{
+    uint32_t known;
+    reg_value_t values[ASM_REGISTER_END - ASM_REGISTER_START];
+} optimizer_values_t;
+
+typedef struct optimizer_s
+{
+    asm_instruction_t * code;
+    size_t count;
+    // ZERO is only guaranteed to be 0 if nothing in the program can restore it from the stack (see asm_fusion.c).
+    // Executions from a snapshot don't get here, see asm_optimizer.h.
+    bool has_popctx;
+    // Per instruction: whether it can be reached, and how many paths lead to it (see optimizer_trace)
+    bool * reached;
+    uint32_t * predecessors;
+    // Per instruction: whether it doesn't change anything (on the paths that reach it)
+    bool * nop;
+    asm_optimizer_stats_t stats;
+} optimizer_t;
+
+// Whether 'instruction' may end the execution (by failing or returning)
+static bool optimizer_may_exit(const asm_instruction_t * instruction)
+{
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case ADD:
+    case ADDI:
+    case AND:
+    case ANDI:
+    case MUL:
+    case MULI:
+    case OR:
+    case ORI:
+    case SUB:
+    case SUBI:
+    case XOR:
+    case XORI:
+    case SHL:
+    case SHR:
+    case ROL:
+    case ROR:
+    case LOADI:
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+    case PRINTNL:
+    case PRINTC4:
+        return false;
+    case DIVI:
+        // (INT32_MIN / -1 traps)
+        return instruction->imm32 == -1;
+    default:
+        return true;
+    }
+}
+
+// Whether 'instruction' does nothing but write its destination register (so it can be removed if that's dead)
+static bool optimizer_is_pure(const asm_instruction_t * instruction)
+{
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+    case PRINTNL:
+    case PRINTC4:
+        return false;
+    default:
+        return !optimizer_may_exit(instruction);
+    }
+}
+
+// Whether the execution may continue to the instruction after 'instruction' (branches aside)
+static bool optimizer_continues(const asm_instruction_t * instruction)
+{
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case RET:
+    case HALT:
+    case FAULT:
+    case DIV_WFAULT:
+    case POP_WFAULT:
+    case JMP:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// The registers 'instruction' reads (only needed for the instructions that can't end the execution)
+static uint32_t optimizer_reads(const asm_instruction_t * instruction)
+{
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case LOADI:
+    case PRINTNL:
+        return 0;
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+    case PRINTC4:
+        return OPTIMIZER_REGISTER_BIT(instruction->reg0);
+    case ADD:
+    case AND:
+    case MUL:
+    case OR:
+    case SUB:
+    case XOR:
+        return OPTIMIZER_REGISTER_BIT(instruction->reg1) | OPTIMIZER_REGISTER_BIT(instruction->reg2);
+    default:
+        // (The immediate operations)
+        return OPTIMIZER_REGISTER_BIT(instruction->reg1);
+    }
+}
+
+// The registers 'instruction' writes (if it continues)
+static uint32_t optimizer_writes(const asm_instruction_t * instruction)
+{
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+    case PRINTNL:
+    case RETNZ:
+    case RETZ:
+    case JMP:
+    case JZ:
+    case JNZ:
+    case STORE:
+    case MEMCPY:
+    case MEMSET:
+        return 0;
+    case PUSH:
+    case PUSHCTX:
+        return OPTIMIZER_REGISTER_BIT(ASM_REGISTER_SP);
+    case POP:
+        return OPTIMIZER_REGISTER_BIT(instruction->reg0) | OPTIMIZER_REGISTER_BIT(ASM_REGISTER_SP);
+    case POPCTX:
+        return OPTIMIZER_ALL_REGISTERS;
+    default:
+        return OPTIMIZER_REGISTER_BIT(instruction->reg0);
+    }
+}
+
+// Forgets everything about the registers (where paths join), except what's always known (ZERO, on executions from
+// a fresh context - the only ones the optimized instructions are executed on)
+static void optimizer_forget(const optimizer_t * optimizer, optimizer_values_t * values)
+{
+    memset(values, 0, sizeof(*values));
+    if (!optimizer->has_popctx)
+    {
+        values->known = OPTIMIZER_REGISTER_BIT(ASM_REGISTER_ZERO);
+    }
+}
+
+static bool optimizer_known(const optimizer_values_t * values, reg_t reg, reg_value_t * value_out)
+{
+    *value_out = values->values[reg];
+    return (values->known & OPTIMIZER_REGISTER_BIT(reg)) != 0;
+}
+
+// Marks the instructions that can be reached, and counts the paths to each of them (the entry counts as a path to
+// the first instruction). Returns 0 on success, otherwise - error.
+static int optimizer_trace(optimizer_t * optimizer)
+{
+    int ret = E_SUCCESS;
+    const asm_instruction_t * code = optimizer->code;
+    size_t * worklist = NULL;
+    size_t worklist_size = 0;
+
+    worklist = malloc((optimizer->count + 1) * sizeof(*worklist));
+    if (worklist == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    memset(optimizer->reached, 0, (optimizer->count + 1) * sizeof(*optimizer->reached));
+    memset(optimizer->predecessors, 0, (optimizer->count + 1) * sizeof(*optimizer->predecessors));
+
+    optimizer->reached[0] = true;
+    optimizer->predecessors[0] = 1;
+    worklist[worklist_size++] = 0;
+    while (worklist_size > 0)
+    {
+        size_t index = worklist[--worklist_size];
+        const asm_instruction_t * instruction = &code[index];
+        size_t successors[2];
+        size_t successors_count = 0;
+
+        if (asm_is_branch((asm_opcode_t)instruction->opcode))
+        {
+            successors[successors_count++] = (size_t)instruction->imm32;
+        }
+        if (optimizer_continues(instruction))
+        {
+            // (Branches are never fused)
+            successors[successors_count++] = index + instruction->length;
+        }
+
+        for (size_t i = 0; i < successors_count; ++i)
+        {
+            optimizer->predecessors[successors[i]]++;
+            if (!optimizer->reached[successors[i]])
+            {
+                optimizer->reached[successors[i]] = true;
+                worklist[worklist_size++] = successors[i];
+            }
+        }
+    }
+
+cleanup:
+    free(worklist);
+    return ret;
+}
+
+// Computes the result of 'instruction' if its operands are known. Returns whether it's known.
+static bool optimizer_fold(const asm_instruction_t * instruction, const optimizer_values_t * values,
+                           reg_value_t * result_out)
+{
+    reg_value_t a = 0;
+    reg_value_t b = instruction->imm32;
+    int32_t imm32 = instruction->imm32;
+
+    if (instruction->opcode == LOADI)
+    {
+        *result_out = imm32;
+        return true;
+    }
+    if (instruction->opcode >= MAX_ASM_OPCODE_VAL || !optimizer_is_pure(instruction) ||
+        !optimizer_known(values, instruction->reg1, &a))
+    {
+        return false;
+    }
+    if (asm_instruction_operands[instruction->opcode] == ASM_OPERANDS_REG3 &&
+        !optimizer_known(values, instruction->reg2, &b))
+    {
+        return false;
+    }
+
+    // (The arithmetic wraps around, like on the engines)
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case ADD:
+    case ADDI:
+        *result_out = (reg_value_t)((uint32_t)a + (uint32_t)b);
+        return true;
+    case SUB:
+    case SUBI:
+        *result_out = (reg_value_t)((uint32_t)a - (uint32_t)b);
+        return true;
+    case MUL:
+    case MULI:
+        *result_out = (reg_value_t)((uint32_t)a * (uint32_t)b);
+        return true;
+    case AND:
+    case ANDI:
+        *result_out = a & b;
+        return true;
+    case OR:
+    case ORI:
+        *result_out = a | b;
+        return true;
+    case XOR:
+    case XORI:
+        *result_out = a ^ b;
+        return true;
+    case DIVI:
+        if (a == INT32_MIN)
+        {
+            return false;
+        }
+        *result_out = a / b;
+        return true;
+    case SHL:
+        if (imm32 < 0 || imm32 > OPTIMIZER_MAX_SHIFT)
+        {
+            return false;
+        }
+        *result_out = (reg_value_t)((uint32_t)a << imm32);
+        return true;
+    case SHR:
+        if (imm32 < 0 || imm32 > OPTIMIZER_MAX_SHIFT)
+        {
+            return false;
+        }
+        *result_out = a >> imm32;
+        return true;
+    case ROL:
+    case ROR:
+        if (imm32 < 1 || imm32 > OPTIMIZER_MAX_SHIFT)
+        {
+            return false;
+        }
+        *result_out = (instruction->opcode == ROL) ? _rotl(a, imm32) : _rotr(a, imm32);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Turns 'instruction' into "opcode reg0, reg1, imm32"
+static void optimizer_set_imm32(asm_instruction_t * instruction, asm_opcode_t opcode, reg_t reg1, int32_t imm32)
+{
+    instruction->opcode = (opcode_t)opcode;
+    instruction->reg1 = reg1;
+    instruction->reg2 = 0;
+    instruction->imm32 = imm32;
+}
+
+// Replaces 'instruction' with a cheaper equivalent, using the known operands. Returns whether it was replaced.
+static bool optimizer_simplify(asm_instruction_t * instruction, const optimizer_values_t * values)
+{
+    bool simplified = false;
+    reg_value_t a = 0;
+    reg_value_t b = 0;
+    uint32_t multiplier = 0;
+    bool a_known = optimizer_known(values, instruction->reg1, &a);
+    bool b_known = optimizer_known(values, instruction->reg2, &b);
+    static const asm_opcode_t immediate_opcodes[MAX_ASM_OPCODE_VAL] = {
+        [ADD] = ADDI, [SUB] = SUBI, [AND] = ANDI, [OR] = ORI, [XOR] = XORI, [MUL] = MULI, [DIV] = DIVI,
+    };
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case SUB:
+    case XOR:
+        if (instruction->reg1 == instruction->reg2)
+        {
+            optimizer_set_imm32(instruction, LOADI, 0, 0);
+            return true;
+        }
+        // fallthrough
+    case ADD:
+    case AND:
+    case OR:
+    case MUL:
+    case DIV:
+        // (A known divisor that can't fail the division, or trap)
+        if (b_known && (instruction->opcode != DIV || (b != 0 && b != -1)))
+        {
+            optimizer_set_imm32(instruction, immediate_opcodes[instruction->opcode], instruction->reg1, b);
+            simplified = true;
+        }
+        else if (a_known && instruction->opcode != SUB && instruction->opcode != DIV)
+        {
+            optimizer_set_imm32(instruction, immediate_opcodes[instruction->opcode], instruction->reg2, a);
+            simplified = true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case MULI:
+    case ANDI:
+        if (instruction->imm32 == 0)
+        {
+            optimizer_set_imm32(instruction, LOADI, 0, 0);
+            return true;
+        }
+        // Multiplying by a power of two (as an unsigned number, INT32_MIN included) is a shift
+        multiplier = (uint32_t)instruction->imm32;
+        if (instruction->opcode == MULI && multiplier > 1 && (multiplier & (multiplier - 1)) == 0)
+        {
+            int32_t shift = 0;
+            while ((multiplier >>= 1) != 0)
+            {
+                shift++;
+            }
+            optimizer_set_imm32(instruction, SHL, instruction->reg1, shift);
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    return simplified;
+}
+
+// Whether 'instruction' leaves its register as it was (an identity operation on itself)
+static bool optimizer_is_identity(const asm_instruction_t * instruction)
+{
+    if (instruction->reg0 != instruction->reg1)
+    {
+        return false;
+    }
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case ADDI:
+    case SUBI:
+    case ORI:
+    case XORI:
+    case SHL:
+    case SHR:
+        return instruction->imm32 == 0;
+    case MULI:
+    case DIVI:
+        return instruction->imm32 == 1;
+    case ANDI:
+        return instruction->imm32 == -1;
+    default:
+        return false;
+    }
+}
+
+// Merges the shifts of the same register by immediates that follow the shift at 'index' (and can only be reached
+// from it) into it: "SHL r, r, a; SHL r, r, b" => "SHL r, r, a + b", and the same for SHR.
+static void optimizer_merge_shifts(optimizer_t * optimizer, size_t index)
+{
+    asm_instruction_t * shift = &optimizer->code[index];
+
+    while ((shift->opcode == SHL || shift->opcode == SHR) && shift->reg0 == shift->reg1 && shift->imm32 >= 0 &&
+           shift->imm32 <= OPTIMIZER_MAX_SHIFT && shift->length < UINT8_MAX)
+    {
+        size_t next_index = index + shift->length;
+        const asm_instruction_t * next = &optimizer->code[next_index];
+        if (next_index >= optimizer->count || optimizer->predecessors[next_index] != 1 ||
+            next->opcode != shift->opcode || next->reg0 != shift->reg0 || next->reg1 != shift->reg0 ||
+            next->imm32 < 0 || next->imm32 > OPTIMIZER_MAX_SHIFT || next->length != 1)
+        {
+            break;
+        }
+
+        // (The merged shift could only be reached through this one, so now it can't be reached at all)
+        int32_t total = shift->imm32 + next->imm32;
+        optimizer->reached[next_index] = false;
+        shift->length++;
+        optimizer->stats.merged++;
+        if (total <= OPTIMIZER_MAX_SHIFT)
+        {
+            shift->imm32 = total;
+        }
+        else if (shift->opcode == SHR)
+        {
+            // (Shifting the sign bit all the way)
+            shift->imm32 = OPTIMIZER_MAX_SHIFT;
+        }
+        else
+        {
+            // (Everything was shifted out)
+            optimizer_set_imm32(shift, LOADI, 0, 0);
+        }
+    }
+}
+
+// Constant propagation & simplification, along the paths of the program. A path's values are only kept while it's
+// the only path to the next instruction.
+static void optimizer_propagate(optimizer_t * optimizer)
+{
+    optimizer_values_t values;
+    // Where the last instruction continues to (SIZE_MAX - it doesn't)
+    size_t expected = 0;
+    optimizer_forget(optimizer, &values);
+
+    for (size_t i = 0; i < optimizer->count; ++i)
+    {
+        asm_instruction_t * instruction = &optimizer->code[i];
+        reg_value_t result = 0;
+        if (!optimizer->reached[i])
+        {
+            continue;
+        }
+        if (i != expected || optimizer->predecessors[i] != 1)
+        {
+            optimizer_forget(optimizer, &values);
+        }
+
+        // (Fused instructions are left alone)
+        if (instruction->length == 1)
+        {
+            bool was_loadi = (instruction->opcode == LOADI);
+            if (optimizer_fold(instruction, &values, &result))
+            {
+                optimizer->stats.folded += was_loadi ? 0 : 1;
+                optimizer_set_imm32(instruction, LOADI, 0, result);
+            }
+            else if (optimizer_simplify(instruction, &values))
+            {
+                optimizer->stats.simplified++;
+            }
+            optimizer_merge_shifts(optimizer, i);
+        }
+
+        if (optimizer_is_identity(instruction) ||
+            (instruction->opcode == LOADI && optimizer_known(&values, instruction->reg0, &result) &&
+             result == instruction->imm32))
+        {
+            optimizer->nop[i] = true;
+        }
+
+        values.known &= ~optimizer_writes(instruction);
+        if (instruction->opcode == LOADI)
+        {
+            values.known |= OPTIMIZER_REGISTER_BIT(instruction->reg0);
+            values.values[instruction->reg0] = instruction->imm32;
+        }
+        expected = (optimizer_continues(instruction) && !asm_is_branch((asm_opcode_t)instruction->opcode))
+                       ? i + instruction->length
+                       : SIZE_MAX;
+    }
+}
+
+// Dead-write elimination. Going backwards, 'dead[i]' is the registers that are overwritten after instruction i
+// starts, before they're read or anything can end the execution. An instruction that only writes dead registers (or
+// does nothing) is removed - the instruction that's executed after it is copied in its place, with both their
+// lengths (branches and the HALT are never copied, they must stay where they are).
+static int optimizer_remove_dead(optimizer_t * optimizer)
+{
+    int ret = E_SUCCESS;
+    asm_instruction_t * code = optimizer->code;
+    uint32_t * dead = NULL;
+    size_t * replacements = NULL;
+    bool * removed = NULL;
+
+    dead = calloc(optimizer->count + 1, sizeof(*dead));
+    replacements = calloc(optimizer->count + 1, sizeof(*replacements));
+    removed = calloc(optimizer->count + 1, sizeof(*removed));
+    if (dead == NULL || replacements == NULL || removed == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    // (The merged shifts changed the paths)
+    ret = optimizer_trace(optimizer);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    for (size_t i = optimizer->count; i > 0; --i)
+    {
+        size_t index = i - 1;
+        const asm_instruction_t * instruction = &code[index];
+        if (!optimizer->reached[index] || optimizer_may_exit(instruction))
+        {
+            continue;
+        }
+
+        size_t next = index + instruction->length;
+        size_t replacement = removed[next] ? replacements[next] : next;
+        uint32_t writes = optimizer_writes(instruction);
+        const asm_instruction_t * executed = &code[replacement];
+        if ((optimizer->nop[index] || (optimizer_is_pure(instruction) && (writes & ~dead[next]) == 0)) &&
+            replacement < optimizer->count && !asm_is_branch((asm_opcode_t)executed->opcode) &&
+            (replacement - index) + executed->length <= UINT8_MAX)
+        {
+            removed[index] = true;
+            replacements[index] = replacement;
+            dead[index] = dead[next];
+        }
+        else
+        {
+            dead[index] = (dead[next] | writes) & ~optimizer_reads(instruction);
+        }
+    }
+
+    // (The replacements are never removed themselves, so they're still in place)
+    for (size_t i = 0; i < optimizer->count; ++i)
+    {
+        if (removed[i])
+        {
+            code[i] = code[replacements[i]];
+            code[i].length = (uint8_t)((replacements[i] - i) + code[replacements[i]].length);
+            optimizer->stats.removed++;
+        }
+    }
+
+cleanup:
+    free(dead);
+    free(replacements);
+    free(removed);
+    return ret;
+}
+
+int program_optimize(asm_program_t * program, asm_optimizer_stats_t * stats_out)
+{
+    int ret = E_SUCCESS;
+    optimizer_t optimizer;
+    memset(&optimizer, 0, sizeof(optimizer));
+
+    if (program->optimized == NULL)
+    {
+        program->optimized = malloc((program->count + 1) * sizeof(*program->optimized));
+        if (program->optimized == NULL)
+        {
+            ret = E_NOMEM;
+            goto cleanup;
+        }
+        memcpy(program->optimized, program->instructions, (program->count + 1) * sizeof(*program->optimized));
+    }
+    optimizer.code = program->optimized;
+    optimizer.count = program->count;
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        optimizer.has_popctx = optimizer.has_popctx || program->instructions[i].opcode == POPCTX;
+    }
+
+    optimizer.reached = calloc(program->count + 1, sizeof(*optimizer.reached));
+    optimizer.predecessors = calloc(program->count + 1, sizeof(*optimizer.predecessors));
+    optimizer.nop = calloc(program->count + 1, sizeof(*optimizer.nop));
+    if (optimizer.reached == NULL || optimizer.predecessors == NULL || optimizer.nop == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    ret = optimizer_trace(&optimizer);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    optimizer_propagate(&optimizer);
+    ret = optimizer_remove_dead(&optimizer);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    if (stats_out)
+    {
+        *stats_out = optimizer.stats;
+    }
+
+cleanup:
+    free(optimizer.reached);
+    free(optimizer.predecessors);
+    free(optimizer.nop);
+    return ret;
+}
+
+void optimizer_stats_print(FILE * fp, const asm_optimizer_stats_t * stats)
+{
+    fprintf(fp, "%-14s %zu instructions\n", "folded", stats->folded);
+    fprintf(fp, "%-14s %zu instructions\n", "simplified", stats->simplified);
+    fprintf(fp, "%-14s %zu shifts\n", "merged", stats->merged);
+    fprintf(fp, "%-14s %zu instructions\n", "removed", stats->removed);
+}
@@ -0,0 +1,271 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "asm_output.h"
+
+// The decimal representation of every number in [0, 100), so numbers are formatted two digits at a time
+static const char decimal_pairs[] = "00010203040506070809"
+                                    "10111213141516171819"
+                                    "20212223242526272829"
+                                    "30313233343536373839"
+                                    "40414243444546474849"
+                                    "50515253545556575859"
+                                    "60616263646566676869"
+                                    "70717273747576777879"
+                                    "80818283848586878889"
+                                    "90919293949596979899";
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Longest formatted number: "-2147483648"
+#define OUTPUT_MAX_NUMBER_SIZE (11)
+
+#define FNV1A_64_OFFSET_BASIS (0xcbf29ce484222325ull)
+#define FNV1A_64_PRIME (0x100000001b3ull)
+
+void output_init(asm_output_t * output, int fd, asm_output_policy_t policy)
+{
+    output->fd = fd;
+    output->policy = policy;
+    output->size = 0;
+    output->digest = FNV1A_64_OFFSET_BASIS;
+    output->total_size = 0;
+    output->skip = 0;
+    output->capture = NULL;
+}
+
+void output_capture(asm_output_t * output, asm_output_capture_t * capture, size_t max_size)
+{
+    if (capture != NULL)
+    {
+        memset(capture, 0, sizeof(*capture));
+        capture->max_size = max_size;
+    }
+    output->capture = capture;
+}
+
+void output_capture_free(asm_output_capture_t * capture)
+{
+    free(capture->bytes);
+    memset(capture, 0, sizeof(*capture));
+}
+
+static void output_capture_append(asm_output_capture_t * capture, const uint8_t * data, size_t size)
+{
+    if (capture->overflowed || size > capture->max_size - capture->size)
+    {
+        capture->overflowed = 1;
+        return;
+    }
+    if (capture->size + size > capture->capacity)
+    {
+        size_t capacity = (capture->capacity == 0) ? ASM_OUTPUT_BUFFER_SIZE : capture->capacity;
+        while (capacity < capture->size + size)
+        {
+            capacity *= 2;
+        }
+        uint8_t * bytes = realloc(capture->bytes, capacity);
+        if (bytes == NULL)
+        {
+            capture->overflowed = 1;
+            return;
+        }
+        capture->bytes = bytes;
+        capture->capacity = capacity;
+    }
+    memcpy(&capture->bytes[capture->size], data, size);
+    capture->size += size;
+}
+
+int output_flush(asm_output_t * output)
+{
+    int ret = E_SUCCESS;
+    size_t written = 0;
+
+    // (What is skipped was already written, and counted in the digest)
+    if (output->skip > 0)
+    {
+        written = (output->skip < output->size) ? (size_t)output->skip : output->size;
+        output->skip -= written;
+    }
+
+    for (size_t i = written; i < output->size; ++i)
+    {
+        output->digest = (output->digest ^ output->buffer[i]) * FNV1A_64_PRIME;
+    }
+    output->total_size += output->size - written;
+    if (output->capture != NULL)
+    {
+        output_capture_append(output->capture, &output->buffer[written], output->size - written);
+    }
+    if (output->fd == ASM_OUTPUT_DISCARD)
+    {
+        goto cleanup;
+    }
+
+    while (written < output->size)
+    {
+        ssize_t result = write(output->fd, &output->buffer[written], output->size - written);
+        if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            ret = E_FWRITE;
+            goto cleanup;
+        }
+        written += (size_t)result;
+    }
+
+cleanup:
+    // Nothing can be done about output that failed to be written, just drop it
+    output->size = 0;
+    return ret;
+}
+
+void output_rewind(asm_output_t * output, uint64_t position)
+{
+    if (position >= output->total_size)
+    {
+        output->size = (size_t)(position - output->total_size);
+    }
+    else
+    {
+        output->skip += output->total_size - position;
+        output->size = 0;
+    }
+}
+
+// Makes sure 'size' more bytes fit in the buffer
+static void output_reserve(asm_output_t * output, size_t size)
+{
+    if (output->size + size > sizeof(output->buffer))
+    {
+        output_flush(output);
+    }
+}
+
+static void output_written(asm_output_t * output)
+{
+    if (output->policy == ASM_OUTPUT_UNBUFFERED)
+    {
+        output_flush(output);
+    }
+}
+
+void output_char(asm_output_t * output, reg_value_t value)
+{
+    output_reserve(output, 1);
+    output->buffer[output->size++] = (uint8_t)(value & 0xff);
+    output_written(output);
+}
+
+void output_dd(asm_output_t * output, reg_value_t value)
+{
+    char digits[OUTPUT_MAX_NUMBER_SIZE];
+    char * end = &digits[sizeof(digits)];
+    char * start = end;
+    uint32_t magnitude = (value < 0) ? (0u - (uint32_t)value) : (uint32_t)value;
+
+    while (magnitude >= 100)
+    {
+        uint32_t pair = magnitude % 100;
+        magnitude /= 100;
+        start -= 2;
+        memcpy(start, &decimal_pairs[pair * 2], 2);
+    }
+    if (magnitude >= 10)
+    {
+        start -= 2;
+        memcpy(start, &decimal_pairs[magnitude * 2], 2);
+    }
+    else
+    {
+        *--start = (char)('0' + magnitude);
+    }
+    if (value < 0)
+    {
+        *--start = '-';
+    }
+
+    output_reserve(output, (size_t)(end - start));
+    memcpy(&output->buffer[output->size], start, (size_t)(end - start));
+    output->size += (size_t)(end - start);
+    output_written(output);
+}
+
+void output_dx(asm_output_t * output, reg_value_t value)
+{
+    char digits[OUTPUT_MAX_NUMBER_SIZE];
+    char * end = &digits[sizeof(digits)];
+    char * start = end;
+    uint32_t bits = (uint32_t)value;
+
+    do
+    {
+        *--start = hex_digits[bits & 0xf];
+        bits >>= 4;
+    } while (bits != 0);
+
+    output_reserve(output, (size_t)(end - start));
+    memcpy(&output->buffer[output->size], start, (size_t)(end - start));
+    output->size += (size_t)(end - start);
+    output_written(output);
+}
+
+void output_nl(asm_output_t * output)
+{
+    output_reserve(output, 1);
+    output->buffer[output->size++] = '\n';
+    if (output->policy != ASM_OUTPUT_BUFFERED)
+    {
+        output_flush(output);
+    }
+}
+
+// The output flushed by output_flush_at_exit
+static asm_output_t * exit_output = NULL;
+
+void output_write(asm_output_t * output, const uint8_t * data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t chunk = sizeof(output->buffer) - output->size;
+        if (chunk == 0)
+        {
+            output_flush(output);
+            continue;
+        }
+        chunk = (chunk < size) ? chunk : size;
+        memcpy(&output->buffer[output->size], data, chunk);
+        output->size += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    output_written(output);
+}
+
+static void output_flush_exit_output(void)
+{
+    output_flush(exit_output);
+}
+
+static void output_flush_on_signal(int signal_number)
+{
+    // (write is async-signal-safe, capturing isn't - and the capture dies with us anyway) - then die from the same
+    // signal, just like without the handler
+    exit_output->capture = NULL;
+    output_flush(exit_output);
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+void output_flush_at_exit(asm_output_t * output)
+{
+    exit_output = output;
+    atexit(output_flush_exit_output);
+    signal(SIGFPE, output_flush_on_signal);
+    signal(SIGSEGV, output_flush_on_signal);
+}
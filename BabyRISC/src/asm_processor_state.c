@@ -1,30 +1,84 @@
 #include <string.h>
 #include "asm_processor_state.h"
+#include "asm_guarded_stack.h"
+#include "asm_snapshot.h"
 
-// The actual stack & registers of the processor
-uint8_t asm_stack[ASM_STACK_SIZE] = { 0 };
-reg_value_t registers[ASM_REGISTER_END - ASM_REGISTER_START] = { 0 };
+int vm_init(vm_context_t * vm, int output_fd)
+{
+    int ret = E_SUCCESS;
+
+    memset(vm, 0, sizeof(*vm));
+    output_init(&vm->output, output_fd, ASM_OUTPUT_DEFAULT_POLICY);
+    vm->instruction_budget = ASM_DEFAULT_INSTRUCTION_BUDGET;
+    vm->stack_dirty_start = ASM_STACK_SIZE;
+    vm->stack_dirty_end = 0;
+#if ASM_GUARDED_STACK
+    ret = guarded_stack_map(&vm->stack);
+#endif
+    return ret;
+}
 
-void initialize_context(void)
+void vm_free(vm_context_t * vm)
 {
-    memset(registers, 0, sizeof(registers));
-    memset(asm_stack, 0, sizeof(asm_stack));
+#if ASM_GUARDED_STACK
+    guarded_stack_unmap(vm->stack);
+    vm->stack = NULL;
+#else
+    (void)vm;
+#endif
+}
+
+void initialize_context(vm_context_t * vm)
+{
+    const asm_snapshot_t * snapshot = vm->snapshot;
+    uint32_t start = vm->stack_dirty_start;
+    uint32_t end = vm->stack_dirty_end;
+
+    if (snapshot != NULL)
+    {
+        memcpy(vm->registers, snapshot->registers, sizeof(vm->registers));
+    }
+    else
+    {
+        memset(vm->registers, 0, sizeof(vm->registers));
+    }
+
+    // Only the bytes that were written since the last reset are restored (the rest still hold the starting state)
+    if (start < end)
+    {
+#if ASM_GUARDED_STACK
+        guarded_stack_reset(vm->stack, start, end);
+#else
+        memset(&vm->stack[start], 0, end - start);
+#endif
+        if (snapshot != NULL)
+        {
+            uint32_t copy_start = (snapshot->stack_start > start) ? snapshot->stack_start : start;
+            uint32_t copy_end = (snapshot->stack_end < end) ? snapshot->stack_end : end;
+            if (copy_start < copy_end)
+            {
+                memcpy(&vm->stack[copy_start], &snapshot->stack[copy_start - snapshot->stack_start],
+                       copy_end - copy_start);
+            }
+        }
+    }
+    vm->stack_dirty_start = ASM_STACK_SIZE;
+    vm->stack_dirty_end = 0;
 }
 
-int read_reg(asm_register_t reg, reg_value_t * reg_out)
+int validate_read_reg(asm_register_t reg)
 {
-    if (reg < 0 || reg >= sizeof(registers) / sizeof(reg_value_t))
+    if (reg < 0 || reg >= ASM_REGISTER_END)
     {
         return E_R_INVLD_REG;
     }
 
-    *reg_out = registers[reg];
     return E_SUCCESS;
 }
 
-int write_reg(asm_register_t reg, reg_value_t value)
+int validate_write_reg(asm_register_t reg)
 {
-    if (reg < 0 || reg >= sizeof(registers) / sizeof(reg_value_t))
+    if (reg < 0 || reg >= ASM_REGISTER_END)
     {
         return E_W_INVLD_REG;
     }
@@ -33,6 +87,5 @@ int write_reg(asm_register_t reg, reg_value_t value)
         return E_W2ZERO;
     }
 
-    registers[reg] = value;
     return E_SUCCESS;
 }
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include "asm_profile.h"
+
+void profile_init(asm_profile_t * profile)
+{
+    memset(profile, 0, sizeof(*profile));
+}
+
+void profile_free(asm_profile_t * profile)
+{
+    free(profile->offset_hits);
+    profile_init(profile);
+}
+
+// Makes sure offsets up to (not including) 'size' can be hit
+static int profile_reserve(asm_profile_t * profile, size_t size)
+{
+    int ret = E_SUCCESS;
+
+    if (size > profile->offset_hits_size)
+    {
+        uint64_t * offset_hits = realloc(profile->offset_hits, size * sizeof(*offset_hits));
+        if (offset_hits == NULL)
+        {
+            ret = E_NOMEM;
+            goto cleanup;
+        }
+        memset(&offset_hits[profile->offset_hits_size], 0,
+               (size - profile->offset_hits_size) * sizeof(*offset_hits));
+        profile->offset_hits = offset_hits;
+        profile->offset_hits_size = size;
+    }
+
+cleanup:
+    return ret;
+}
+
+int profile_prepare(asm_profile_t * profile, const asm_program_t * program)
+{
+    int ret = E_SUCCESS;
+
+    if (program->offsets == NULL)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    // The offsets only grow, so the HALT has the largest one
+    ret = profile_reserve(profile, (size_t)program->offsets[program->count] + 1);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    profile->executions++;
+
+cleanup:
+    return ret;
+}
+
+int profile_merge(asm_profile_t * profile, const asm_profile_t * other)
+{
+    int ret = E_SUCCESS;
+
+    ret = profile_reserve(profile, other->offset_hits_size);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    profile->executions += other->executions;
+    for (size_t opcode = 0; opcode < MAX_ASM_INTERNAL_OPCODE_VAL; ++opcode)
+    {
+        profile->opcode_count[opcode] += other->opcode_count[opcode];
+        profile->opcode_cycles[opcode] += other->opcode_cycles[opcode];
+    }
+    for (size_t offset = 0; offset < other->offset_hits_size; ++offset)
+    {
+        profile->offset_hits[offset] += other->offset_hits[offset];
+    }
+
+cleanup:
+    return ret;
+}
+
+void profile_print_table(FILE * fp, const asm_profile_t * profile)
+{
+    uint64_t total_cycles = 0;
+
+    for (size_t opcode = 0; opcode < MAX_ASM_INTERNAL_OPCODE_VAL; ++opcode)
+    {
+        total_cycles += profile->opcode_cycles[opcode];
+    }
+
+    fprintf(fp, "%llu executions\n", (unsigned long long)profile->executions);
+    fprintf(fp, "%-14s %14s %16s %10s %8s\n", "opcode", "count", "cycles", "cycles/op", "cycles%");
+    for (size_t opcode = 0; opcode < MAX_ASM_INTERNAL_OPCODE_VAL; ++opcode)
+    {
+        uint64_t count = profile->opcode_count[opcode];
+        uint64_t cycles = profile->opcode_cycles[opcode];
+        if (count == 0)
+        {
+            continue;
+        }
+
+        fprintf(fp, "%-14s %14llu %16llu %10.1f %7.2f%%\n", asm_opcode_names[opcode], (unsigned long long)count,
+                (unsigned long long)cycles, (double)cycles / (double)count,
+                (total_cycles != 0) ? 100.0 * (double)cycles / (double)total_cycles : 0.0);
+    }
+
+    fprintf(fp, "\n%-14s %14s\n", "offset", "hits");
+    for (size_t offset = 0; offset < profile->offset_hits_size; ++offset)
+    {
+        if (profile->offset_hits[offset] != 0)
+        {
+            fprintf(fp, "0x%-12zx %14llu\n", offset, (unsigned long long)profile->offset_hits[offset]);
+        }
+    }
+}
+
+void profile_print_json(FILE * fp, const asm_profile_t * profile)
+{
+    const char * separator = "";
+
+    fprintf(fp, "{\n  \"executions\": %llu,\n  \"opcodes\": [", (unsigned long long)profile->executions);
+    for (size_t opcode = 0; opcode < MAX_ASM_INTERNAL_OPCODE_VAL; ++opcode)
+    {
+        if (profile->opcode_count[opcode] == 0)
+        {
+            continue;
+        }
+        fprintf(fp, "%s\n    {\"opcode\": \"%s\", \"count\": %llu, \"cycles\": %llu}", separator,
+                asm_opcode_names[opcode], (unsigned long long)profile->opcode_count[opcode],
+                (unsigned long long)profile->opcode_cycles[opcode]);
+        separator = ",";
+    }
+
+    separator = "";
+    fprintf(fp, "\n  ],\n  \"offsets\": [");
+    for (size_t offset = 0; offset < profile->offset_hits_size; ++offset)
+    {
+        if (profile->offset_hits[offset] == 0)
+        {
+            continue;
+        }
+        fprintf(fp, "%s\n    {\"offset\": %zu, \"hits\": %llu}", separator, offset,
+                (unsigned long long)profile->offset_hits[offset]);
+        separator = ",";
+    }
+    fprintf(fp, "\n  ]\n}\n");
+}
@@ -0,0 +1,482 @@
+#include <string.h>
+#include "asm_program.h"
+#include "asm_span_parsing.h"
+#include "asm_processor_state.h"
+#include "asm_profile.h"
+#include "asm_execution.h"
+#include "asm_fusion.h"
+#include "asm_optimizer.h"
+#include "asm_verifier.h"
+
+void program_init(asm_program_t * program)
+{
+    memset(program, 0, sizeof(*program));
+}
+
+void program_free(asm_program_t * program)
+{
+    if (!(program->borrowed & ASM_PROGRAM_BORROWED_INSTRUCTIONS))
+    {
+        free(program->instructions);
+    }
+    free(program->optimized);
+    free(program->unchecked);
+    free(program->offsets);
+    free(program->runs);
+    program_init(program);
+}
+
+const asm_instruction_t * program_code(const asm_program_t * program)
+{
+    return (program->optimized != NULL) ? program->optimized : program->instructions;
+}
+
+// Turns 'instruction' into the terminating HALT instruction.
+// 'counted' tells whether the instruction that failed to decode should count as executed
+// (it does, unless we couldn't even read its opcode).
+static void program_halt(asm_instruction_t * instruction, int error, int counted)
+{
+    memset(instruction, 0, sizeof(*instruction));
+    instruction->opcode = HALT;
+    instruction->reg0 = (reg_t)counted;
+    instruction->imm32 = error;
+    instruction->length = 1;
+}
+
+// Turns 'instruction' into a FAULT instruction, which fails with 'error' when it is executed.
+static void program_fault(asm_instruction_t * instruction, int error)
+{
+    memset(instruction, 0, sizeof(*instruction));
+    instruction->opcode = FAULT;
+    instruction->imm32 = error;
+    instruction->length = 1;
+}
+
+// An instruction with an invalid register is replaced with one that fails with the same error, after the same checks
+// the original instruction would have made (registers reads come first, then the division-by-zero / stack checks,
+// then the write of the destination register). The memory instructions are the exception - an invalid destination
+// of LOAD / MEMCMP fails before their ranges are checked.
+void program_validate_instruction(asm_instruction_t * instruction)
+{
+    int error = E_SUCCESS;
+
+    switch (asm_instruction_operands[instruction->opcode])
+    {
+    case ASM_OPERANDS_REG3:
+        // The memory instructions also read reg0 (MEMCPY / MEMSET don't write any register)
+        if (asm_is_memory_access((asm_opcode_t)instruction->opcode))
+        {
+            error = validate_read_reg((asm_register_t)instruction->reg0);
+        }
+        if (error == E_SUCCESS)
+        {
+            error = validate_read_reg((asm_register_t)instruction->reg1);
+        }
+        if (error == E_SUCCESS)
+        {
+            error = validate_read_reg((asm_register_t)instruction->reg2);
+        }
+        if (error == E_SUCCESS && instruction->opcode != MEMCPY && instruction->opcode != MEMSET)
+        {
+            error = validate_write_reg((asm_register_t)instruction->reg0);
+            if (error != E_SUCCESS && instruction->opcode == DIV)
+            {
+                instruction->opcode = DIV_WFAULT;
+                instruction->imm32 = error;
+                return;
+            }
+        }
+        break;
+    case ASM_OPERANDS_REG2_IMM32:
+        error = validate_read_reg((asm_register_t)instruction->reg1);
+        if (error == E_SUCCESS && instruction->opcode == DIVI && instruction->imm32 == 0)
+        {
+            error = E_DIV_ZERO;
+        }
+        if (error == E_SUCCESS)
+        {
+            // STORE is the only one that reads reg0 instead of writing it
+            error = (instruction->opcode == STORE) ? validate_read_reg((asm_register_t)instruction->reg0)
+                                                   : validate_write_reg((asm_register_t)instruction->reg0);
+        }
+        break;
+    case ASM_OPERANDS_REG1:
+        // POP is the only single register instruction that writes its register
+        if (instruction->opcode == POP)
+        {
+            error = validate_write_reg((asm_register_t)instruction->reg0);
+            if (error != E_SUCCESS)
+            {
+                instruction->opcode = POP_WFAULT;
+                instruction->imm32 = error;
+                return;
+            }
+        }
+        else
+        {
+            error = validate_read_reg((asm_register_t)instruction->reg0);
+        }
+        break;
+    case ASM_OPERANDS_REG1_REL32:
+        // LOOP also writes its register (the target is validated later, see program_resolve_branches)
+        error = validate_read_reg((asm_register_t)instruction->reg0);
+        if (error == E_SUCCESS && instruction->opcode == LOOP)
+        {
+            error = validate_write_reg((asm_register_t)instruction->reg0);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (error != E_SUCCESS)
+    {
+        program_fault(instruction, error);
+    }
+}
+
+// How many registers, and whether an imm32, follow the opcode in the encoding of the instructions with 'format'
+static void program_operands_layout(asm_operands_format_t format, size_t * regs_count_out, int * has_imm32_out)
+{
+    size_t regs_count = 0;
+    int has_imm32 = 0;
+
+    switch (format)
+    {
+    case ASM_OPERANDS_NONE:
+        break;
+    case ASM_OPERANDS_REG1:
+        regs_count = 1;
+        break;
+    case ASM_OPERANDS_REG2:
+        regs_count = 2;
+        break;
+    case ASM_OPERANDS_REG3:
+        regs_count = 3;
+        break;
+    case ASM_OPERANDS_REG2_IMM32:
+        regs_count = 2;
+        has_imm32 = 1;
+        break;
+    case ASM_OPERANDS_REG3_IMM32:
+        regs_count = 3;
+        has_imm32 = 1;
+        break;
+    case ASM_OPERANDS_REL32:
+        has_imm32 = 1;
+        break;
+    case ASM_OPERANDS_REG1_REL32:
+        regs_count = 1;
+        has_imm32 = 1;
+        break;
+    }
+
+    *regs_count_out = regs_count;
+    *has_imm32_out = has_imm32;
+}
+
+size_t program_instruction_size(opcode_t opcode)
+{
+    size_t regs_count = 0;
+    int has_imm32 = 0;
+
+    if (opcode >= MAX_ASM_OPCODE_VAL)
+    {
+        return sizeof(opcode_t);
+    }
+    program_operands_layout(asm_instruction_operands[opcode], &regs_count, &has_imm32);
+    return sizeof(opcode_t) + regs_count * sizeof(reg_t) + (has_imm32 ? sizeof(int32_t) : 0);
+}
+
+static int span_parse_operands(asm_span_t * span, asm_instruction_t * instruction)
+{
+    int ret = E_SUCCESS;
+    asm_register_t reg = ASM_REGISTER_START;
+    reg_t * regs[] = { &instruction->reg0, &instruction->reg1, &instruction->reg2 };
+    size_t regs_count = 0;
+    int has_imm32 = 0;
+
+    program_operands_layout(asm_instruction_operands[instruction->opcode], &regs_count, &has_imm32);
+    for (size_t i = 0; i < regs_count; ++i)
+    {
+        ret = span_parse_reg(span, &reg);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+        *regs[i] = (reg_t)reg;
+    }
+
+    if (has_imm32)
+    {
+        ret = span_parse_imm32(span, &instruction->imm32);
+    }
+
+cleanup:
+    return ret;
+}
+
+int64_t program_branch_target(const asm_program_t * program, size_t index)
+{
+    // The offset is relative to the end of the branch, which is where the next instruction starts
+    return (int64_t)program->offsets[index + 1] + program->instructions[index].imm32;
+}
+
+void program_resolve_branch(asm_program_t * program, size_t index)
+{
+    asm_instruction_t * instruction = &program->instructions[index];
+    int64_t target = program_branch_target(program, index);
+    size_t low = 0;
+    size_t high = program->count + 1;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if ((int64_t)program->offsets[middle] < target)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if (low > program->count || (int64_t)program->offsets[low] != target)
+    {
+        program_fault(instruction, E_INVLD_BRANCH_TARGET);
+        return;
+    }
+    instruction->imm32 = (int32_t)low;
+}
+
+int program_decode_begin(asm_program_t * program, size_t size)
+{
+    int ret = E_SUCCESS;
+
+    program_init(program);
+
+    // Every instruction is at least one byte long, so this is the only allocation we need
+    // (the extra instruction is for the terminating HALT).
+    program->capacity = size + 1;
+    program->instructions = malloc(program->capacity * sizeof(*program->instructions));
+    if (program->instructions == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    // (The offsets are needed for resolving the branches targets)
+    program->offsets = malloc(program->capacity * sizeof(*program->offsets));
+    if (program->offsets == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    program->offsets[0] = 0;
+
+cleanup:
+    if (ret != E_SUCCESS)
+    {
+        program_free(program);
+    }
+    return ret;
+}
+
+int program_decode_next(asm_program_t * program, asm_span_t * span)
+{
+    int ret = E_SUCCESS;
+    asm_opcode_t opcode;
+    asm_instruction_t * instruction = &program->instructions[program->count];
+
+    memset(instruction, 0, sizeof(*instruction));
+    program->offsets[program->count] = (uint32_t)span->offset;
+
+    ret = span_parse_opcode(span, &opcode);
+    if (ret != E_SUCCESS)
+    {
+        program_halt(instruction, ret, 0);
+        return 1;
+    }
+
+    if (opcode >= MAX_ASM_OPCODE_VAL || opcode < 0)
+    {
+        program_halt(instruction, E_INVLD_OPCODE, 1);
+        return 1;
+    }
+
+    instruction->opcode = (opcode_t)opcode;
+    instruction->length = 1;
+    ret = span_parse_operands(span, instruction);
+    if (ret != E_SUCCESS)
+    {
+        program_halt(instruction, ret, 1);
+        return 1;
+    }
+
+    program_validate_instruction(instruction);
+    program->count++;
+    // (Where the next instruction starts)
+    program->offsets[program->count] = (uint32_t)span->offset;
+    return 0;
+}
+
+int program_decode_span(const uint8_t * bytes, size_t size, asm_program_t * program)
+{
+    int ret = E_SUCCESS;
+    asm_span_t span;
+
+    ret = program_decode_begin(program, size);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    span_init(&span, bytes, size);
+    while (!program_decode_next(program, &span))
+    {
+    }
+
+    // The HALT instruction is in place - replace the relative payload offset in every branch with the index of the
+    // instruction it targets
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        if (asm_is_branch((asm_opcode_t)program->instructions[i].opcode))
+        {
+            program_resolve_branch(program, i);
+        }
+    }
+#if !ASM_ENABLE_PROFILING
+    free(program->offsets);
+    program->offsets = NULL;
+#endif
+
+cleanup:
+    if (ret != E_SUCCESS)
+    {
+        program_free(program);
+    }
+    return ret;
+}
+
+int program_limit(asm_program_t * program, uint64_t budget)
+{
+    int ret = E_SUCCESS;
+    const asm_instruction_t * halt = &program->instructions[program->count];
+    size_t first_branch = 0;
+    uint32_t * runs = NULL;
+
+    if (budget == 0)
+    {
+        goto cleanup;
+    }
+    if (budget > ASM_MAX_INSTRUCTION_BUDGET)
+    {
+        ret = E_IVLD_ARGS;
+        goto cleanup;
+    }
+
+    // The first run ends with the first branch, or with the HALT (if it counts)
+    while (first_branch < program->count && !asm_is_branch((asm_opcode_t)program->instructions[first_branch].opcode))
+    {
+        first_branch++;
+    }
+    uint64_t first_run = (first_branch < program->count) ? first_branch + 1 : program->count + (halt->reg0 ? 1 : 0);
+
+    if (budget < first_run)
+    {
+        // Nothing past the cut can be reached (there are no branches before it)
+        size_t cut = (size_t)budget;
+
+        if (program->optimized != NULL)
+        {
+            // A fused instruction that covers the cut is replaced with the instructions it stands for
+            size_t start = 0;
+            while (start + program->optimized[start].length <= cut)
+            {
+                start += program->optimized[start].length;
+            }
+            memcpy(&program->optimized[start], &program->instructions[start],
+                   (cut - start) * sizeof(*program->optimized));
+            program_halt(&program->optimized[cut], E_OUT_OF_GAS, 0);
+        }
+
+        // (Like at the end of the payload - the instruction that would exceed the budget is not executed)
+        program_halt(&program->instructions[cut], E_OUT_OF_GAS, 0);
+        program->count = cut;
+        goto cleanup;
+    }
+
+    if (first_branch == program->count)
+    {
+        // The whole program is a single run, which fits
+        goto cleanup;
+    }
+
+    // Every run continues until the next branch (including it), or through the HALT
+    runs = malloc((program->count + 1) * sizeof(*runs));
+    if (runs == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    runs[program->count] = halt->reg0 ? 1 : 0;
+    for (size_t i = program->count; i > 0; --i)
+    {
+        runs[i - 1] = 1 + (asm_is_branch((asm_opcode_t)program->instructions[i - 1].opcode) ? 0 : runs[i]);
+    }
+
+    free(program->runs);
+    program->runs = runs;
+    program->budget = budget;
+    runs = NULL;
+
+cleanup:
+    free(runs);
+    return ret;
+}
+
+int program_prepare(asm_program_t * program, const uint8_t * bytes, size_t size, uint64_t budget, int flags)
+{
+    int ret = E_SUCCESS;
+
+    if (flags & ASM_PREPARE_DECODE)
+    {
+        ret = program_decode_span(bytes, size, program);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+
+    if (flags & ASM_PREPARE_PASSES)
+    {
+#if ASM_ENABLE_FUSION
+        ret = program_fuse(program, NULL);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+#endif
+#if ASM_ENABLE_OPTIMIZER
+        ret = program_optimize(program, NULL);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+#endif
+    }
+
+    if (flags & ASM_PREPARE_FINISH)
+    {
+#if ASM_ENABLE_VERIFIER
+        ret = program_verify(program, NULL);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+#endif
+        ret = program_limit(program, budget);
+    }
+
+cleanup:
+    return ret;
+}
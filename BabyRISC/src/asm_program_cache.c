@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <string.h>
+#include "asm_program_cache.h"
+#include "asm_execution.h"
+#include "asm_hash.h"
+
+#define PROGRAM_CACHE_INITIAL_BUCKETS (256)
+
+static pthread_once_t default_cache_once = PTHREAD_ONCE_INIT;
+static asm_program_cache_t default_cache;
+static int default_cache_ready = 0;
+
+int program_cache_init(asm_program_cache_t * cache, size_t max_memory_size)
+{
+    int ret = E_SUCCESS;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->max_memory_size = max_memory_size;
+    cache->buckets_count = PROGRAM_CACHE_INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->buckets_count, sizeof(*cache->buckets));
+    if (cache->buckets == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+cleanup:
+    return ret;
+}
+
+static void program_cache_free_entry(asm_cached_program_t * entry)
+{
+    jit_free(&entry->jit);
+    program_free(&entry->program);
+    free(entry->bytes);
+    free(entry);
+}
+
+void program_cache_free(asm_program_cache_t * cache)
+{
+    asm_cached_program_t * entry = cache->lru_head;
+    while (entry != NULL)
+    {
+        asm_cached_program_t * next = entry->lru_next;
+        program_cache_free_entry(entry);
+        entry = next;
+    }
+    if (cache->buckets != NULL)
+    {
+        pthread_mutex_destroy(&cache->lock);
+    }
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void program_cache_init_default(void)
+{
+    if (ASM_PROGRAM_CACHE_SIZE > 0 && program_cache_init(&default_cache, ASM_PROGRAM_CACHE_SIZE) == E_SUCCESS)
+    {
+        default_cache_ready = 1;
+    }
+}
+
+asm_program_cache_t * program_cache_default(void)
+{
+    pthread_once(&default_cache_once, program_cache_init_default);
+    return default_cache_ready ? &default_cache : NULL;
+}
+
+static asm_cached_program_t * program_cache_find(asm_program_cache_t * cache, uint64_t hash, const uint8_t * bytes,
+                                                 size_t size, uint64_t budget)
+{
+    asm_cached_program_t * entry = cache->buckets[hash & (cache->buckets_count - 1)];
+    for (; entry != NULL; entry = entry->bucket_next)
+    {
+        if (entry->hash == hash && entry->size == size && entry->budget == budget &&
+            memcmp(entry->bytes, bytes, size) == 0)
+        {
+            break;
+        }
+    }
+    return entry;
+}
+
+static void program_cache_lru_unlink(asm_program_cache_t * cache, asm_cached_program_t * entry)
+{
+    if (entry->lru_prev != NULL)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else
+    {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void program_cache_lru_push(asm_program_cache_t * cache, asm_cached_program_t * entry)
+{
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+    {
+        cache->lru_head->lru_prev = entry;
+    }
+    else
+    {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+// Doubles the buckets once there are more entries than buckets (if that fails, the chains just get longer)
+static void program_cache_grow(asm_program_cache_t * cache)
+{
+    size_t buckets_count = cache->buckets_count * 2;
+    asm_cached_program_t ** buckets = calloc(buckets_count, sizeof(*buckets));
+    if (buckets == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < cache->buckets_count; ++i)
+    {
+        asm_cached_program_t * entry = cache->buckets[i];
+        while (entry != NULL)
+        {
+            asm_cached_program_t * next = entry->bucket_next;
+            size_t bucket = entry->hash & (buckets_count - 1);
+            entry->bucket_next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->buckets_count = buckets_count;
+}
+
+// Removes 'entry' from the cache (it's freed once it's not referenced). Returns whether it can be freed right away.
+static int program_cache_remove(asm_program_cache_t * cache, asm_cached_program_t * entry)
+{
+    asm_cached_program_t ** link = &cache->buckets[entry->hash & (cache->buckets_count - 1)];
+    while (*link != entry)
+    {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    program_cache_lru_unlink(cache, entry);
+
+    entry->evicted = 1;
+    cache->stats.evictions++;
+    cache->stats.entries--;
+    cache->stats.memory_size -= entry->memory_size;
+    return entry->references == 0;
+}
+
+static void program_cache_compile(asm_cached_program_t * entry)
+{
+    if (jit_compile(&entry->program, &entry->jit) == E_SUCCESS)
+    {
+        entry->program.jit = &entry->jit;
+        entry->memory_size += entry->jit.capacity;
+    }
+}
+
+// Decodes the payload into a new entry (the way execute_asm_memory does)
+static int program_cache_prepare(const uint8_t * bytes, size_t size, uint64_t hash, uint64_t budget, int flags,
+                                 asm_cached_program_t ** entry_out)
+{
+    int ret = E_SUCCESS;
+    asm_cached_program_t * entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    entry->bytes = malloc((size > 0) ? size : 1);
+    if (entry->bytes == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    memcpy(entry->bytes, bytes, size);
+    entry->size = size;
+    entry->hash = hash;
+    entry->budget = budget;
+
+    ret = program_prepare(&entry->program, bytes, size, budget, ASM_PREPARE_ALL);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    // (Roughly what the entry holds on to)
+    entry->memory_size = sizeof(*entry) + size + entry->program.capacity * sizeof(*entry->program.instructions);
+    if (entry->program.optimized != NULL)
+    {
+        entry->memory_size += entry->program.capacity * sizeof(*entry->program.optimized);
+    }
+    if (entry->program.unchecked != NULL)
+    {
+        entry->memory_size += entry->program.capacity * sizeof(*entry->program.unchecked);
+    }
+    if (entry->program.offsets != NULL)
+    {
+        entry->memory_size += entry->program.capacity * sizeof(*entry->program.offsets);
+    }
+    if (entry->program.runs != NULL)
+    {
+        entry->memory_size += entry->program.capacity * sizeof(*entry->program.runs);
+    }
+    if (flags & ASM_CACHE_COMPILE)
+    {
+        program_cache_compile(entry);
+    }
+
+    *entry_out = entry;
+    entry = NULL;
+
+cleanup:
+    if (entry != NULL)
+    {
+        program_cache_free_entry(entry);
+    }
+    return ret;
+}
+
+int program_cache_get(asm_program_cache_t * cache, const uint8_t * bytes, size_t size, uint64_t budget, int flags,
+                      asm_cached_program_t ** entry_out)
+{
+    int ret = E_SUCCESS;
+    // (The budget is part of the key - the same payload is limited differently for different budgets)
+    uint64_t hash = hash_xxh64(bytes, size, budget);
+    asm_cached_program_t * entry = NULL;
+    asm_cached_program_t * prepared = NULL;
+    asm_cached_program_t * evicted = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = program_cache_find(cache, hash, bytes, size, budget);
+    if (entry != NULL)
+    {
+        cache->stats.hits++;
+    }
+    else
+    {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (entry == NULL)
+    {
+        // Preparing the program is the slow part, so it's done outside of the lock
+        ret = program_cache_prepare(bytes, size, hash, budget, flags, &prepared);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (entry == NULL)
+    {
+        // (Another thread may have prepared the same payload in the meantime - then its program is used)
+        entry = program_cache_find(cache, hash, bytes, size, budget);
+        if (entry == NULL)
+        {
+            entry = prepared;
+            prepared = NULL;
+            if (cache->stats.entries >= cache->buckets_count)
+            {
+                program_cache_grow(cache);
+            }
+            size_t bucket = hash & (cache->buckets_count - 1);
+            entry->bucket_next = cache->buckets[bucket];
+            cache->buckets[bucket] = entry;
+            program_cache_lru_push(cache, entry);
+            cache->stats.entries++;
+            cache->stats.memory_size += entry->memory_size;
+        }
+    }
+    else
+    {
+        program_cache_lru_unlink(cache, entry);
+        program_cache_lru_push(cache, entry);
+    }
+
+    // A program that was cached without its machine code is compiled only while nobody executes it
+    if ((flags & ASM_CACHE_COMPILE) && entry->program.jit == NULL && entry->jit.code == NULL &&
+        entry->references == 0)
+    {
+        cache->stats.memory_size -= entry->memory_size;
+        program_cache_compile(entry);
+        cache->stats.memory_size += entry->memory_size;
+    }
+    if (flags & ASM_CACHE_PIN)
+    {
+        entry->pinned = 1;
+    }
+    entry->references++;
+
+    // Evict the least recently used programs (but never the one that's returned)
+    asm_cached_program_t * candidate = cache->lru_tail;
+    while (cache->stats.memory_size > cache->max_memory_size && candidate != NULL)
+    {
+        asm_cached_program_t * previous = candidate->lru_prev;
+        if (candidate != entry && !candidate->pinned && program_cache_remove(cache, candidate))
+        {
+            // (Freed outside of the lock)
+            candidate->lru_next = evicted;
+            evicted = candidate;
+        }
+        candidate = previous;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    *entry_out = entry;
+
+cleanup:
+    while (evicted != NULL)
+    {
+        asm_cached_program_t * next = evicted->lru_next;
+        program_cache_free_entry(evicted);
+        evicted = next;
+    }
+    if (prepared != NULL)
+    {
+        program_cache_free_entry(prepared);
+    }
+    return ret;
+}
+
+void program_cache_release(asm_program_cache_t * cache, asm_cached_program_t * entry)
+{
+    int free_entry = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    entry->references--;
+    free_entry = entry->evicted && entry->references == 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (free_entry)
+    {
+        program_cache_free_entry(entry);
+    }
+}
+
+void program_cache_get_stats(asm_program_cache_t * cache, asm_program_cache_stats_t * stats_out)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats_out = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
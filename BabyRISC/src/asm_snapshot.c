@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include "asm_snapshot.h"
+#include "common.h"
+
+void snapshot_init(asm_snapshot_t * snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+void snapshot_free(asm_snapshot_t * snapshot)
+{
+    free(snapshot->stack);
+    snapshot_init(snapshot);
+}
+
+int snapshot_capture(asm_snapshot_t * snapshot, const vm_context_t * vm)
+{
+    int ret = E_SUCCESS;
+    uint8_t * stack = NULL;
+    // Only the bytes the executions wrote, and the bytes they started with, may not be zeroes
+    uint32_t start = vm->stack_dirty_start;
+    uint32_t end = vm->stack_dirty_end;
+    if (start >= end)
+    {
+        start = ASM_STACK_SIZE;
+        end = 0;
+    }
+    if (vm->snapshot != NULL && vm->snapshot->stack_start < vm->snapshot->stack_end)
+    {
+        start = (vm->snapshot->stack_start < start) ? vm->snapshot->stack_start : start;
+        end = (vm->snapshot->stack_end > end) ? vm->snapshot->stack_end : end;
+    }
+
+    while (start < end && vm->stack[start] == 0)
+    {
+        start++;
+    }
+    while (start < end && vm->stack[end - 1] == 0)
+    {
+        end--;
+    }
+
+    if (start < end)
+    {
+        stack = malloc(end - start);
+        if (stack == NULL)
+        {
+            ret = E_NOMEM;
+            goto cleanup;
+        }
+        memcpy(stack, &vm->stack[start], end - start);
+    }
+    else
+    {
+        start = 0;
+        end = 0;
+    }
+
+    // (The snapshot may be the one 'vm' started from, so it's replaced only once it's no longer needed)
+    free(snapshot->stack);
+    memcpy(snapshot->registers, vm->registers, sizeof(snapshot->registers));
+    snapshot->stack_start = start;
+    snapshot->stack_end = end;
+    snapshot->stack = stack;
+    stack = NULL;
+
+cleanup:
+    free(stack);
+    return ret;
+}
+
+void vm_set_snapshot(vm_context_t * vm, const asm_snapshot_t * snapshot)
+{
+    vm->snapshot = snapshot;
+    // The stack holds what the previous executions started with, which may differ anywhere from the new state
+    stack_mark_dirty(vm, 0, ASM_STACK_SIZE);
+}
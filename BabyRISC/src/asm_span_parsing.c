@@ -0,0 +1,63 @@
+#include <string.h>
+#include "asm_span_parsing.h"
+
+void span_init(asm_span_t * span, const uint8_t * data, size_t size)
+{
+    span->data = data;
+    span->size = size;
+    span->offset = 0;
+}
+
+int span_parse_imm32(asm_span_t * span, int32_t * imm32_out)
+{
+    int ret = E_SUCCESS;
+    int32_t imm32;
+    if (span->size - span->offset < sizeof(imm32))
+    {
+        ret = E_READ_IMM32;
+        goto cleanup;
+    }
+
+    memcpy(&imm32, &span->data[span->offset], sizeof(imm32));
+    span->offset += sizeof(imm32);
+    *imm32_out = imm32;
+
+cleanup:
+    return ret;
+}
+
+int span_parse_reg(asm_span_t * span, asm_register_t * reg_out)
+{
+    int ret = E_SUCCESS;
+    reg_t reg;
+    if (span->size - span->offset < sizeof(reg))
+    {
+        ret = E_READ_REG;
+        goto cleanup;
+    }
+
+    reg = span->data[span->offset];
+    span->offset += sizeof(reg);
+    *reg_out = (asm_register_t)reg;
+
+cleanup:
+    return ret;
+}
+
+int span_parse_opcode(asm_span_t * span, asm_opcode_t * opcode_out)
+{
+    int ret = E_SUCCESS;
+    opcode_t opcode;
+    if (span->size - span->offset < sizeof(opcode))
+    {
+        ret = E_READ_OPCODE;
+        goto cleanup;
+    }
+
+    opcode = span->data[span->offset];
+    span->offset += sizeof(opcode);
+    *opcode_out = (asm_opcode_t)opcode;
+
+cleanup:
+    return ret;
+}
@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "asm_stream.h"
+#include "asm_program.h"
+#include "asm_instructions.h"
+#include "asm_span_parsing.h"
+#include "payload_input.h"
+
+#define STREAM_RUN_UNKNOWN (UINT32_MAX)
+
+// The payload being decoded as it's received
+typedef struct stream_decoder_s
+{
+    asm_stream_t * stream;
+    asm_program_t program;
+    asm_span_t span;
+    // Whether the HALT is in place (the whole payload is decoded)
+    int halted;
+    // Which branches were already resolved (see program_resolve_branch)
+    uint8_t * resolved;
+} stream_decoder_t;
+
+void stream_init(asm_stream_t * stream, int fd, uint8_t * buffer, size_t max_size, const uint8_t * suffix,
+                 size_t suffix_size)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = fd;
+    stream->bytes = buffer;
+    stream->max_size = max_size;
+    stream->suffix = suffix;
+    stream->suffix_size = suffix_size;
+    stream->state = ASM_STREAM_RECEIVING;
+}
+
+// Reads the next block of the payload (as much as is available)
+static int stream_receive(asm_stream_t * stream)
+{
+    const size_t marker_size = sizeof(uint32_t);
+    ssize_t bytes_read = 0;
+
+    do
+    {
+        bytes_read = read(stream->fd, &stream->bytes[stream->received], stream->max_size - stream->received);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read <= 0)
+    {
+        stream->state = ASM_STREAM_FAILED;
+        return E_FREAD;
+    }
+
+    // A terminator may start in the previous block, and end in this one
+    size_t scan_start = (stream->received >= marker_size - 1) ? stream->received - (marker_size - 1) : 0;
+    stream->received += (size_t)bytes_read;
+    size_t marker_offset = payload_find_terminator(stream->bytes, scan_start, stream->received);
+    if (marker_offset != stream->received)
+    {
+        // (What was received after the terminator isn't part of the payload)
+        memcpy(&stream->bytes[marker_offset], stream->suffix, stream->suffix_size);
+        stream->payload_size = marker_offset;
+        stream->available = marker_offset + stream->suffix_size;
+        stream->state = ASM_STREAM_COMPLETE;
+        return E_SUCCESS;
+    }
+    if (stream->received == stream->max_size)
+    {
+        stream->state = ASM_STREAM_FAILED;
+        return E_FREAD;
+    }
+
+    // The 0xff bytes at the end may be the start of the terminator
+    stream->available = stream->received;
+    while (stream->available > 0 && stream->received - stream->available < marker_size - 1 &&
+           stream->bytes[stream->available - 1] == 0xff)
+    {
+        stream->available--;
+    }
+    return E_SUCCESS;
+}
+
+// Receives the payload until there are 'end' bytes of it (or all of it, if it's shorter)
+static int stream_wait(asm_stream_t * stream, size_t end)
+{
+    while (stream->state == ASM_STREAM_RECEIVING && stream->available < end)
+    {
+        if (stream_receive(stream) != E_SUCCESS)
+        {
+            break;
+        }
+    }
+    return (stream->state == ASM_STREAM_COMPLETE || stream->available >= end) ? E_SUCCESS : E_FREAD;
+}
+
+int stream_finish(asm_stream_t * stream)
+{
+    return stream_wait(stream, SIZE_MAX);
+}
+
+// Decodes the next instruction, once all of it arrived (its opcode first, which tells how long it is)
+static int stream_decode_next(stream_decoder_t * decoder)
+{
+    asm_stream_t * stream = decoder->stream;
+    size_t offset = decoder->span.offset;
+
+    int ret = stream_wait(stream, offset + sizeof(opcode_t));
+    if (ret == E_SUCCESS && stream->available > offset)
+    {
+        ret = stream_wait(stream, offset + program_instruction_size(stream->bytes[offset]));
+    }
+    if (ret != E_SUCCESS)
+    {
+        return ret;
+    }
+
+    decoder->span.size = stream->available;
+    decoder->halted = program_decode_next(&decoder->program, &decoder->span);
+    return E_SUCCESS;
+}
+
+// Decodes the instructions up to instruction 'index' (or up to the HALT, if it comes first)
+static int stream_decode_through(stream_decoder_t * decoder, size_t index)
+{
+    int ret = E_SUCCESS;
+    while (ret == E_SUCCESS && !decoder->halted && decoder->program.count <= index)
+    {
+        ret = stream_decode_next(decoder);
+    }
+    return ret;
+}
+
+// Resolves the branch at 'index' (if it wasn't already), once the instructions up to its target are decoded
+static int stream_resolve_branch(stream_decoder_t * decoder, size_t index)
+{
+    int ret = E_SUCCESS;
+    int64_t target = program_branch_target(&decoder->program, index);
+
+    if (decoder->resolved[index])
+    {
+        return E_SUCCESS;
+    }
+    while (ret == E_SUCCESS && !decoder->halted &&
+           (int64_t)decoder->program.offsets[decoder->program.count] < target)
+    {
+        ret = stream_decode_next(decoder);
+    }
+    if (ret == E_SUCCESS)
+    {
+        program_resolve_branch(&decoder->program, index);
+        decoder->resolved[index] = 1;
+    }
+    return ret;
+}
+
+// Makes sure the length of the run that starts at instruction 'index' is known (see program_limit), decoding the
+// instructions up to the branch that ends it
+static int stream_measure_run(stream_decoder_t * decoder, size_t index)
+{
+    int ret = E_SUCCESS;
+    asm_program_t * program = &decoder->program;
+
+    for (size_t i = index; program->runs[index] == STREAM_RUN_UNKNOWN; ++i)
+    {
+        ret = stream_decode_through(decoder, i);
+        if (ret != E_SUCCESS)
+        {
+            break;
+        }
+
+        if (i == program->count)
+        {
+            // The run continues through the HALT
+            program->runs[index] = (uint32_t)(i - index) + (program->instructions[i].reg0 ? 1 : 0);
+            break;
+        }
+        if (asm_is_branch((asm_opcode_t)program->instructions[i].opcode))
+        {
+            // (Branches to invalid targets are turned into FAULT, which doesn't end the run)
+            ret = stream_resolve_branch(decoder, i);
+            if (ret != E_SUCCESS)
+            {
+                break;
+            }
+            if (asm_is_branch((asm_opcode_t)program->instructions[i].opcode))
+            {
+                program->runs[index] = (uint32_t)(i - index) + 1;
+            }
+        }
+    }
+    return ret;
+}
+
+int execute_asm_stream(vm_context_t * vm, asm_stream_t * stream, int * count_out)
+{
+    int ret = E_SUCCESS;
+    stream_decoder_t decoder = { 0 };
+    const asm_instruction_t * instruction = NULL;
+    size_t index = 0;
+    unsigned int inst_count = 0;
+    // Whether the first run ended (nothing was cut from the program for the budget, see program_limit)
+    int branched = 0;
+
+    decoder.stream = stream;
+    ret = program_decode_begin(&decoder.program, stream->max_size + stream->suffix_size);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    decoder.resolved = calloc(decoder.program.capacity, sizeof(*decoder.resolved));
+    if (decoder.resolved == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    if (vm->instruction_budget != 0)
+    {
+        decoder.program.runs = malloc(decoder.program.capacity * sizeof(*decoder.program.runs));
+        if (decoder.program.runs == NULL)
+        {
+            ret = E_NOMEM;
+            goto cleanup;
+        }
+        memset(decoder.program.runs, 0xff, decoder.program.capacity * sizeof(*decoder.program.runs));
+        decoder.program.budget = vm->instruction_budget;
+    }
+    span_init(&decoder.span, stream->bytes, 0);
+
+    // Init context
+    initialize_context(vm);
+
+    // The same loop as the interpreter's, except that the instructions are decoded just before they're executed
+    while (1)
+    {
+        ret = stream_decode_through(&decoder, index);
+        if (ret != E_SUCCESS)
+        {
+            break;
+        }
+        instruction = &decoder.program.instructions[index];
+
+        // The program would have been cut here if the first run doesn't fit in the budget (the instruction that
+        // would exceed it isn't executed)
+        if (decoder.program.runs != NULL && !branched && index == decoder.program.budget &&
+            !(instruction->opcode == HALT && !instruction->reg0))
+        {
+            ret = E_OUT_OF_GAS;
+            instruction = NULL;
+            break;
+        }
+        if (asm_is_branch((asm_opcode_t)instruction->opcode))
+        {
+            ret = stream_resolve_branch(&decoder, index);
+            if (ret != E_SUCCESS)
+            {
+                break;
+            }
+        }
+
+        inst_count++;
+        ret = asm_instruction_definitions[instruction->opcode](vm, instruction);
+        if (ret == E_SUCCESS)
+        {
+            index++;
+            continue;
+        }
+
+        // Branches continue at their target (or at the next instruction), if the run there fits in the budget
+        if (ret != E_BRANCH_TAKEN && ret != E_BRANCH_NOT_TAKEN)
+        {
+            break;
+        }
+        branched = 1;
+        size_t next = (ret == E_BRANCH_TAKEN) ? (size_t)instruction->imm32 : index + 1;
+        if (decoder.program.runs != NULL)
+        {
+            ret = stream_measure_run(&decoder, next);
+            if (ret != E_SUCCESS)
+            {
+                break;
+            }
+            if (!program_run_fits(&decoder.program, (uint64_t)inst_count, next))
+            {
+                ret = E_OUT_OF_GAS;
+                break;
+            }
+        }
+        index = next;
+    }
+
+    // If we couldn't even read the opcode of the last instruction, it wasn't executed
+    if (instruction != NULL && instruction->opcode == HALT && !instruction->reg0)
+    {
+        inst_count--;
+    }
+
+    // If we exited the loop because RET/RETNZ instruction, we want to report success
+    if (ret == E_RETURN)
+    {
+        ret = E_SUCCESS;
+    }
+
+cleanup:
+    // Whatever the program printed is written out by the time it's done (whether it returned or failed)
+    output_flush(&vm->output);
+    vm->executions++;
+    vm->instructions_executed += (uint64_t)inst_count;
+    if (count_out)
+    {
+        *count_out = (int)inst_count;
+    }
+    free(decoder.resolved);
+    program_free(&decoder.program);
+    return ret;
+}
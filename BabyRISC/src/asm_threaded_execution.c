@@ -0,0 +1,440 @@
+#include <string.h>
+#include "asm_threaded_execution.h"
+#include "asm_processor_state.h"
+#include "asm_instructions.h"
+#include "common.h"
+
+// This engine executes the decoded instructions with computed gotos ("direct threading"):
+// every instruction implementation jumps straight to the implementation of the next instruction,
+// and the registers are kept in a local copy for the whole run.
+// The registers are accessed directly (see program_validate_instruction).
+// Errors (and RET*) just jump to 'exit' with 'ret' set, instead of being returned up a call chain.
+// Branches dispatch the instruction they continue to with THREADED_BRANCH (after checking the budget).
+
+#define THREADED_DISPATCH()                                                                                            \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        instruction += instruction->length;                                                                            \
+        inst_count += instruction->length;                                                                             \
+        goto * dispatch_table[instruction->opcode];                                                                    \
+    } while (0)
+
+// Continues at instruction 'index' of the code, if the run there fits in the budget (see program_limit)
+#define THREADED_BRANCH(index)                                                                                         \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        size_t next = (index);                                                                                         \
+        if (!program_run_fits(program, (uint64_t)inst_count, next))                                                    \
+        {                                                                                                              \
+            ret = E_OUT_OF_GAS;                                                                                        \
+            goto exit;                                                                                                 \
+        }                                                                                                              \
+        instruction = &code[next];                                                                                     \
+        inst_count += instruction->length;                                                                             \
+        goto * dispatch_table[instruction->opcode];                                                                    \
+    } while (0)
+
+// Fails with E_STACK_VIOLATION if 'violation' (the stack access is out of bounds). On a guarded stack the accesses
+// are not checked - the guard regions catch them instead (see asm_guarded_stack.h).
+#if ASM_GUARDED_STACK
+#define THREADED_STACK_CHECK(violation)
+#else
+#define THREADED_STACK_CHECK(violation)                                                                                \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (violation)                                                                                                 \
+        {                                                                                                              \
+            ret = E_STACK_VIOLATION;                                                                                   \
+            goto exit;                                                                                                 \
+        }                                                                                                              \
+    } while (0)
+#endif
+
+// Records the stack bytes that were written (see stack_mark_dirty), after the write succeeded
+#define THREADED_MARK_DIRTY(offset, size)                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if ((uint32_t)(offset) < dirty_start)                                                                          \
+        {                                                                                                              \
+            dirty_start = (uint32_t)(offset);                                                                          \
+        }                                                                                                              \
+        if ((uint32_t)((offset) + (size)) > dirty_end)                                                                 \
+        {                                                                                                              \
+            dirty_end = (uint32_t)((offset) + (size));                                                                 \
+        }                                                                                                              \
+    } while (0)
+
+// "reg0 = reg1 (op) reg2"
+#define THREADED_BINARY_OP(opcode, operator)                                                                           \
+    op_##opcode:                                                                                                       \
+    {                                                                                                                  \
+        regs[instruction->reg0] = (regs[instruction->reg1]) operator(regs[instruction->reg2]);                         \
+        THREADED_DISPATCH();                                                                                           \
+    }
+
+// "reg0 = reg1 (op) imm32"
+#define THREADED_BINARY_IMM32_OP(opcode, operator)                                                                     \
+    op_##opcode:                                                                                                       \
+    {                                                                                                                  \
+        regs[instruction->reg0] = (regs[instruction->reg1]) operator(instruction->imm32);                              \
+        THREADED_DISPATCH();                                                                                           \
+    }
+
+#define THREADED_LABEL(opcode) [opcode] = &&op_##opcode
+
+int execute_asm_program_threaded(vm_context_t * vm, const asm_program_t * program, int * count_out)
+{
+    static const void * const dispatch_table[MAX_ASM_INTERNAL_OPCODE_VAL] = {
+        THREADED_LABEL(ADD),        THREADED_LABEL(ADDI),       THREADED_LABEL(AND),
+        THREADED_LABEL(ANDI),       THREADED_LABEL(DIV),        THREADED_LABEL(DIVI),
+        THREADED_LABEL(MUL),        THREADED_LABEL(MULI),       THREADED_LABEL(OR),
+        THREADED_LABEL(ORI),        THREADED_LABEL(PRINTC),     THREADED_LABEL(PRINTDD),
+        THREADED_LABEL(PRINTDX),    THREADED_LABEL(PRINTNL),    THREADED_LABEL(RET),
+        THREADED_LABEL(RETNZ),      THREADED_LABEL(RETZ),       THREADED_LABEL(ROL),
+        THREADED_LABEL(ROR),        THREADED_LABEL(SHL),        THREADED_LABEL(SHR),
+        THREADED_LABEL(SUB),        THREADED_LABEL(SUBI),       THREADED_LABEL(XOR),
+        THREADED_LABEL(XORI),       THREADED_LABEL(PUSH),       THREADED_LABEL(POP),
+        THREADED_LABEL(PUSHCTX),    THREADED_LABEL(POPCTX),     THREADED_LABEL(JMP),
+        THREADED_LABEL(JZ),         THREADED_LABEL(JNZ),        THREADED_LABEL(LOOP),
+        THREADED_LABEL(LOAD),       THREADED_LABEL(STORE),      THREADED_LABEL(MEMCPY),
+        THREADED_LABEL(MEMSET),     THREADED_LABEL(MEMCMP),     THREADED_LABEL(HALT),
+        THREADED_LABEL(FAULT),      THREADED_LABEL(DIV_WFAULT), THREADED_LABEL(POP_WFAULT),
+        THREADED_LABEL(LOADI),      THREADED_LABEL(PRINTC4),    THREADED_LABEL(MULSUBIRETNZ),
+        THREADED_LABEL(PUSH_NOCHECK), THREADED_LABEL(POP_NOCHECK),
+    };
+
+    int ret = E_SUCCESS;
+    reg_value_t regs[ASM_REGISTER_END - ASM_REGISTER_START];
+    const asm_instruction_t * code = program_code(program);
+    const asm_instruction_t * instruction = code;
+    unsigned int inst_count = instruction->length;
+    // The stack bytes written by this execution (kept in locals, and recorded in the context when it ends)
+    uint32_t dirty_start = ASM_STACK_SIZE;
+    uint32_t dirty_end = 0;
+
+    // Init context
+    initialize_context(vm);
+    memcpy(regs, vm->registers, sizeof(regs));
+
+    goto * dispatch_table[instruction->opcode];
+
+    THREADED_BINARY_OP(AND, &)
+    THREADED_BINARY_OP(ADD, +)
+    THREADED_BINARY_OP(XOR, ^)
+    THREADED_BINARY_OP(SUB, -)
+    THREADED_BINARY_OP(MUL, *)
+    THREADED_BINARY_OP(OR, |)
+    THREADED_BINARY_IMM32_OP(ANDI, &)
+    THREADED_BINARY_IMM32_OP(ADDI, +)
+    THREADED_BINARY_IMM32_OP(XORI, ^)
+    THREADED_BINARY_IMM32_OP(SUBI, -)
+    THREADED_BINARY_IMM32_OP(MULI, *)
+    THREADED_BINARY_IMM32_OP(ORI, |)
+    THREADED_BINARY_IMM32_OP(SHR, >>)
+    THREADED_BINARY_IMM32_OP(SHL, <<)
+
+op_DIV:
+{
+    if (regs[instruction->reg2] == 0)
+    {
+        ret = E_DIV_ZERO;
+        goto exit;
+    }
+    regs[instruction->reg0] = regs[instruction->reg1] / regs[instruction->reg2];
+    THREADED_DISPATCH();
+}
+
+op_DIVI:
+{
+    regs[instruction->reg0] = regs[instruction->reg1] / instruction->imm32;
+    THREADED_DISPATCH();
+}
+
+op_ROL:
+{
+    regs[instruction->reg0] = _rotl(regs[instruction->reg1], instruction->imm32);
+    THREADED_DISPATCH();
+}
+
+op_ROR:
+{
+    regs[instruction->reg0] = _rotr(regs[instruction->reg1], instruction->imm32);
+    THREADED_DISPATCH();
+}
+
+op_PRINTNL:
+{
+    output_nl(&vm->output);
+    THREADED_DISPATCH();
+}
+
+op_PRINTDX:
+{
+    output_dx(&vm->output, regs[instruction->reg0]);
+    THREADED_DISPATCH();
+}
+
+op_PRINTDD:
+{
+    output_dd(&vm->output, regs[instruction->reg0]);
+    THREADED_DISPATCH();
+}
+
+op_PRINTC:
+{
+    output_char(&vm->output, regs[instruction->reg0]);
+    THREADED_DISPATCH();
+}
+
+op_RET:
+{
+    ret = E_RETURN;
+    goto exit;
+}
+
+op_RETNZ:
+{
+    if (regs[instruction->reg0] != 0)
+    {
+        ret = E_RETURN;
+        goto exit;
+    }
+    THREADED_DISPATCH();
+}
+
+op_RETZ:
+{
+    if (regs[instruction->reg0] == 0)
+    {
+        ret = E_RETURN;
+        goto exit;
+    }
+    THREADED_DISPATCH();
+}
+
+op_PUSH:
+{
+    reg_value_t reg_val = regs[instruction->reg0];
+    reg_value_t sp_val = regs[ASM_REGISTER_SP];
+    THREADED_STACK_CHECK(sp_val < (reg_value_t)0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(reg_val)));
+    memcpy(&vm->stack[sp_val], &reg_val, sizeof(reg_val));
+    THREADED_MARK_DIRTY(sp_val, sizeof(reg_val));
+    regs[ASM_REGISTER_SP] = sp_val + sizeof(reg_val);
+    THREADED_DISPATCH();
+}
+
+op_POP:
+{
+    reg_value_t reg_val = 0;
+    reg_value_t sp_val = regs[ASM_REGISTER_SP];
+    THREADED_STACK_CHECK(sp_val < (reg_value_t)sizeof(reg_val) || sp_val > (reg_value_t)ASM_STACK_SIZE);
+    sp_val -= sizeof(reg_val);
+    memcpy(&reg_val, &vm->stack[sp_val], sizeof(reg_val));
+    regs[instruction->reg0] = reg_val;
+    regs[ASM_REGISTER_SP] = sp_val;
+    THREADED_DISPATCH();
+}
+
+op_PUSHCTX:
+{
+    reg_value_t sp_val = regs[ASM_REGISTER_SP];
+    THREADED_STACK_CHECK(sp_val < (reg_value_t)0 || sp_val > (reg_value_t)(ASM_STACK_SIZE - sizeof(regs)));
+    memcpy(&vm->stack[sp_val], regs, sizeof(regs));
+    THREADED_MARK_DIRTY(sp_val, sizeof(regs));
+    regs[ASM_REGISTER_SP] = sp_val + sizeof(regs);
+    THREADED_DISPATCH();
+}
+
+op_POPCTX:
+{
+    reg_value_t sp_val = regs[ASM_REGISTER_SP];
+    THREADED_STACK_CHECK(sp_val < (reg_value_t)sizeof(regs) || sp_val > (reg_value_t)ASM_STACK_SIZE);
+    sp_val -= sizeof(regs);
+    memcpy(regs, &vm->stack[sp_val], sizeof(regs));
+    THREADED_DISPATCH();
+}
+
+op_JMP:
+{
+    THREADED_BRANCH((size_t)instruction->imm32);
+}
+
+op_JZ:
+{
+    THREADED_BRANCH((regs[instruction->reg0] == 0) ? (size_t)instruction->imm32 : (size_t)(instruction - code) + 1);
+}
+
+op_JNZ:
+{
+    THREADED_BRANCH((regs[instruction->reg0] != 0) ? (size_t)instruction->imm32 : (size_t)(instruction - code) + 1);
+}
+
+op_LOOP:
+{
+    reg_value_t counter = (reg_value_t)((uint32_t)regs[instruction->reg0] - 1);
+    regs[instruction->reg0] = counter;
+    THREADED_BRANCH((counter != 0) ? (size_t)instruction->imm32 : (size_t)(instruction - code) + 1);
+}
+
+op_LOAD:
+{
+    reg_value_t offset = (reg_value_t)((uint32_t)regs[instruction->reg1] + (uint32_t)instruction->imm32);
+    reg_value_t reg_val = 0;
+    THREADED_STACK_CHECK(!stack_range_valid(offset, sizeof(reg_val)));
+    memcpy(&reg_val, &vm->stack[offset], sizeof(reg_val));
+    regs[instruction->reg0] = reg_val;
+    THREADED_DISPATCH();
+}
+
+op_STORE:
+{
+    reg_value_t offset = (reg_value_t)((uint32_t)regs[instruction->reg1] + (uint32_t)instruction->imm32);
+    reg_value_t reg_val = regs[instruction->reg0];
+    THREADED_STACK_CHECK(!stack_range_valid(offset, sizeof(reg_val)));
+    memcpy(&vm->stack[offset], &reg_val, sizeof(reg_val));
+    THREADED_MARK_DIRTY(offset, sizeof(reg_val));
+    THREADED_DISPATCH();
+}
+
+op_MEMCPY:
+{
+    reg_value_t size = regs[instruction->reg2];
+    if (!stack_range_valid(regs[instruction->reg0], size) || !stack_range_valid(regs[instruction->reg1], size))
+    {
+        ret = E_STACK_VIOLATION;
+        goto exit;
+    }
+    memmove(&vm->stack[regs[instruction->reg0]], &vm->stack[regs[instruction->reg1]], (size_t)size);
+    THREADED_MARK_DIRTY(regs[instruction->reg0], size);
+    THREADED_DISPATCH();
+}
+
+op_MEMSET:
+{
+    reg_value_t size = regs[instruction->reg2];
+    if (!stack_range_valid(regs[instruction->reg0], size))
+    {
+        ret = E_STACK_VIOLATION;
+        goto exit;
+    }
+    memset(&vm->stack[regs[instruction->reg0]], (uint8_t)regs[instruction->reg1], (size_t)size);
+    THREADED_MARK_DIRTY(regs[instruction->reg0], size);
+    THREADED_DISPATCH();
+}
+
+op_MEMCMP:
+{
+    reg_value_t size = regs[instruction->reg0];
+    int result = 0;
+    if (!stack_range_valid(regs[instruction->reg1], size) || !stack_range_valid(regs[instruction->reg2], size))
+    {
+        ret = E_STACK_VIOLATION;
+        goto exit;
+    }
+    result = memcmp(&vm->stack[regs[instruction->reg1]], &vm->stack[regs[instruction->reg2]], (size_t)size);
+    regs[instruction->reg0] = (result > 0) - (result < 0);
+    THREADED_DISPATCH();
+}
+
+op_FAULT:
+{
+    ret = instruction->imm32;
+    goto exit;
+}
+
+op_DIV_WFAULT:
+{
+    ret = (regs[instruction->reg2] == 0) ? E_DIV_ZERO : instruction->imm32;
+    goto exit;
+}
+
+op_POP_WFAULT:
+{
+    reg_value_t sp_val = regs[ASM_REGISTER_SP];
+    if (sp_val < (reg_value_t)sizeof(reg_value_t) || sp_val > (reg_value_t)ASM_STACK_SIZE)
+    {
+        ret = E_STACK_VIOLATION;
+        goto exit;
+    }
+    ret = instruction->imm32;
+    goto exit;
+}
+
+op_LOADI:
+{
+    regs[instruction->reg0] = instruction->imm32;
+    THREADED_DISPATCH();
+}
+
+op_PRINTC4:
+{
+    reg_value_t value = regs[instruction->reg0];
+    for (size_t i = 0; i < sizeof(value); ++i)
+    {
+        output_char(&vm->output, value);
+        value = _rotr(value, 8);
+    }
+    regs[instruction->reg0] = value;
+    THREADED_DISPATCH();
+}
+
+op_MULSUBIRETNZ:
+{
+    reg_value_t value = regs[instruction->reg1] * regs[instruction->reg2] - instruction->imm32;
+    regs[instruction->reg0] = value;
+    if (value != 0)
+    {
+        ret = E_RETURN;
+        goto exit;
+    }
+    THREADED_DISPATCH();
+}
+
+op_PUSH_NOCHECK:
+{
+    reg_value_t reg_val = regs[instruction->reg0];
+    reg_value_t sp_val = regs[ASM_REGISTER_SP];
+    memcpy(&vm->stack[sp_val], &reg_val, sizeof(reg_val));
+    THREADED_MARK_DIRTY(sp_val, sizeof(reg_val));
+    regs[ASM_REGISTER_SP] = sp_val + sizeof(reg_val);
+    THREADED_DISPATCH();
+}
+
+op_POP_NOCHECK:
+{
+    reg_value_t reg_val = 0;
+    reg_value_t sp_val = regs[ASM_REGISTER_SP] - sizeof(reg_val);
+    memcpy(&reg_val, &vm->stack[sp_val], sizeof(reg_val));
+    regs[instruction->reg0] = reg_val;
+    regs[ASM_REGISTER_SP] = sp_val;
+    THREADED_DISPATCH();
+}
+
+op_HALT:
+{
+    // If we couldn't even read the opcode of the last instruction, it wasn't executed
+    if (!instruction->reg0)
+    {
+        inst_count--;
+    }
+    ret = instruction->imm32;
+    goto exit;
+}
+
+exit:
+    memcpy(vm->registers, regs, sizeof(regs));
+    vm->stack_dirty_start = dirty_start;
+    vm->stack_dirty_end = dirty_end;
+
+    // If we exited because of a RET/RETNZ instruction, we want to report success
+    if (ret == E_RETURN)
+    {
+        ret = E_SUCCESS;
+    }
+
+    if (count_out)
+    {
+        *count_out = (int)inst_count;
+    }
+    return ret;
+}
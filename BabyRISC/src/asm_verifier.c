@@ -0,0 +1,420 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "asm_verifier.h"
+#include "asm_instructions.h"
+
+// How many times an instruction's state may change before its SP range is given up on (loops that keep moving SP
+// would never settle otherwise)
+#define VERIFY_MAX_CHANGES (8)
+
+#define VERIFY_REGISTER_BIT(reg) (1u << (reg))
+#define VERIFY_ALL_REGISTERS ((1u << ASM_REGISTER_END) - 1)
+
+// The state every path to an instruction may reach it with
+typedef struct verify_state_s
+{
+    // The range SP is in
+    int64_t sp_low;
+    int64_t sp_high;
+    // The registers every path wrote (ZERO & SP count as written)
+    uint32_t written;
+    bool reached;
+    uint8_t changes;
+} verify_state_t;
+
+static void verify_sp_unknown(verify_state_t * state)
+{
+    state->sp_low = INT32_MIN;
+    state->sp_high = INT32_MAX;
+}
+
+// Moves SP's range by 'delta' (SP wraps around, so a range that crosses the edges of a register is unknown)
+static void verify_sp_add(verify_state_t * state, int64_t delta)
+{
+    state->sp_low += delta;
+    state->sp_high += delta;
+    if (state->sp_low < INT32_MIN || state->sp_high > INT32_MAX)
+    {
+        verify_sp_unknown(state);
+    }
+}
+
+// Narrows SP's range to the SPs a stack access of 'size' bytes succeeds with ([size, ASM_STACK_SIZE] when popping,
+// [0, ASM_STACK_SIZE - size] when pushing). Returns false if no SP in the range succeeds.
+static bool verify_sp_access(verify_state_t * state, bool pop, int64_t size)
+{
+    int64_t low = pop ? size : 0;
+    int64_t high = pop ? (int64_t)ASM_STACK_SIZE : (int64_t)ASM_STACK_SIZE - size;
+
+    state->sp_low = (state->sp_low > low) ? state->sp_low : low;
+    state->sp_high = (state->sp_high < high) ? state->sp_high : high;
+    return state->sp_low <= state->sp_high;
+}
+
+// Whether every SP in the range is one a stack access of 'size' bytes succeeds with (see verify_sp_access)
+static bool verify_sp_safe(const verify_state_t * state, bool pop, int64_t size)
+{
+    verify_state_t narrowed = *state;
+    return verify_sp_access(&narrowed, pop, size) && narrowed.sp_low == state->sp_low &&
+           narrowed.sp_high == state->sp_high;
+}
+
+// The registers 'instruction' reads (PUSHCTX's copy of all the registers doesn't count as using them)
+static uint32_t verify_reads(const asm_instruction_t * instruction)
+{
+    uint32_t reg0 = VERIFY_REGISTER_BIT(instruction->reg0);
+    uint32_t reg1 = VERIFY_REGISTER_BIT(instruction->reg1);
+    uint32_t reg2 = VERIFY_REGISTER_BIT(instruction->reg2);
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+    case RETNZ:
+    case RETZ:
+    case PUSH:
+    case PUSH_NOCHECK:
+    case JZ:
+    case JNZ:
+    case LOOP:
+    case PRINTC4:
+        return reg0;
+    case STORE:
+        return reg0 | reg1;
+    case MEMCPY:
+    case MEMSET:
+    case MEMCMP:
+        return reg0 | reg1 | reg2;
+    case ADD:
+    case AND:
+    case DIV:
+    case MUL:
+    case OR:
+    case SUB:
+    case XOR:
+    case MULSUBIRETNZ:
+        return reg1 | reg2;
+    case ADDI:
+    case ANDI:
+    case DIVI:
+    case MULI:
+    case ORI:
+    case ROL:
+    case ROR:
+    case SHL:
+    case SHR:
+    case SUBI:
+    case XORI:
+    case LOAD:
+        return reg1;
+    default:
+        return 0;
+    }
+}
+
+// The registers 'instruction' writes (only for the instructions that may continue)
+static uint32_t verify_writes(const asm_instruction_t * instruction)
+{
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case PRINTC:
+    case PRINTDD:
+    case PRINTDX:
+    case PRINTNL:
+    case RETNZ:
+    case RETZ:
+    case JMP:
+    case JZ:
+    case JNZ:
+    case STORE:
+    case MEMCPY:
+    case MEMSET:
+        return 0;
+    case PUSH:
+    case PUSH_NOCHECK:
+    case PUSHCTX:
+        return VERIFY_REGISTER_BIT(ASM_REGISTER_SP);
+    case POP:
+    case POP_NOCHECK:
+        return VERIFY_REGISTER_BIT(instruction->reg0) | VERIFY_REGISTER_BIT(ASM_REGISTER_SP);
+    case POPCTX:
+        return VERIFY_ALL_REGISTERS;
+    default:
+        return VERIFY_REGISTER_BIT(instruction->reg0);
+    }
+}
+
+// Applies 'instruction' to 'state' (the state it continues with). Returns false if it can't continue - it always
+// fails (with 'violation_out' set if that's because of the stack), or never continues to the next instruction.
+static bool verify_transfer(const asm_instruction_t * instruction, verify_state_t * state, bool * violation_out)
+{
+    int64_t context_size = (int64_t)(ASM_REGISTER_END - ASM_REGISTER_START) * (int64_t)sizeof(reg_value_t);
+    *violation_out = false;
+
+    switch ((asm_opcode_t)instruction->opcode)
+    {
+    case RET:
+    case HALT:
+    case FAULT:
+    case DIV_WFAULT:
+    case POP_WFAULT:
+        return false;
+    case PUSH:
+    case PUSH_NOCHECK:
+    case PUSHCTX:
+    case POP:
+    case POP_NOCHECK:
+    case POPCTX:
+    {
+        bool context = (instruction->opcode == PUSHCTX || instruction->opcode == POPCTX);
+        bool pop = (instruction->opcode == POP || instruction->opcode == POP_NOCHECK || instruction->opcode == POPCTX);
+        int64_t size = context ? context_size : (int64_t)sizeof(reg_value_t);
+        if (!verify_sp_access(state, pop, size))
+        {
+            *violation_out = true;
+            return false;
+        }
+        // (POP into SP writes the popped value first, and then the new SP over it)
+        verify_sp_add(state, pop ? -size : size);
+        if (instruction->opcode == POPCTX)
+        {
+            verify_sp_unknown(state);
+        }
+        break;
+    }
+    case ADDI:
+    case SUBI:
+        if (instruction->reg0 == ASM_REGISTER_SP && instruction->reg1 == ASM_REGISTER_SP)
+        {
+            verify_sp_add(state, (instruction->opcode == ADDI) ? (int64_t)instruction->imm32
+                                                               : -(int64_t)instruction->imm32);
+            break;
+        }
+        // fallthrough
+    default:
+        if (verify_writes(instruction) & VERIFY_REGISTER_BIT(ASM_REGISTER_SP))
+        {
+            verify_sp_unknown(state);
+        }
+        break;
+    }
+
+    state->written |= verify_writes(instruction);
+    return instruction->opcode != JMP;
+}
+
+// Merges 'incoming' into the state of instruction 'index', and queues it if its state changed
+static void verify_merge(verify_state_t * states, size_t * worklist, size_t * worklist_size, bool * queued,
+                         size_t index, const verify_state_t * incoming)
+{
+    verify_state_t * state = &states[index];
+    verify_state_t merged = *incoming;
+
+    if (state->reached)
+    {
+        merged.sp_low = (state->sp_low < incoming->sp_low) ? state->sp_low : incoming->sp_low;
+        merged.sp_high = (state->sp_high > incoming->sp_high) ? state->sp_high : incoming->sp_high;
+        merged.written = state->written & incoming->written;
+        if (merged.sp_low == state->sp_low && merged.sp_high == state->sp_high && merged.written == state->written)
+        {
+            return;
+        }
+        if (state->changes >= VERIFY_MAX_CHANGES)
+        {
+            verify_sp_unknown(&merged);
+        }
+    }
+    merged.reached = true;
+    merged.changes = state->changes + 1;
+    *state = merged;
+
+    if (!queued[index])
+    {
+        queued[index] = true;
+        worklist[(*worklist_size)++] = index;
+    }
+}
+
+// Computes the states every instruction of 'code' (of 'count' instructions and the HALT) may be reached with, into
+// 'states_out' (which must be freed). Returns 0 on success, otherwise - error.
+static int verify_analyze(const asm_instruction_t * code, size_t count, verify_state_t ** states_out)
+{
+    int ret = E_SUCCESS;
+    verify_state_t * states = NULL;
+    size_t * worklist = NULL;
+    bool * queued = NULL;
+    size_t worklist_size = 0;
+
+    states = calloc(count + 1, sizeof(*states));
+    worklist = malloc((count + 1) * sizeof(*worklist));
+    queued = calloc(count + 1, sizeof(*queued));
+    if (states == NULL || worklist == NULL || queued == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+
+    // Executions start at the first instruction, with SP at 0 (ZERO & SP are never uninitialized)
+    verify_state_t entry = { 0 };
+    entry.written = VERIFY_REGISTER_BIT(ASM_REGISTER_ZERO) | VERIFY_REGISTER_BIT(ASM_REGISTER_SP);
+    verify_merge(states, worklist, &worklist_size, queued, 0, &entry);
+
+    while (worklist_size > 0)
+    {
+        size_t index = worklist[--worklist_size];
+        const asm_instruction_t * instruction = &code[index];
+        verify_state_t state = states[index];
+        bool violation = false;
+        queued[index] = false;
+
+        if (asm_is_branch((asm_opcode_t)instruction->opcode))
+        {
+            // (LOOP writes its register before it branches, so both its successors get the same state)
+            verify_transfer(instruction, &state, &violation);
+            verify_merge(states, worklist, &worklist_size, queued, (size_t)instruction->imm32, &state);
+            if (instruction->opcode != JMP)
+            {
+                verify_merge(states, worklist, &worklist_size, queued, index + 1, &state);
+            }
+        }
+        else if (verify_transfer(instruction, &state, &violation))
+        {
+            verify_merge(states, worklist, &worklist_size, queued, index + instruction->length, &state);
+        }
+    }
+
+    *states_out = states;
+    states = NULL;
+
+cleanup:
+    free(states);
+    free(worklist);
+    free(queued);
+    return ret;
+}
+
+// Whether the stack instruction reached with 'state' is proven to stay inside the stack
+static bool verify_unchecked(const asm_instruction_t * instruction, const verify_state_t * state)
+{
+    return state->reached && ((instruction->opcode == PUSH && verify_sp_safe(state, false, sizeof(reg_value_t))) ||
+                              (instruction->opcode == POP && verify_sp_safe(state, true, sizeof(reg_value_t))));
+}
+
+int program_verify(asm_program_t * program, asm_verify_report_t * report_out)
+{
+    int ret = E_SUCCESS;
+    asm_verify_report_t report;
+    verify_state_t * states = NULL;
+    verify_state_t * instructions_states = NULL;
+    bool copied = false;
+    memset(&report, 0, sizeof(report));
+
+    // The marks go in the version the engines execute (see program_code)
+    if (program->optimized == NULL)
+    {
+        program->optimized = malloc((program->count + 1) * sizeof(*program->optimized));
+        if (program->optimized == NULL)
+        {
+            ret = E_NOMEM;
+            goto cleanup;
+        }
+        memcpy(program->optimized, program->instructions, (program->count + 1) * sizeof(*program->optimized));
+        copied = true;
+    }
+    asm_instruction_t * code = program->optimized;
+
+    ret = verify_analyze(code, program->count, &states);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    // The engines that compile 'instructions' get their own marks - the passes may have changed SP's range anywhere
+    // (and the instructions were only copied if there were no passes, so their analysis is the same)
+    if (!copied)
+    {
+        ret = verify_analyze(program->instructions, program->count, &instructions_states);
+        if (ret != E_SUCCESS)
+        {
+            goto cleanup;
+        }
+    }
+    free(program->unchecked);
+    program->unchecked = calloc(program->count + 1, sizeof(*program->unchecked));
+    if (program->unchecked == NULL)
+    {
+        ret = E_NOMEM;
+        goto cleanup;
+    }
+    for (size_t i = 0; i < program->count; ++i)
+    {
+        const verify_state_t * state = copied ? &states[i] : &instructions_states[i];
+        program->unchecked[i] = verify_unchecked(&program->instructions[i], state);
+    }
+
+    for (size_t i = 0; i <= program->count; ++i)
+    {
+        asm_instruction_t * instruction = &code[i];
+        verify_state_t state = states[i];
+        bool violation = false;
+        if (!state.reached)
+        {
+            continue;
+        }
+
+        uint32_t uninitialized = verify_reads(instruction) & ~state.written;
+        for (size_t reg = ASM_REGISTER_START; reg < ASM_REGISTER_END; ++reg)
+        {
+            if ((uninitialized & VERIFY_REGISTER_BIT(reg)) && !(report.uninitialized_reads & VERIFY_REGISTER_BIT(reg)))
+            {
+                report.uninitialized_reads |= VERIFY_REGISTER_BIT(reg);
+                report.first_uninitialized_read[reg] = i;
+            }
+        }
+
+        verify_transfer(instruction, &state, &violation);
+        if (violation)
+        {
+            if (report.violations++ == 0)
+            {
+                report.first_violation = i;
+            }
+        }
+        else if (verify_unchecked(instruction, &states[i]))
+        {
+            instruction->opcode = (instruction->opcode == PUSH) ? PUSH_NOCHECK : POP_NOCHECK;
+            report.unchecked++;
+        }
+    }
+    program->stack_verified = 1;
+
+    if (report_out)
+    {
+        *report_out = report;
+    }
+
+cleanup:
+    free(states);
+    free(instructions_states);
+    return ret;
+}
+
+void verify_report_print(FILE * fp, const asm_verify_report_t * report)
+{
+    fprintf(fp, "%-14s %zu stack instructions\n", "unchecked", report->unchecked);
+    if (report->violations > 0)
+    {
+        fprintf(fp, "%-14s %zu stack instructions (the first is instruction %zu)\n", "violating", report->violations,
+                report->first_violation);
+    }
+    for (size_t reg = ASM_REGISTER_START; reg < ASM_REGISTER_END; ++reg)
+    {
+        if (report->uninitialized_reads & VERIFY_REGISTER_BIT(reg))
+        {
+            fprintf(fp, "%-14s register %zu is read by instruction %zu before it's written\n", "uninitialized", reg,
+                    report->first_uninitialized_read[reg]);
+        }
+    }
+}
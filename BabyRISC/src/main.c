@@ -5,14 +5,21 @@
 #include "prompt.h"
 #include "common.h"
 #include "asm_types.h"
-#include "asm_file_generation.h"
 #include "asm_execution.h"
+#include "asm_output.h"
+#include "admin_code.h"
+#include "asm_profile.h"
+#include "payload_input.h"
+#include "asm_stream.h"
 
-#define MAX_FLAG_SIZE (256)
 #define FLAG_FILE_PATH "flag"
-#define MAX_ADMIN_PAYLOAD_SIZE (1024)
 #define MAX_USER_PAYLOAD_SIZE (4096)
-#define TERMINATE_MARKER_UINT32 (0xfffffffful)
+
+// Whether the user's payload is executed while it's still being received (see asm_stream.h), can be chosen at build
+// time
+#ifndef ASM_STREAM_INPUT
+#define ASM_STREAM_INPUT 0
+#endif
 
 static void disable_io_buffering(void)
 {
@@ -20,179 +27,80 @@ static void disable_io_buffering(void)
     setvbuf(stdin, NULL, _IONBF, 0);
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
-}
-
-// Reads the flag from the flag file into the buffer.
-// The flag is written null-terminated (and the rest of the buffer is padded with nulls).
-// Return 0 on success, otherwise - error.
-static int read_flag(char * buffer, size_t buffer_len)
-{
-    int ret = E_SUCCESS;
-    FILE * flag_fp = NULL;
-
-    memset(buffer, 0, buffer_len);
-
-    flag_fp = fopen(FLAG_FILE_PATH, "r");
-    if (flag_fp == NULL)
-    {
-        ret = E_FOPEN;
-        goto cleanup;
-    }
-
-    // Read entire flag from file
-    size_t bytes_read = fread(buffer, 1, buffer_len - 1, flag_fp);
-    if ((bytes_read == 0) || !feof(flag_fp))
-    {
-        // Read error
-        ret = E_FREAD;
-        goto cleanup;
-    }
-
-    // Success
-    ret = E_SUCCESS;
 
-cleanup:
-    if (flag_fp != NULL)
-    {
-        fclose(flag_fp);
-    }
-    return ret;
+    // (The processor's output is buffered separately, and flushed at the end of every execution - see asm_output.h)
 }
 
-// Writes the admin shellcode to the 'payload' buffer.
-// Writes the actual size of the payload to 'payload_size_out'.
-static int generate_admin_code(uint8_t * payload, size_t max_size, size_t * payload_size_out)
+#if ASM_STREAM_INPUT
+// Executes the user code from 'stdin' (followed by the admin code) while it's still being received.
+// The user code must be terminated with 4 0xff bytes (0xffffffff), its maximum size is MAX_USER_PAYLOAD_SIZE.
+static int execute_user_stream(vm_context_t * vm, const uint8_t * admin_payload, size_t admin_payload_size)
 {
     int ret = E_SUCCESS;
-    char flag_string[MAX_FLAG_SIZE] = { 0 };
-    FILE * payload_fp = NULL;
+    static uint8_t payload[MAX_USER_PAYLOAD_SIZE + MAX_ADMIN_PAYLOAD_SIZE];
+    asm_stream_t stream;
+    int count = 0;
 
-    ret = read_flag(flag_string, sizeof(flag_string));
-    if (ret != E_SUCCESS)
-    {
-        printf("Failed to read flag.\n");
-        goto cleanup;
-    }
+    stream_init(&stream, STDIN_FILENO, payload, MAX_USER_PAYLOAD_SIZE, admin_payload, admin_payload_size);
 
-    payload_fp = fmemopen(payload, max_size, "w");
-    if (payload_fp == NULL)
-    {
-        ret = E_FOPEN;
-        goto cleanup;
-    }
-
-    // Write admin shellcode to payload buffer
-    // (Because E_SUCCESS == 0, we just OR all the return values, to check for error when we finish).
-    ret = E_SUCCESS;
-
-    // Pad out with newlines
-    for (size_t i = 0; i < 8; ++i)
-    {
-        ret |= file_write_opcode(payload_fp, PRINTNL);
-    }
-
-    // If the user sets R0 so (R0 * 42) == 1 (impossible!), she deserves to read the flag
-    ret |= file_write_opcode_imm32(payload_fp, ADDI, ASM_REGISTER_R1, ASM_REGISTER_ZERO, 42);
-    ret |= file_write_opcode3(payload_fp, MUL, ASM_REGISTER_R2, ASM_REGISTER_R0, ASM_REGISTER_R1);
-    ret |= file_write_opcode_imm32(payload_fp, SUBI, ASM_REGISTER_R2, ASM_REGISTER_R2, 1);
-    ret |= file_write_opcode1(payload_fp, RETNZ, ASM_REGISTER_R2);
-
-    // Print each 4-bytes of the flag as 4-characters
-    // (We might print some trailing null-characters if the flag length is not divisible by 4)
-    int32_t * flag_start = (int32_t *)flag_string;
-    int32_t * flag_end = (int32_t *)((char *)flag_string + strlen(flag_string));
-    for (int32_t * p = flag_start; p <= flag_end; ++p)
-    {
-        int32_t dword = *p;
-
-        ret |= file_write_opcode_imm32(payload_fp, ADDI, ASM_REGISTER_R1, ASM_REGISTER_ZERO, dword);
-        for (size_t j = 0; j < 4; j++)
-        {
-            ret |= file_write_opcode1(payload_fp, PRINTC, ASM_REGISTER_R1);
-            ret |= file_write_opcode_imm32(payload_fp, ROR, ASM_REGISTER_R1, ASM_REGISTER_R1, 8);
-        }
-    }
-
-    ret |= file_write_opcode(payload_fp, PRINTNL);
-    ret |= file_write_opcode(payload_fp, RET);
-
-    // Check if some error (other than E_SUCCESS) was recieved during the admin code generation
-    if (ret != E_SUCCESS)
-    {
-        ret = E_ADMIN_CODE_ERR;
-        goto cleanup;
-    }
+    // Execute the code!
+    PROMPT_PRINTF_COLOR(GRN, "Executing code!\n");
+    ret = execute_asm_stream(vm, &stream, &count);
+    PROMPT_PRINTF("executed 0x%X instructions\n\n", count);
 
-    // Success
-    long offset = ftell(payload_fp);
-    if (offset == -1)
+    // (A payload that never ended is a failure, even if its execution didn't need all of it)
+    if (stream_finish(&stream) != E_SUCCESS)
     {
-        ret = E_FTELL;
+        printf("Failed to read code from user (stdin).\n");
+        ret = E_FREAD;
         goto cleanup;
     }
-    *payload_size_out = (size_t)offset;
+    printf("User payload size: %ld\n", stream.payload_size);
 
 cleanup:
-    if (payload_fp != NULL)
-    {
-        fclose(payload_fp);
-    }
     return ret;
 }
-
+#else
 // Read the user code from 'stdin'. The code must be terminated with 4 0xff bytes (0xffffffff).
 // The code maximum size is 'max_size'.
+// (stdin is read directly in blocks, not through stdio - nothing reads it through stdio before that)
 static int read_user_code(uint8_t * payload, size_t max_size, size_t * payload_size_out)
 {
-    int ret = E_FREAD;
-    size_t bytes_read = 0;
-    size_t current_offset = 0;
-    uint32_t terminate_marker = TERMINATE_MARKER_UINT32;
-    size_t marker_size = sizeof(terminate_marker);
-
-    while (current_offset < max_size)
-    {
-        // Read byte from 'stdin'
-        bytes_read = fread(payload + current_offset, 1, 1, stdin);
-        if (bytes_read == 0)
-        {
-            goto cleanup;
-        }
-        current_offset += bytes_read;
-
-        // Check if terminator marker is here
-        if (current_offset >= marker_size &&
-            (memcmp(&terminate_marker, &payload[current_offset - marker_size], marker_size) == 0))
-        {
-            // Success
-            *payload_size_out = current_offset - marker_size;
-            ret = E_SUCCESS;
-            break;
-        }
-    }
-
-cleanup:
-    return ret;
+    return payload_read_fd(STDIN_FILENO, payload, max_size, payload_size_out);
 }
+#endif
 
 int main(void)
 {
     int ret = E_SUCCESS;
+    static vm_context_t vm;
     disable_io_buffering();
+    ret = vm_init(&vm, STDOUT_FILENO);
+    if (ret != E_SUCCESS)
+    {
+        printf("Failed to initialize the processor\n");
+        goto cleanup;
+    }
+    output_flush_at_exit(&vm.output);
     uint8_t admin_payload[MAX_ADMIN_PAYLOAD_SIZE] = { 0 };
     size_t admin_payload_size = 0;
+#if !ASM_STREAM_INPUT
     uint8_t user_payload[MAX_USER_PAYLOAD_SIZE] = { 0 };
     size_t user_payload_size = 0;
     uint8_t * combined_payload = NULL;
     size_t combined_payload_size = 0;
+#endif
 
-    ret = generate_admin_code(admin_payload, sizeof(admin_payload), &admin_payload_size);
+    ret = generate_admin_code(FLAG_FILE_PATH, admin_payload, sizeof(admin_payload), &admin_payload_size);
     if (ret != E_SUCCESS)
     {
         printf("Failed to generate admin code\n");
         goto cleanup;
     }
 
+#if ASM_STREAM_INPUT
+    ret = execute_user_stream(&vm, admin_payload, admin_payload_size);
+#else
     ret = read_user_code(user_payload, sizeof(user_payload), &user_payload_size);
     if (ret != E_SUCCESS)
     {
@@ -212,10 +120,30 @@ int main(void)
     memcpy(combined_payload, user_payload, user_payload_size);
     memcpy(&combined_payload[user_payload_size], admin_payload, admin_payload_size);
 
+#if ASM_ENABLE_PROFILING
+    static asm_profile_t profile;
+    profile_init(&profile);
+    vm.profile = &profile;
+#endif
+
     // Execute the code!
     PROMPT_PRINTF_COLOR(GRN, "Executing code!\n");
-    ret = execute_asm_memory(combined_payload, combined_payload_size);
+    ret = execute_asm_memory(&vm, combined_payload, combined_payload_size);
+
+#if ASM_ENABLE_PROFILING
+    // (The table goes to stderr, so it's never mixed with the processor's output)
+    profile_print_table(stderr, &profile);
+    FILE * profile_fp = fopen(ASM_PROFILE_JSON_PATH, "w");
+    if (profile_fp != NULL)
+    {
+        profile_print_json(profile_fp, &profile);
+        fclose(profile_fp);
+    }
+    profile_free(&profile);
+#endif
+#endif /* ASM_STREAM_INPUT */
 
 cleanup:
+    vm_free(&vm);
     return ret;
 }
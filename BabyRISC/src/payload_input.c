@@ -0,0 +1,78 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "payload_input.h"
+#include "common.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+size_t payload_find_terminator(const uint8_t * bytes, size_t start, size_t size)
+{
+    const uint32_t terminate_marker = TERMINATE_MARKER_UINT32;
+    const size_t marker_size = sizeof(terminate_marker);
+    size_t offset = start;
+
+#if defined(__SSE2__)
+    // The bytes at offsets i, i+1, i+2 and i+3 are ANDed together - a byte that is still 0xff starts a terminator
+    const __m128i all_ones = _mm_set1_epi8((char)0xff);
+    while (offset + 16 + marker_size - 1 <= size)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)&bytes[offset]);
+        block = _mm_and_si128(block, _mm_loadu_si128((const __m128i *)&bytes[offset + 1]));
+        block = _mm_and_si128(block, _mm_loadu_si128((const __m128i *)&bytes[offset + 2]));
+        block = _mm_and_si128(block, _mm_loadu_si128((const __m128i *)&bytes[offset + 3]));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, all_ones));
+        if (mask != 0)
+        {
+            return offset + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+        offset += 16;
+    }
+#endif
+
+    for (; offset + marker_size <= size; ++offset)
+    {
+        if (memcmp(&bytes[offset], &terminate_marker, marker_size) == 0)
+        {
+            return offset;
+        }
+    }
+    return size;
+}
+
+int payload_read_fd(int fd, uint8_t * payload, size_t max_size, size_t * payload_size_out)
+{
+    int ret = E_FREAD;
+    const size_t marker_size = sizeof(uint32_t);
+    size_t current_offset = 0;
+
+    while (current_offset < max_size)
+    {
+        ssize_t bytes_read = read(fd, &payload[current_offset], max_size - current_offset);
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read <= 0)
+        {
+            goto cleanup;
+        }
+
+        // A terminator may start in the previous block, and end in this one
+        size_t scan_start = (current_offset >= marker_size - 1) ? current_offset - (marker_size - 1) : 0;
+        current_offset += (size_t)bytes_read;
+        size_t marker_offset = payload_find_terminator(payload, scan_start, current_offset);
+        if (marker_offset != current_offset)
+        {
+            // Success
+            *payload_size_out = marker_offset;
+            ret = E_SUCCESS;
+            break;
+        }
+    }
+
+cleanup:
+    return ret;
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test_common.h"
+#include "asm_fusion.h"
+#include "asm_optimizer.h"
+#include "asm_verifier.h"
+
+const char * test_engine_names[MAX_ASM_ENGINE_VAL] = {
+    [ASM_ENGINE_INTERPRETER] = "interpreter",
+    [ASM_ENGINE_THREADED] = "threaded",
+    [ASM_ENGINE_JIT] = "jit",
+    [ASM_ENGINE_JIT_DIFFERENTIAL] = "jit-differential",
+};
+
+int test_decode(const uint8_t * payload, size_t size, bool passes, uint64_t budget, asm_program_t * program)
+{
+    int ret = program_decode_span(payload, size, program);
+    if (ret == E_SUCCESS && passes)
+    {
+        ret = program_fuse(program, NULL);
+        if (ret == E_SUCCESS)
+        {
+            ret = program_optimize(program, NULL);
+        }
+        if (ret == E_SUCCESS)
+        {
+            ret = program_verify(program, NULL);
+        }
+    }
+    if (ret == E_SUCCESS)
+    {
+        ret = program_limit(program, budget);
+    }
+    return ret;
+}
+
+int test_run(const asm_program_t * program, asm_engine_t engine, const asm_snapshot_t * snapshot, test_run_t * run)
+{
+    int ret = E_SUCCESS;
+    FILE * capture_fp = NULL;
+    vm_context_t * vm = NULL;
+
+    memset(run, 0, sizeof(*run));
+    capture_fp = tmpfile();
+    vm = malloc(sizeof(*vm));
+    if (capture_fp == NULL || vm == NULL)
+    {
+        ret = (capture_fp == NULL) ? E_FOPEN : E_NOMEM;
+        goto cleanup;
+    }
+    ret = vm_init(vm, fileno(capture_fp));
+    if (ret != E_SUCCESS)
+    {
+        free(vm);
+        vm = NULL;
+        goto cleanup;
+    }
+    vm_set_snapshot(vm, snapshot);
+
+    run->ret = execute_asm_program(vm, program, engine, &run->count);
+    memcpy(run->registers, vm->registers, sizeof(run->registers));
+
+    long size = ftell(capture_fp);
+    run->output = malloc((size > 0) ? (size_t)size : 1);
+    if (size == -1 || run->output == NULL)
+    {
+        ret = E_FREAD;
+        goto cleanup;
+    }
+    rewind(capture_fp);
+    run->output_size = fread(run->output, 1, (size_t)size, capture_fp);
+
+cleanup:
+    if (vm != NULL)
+    {
+        vm_free(vm);
+        free(vm);
+    }
+    if (capture_fp != NULL)
+    {
+        fclose(capture_fp);
+    }
+    return ret;
+}
+
+void test_run_free(test_run_t * run)
+{
+    free(run->output);
+    memset(run, 0, sizeof(*run));
+}
+
+bool test_runs_equal(const test_run_t * run, const test_run_t * other)
+{
+    return run->ret == other->ret && run->count == other->count &&
+           memcmp(run->registers, other->registers, sizeof(run->registers)) == 0 &&
+           run->output_size == other->output_size && memcmp(run->output, other->output, run->output_size) == 0;
+}
+
+int test_engines_agree(const uint8_t * payload, size_t size, uint64_t budget, const asm_snapshot_t * snapshot,
+                       test_run_t * run_out)
+{
+    int ret = E_SUCCESS;
+    asm_program_t decoded;
+    asm_program_t passed;
+    test_run_t expected = { 0 };
+    test_run_t actual = { 0 };
+    program_init(&decoded);
+    program_init(&passed);
+
+    ret = test_decode(payload, size, false, budget, &decoded);
+    if (ret == E_SUCCESS)
+    {
+        ret = test_decode(payload, size, true, budget, &passed);
+    }
+    if (ret == E_SUCCESS)
+    {
+        ret = test_run(&decoded, ASM_ENGINE_INTERPRETER, snapshot, &expected);
+    }
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    for (int engine = 0; engine < MAX_ASM_ENGINE_VAL; ++engine)
+    {
+        for (int with_passes = 0; with_passes <= 1; ++with_passes)
+        {
+            ret = test_run(with_passes ? &passed : &decoded, (asm_engine_t)engine, snapshot, &actual);
+            if (ret != E_SUCCESS)
+            {
+                goto cleanup;
+            }
+            if (!test_runs_equal(&expected, &actual))
+            {
+                fprintf(stderr,
+                        "The %s engine (%s) ended with %d after %d instructions (%zu bytes of output), instead of %d "
+                        "after %d (%zu bytes)\n",
+                        test_engine_names[engine], with_passes ? "with the passes" : "decoded", actual.ret,
+                        actual.count, actual.output_size, expected.ret, expected.count, expected.output_size);
+                ret = E_ENGINE_MISMATCH;
+                goto cleanup;
+            }
+            test_run_free(&actual);
+        }
+    }
+
+    if (run_out)
+    {
+        *run_out = expected;
+        memset(&expected, 0, sizeof(expected));
+    }
+
+cleanup:
+    test_run_free(&expected);
+    test_run_free(&actual);
+    program_free(&passed);
+    program_free(&decoded);
+    return ret;
+}
+
+int test_write_flag(const char * flag, char * path, size_t path_size)
+{
+    int ret = E_SUCCESS;
+    FILE * flag_fp = NULL;
+
+    snprintf(path, path_size, "/tmp/babyrisc_test_flag_XXXXXX");
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+    flag_fp = fdopen(fd, "w");
+    if (flag_fp == NULL)
+    {
+        close(fd);
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+    if (fputs(flag, flag_fp) == EOF)
+    {
+        ret = E_FWRITE;
+        goto cleanup;
+    }
+
+cleanup:
+    if (flag_fp != NULL)
+    {
+        fclose(flag_fp);
+    }
+    return ret;
+}
+
+int test_report(const char * name, int result)
+{
+    printf("%s %s", (result == E_SUCCESS) ? "[PASS]" : "[FAIL]", name);
+    if (result != E_SUCCESS)
+    {
+        printf(" (%d)", result);
+    }
+    printf("\n");
+    return result;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#ifndef __TEST_COMMON_H
+#define __TEST_COMMON_H
+
+#include <stdbool.h>
+#include "asm_execution.h"
+#include "asm_program.h"
+#include "asm_snapshot.h"
+#include "common.h"
+
+// Fails the current test (a function returning int) with 'error' unless 'condition' holds
+#define TEST_CHECK(condition, error)                                                                                  \
+    do                                                                                                                \
+    {                                                                                                                 \
+        if (!(condition))                                                                                             \
+        {                                                                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                             \
+            return (error);                                                                                           \
+        }                                                                                                             \
+    } while (0)
+
+// The engines every test compares (all of them, see asm_execution.h)
+extern const char * test_engine_names[MAX_ASM_ENGINE_VAL];
+
+// The results of an execution (its output captured)
+typedef struct test_run_s
+{
+    int ret;
+    int count;
+    reg_value_t registers[ASM_REGISTER_END - ASM_REGISTER_START];
+    char * output;
+    size_t output_size;
+} test_run_t;
+
+// Decodes 'payload' into 'program', and (if 'passes') fuses, optimizes & verifies it the way BabyRISC does. Then it's
+// limited to 'budget' instructions. Returns 0 on success, otherwise - error.
+int test_decode(const uint8_t * payload, size_t size, bool passes, uint64_t budget, asm_program_t * program);
+
+// Executes 'program' with 'engine' on a new context that starts from 'snapshot' (NULL - a fresh context)
+// Returns 0 on success (whatever the execution itself returned), otherwise - error.
+int test_run(const asm_program_t * program, asm_engine_t engine, const asm_snapshot_t * snapshot, test_run_t * run);
+void test_run_free(test_run_t * run);
+
+// Whether two executions ended the same (result, instructions count, registers and output)
+bool test_runs_equal(const test_run_t * run, const test_run_t * other);
+
+// Executes 'payload' with every engine, decoded with and without the passes, and checks they all end the same as
+// the interpreter with the decoded instructions - whose run goes to 'run_out' (optional).
+// Returns 0 if they do, E_ENGINE_MISMATCH if they don't, otherwise - error.
+int test_engines_agree(const uint8_t * payload, size_t size, uint64_t budget, const asm_snapshot_t * snapshot,
+                       test_run_t * run_out);
+
+// Writes a flag file for the admin code (see admin_code.h) to 'path' (at least 64 bytes).
+// Returns 0 on success, otherwise - error.
+int test_write_flag(const char * flag, char * path, size_t path_size);
+
+// Runs a test function, and reports whether it passed. Returns the test's result.
+int test_report(const char * name, int result);
+
+#endif /* __TEST_COMMON_H */
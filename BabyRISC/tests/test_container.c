@@ -0,0 +1,201 @@
+/* Checks that containers (see asm_container.h) whose decoded sections were tampered with are never executed as they
+ * are - they're decoded from their code section instead, and executed like the raw payload.
+ * Usage: ./test_container (exits with 0 if all the tests passed)
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "test_common.h"
+#include "asm_container.h"
+#include "asm_emitter.h"
+
+#define TEST_CONTAINER_FLAGS (ASM_BRX_DECODED | ASM_BRX_FUSED | ASM_BRX_OPTIMIZED)
+
+// Changes an instruction of a container's section
+typedef void (*test_patch_t)(asm_instruction_t * instruction);
+
+// R0 = 5; R1 = R0 / 7; R2 = R0 + R1; PUSH R2; PRINTDD R2
+static int test_emit_payload(uint8_t * code, size_t code_size, size_t * size_out)
+{
+    asm_emitter_t emitter;
+
+    emitter_init_buffer(&emitter, code, code_size);
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R0, ASM_REGISTER_ZERO, 5);
+    emit_opcode_imm32(&emitter, DIVI, ASM_REGISTER_R1, ASM_REGISTER_R0, 7);
+    emit_opcode3(&emitter, ADD, ASM_REGISTER_R2, ASM_REGISTER_R0, ASM_REGISTER_R1);
+    emit_opcode1(&emitter, PUSH, ASM_REGISTER_R2);
+    emit_opcode1(&emitter, PRINTDD, ASM_REGISTER_R2);
+    emit_opcode(&emitter, RET);
+    *size_out = emitter.size;
+    return emitter_error(&emitter);
+}
+
+// Writes a container of the payload, patches instruction 'index' of the section at 'section_field' (the offset of
+// its offset in the header, NULL 'patch' - none), and loads it. Then checks every engine executes it like the
+// interpreter executes the payload, and whether the loader used the instructions section ('mapped').
+static int test_load_patched(size_t section_field, size_t index, test_patch_t patch, bool mapped)
+{
+    int ret = E_SUCCESS;
+    uint8_t code[256];
+    size_t size = 0;
+    FILE * fp = NULL;
+    asm_container_t container;
+    asm_program_t expected;
+    asm_program_t program;
+    test_run_t expected_run = { 0 };
+    test_run_t run = { 0 };
+    bool opened = false;
+    bool was_mapped = false;
+    memset(&container, 0, sizeof(container));
+    program_init(&expected);
+    program_init(&program);
+
+    ret = test_emit_payload(code, sizeof(code), &size);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    fp = tmpfile();
+    if (fp == NULL)
+    {
+        ret = E_FOPEN;
+        goto cleanup;
+    }
+    ret = container_write(fp, code, size, 0, TEST_CONTAINER_FLAGS);
+    if (ret != E_SUCCESS || fflush(fp) != 0)
+    {
+        ret = (ret != E_SUCCESS) ? ret : E_FWRITE;
+        goto cleanup;
+    }
+    ret = container_open(&container, fileno(fp), 0);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    opened = true;
+
+    // (The mapping is private, so it's patched in place)
+    if (patch != NULL)
+    {
+        uint64_t offset = 0;
+        memcpy(&offset, &container.mapping[section_field], sizeof(offset));
+        patch((asm_instruction_t *)&container.mapping[offset] + index);
+    }
+    ret = container_load_program(&container, 0, &program);
+    if (ret != E_SUCCESS)
+    {
+        goto cleanup;
+    }
+    was_mapped = (program.borrowed & ASM_PROGRAM_BORROWED_INSTRUCTIONS) != 0;
+    if (was_mapped != mapped)
+    {
+        fprintf(stderr, "the container was %s\n", was_mapped ? "mapped" : "decoded");
+        ret = E_ENGINE_MISMATCH;
+        goto cleanup;
+    }
+
+    ret = test_decode(code, size, false, 0, &expected);
+    if (ret == E_SUCCESS)
+    {
+        ret = test_run(&expected, ASM_ENGINE_INTERPRETER, NULL, &expected_run);
+    }
+    for (asm_engine_t engine = 0; ret == E_SUCCESS && engine < MAX_ASM_ENGINE_VAL; ++engine)
+    {
+        ret = test_run(&program, engine, NULL, &run);
+        if (ret == E_SUCCESS && !test_runs_equal(&run, &expected_run))
+        {
+            fprintf(stderr, "%s: returned %d after %d instructions (expected %d after %d)\n",
+                    test_engine_names[engine], run.ret, run.count, expected_run.ret, expected_run.count);
+            ret = E_ENGINE_MISMATCH;
+        }
+        test_run_free(&run);
+    }
+
+cleanup:
+    test_run_free(&expected_run);
+    program_free(&expected);
+    program_free(&program);
+    if (opened)
+    {
+        container_close(&container);
+    }
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+    return ret;
+}
+
+static void test_patch_divisor(asm_instruction_t * instruction)
+{
+    instruction->imm32 = 0;
+}
+
+static void test_patch_write_zero(asm_instruction_t * instruction)
+{
+    instruction->reg0 = ASM_REGISTER_ZERO;
+}
+
+static void test_patch_imm32(asm_instruction_t * instruction)
+{
+    instruction->imm32 += 1;
+}
+
+static void test_patch_stack_pointer(asm_instruction_t * instruction)
+{
+    instruction->reg0 = ASM_REGISTER_SP;
+    instruction->imm32 = 0x40000000;
+}
+
+// An untouched container is executed right from its instructions section
+static int test_valid(void)
+{
+    return test_load_patched(offsetof(asm_brx_header_t, instructions_offset), 0, NULL, true);
+}
+
+// DIVI by an immediate 0 is never decoded (the engines would divide by it)
+static int test_divisor_zero(void)
+{
+    return test_load_patched(offsetof(asm_brx_header_t, instructions_offset), 1, test_patch_divisor, false);
+}
+
+// Nothing decoded writes to ZERO
+static int test_write_zero(void)
+{
+    return test_load_patched(offsetof(asm_brx_header_t, instructions_offset), 2, test_patch_write_zero, false);
+}
+
+// An optimized section that isn't what the passes make of the instructions section (the PRINTDD prints a constant
+// once optimized, so its value is patched)
+static int test_optimized_disagrees(void)
+{
+#if ASM_ENABLE_FUSION || ASM_ENABLE_OPTIMIZER
+    return test_load_patched(offsetof(asm_brx_header_t, optimized_offset), 0, test_patch_imm32, false);
+#else
+    return E_SUCCESS;
+#endif
+}
+
+// Instructions that move SP out of the stack before a PUSH the optimized section proves safe (the optimized section
+// isn't theirs, so it doesn't prove anything)
+static int test_stack_pointer(void)
+{
+#if ASM_ENABLE_FUSION || ASM_ENABLE_OPTIMIZER
+    return test_load_patched(offsetof(asm_brx_header_t, instructions_offset), 0, test_patch_stack_pointer, false);
+#else
+    return E_SUCCESS;
+#endif
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed += test_report("valid container", test_valid()) != E_SUCCESS;
+    failed += test_report("DIVI by 0", test_divisor_zero()) != E_SUCCESS;
+    failed += test_report("write to ZERO", test_write_zero()) != E_SUCCESS;
+    failed += test_report("disagreeing optimized section", test_optimized_disagrees()) != E_SUCCESS;
+    failed += test_report("SP moved by the instructions section", test_stack_pointer()) != E_SUCCESS;
+
+    return (failed == 0) ? 0 : 1;
+}
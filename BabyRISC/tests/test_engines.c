@@ -0,0 +1,228 @@
+/* Checks that all the engines (with and without the fusion, optimizer & verifier passes) execute payloads exactly the
+ * same - the result, the instructions count, the registers and the output.
+ * Usage: ./test_engines (exits with 0 if all the tests passed)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test_common.h"
+#include "admin_code.h"
+#include "asm_emitter.h"
+#include "asm_verifier.h"
+
+#define TEST_FLAG "FLAG{every_engine_agrees}"
+
+// A context POPCTX restores with ZERO at 'zero' and R0 at 'r0' (the rest of the registers, and SP, at 0)
+static void emit_context_with_zero(asm_emitter_t * emitter, int32_t zero, int32_t r0)
+{
+    emit_opcode_imm32(emitter, ADDI, ASM_REGISTER_R0, ASM_REGISTER_ZERO, zero);
+    emit_opcode1(emitter, PUSH, ASM_REGISTER_R0);
+    emit_opcode_imm32(emitter, ADDI, ASM_REGISTER_R0, ASM_REGISTER_ZERO, r0);
+    emit_opcode1(emitter, PUSH, ASM_REGISTER_R0);
+    for (asm_register_t reg = ASM_REGISTER_R1; reg <= ASM_REGISTER_SP; ++reg)
+    {
+        emit_opcode1(emitter, PUSH, ASM_REGISTER_ZERO);
+    }
+    emit_opcode(emitter, POPCTX);
+}
+
+// The payload that reads the flag - ZERO is restored to -41 and R0 to 1, so the admin code's R1 (ZERO + 42) times R0
+// is 1. The admin code follows it, just like BabyRISC appends it.
+static int test_exploit_payload(void)
+{
+    int ret = E_SUCCESS;
+    char flag_path[64];
+    static uint8_t payload[4096 + MAX_ADMIN_PAYLOAD_SIZE];
+    size_t admin_size = 0;
+    asm_emitter_t emitter;
+    test_run_t run = { 0 };
+
+    ret = test_write_flag(TEST_FLAG, flag_path, sizeof(flag_path));
+    TEST_CHECK(ret == E_SUCCESS, ret);
+
+    emitter_init_buffer(&emitter, payload, 4096);
+    emit_context_with_zero(&emitter, -41, 1);
+    ret = emitter_error(&emitter);
+    TEST_CHECK(ret == E_SUCCESS, ret);
+    ret = generate_admin_code(flag_path, &payload[emitter.size], sizeof(payload) - emitter.size, &admin_size);
+    unlink(flag_path);
+    TEST_CHECK(ret == E_SUCCESS, ret);
+
+    ret = test_engines_agree(payload, emitter.size + admin_size, 0, NULL, &run);
+    TEST_CHECK(ret == E_SUCCESS, ret);
+    // (The admin code got past its check - the flag is printed after the newlines it starts with)
+    TEST_CHECK(run.ret == E_SUCCESS && run.output_size > 8 + strlen(TEST_FLAG), E_ENGINE_MISMATCH);
+    test_run_free(&run);
+    return E_SUCCESS;
+}
+
+// A prelude that ends with a POPCTX which leaves ZERO at -41, and a variant that reads ZERO - executions from the
+// snapshot must print 1 (the fused LOADI / the optimizer's known ZERO would make them print 42).
+static int test_snapshot_zero(void)
+{
+    int ret = E_SUCCESS;
+    uint8_t code[256];
+    asm_emitter_t emitter;
+    asm_program_t prelude;
+    asm_snapshot_t snapshot;
+    test_run_t run = { 0 };
+    program_init(&prelude);
+    snapshot_init(&snapshot);
+
+    emitter_init_buffer(&emitter, code, sizeof(code));
+    emit_context_with_zero(&emitter, -41, 0);
+    emit_opcode(&emitter, RET);
+    ret = emitter_error(&emitter);
+    if (ret == E_SUCCESS)
+    {
+        ret = test_decode(code, emitter.size, false, 0, &prelude);
+    }
+    if (ret == E_SUCCESS)
+    {
+        static vm_context_t vm;
+        ret = vm_init(&vm, ASM_OUTPUT_DISCARD);
+        if (ret == E_SUCCESS)
+        {
+            ret = execute_asm_program(&vm, &prelude, ASM_ENGINE_INTERPRETER, NULL);
+            if (ret == E_SUCCESS)
+            {
+                ret = snapshot_capture(&snapshot, &vm);
+            }
+            vm_free(&vm);
+        }
+    }
+    program_free(&prelude);
+    if (ret != E_SUCCESS)
+    {
+        snapshot_free(&snapshot);
+        return ret;
+    }
+
+    emitter_init_buffer(&emitter, code, sizeof(code));
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R2, ASM_REGISTER_ZERO, 42);
+    emit_opcode1(&emitter, PRINTDD, ASM_REGISTER_R2);
+    emit_opcode(&emitter, RET);
+    ret = test_engines_agree(code, emitter.size, 0, &snapshot, &run);
+    snapshot_free(&snapshot);
+    TEST_CHECK(ret == E_SUCCESS, ret);
+    TEST_CHECK(run.registers[ASM_REGISTER_R2] == 1 && run.output_size == 1 && run.output[0] == '1',
+               E_ENGINE_MISMATCH);
+    test_run_free(&run);
+    return E_SUCCESS;
+}
+
+// Straight-line code stops exactly at the budget
+static int test_budget_straight(void)
+{
+    int ret = E_SUCCESS;
+    uint8_t code[256];
+    asm_emitter_t emitter;
+    test_run_t run = { 0 };
+
+    emitter_init_buffer(&emitter, code, sizeof(code));
+    for (int32_t i = 0; i < 10; ++i)
+    {
+        emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R0, ASM_REGISTER_R0, i);
+        emit_opcode1(&emitter, PRINTDD, ASM_REGISTER_R0);
+    }
+    emit_opcode(&emitter, RET);
+    TEST_CHECK(emitter_error(&emitter) == E_SUCCESS, emitter_error(&emitter));
+
+    ret = test_engines_agree(code, emitter.size, 7, NULL, &run);
+    TEST_CHECK(ret == E_SUCCESS, ret);
+    TEST_CHECK(run.ret == E_OUT_OF_GAS && run.count == 7, E_ENGINE_MISMATCH);
+    test_run_free(&run);
+    return E_SUCCESS;
+}
+
+// A loop stops at the first branch whose next run doesn't fit in the budget
+static int test_budget_loop(void)
+{
+    int ret = E_SUCCESS;
+    uint8_t code[256];
+    asm_emitter_t emitter;
+    test_run_t run = { 0 };
+
+    // R0 = 1000; do { R1 += R0; PRINTDD R1 } while (--R0)
+    emitter_init_buffer(&emitter, code, sizeof(code));
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_R0, ASM_REGISTER_ZERO, 1000);
+    size_t loop = emitter.size;
+    emit_opcode3(&emitter, ADD, ASM_REGISTER_R1, ASM_REGISTER_R1, ASM_REGISTER_R0);
+    emit_opcode1(&emitter, PRINTDD, ASM_REGISTER_R1);
+    emit_opcode1_rel32(&emitter, LOOP, ASM_REGISTER_R0, emitter_branch_rel32(&emitter, LOOP, loop));
+    emit_opcode(&emitter, RET);
+    TEST_CHECK(emitter_error(&emitter) == E_SUCCESS, emitter_error(&emitter));
+
+    // (1 + 3 * 33 = 100 instructions fit, the next run doesn't)
+    ret = test_engines_agree(code, emitter.size, 101, NULL, &run);
+    TEST_CHECK(ret == E_SUCCESS, ret);
+    TEST_CHECK(run.ret == E_OUT_OF_GAS && run.count == 100, E_ENGINE_MISMATCH);
+    test_run_free(&run);
+
+    // Without a budget it runs to the end
+    ret = test_engines_agree(code, emitter.size, 0, NULL, &run);
+    TEST_CHECK(ret == E_SUCCESS, ret);
+    TEST_CHECK(run.ret == E_SUCCESS && run.count == 1 + 3 * 1000 + 1, E_ENGINE_MISMATCH);
+    test_run_free(&run);
+    return E_SUCCESS;
+}
+
+// The JIT compiles the decoded instructions, so only their own proofs let it skip the stack checks - here the
+// optimized version (grafted, like a container could carry) never moves SP, but the instructions move it far out
+static int test_unchecked_graft(void)
+{
+    int ret = E_SUCCESS;
+    uint8_t code[256];
+    asm_emitter_t emitter;
+    asm_program_t program;
+    test_run_t run = { 0 };
+    program_init(&program);
+
+    emitter_init_buffer(&emitter, code, sizeof(code));
+    emit_opcode_imm32(&emitter, ADDI, ASM_REGISTER_SP, ASM_REGISTER_ZERO, 0x40000000);
+    emit_opcode1(&emitter, PUSH, ASM_REGISTER_R0);
+    emit_opcode1(&emitter, PRINTDD, ASM_REGISTER_R1);
+    emit_opcode(&emitter, RET);
+    ret = emitter_error(&emitter);
+    if (ret == E_SUCCESS)
+    {
+        ret = program_decode_span(code, emitter.size, &program);
+    }
+    if (ret == E_SUCCESS)
+    {
+        program.optimized = malloc((program.count + 1) * sizeof(*program.optimized));
+        ret = (program.optimized != NULL) ? E_SUCCESS : E_NOMEM;
+    }
+    if (ret == E_SUCCESS)
+    {
+        memcpy(program.optimized, program.instructions, (program.count + 1) * sizeof(*program.optimized));
+        program.optimized[0].reg0 = ASM_REGISTER_R0;
+        ret = program_verify(&program, NULL);
+    }
+    if (ret == E_SUCCESS)
+    {
+        ret = test_run(&program, ASM_ENGINE_JIT, NULL, &run);
+    }
+    if (ret == E_SUCCESS && (program.optimized[1].opcode != PUSH_NOCHECK || run.ret != E_STACK_VIOLATION))
+    {
+        fprintf(stderr, "%s: returned %d after %d instructions\n", test_engine_names[ASM_ENGINE_JIT], run.ret,
+                run.count);
+        ret = E_ENGINE_MISMATCH;
+    }
+    test_run_free(&run);
+    program_free(&program);
+    return ret;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed += test_report("exploit payload", test_exploit_payload()) != E_SUCCESS;
+    failed += test_report("snapshot with ZERO restored", test_snapshot_zero()) != E_SUCCESS;
+    failed += test_report("budget of straight-line code", test_budget_straight()) != E_SUCCESS;
+    failed += test_report("budget of a loop", test_budget_loop()) != E_SUCCESS;
+    failed += test_report("stack proofs of the JIT", test_unchecked_graft()) != E_SUCCESS;
+
+    return (failed == 0) ? 0 : 1;
+}